@@ -3,6 +3,7 @@ import re
 import struct
 import copy
 import argparse
+import functools
 
 
 class AssemblerException(Exception):
@@ -252,23 +253,33 @@ class VMAssembler:
         return
 
     def encrypt_ops(self, key):
-        key_ba = bytearray(key, 'utf-8')
         olds = copy.deepcopy(ops)
 
-        # RC4 KSA! :-P
-        arr = [i for i in range(256)]
-        j = 0
-        for i in range(len(arr)):
-            j = (j + arr[i] + key_ba[i % len(key)]) % len(arr)
-            arr[i], arr[j] = arr[j], arr[i]
-
-        for i, o in enumerate(ops):
-            o.set_value(arr[i])
+        for o, value in zip(ops, shuffled_values(key)):
+            o.set_value(value)
 
         for o, n in zip(olds, ops):
             print("{} : {}->{}".format(o.name, hex(o.value), hex(n.value)))
 
 
+@functools.lru_cache(maxsize=None)
+def shuffled_values(key):
+    """
+    The value of every op, in the order of ops, for the given key. Cached per
+    key like VMOpcodeCache does for the VM: shuffled_values.cache_info()
+    tells the hits and misses.
+    """
+    key_ba = bytearray(key, 'utf-8')
+
+    # RC4 KSA! :-P
+    arr = [i for i in range(256)]
+    j = 0
+    for i in range(len(arr)):
+        j = (j + arr[i] + key_ba[i % len(key)]) % len(arr)
+        arr[i], arr[j] = arr[j], arr[i]
+    return tuple(arr[:len(ops)])
+
+
 class VMFunction:
 
     def __init__(self, name, code):
@@ -469,7 +480,13 @@ op_names = [["MOVI", "imm2reg"],
             ["RETN", "single"],
             ["SHIT", "single"],
             ["NOPE", "single"],
-            ["GRMN", "single"]]
+            ["GRMN", "single"],
+            ["BNKI", "immonly"],
+            ["BNKR", "regonly"],
+            ["LODF", "reg2reg"],
+            ["STRF", "reg2reg"],
+            ["RECV", "byt2reg"],
+            ["SEND", "byt2reg"]]
 
 reg_names = ["R0", "R1", "R2", "R3", "S0", "S1", "S2", "S3", "IP", "RP", "SP"]
 ops_sizes = {"reg2reg": 2,
@@ -503,6 +520,8 @@ def main():
     parser.add_argument('outfile', help='The output file')
     parser.add_argument('--debug', action='store_true',
                         help='Enables the DEBG opcode')
+    parser.add_argument('--symbols', metavar='SYMFILE',
+                        help='Writes the offset of every function to SYMFILE, for the profiler')
     args = parser.parse_args()
 
     if args.debug:
@@ -519,6 +538,10 @@ def main():
 
     with open(args.outfile, 'wb') as f:
         f.write(vma.assembled_code)
+    if args.symbols:
+        with open(args.symbols, 'w') as f:
+            for fun in vma.functions:
+                f.write("{} {}\n".format(hex(fun.offset), fun.name))
 
 if __name__ == '__main__':
     main()
@@ -0,0 +1,450 @@
+#include "../vm/staticvm.h"
+#include "../vm/vmbatch.h"
+#include "../vm/vmlockstep.h"
+#include "../vm/vmopcodecache.h"
+#include "../vm/vmpool.h"
+#include "../vm/vmscheduler.h"
+#include "../vm/vmsnapshot.h"
+#include "../tests/include/programs.h"
+#include "benchmark.h"
+#include <chrono>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFAULT_RUNS 2000
+#define LOCKSTEP_STRIDE 0x40
+
+const char *ENGINE_NAMES[NUM_ENGINES] = {"loop", "threaded", "decoded", "jit"};
+const char *FUSION_NAMES[NUM_FUSIONS] = {"CMPx + JPxI", "MOVI + ADDR + LODR", "ADDR + LODR", "PUSH chain",
+                                         "POOP chain"};
+
+/*
+ * Only run() is timed: construction and RC4 key scheduling happen outside
+ * the measured region.
+ */
+void benchRun(const char *name, uint8_t engine, uint8_t *code, uint32_t codesize, uint8_t *data,
+              uint32_t datasize, uint32_t runs) {
+    uint32_t i;
+    uint64_t instructions = 0;
+    double elapsed = 0;
+
+    for (i = 0; i < runs; i++) {
+        VM vm(TEA_KEY, code, codesize);
+        vm.setEngine(engine);
+        if (data) {
+            vm.addressSpace()->insData(data, datasize);
+        }
+        auto start = std::chrono::steady_clock::now();
+        vm.run();
+        auto end = std::chrono::steady_clock::now();
+        elapsed += std::chrono::duration<double>(end - start).count();
+        instructions += vm.executed();
+    }
+
+    printf("%s (%s): %u runs, %lu instructions/run\n", name, ENGINE_NAMES[engine], runs,
+           (unsigned long) (instructions / runs));
+    printf("\t%.2f us/run, %.2f M instructions/sec\n", elapsed * 1e6 / runs, instructions / elapsed / 1e6);
+}
+
+/*
+ * Which superinstructions the decoded engine ran and how many dispatches
+ * they saved.
+ */
+void fusionReport(const char *name, uint8_t *code, uint32_t codesize, uint8_t *data, uint32_t datasize) {
+    VM vm(TEA_KEY, code, codesize);
+    uint8_t i;
+
+    vm.setEngine(ENGINE_DECODED);
+    if (data) {
+        vm.addressSpace()->insData(data, datasize);
+    }
+    vm.run();
+    printf("%s (%s): superinstructions\n", name, ENGINE_NAMES[ENGINE_DECODED]);
+    for (i = 0; i < NUM_FUSIONS; i++) {
+        printf("\t%s: %lu\n", FUSION_NAMES[i], (unsigned long) vm.fired(i));
+    }
+    printf("\t%lu dispatches for %lu instructions (-%.1f%%)\n", (unsigned long) vm.dispatched(),
+           (unsigned long) vm.executed(), 100.0 * (vm.executed() - vm.dispatched()) / vm.executed());
+}
+
+/*
+ * Building, running and tearing down a VM for every run of encrypt.pstc, with
+ * the address space allocated on its own and out of a reused arena, against
+ * taking the VM from a VMPool.
+ */
+void constructionReport(uint8_t engine, uint32_t runs) {
+    uint8_t *arena = (uint8_t *) aligned_alloc(
+            SEGMENT_ALIGN, VMAddrSpace::arenaSize(DEFAULT_STACKSIZE, DEFAULT_CODESIZE, DEFAULT_DATASIZE));
+    uint32_t i;
+    double elapsed;
+    VMPool pool;
+    VM *vm;
+
+    auto start = std::chrono::steady_clock::now();
+    for (i = 0; i < runs; i++) {
+        VM vm(TEA_KEY, TEA_ENCRYPT, TEA_ENCRYPT_LEN);
+        vm.setEngine(engine);
+        vm.run();
+    }
+    auto end = std::chrono::steady_clock::now();
+    elapsed = std::chrono::duration<double>(end - start).count();
+    printf("construction (%s): %u VMs\n", ENGINE_NAMES[engine], runs);
+    printf("\tallocated: %.2f us/run\n", elapsed * 1e6 / runs);
+    start = std::chrono::steady_clock::now();
+    for (i = 0; i < runs; i++) {
+        VM vm(TEA_KEY, TEA_ENCRYPT, TEA_ENCRYPT_LEN, arena);
+        vm.setEngine(engine);
+        vm.run();
+    }
+    end = std::chrono::steady_clock::now();
+    elapsed = std::chrono::duration<double>(end - start).count();
+    printf("\tarena: %.2f us/run\n", elapsed * 1e6 / runs);
+    start = std::chrono::steady_clock::now();
+    for (i = 0; i < runs; i++) {
+        vm = pool.acquire(TEA_KEY, TEA_ENCRYPT, TEA_ENCRYPT_LEN);
+        vm->setEngine(engine);
+        vm->run();
+        pool.release(vm);
+    }
+    end = std::chrono::steady_clock::now();
+    elapsed = std::chrono::duration<double>(end - start).count();
+    printf("\tpooled: %.2f us/run\n", elapsed * 1e6 / runs);
+    free(arena);
+}
+
+/*
+ * The decoded engine in a plain and in a guarded address space, on
+ * decrypt.pstc and on a loop made of loads, stores, pushes and pops. The VMs
+ * are reset between runs, as guarded ones take a few system calls to build.
+ */
+void guardReport(uint32_t runs) {
+#define OP(_op_) encryptOpcode(TEA_KEY, _op_)
+    // data[R0] = data[R0] + 1 through the stack, for R0 = 0, 2, ... 0xfc
+    uint8_t memory[] = {OP(LODR), 0x10, OP(ADDI), R1, 0x01, 0x00, OP(STRR), 0x01, OP(PUSH), R1, OP(POOP), R2,
+                        OP(ADDI), R0, 0x02, 0x00, OP(CMPW), R0, 0xfc, 0x00, OP(JPBI), 0x00, 0x00, OP(SHIT)};
+#undef OP
+    const char *names[] = {"decrypt.pstc", "memory loop"};
+    uint8_t *programs[] = {TEA_DECRYPT, memory};
+    uint32_t sizes[] = {TEA_DECRYPT_LEN, sizeof(memory)};
+    uint8_t kinds[] = {ARENA_HEAP, ARENA_GUARDED};
+    uint32_t i, j, k;
+    double elapsed;
+
+    if (!VM::hasEngine(ENGINE_DECODED)) {
+        return;
+    }
+    for (i = 0; i < sizeof(programs) / sizeof(*programs); i++) {
+        printf("%s (%s): bounds checks against guard pages\n", names[i], ENGINE_NAMES[ENGINE_DECODED]);
+        for (k = 0; k < sizeof(kinds); k++) {
+            VM vm(TEA_KEY, programs[i], sizes[i], (enum arenas) kinds[k]);
+            uint64_t instructions = 0;
+
+            vm.setEngine(ENGINE_DECODED);
+            auto start = std::chrono::steady_clock::now();
+            for (j = 0; j < runs; j++) {
+                vm.reset();
+                vm.addressSpace()->insData(TEA_DATA, TEA_DATA_LEN);
+                vm.run();
+                instructions += vm.executed();
+            }
+            auto end = std::chrono::steady_clock::now();
+            elapsed = std::chrono::duration<double>(end - start).count();
+            printf("\t%s: %.2f us/run, %.2f M instructions/sec\n", kinds[k] == ARENA_GUARDED ? "guarded" : "checked",
+                   elapsed * 1e6 / runs, instructions / elapsed / 1e6);
+        }
+    }
+}
+
+/*
+ * decrypt.pstc run in one go against slices of a budget: the budget is only
+ * checked at jumps, so what a slice costs is mostly leaving and re-entering
+ * the engine.
+ */
+void budgetReport(uint8_t engine, uint32_t runs) {
+    const uint64_t budgets[] = {RUN_FOREVER, 100000, 1000, 100};
+    uint32_t i, j;
+    uint64_t instructions;
+    double elapsed;
+
+    printf("decrypt.pstc (%s): budgeted runs\n", ENGINE_NAMES[engine]);
+    for (i = 0; i < sizeof(budgets) / sizeof(*budgets); i++) {
+        VM vm(TEA_KEY, TEA_DECRYPT, TEA_DECRYPT_LEN);
+        vm.setEngine(engine);
+        instructions = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (j = 0; j < runs; j++) {
+            vm.reset();
+            vm.addressSpace()->insData(TEA_DATA, TEA_DATA_LEN);
+            while (vm.run(budgets[i]) == STOP_BUDGET);
+            instructions += vm.executed();
+        }
+        auto end = std::chrono::steady_clock::now();
+        elapsed = std::chrono::duration<double>(end - start).count();
+        if (budgets[i] == RUN_FOREVER) {
+            printf("\tunbudgeted: ");
+        } else {
+            printf("\t%lu/slice: ", (unsigned long) budgets[i]);
+        }
+        printf("%.2f us/run, %.2f M instructions/sec\n", elapsed * 1e6 / runs, instructions / elapsed / 1e6);
+    }
+}
+
+/*
+ * runs VMs of decrypt.pstc, all spawned at once, on a VMScheduler with as
+ * many workers as CPUs against running them one after the other.
+ */
+void schedulerReport(uint32_t runs) {
+    const uint64_t slices[] = {1000, DEFAULT_SLICE, 100000};
+    std::vector<VM *> vms;
+    uint64_t instructions = 0;
+    uint32_t i, j;
+    double elapsed;
+
+    for (i = 0; i < runs; i++) {
+        vms.push_back(new VM(TEA_KEY, TEA_DECRYPT, TEA_DECRYPT_LEN));
+    }
+    printf("decrypt.pstc (scheduler): %u VMs at once\n", runs);
+    auto start = std::chrono::steady_clock::now();
+    for (VM *vm : vms) {
+        vm->addressSpace()->insData(TEA_DATA, TEA_DATA_LEN);
+        vm->run();
+        instructions += vm->executed();
+    }
+    auto end = std::chrono::steady_clock::now();
+    elapsed = std::chrono::duration<double>(end - start).count();
+    printf("\tone by one: %.2f ms, %.2f M instructions/sec\n", elapsed * 1e3, instructions / elapsed / 1e6);
+    for (i = 0; i < sizeof(slices) / sizeof(*slices); i++) {
+        VMScheduler scheduler(0, slices[i]);
+
+        for (VM *vm : vms) {
+            vm->reset();
+            vm->addressSpace()->insData(TEA_DATA, TEA_DATA_LEN);
+        }
+        start = std::chrono::steady_clock::now();
+        for (j = 0; j < runs; j++) {
+            scheduler.spawn(vms[j]);
+        }
+        scheduler.wait();
+        end = std::chrono::steady_clock::now();
+        elapsed = std::chrono::duration<double>(end - start).count();
+        printf("\t%u workers, %lu/slice: %.2f ms, %.2f M instructions/sec, %lu slices, %lu steals\n",
+               scheduler.size(), (unsigned long) slices[i], elapsed * 1e3, instructions / elapsed / 1e6,
+               (unsigned long) scheduler.slices(), (unsigned long) scheduler.steals());
+    }
+    for (VM *vm : vms) {
+        delete vm;
+    }
+}
+
+/*
+ * StaticVM, with the opcodes of TEA_KEY known at compile time, against the
+ * loop engine it shares its handlers with.
+ */
+void staticReport(const char *name, uint8_t *code, uint32_t codesize, uint8_t *data, uint32_t datasize,
+                  uint32_t runs) {
+    uint32_t i;
+    uint64_t instructions = 0;
+    double elapsed = 0;
+
+    for (i = 0; i < runs; i++) {
+        StaticVM<STATIC_KEY> vm(code, codesize);
+        if (data) {
+            vm.addressSpace()->insData(data, datasize);
+        }
+        auto start = std::chrono::steady_clock::now();
+        vm.run();
+        auto end = std::chrono::steady_clock::now();
+        elapsed += std::chrono::duration<double>(end - start).count();
+        instructions += vm.executed();
+    }
+    printf("%s (static): %u runs, %lu instructions/run\n", name, runs, (unsigned long) (instructions / runs));
+    printf("\t%.2f us/run, %.2f M instructions/sec\n", elapsed * 1e6 / runs, instructions / elapsed / 1e6);
+}
+
+/*
+ * The RC4 key schedule every VM used to run, against looking its result up
+ * in VMOpcodeCache, and what the cache saved over the whole bench.
+ */
+void opcodeCacheReport(uint32_t runs) {
+    opcode_map_t map;
+    uint32_t i;
+    double elapsed;
+
+    auto start = std::chrono::steady_clock::now();
+    for (i = 0; i < runs; i++) {
+        VMOpcodeCache::shuffle(TEA_KEY, &map);
+    }
+    auto end = std::chrono::steady_clock::now();
+    elapsed = std::chrono::duration<double>(end - start).count();
+    printf("opcode maps: %u keys\n", runs);
+    printf("\tkey schedule: %.3f us/key\n", elapsed * 1e6 / runs);
+    start = std::chrono::steady_clock::now();
+    for (i = 0; i < runs; i++) {
+        VMOpcodeCache::lookup(TEA_KEY, &map);
+    }
+    end = std::chrono::steady_clock::now();
+    elapsed = std::chrono::duration<double>(end - start).count();
+    printf("\tcached: %.3f us/key\n", elapsed * 1e6 / runs);
+    printf("\t%lu hits, %lu misses, %.2f ms saved\n", (unsigned long) VMOpcodeCache::hits(),
+           (unsigned long) VMOpcodeCache::misses(), VMOpcodeCache::saved() * 1e3);
+}
+
+/*
+ * Taking a snapshot of decrypt.pstc in the biggest address space and forking
+ * it, against copying the three segments. The forks then decrypt the data
+ * section again with the decoded instructions of the first run.
+ */
+void snapshotReport(uint32_t runs) {
+    VM vm(TEA_KEY, TEA_DECRYPT, TEA_DECRYPT_LEN, 0x10000, MAX_CODESIZE, MAX_DATASIZE);
+    VMAddrSpace *as = vm.addressSpace();
+    uint32_t size = as->getCodesize() + as->getDatasize() + as->getStacksize();
+    uint8_t *copy = new uint8_t[size];
+    uint32_t i;
+    double elapsed;
+    VM *fork;
+
+    as->insData(TEA_DATA, TEA_DATA_LEN);
+    vm.run();
+    as->insData(TEA_DATA, TEA_DATA_LEN);
+    auto start = std::chrono::steady_clock::now();
+    for (i = 0; i < runs; i++) {
+        memcpy(copy, as->getCode(), as->getCodesize());
+        memcpy(copy + as->getCodesize(), as->getData(), as->getDatasize());
+        memcpy(copy + as->getCodesize() + as->getDatasize(), as->getStack(), as->getStacksize());
+    }
+    auto end = std::chrono::steady_clock::now();
+    elapsed = std::chrono::duration<double>(end - start).count();
+    printf("snapshots: %u bytes of segments\n", size);
+    printf("\tmemcpy: %.2f us\n", elapsed * 1e6 / runs);
+    start = std::chrono::steady_clock::now();
+    for (i = 0; i < runs; i++) {
+        VMSnapshot snapshot(&vm);
+    }
+    end = std::chrono::steady_clock::now();
+    elapsed = std::chrono::duration<double>(end - start).count();
+    printf("\tsnapshot: %.2f us\n", elapsed * 1e6 / runs);
+    VMSnapshot snapshot(&vm);
+    start = std::chrono::steady_clock::now();
+    for (i = 0; i < runs; i++) {
+        delete snapshot.fork();
+    }
+    end = std::chrono::steady_clock::now();
+    elapsed = std::chrono::duration<double>(end - start).count();
+    printf("\tfork: %.2f us\n", elapsed * 1e6 / runs);
+    start = std::chrono::steady_clock::now();
+    for (i = 0; i < runs; i++) {
+        fork = snapshot.fork();
+        fork->reset();
+        fork->addressSpace()->insData(TEA_DATA, TEA_DATA_LEN);
+        fork->run();
+        delete fork;
+    }
+    end = std::chrono::steady_clock::now();
+    elapsed = std::chrono::duration<double>(end - start).count();
+    printf("\tfork and decrypt: %.2f us\n", elapsed * 1e6 / runs);
+    delete[] copy;
+}
+
+template<uint8_t LANES>
+double lockstepRun(uint8_t *code, uint32_t codesize, uint8_t *data, uint8_t *plain, uint32_t count,
+                   vm_state_t *states, uint64_t *splits) {
+    VMLockstep<LANES> lockstep(TEA_KEY, code, codesize);
+
+    memcpy(data, plain, (uint64_t) count * LOCKSTEP_STRIDE);
+    auto start = std::chrono::steady_clock::now();
+    lockstep.run(data, LOCKSTEP_STRIDE, count, states);
+    auto end = std::chrono::steady_clock::now();
+    *splits = lockstep.splits();
+    return std::chrono::duration<double>(end - start).count();
+}
+
+/*
+ * A single threaded VMBatch against VMLockstep, over strings of the same
+ * length.
+ */
+void lockstepReport(const char *name, uint8_t *code, uint32_t codesize, uint32_t count) {
+    uint8_t *data = new uint8_t[(uint64_t) count * LOCKSTEP_STRIDE];
+    uint8_t *plain = new uint8_t[(uint64_t) count * LOCKSTEP_STRIDE];
+    vm_state_t *states = new vm_state_t[count];
+    uint32_t i, seed = 1;
+    uint64_t instructions = 0, splits;
+    double elapsed;
+    VMBatch batch(TEA_KEY, code, codesize, 1);
+
+    for (i = 0; i < count * LOCKSTEP_STRIDE; i++) {
+        plain[i] = i % LOCKSTEP_STRIDE < 0x20 ? lcg(&seed) | 1 : 0;
+    }
+    memcpy(data, plain, (uint64_t) count * LOCKSTEP_STRIDE);
+    auto start = std::chrono::steady_clock::now();
+    batch.run(data, LOCKSTEP_STRIDE, count, states);
+    auto end = std::chrono::steady_clock::now();
+    elapsed = std::chrono::duration<double>(end - start).count();
+    for (i = 0; i < count; i++) {
+        instructions += states[i].executed;
+    }
+    printf("%s (lockstep): %u data sections, %lu instructions/section\n", name, count,
+           (unsigned long) (instructions / count));
+    printf("\tscalar: %.2f M instructions/sec\n", instructions / elapsed / 1e6);
+    elapsed = lockstepRun<8>(code, codesize, data, plain, count, states, &splits);
+    printf("\t8 lanes: %.2f M instructions/sec, %lu splits\n", instructions / elapsed / 1e6, (unsigned long) splits);
+    elapsed = lockstepRun<16>(code, codesize, data, plain, count, states, &splits);
+    printf("\t16 lanes: %.2f M instructions/sec, %lu splits\n", instructions / elapsed / 1e6, (unsigned long) splits);
+    elapsed = lockstepRun<32>(code, codesize, data, plain, count, states, &splits);
+    printf("\t32 lanes: %.2f M instructions/sec, %lu splits\n", instructions / elapsed / 1e6, (unsigned long) splits);
+    delete[] data;
+    delete[] plain;
+    delete[] states;
+}
+
+/*
+ * pasticciotto-bench [runs] prints the reports above, with --benchmark_...
+ * flags it runs the suite of benchmark.h instead.
+ */
+int main(int argc, char *argv[]) {
+    uint32_t runs = DEFAULT_RUNS;
+    uint8_t engine;
+
+    if (argc > 1 && argv[1][0] == '-') {
+        try {
+            Benchmarks suite(argc, argv);
+            runSuite(&suite);
+            suite.finish();
+        } catch (std::exception &e) {
+            printf("%s\n", e.what());
+            return 1;
+        }
+        return 0;
+    }
+    if (argc > 1) {
+        runs = strtoul(argv[1], NULL, 0);
+    }
+    for (engine = ENGINE_LOOP; engine < NUM_ENGINES; engine++) {
+        if (!VM::hasEngine(engine)) {
+            continue;
+        }
+        benchRun("encrypt.pstc", engine, TEA_ENCRYPT, TEA_ENCRYPT_LEN, NULL, 0, runs);
+        benchRun("decrypt.pstc", engine, TEA_DECRYPT, TEA_DECRYPT_LEN, TEA_DATA, TEA_DATA_LEN, runs / 10);
+    }
+    staticReport("encrypt.pstc", TEA_ENCRYPT, TEA_ENCRYPT_LEN, NULL, 0, runs);
+    staticReport("decrypt.pstc", TEA_DECRYPT, TEA_DECRYPT_LEN, TEA_DATA, TEA_DATA_LEN, runs / 10);
+    if (VM::hasEngine(ENGINE_DECODED)) {
+        fusionReport("encrypt.pstc", TEA_ENCRYPT, TEA_ENCRYPT_LEN, NULL, 0);
+        fusionReport("decrypt.pstc", TEA_DECRYPT, TEA_DECRYPT_LEN, TEA_DATA, TEA_DATA_LEN);
+    }
+    lockstepReport("encrypt.pstc", TEA_ENCRYPT, TEA_ENCRYPT_LEN, runs);
+    for (engine = ENGINE_LOOP; engine < NUM_ENGINES; engine++) {
+        if (VM::hasEngine(engine)) {
+            constructionReport(engine, runs);
+        }
+    }
+    snapshotReport(runs);
+    for (engine = ENGINE_LOOP; engine < NUM_ENGINES; engine++) {
+        if (VM::hasEngine(engine)) {
+            budgetReport(engine, runs / 10);
+        }
+    }
+    schedulerReport(runs / 2);
+    guardReport(runs);
+    opcodeCacheReport(runs);
+    return 0;
+}
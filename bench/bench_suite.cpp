@@ -0,0 +1,304 @@
+#include "benchmark.h"
+#include "../vm/vmopcodecache.h"
+#include "../vm/vmpool.h"
+#include "../tests/include/programs.h"
+#include <stdexcept>
+#include <stdlib.h>
+
+// instructions of a kind in every iteration of an opcode benchmark
+#define KIND_BODY 16
+#define KIND_LOOPS 0x1000
+
+/*
+ * polictf/tea_cversion, built along with the bench: encrypt() and decrypt()
+ * are renamed so that they don't clash with the libc ones.
+ */
+extern "C" void teaEncrypt(uint16_t *v);
+extern "C" void teaDecrypt(uint16_t *v);
+
+// growing plaintexts, up to what a data section holds
+static const uint32_t NATIVE_SIZES[] = {0x10, 0x100, 0x1000, 0xfff0};
+
+enum kinds {
+    KIND_REG2REG, KIND_IMM2REG, KIND_BYT2REG, KIND_JUMP, KIND_CALL, KIND_STACK, NUM_KINDS
+};
+
+static const char *KIND_NAMES[NUM_KINDS] = {"REG2REG", "IMM2REG", "BYT2REG", "JMPI", "CALL+RETN", "PUSH+POOP"};
+static const char *ENGINE_NAMES[NUM_ENGINES] = {"loop", "threaded", "decoded", "jit"};
+
+/*
+ * KIND_LOOPS times KIND_BODY instructions of a kind, then R0 counting the
+ * loops: the loop around them is part of what is timed.
+ *
+ *     REG2REG:   ADDR R1, R2
+ *     IMM2REG:   ADDI R1, 0x0101
+ *     BYT2REG:   XORB R1, 0x5a
+ *     JMPI:      JMPI <the next instruction>
+ *     CALL+RETN: CALL <a RETN after SHIT>, half as many
+ *     PUSH+POOP: PUSH R1, POOP R2 in turn
+ */
+static uint32_t kindProgram(uint8_t kind, uint8_t *code) {
+#define OP(_op_) encryptOpcode(TEA_KEY, _op_)
+    uint32_t len = 0, calls = 0, i;
+
+    for (i = 0; i < KIND_BODY; i++) {
+        switch (kind) {
+            case KIND_REG2REG:
+                code[len++] = OP(ADDR);
+                code[len++] = R1 << 4 | R2;
+                break;
+            case KIND_IMM2REG:
+                code[len++] = OP(ADDI);
+                code[len++] = R1;
+                code[len++] = 0x01;
+                code[len++] = 0x01;
+                break;
+            case KIND_BYT2REG:
+                code[len++] = OP(XORB);
+                code[len++] = R1;
+                code[len++] = 0x5a;
+                break;
+            case KIND_JUMP:
+                code[len] = OP(JMPI);
+                code[len + 1] = (len + JMPI_SIZE) & 0xff;
+                code[len + 2] = (len + JMPI_SIZE) >> 8;
+                len += JMPI_SIZE;
+                break;
+            case KIND_CALL:
+                // patched once the RETN is placed
+                if (i % 2 == 0) {
+                    code[len++] = OP(CALL);
+                    len += 2;
+                    calls++;
+                }
+                break;
+            case KIND_STACK:
+                code[len++] = OP(i % 2 ? POOP : PUSH);
+                code[len++] = i % 2 ? R2 : R1;
+                break;
+        }
+    }
+    code[len++] = OP(ADDI);
+    code[len++] = R0;
+    code[len++] = 0x01;
+    code[len++] = 0x00;
+    code[len++] = OP(CMPW);
+    code[len++] = R0;
+    code[len++] = (KIND_LOOPS - 1) & 0xff;
+    code[len++] = (KIND_LOOPS - 1) >> 8;
+    code[len++] = OP(JPBI);
+    code[len++] = 0x00;
+    code[len++] = 0x00;
+    code[len++] = OP(SHIT);
+    if (kind == KIND_CALL) {
+        for (i = 0; i < calls; i++) {
+            code[i * CALL_SIZE + 1] = len & 0xff;
+            code[i * CALL_SIZE + 2] = len >> 8;
+        }
+        code[len++] = OP(RETN);
+    }
+#undef OP
+    return len;
+}
+
+static void engineRuns(Benchmarks *b, const std::string &name, uint8_t *code, uint32_t codesize, uint8_t *data,
+                       uint32_t datasize) {
+    forEachEngine(code, codesize, [&](VM *vm, uint8_t engine, auto run) {
+        b->run(name + "/" + (engine < NUM_ENGINES ? ENGINE_NAMES[engine] : "static"), [&](uint64_t iterations) {
+            uint64_t i, instructions = 0;
+
+            for (i = 0; i < iterations; i++) {
+                vm->reset();
+                if (data) {
+                    vm->addressSpace()->insData(data, datasize);
+                }
+                run();
+                instructions += vm->executed();
+            }
+            return instructions;
+        });
+    });
+}
+
+/*
+ * encrypt.pstc stores its own 8 bytes of plaintext before encrypting the
+ * data section: with those STRIs made NOPEs it encrypts whatever string the
+ * data section holds, in blocks of 4 bytes up to and including the one at
+ * its NUL. Only GRMN, MOVI and STRI come before its first CALL.
+ */
+static void plaintextFromData(uint8_t *code) {
+#define OP(_op_) encryptOpcode(TEA_KEY, _op_)
+    uint32_t ip = 0, i;
+
+    while (code[ip] != OP(CALL)) {
+        if (code[ip] == OP(STRI)) {
+            for (i = 0; i < STRI_SIZE; i++) {
+                code[ip + i] = OP(NOPE);
+            }
+            ip += STRI_SIZE;
+        } else if (code[ip] == OP(MOVI)) {
+            ip += MOVI_SIZE;
+        } else if (code[ip] == OP(GRMN)) {
+            ip += GRMN_SIZE;
+        } else {
+            throw std::runtime_error("Unexpected encrypt.pstc");
+        }
+    }
+#undef OP
+}
+
+// what tea-encrypt.c does with its argument, in place
+static void nativeEncrypt(uint8_t *buf, uint32_t size) {
+    uint32_t i;
+
+    for (i = 0; i + 2 * sizeof(uint16_t) <= size; i += sizeof(uint32_t)) {
+        teaEncrypt((uint16_t *) &buf[i]);
+    }
+}
+
+/*
+ * The VM's ciphertext against the native one, and the native decryption of
+ * it against the plaintext.
+ */
+static void checkCiphertext(VM *vm, const uint8_t *plain, const uint8_t *cipher, uint32_t size) {
+    std::vector<uint8_t> back(cipher, cipher + size);
+    uint32_t i;
+
+    if (memcmp(vm->addressSpace()->getData(), cipher, size)) {
+        throw std::runtime_error("The VM and the native TEA disagree on " + std::to_string(size) + " bytes");
+    }
+    for (i = 0; i + 2 * sizeof(uint16_t) <= size; i += sizeof(uint32_t)) {
+        teaDecrypt((uint16_t *) &back[i]);
+    }
+    if (memcmp(back.data(), plain, size)) {
+        throw std::runtime_error("The native TEA doesn't decrypt what it encrypts");
+    }
+}
+
+/*
+ * The same plaintexts encrypted by the native TEA and by encrypt.pstc on
+ * every engine, which are checked against it first: bytes a second and
+ * how many times slower than native each engine went.
+ */
+static void nativeRuns(Benchmarks *b) {
+    uint8_t code[sizeof(TEA_ENCRYPT)];
+    std::vector<uint8_t> plain, cipher, buf;
+    uint32_t seed = 1, size, i, j;
+    double native;
+
+    memcpy(code, TEA_ENCRYPT, TEA_ENCRYPT_LEN);
+    plaintextFromData(code);
+    for (i = 0; i < sizeof(NATIVE_SIZES) / sizeof(*NATIVE_SIZES); i++) {
+        size = NATIVE_SIZES[i];
+        // no zero bytes: the VM encrypts up to the first one
+        plain.resize(size);
+        for (j = 0; j < size; j++) {
+            plain[j] = lcg(&seed) | 1;
+        }
+        cipher = plain;
+        nativeEncrypt(cipher.data(), size);
+        buf.resize(size);
+
+        std::string name = "native/encrypt/" + std::to_string(size) + "/";
+        native = b->run(name + "c", [&](uint64_t iterations) {
+            uint64_t k;
+
+            for (k = 0; k < iterations; k++) {
+                memcpy(buf.data(), plain.data(), size);
+                nativeEncrypt(buf.data(), size);
+            }
+            return iterations * size;
+        }, UNIT_BYTES);
+        // the data section ends with the zero block after the string
+        forEachEngine(code, TEA_ENCRYPT_LEN, [&](VM *vm, uint8_t engine, auto run) {
+            auto encrypt = [&](void) {
+                vm->reset();
+                vm->addressSpace()->insData(plain.data(), size);
+                run();
+            };
+
+            encrypt();
+            checkCiphertext(vm, plain.data(), cipher.data(), size);
+            b->run(name + (engine < NUM_ENGINES ? ENGINE_NAMES[engine] : "static"), [&](uint64_t iterations) {
+                uint64_t k;
+
+                for (k = 0; k < iterations; k++) {
+                    encrypt();
+                }
+                return iterations * size;
+            }, UNIT_BYTES, native);
+        }, ENGINE_LOOP, size + 8);
+    }
+}
+
+void runSuite(Benchmarks *b) {
+    uint8_t code[0x100], kind;
+    uint32_t len;
+
+    /*
+    MICRO
+    */
+    for (kind = 0; kind < NUM_KINDS; kind++) {
+        len = kindProgram(kind, code);
+        engineRuns(b, std::string("opcodes/") + KIND_NAMES[kind], code, len, NULL, 0);
+    }
+
+    /*
+    MACRO
+    */
+    b->run("construction/allocated", [](uint64_t iterations) {
+        uint64_t i;
+
+        for (i = 0; i < iterations; i++) {
+            VM vm(TEA_KEY, TEA_ENCRYPT, TEA_ENCRYPT_LEN);
+        }
+        return iterations;
+    });
+    b->run("construction/arena", [](uint64_t iterations) {
+        uint8_t *arena = (uint8_t *) aligned_alloc(
+                SEGMENT_ALIGN, VMAddrSpace::arenaSize(DEFAULT_STACKSIZE, DEFAULT_CODESIZE, DEFAULT_DATASIZE));
+        uint64_t i;
+
+        for (i = 0; i < iterations; i++) {
+            VM vm(TEA_KEY, TEA_ENCRYPT, TEA_ENCRYPT_LEN, arena);
+        }
+        free(arena);
+        return iterations;
+    });
+    b->run("construction/pooled", [](uint64_t iterations) {
+        VMPool pool;
+        uint64_t i;
+
+        for (i = 0; i < iterations; i++) {
+            pool.release(pool.acquire(TEA_KEY, TEA_ENCRYPT, TEA_ENCRYPT_LEN));
+        }
+        return iterations;
+    });
+    // what encryptOpcodes() costs on a new key, then on a cached one
+    b->run("encryptOpcodes/schedule", [](uint64_t iterations) {
+        opcode_map_t map;
+        uint64_t i;
+
+        for (i = 0; i < iterations; i++) {
+            VMOpcodeCache::shuffle(TEA_KEY, &map);
+            keep(map);
+        }
+        return iterations;
+    });
+    b->run("encryptOpcodes/cached", [](uint64_t iterations) {
+        opcode_map_t map;
+        uint64_t i;
+
+        for (i = 0; i < iterations; i++) {
+            keep(VMOpcodeCache::lookup(TEA_KEY, &map));
+        }
+        return iterations;
+    });
+    engineRuns(b, "tea/encrypt.pstc", TEA_ENCRYPT, TEA_ENCRYPT_LEN, NULL, 0);
+    engineRuns(b, "tea/decrypt.pstc", TEA_DECRYPT, TEA_DECRYPT_LEN, TEA_DATA, TEA_DATA_LEN);
+
+    /*
+    NATIVE
+    */
+    nativeRuns(b);
+}
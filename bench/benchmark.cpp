@@ -0,0 +1,172 @@
+#include "benchmark.h"
+#include "../vm/vm.h"
+#include <string.h>
+#include <unistd.h>
+#include <stdexcept>
+#include <thread>
+
+/*
+CONSTRUCTORS
+*/
+Benchmarks::Benchmarks(int argc, char *argv[]) {
+    const char *value;
+    int i;
+
+    filter = std::regex(".");
+    mintime = DEFAULT_MIN_TIME;
+    json = false;
+    out = NULL;
+    executable = argv[0];
+    for (i = 1; i < argc; i++) {
+        value = strchr(argv[i], '=');
+        if (!value) {
+            throw std::invalid_argument(std::string("Unknown argument ") + argv[i]);
+        }
+        value++;
+        if (!strncmp(argv[i], "--benchmark_filter=", value - argv[i])) {
+            filter = std::regex(value);
+        } else if (!strncmp(argv[i], "--benchmark_min_time=", value - argv[i])) {
+            mintime = strtod(value, NULL);
+        } else if (!strncmp(argv[i], "--benchmark_format=", value - argv[i])) {
+            if (strcmp(value, "json") && strcmp(value, "console")) {
+                throw std::invalid_argument(std::string("Unknown format ") + value);
+            }
+            json = !strcmp(value, "json");
+        } else if (!strncmp(argv[i], "--benchmark_out=", value - argv[i])) {
+            out = fopen(value, "w");
+            if (!out) {
+                throw std::runtime_error(std::string("Couldn't open ") + value);
+            }
+        } else {
+            throw std::invalid_argument(std::string("Unknown argument ") + argv[i]);
+        }
+    }
+    if (!json) {
+        printf("%-40s %15s %15s %12s %16s %9s\n", "Benchmark", "Time", "CPU", "Iterations", "Rate", "Slowdown");
+    }
+}
+
+Benchmarks::~Benchmarks() {
+    if (out) {
+        fclose(out);
+    }
+}
+
+/*
+INTERFACE
+*/
+// the results of every benchmark run, as JSON
+void Benchmarks::finish(void) {
+    if (json) {
+        writeJson(stdout);
+    }
+    if (out) {
+        writeJson(out);
+        fclose(out);
+        out = NULL;
+    }
+}
+
+/*
+WORKERS
+*/
+double Benchmarks::cpuNow(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// the rate with its unit in every cell, as rows of items and of bytes share the column
+void Benchmarks::report(const bench_result_t *r) {
+    char rate[32];
+
+    if (json) {
+        return;
+    }
+    printf("%-40s %12.0f ns %12.0f ns %12lu", r->name.c_str(), r->realtime, r->cputime,
+           (unsigned long) r->iterations);
+    if (r->items) {
+        snprintf(rate, sizeof(rate), "%.2f%s", r->items / 1e6, r->unit == UNIT_BYTES ? " MB/s" : " Mitems/s");
+        printf(" %16s", rate);
+    }
+    if (r->slowdown) {
+        printf(" %8.1fx", r->slowdown);
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+/*
+ * The layout of Google Benchmark's JSON reporter, with the engines and the
+ * build flags of the VM in the context: STATS and TRACE builds are slower.
+ */
+void Benchmarks::writeJson(FILE *f) {
+    const char *engines[NUM_ENGINES] = {"loop", "threaded", "decoded", "jit"};
+    const char *flags[] = {
+#ifdef THREADED
+            "THREADED",
+#endif
+#ifdef JIT
+            "JIT",
+#endif
+#ifdef STATS
+            "STATS",
+#endif
+#ifdef TRACE
+            "TRACE",
+#endif
+#ifdef DBG
+            "DBG",
+#endif
+            NULL};
+    char date[32], host[256];
+    time_t now = time(NULL);
+    bool first;
+    uint32_t i;
+
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", localtime(&now));
+    if (gethostname(host, sizeof(host))) {
+        strcpy(host, "unknown");
+    }
+    host[sizeof(host) - 1] = '\0';
+    fprintf(f, "{\n  \"context\": {\n");
+    fprintf(f, "    \"date\": \"%s\",\n    \"host_name\": \"%s\",\n    \"executable\": \"%s\",\n", date, host,
+            executable.c_str());
+    fprintf(f, "    \"num_cpus\": %u,\n", std::thread::hardware_concurrency());
+#ifdef NDEBUG
+    fprintf(f, "    \"library_build_type\": \"release\",\n");
+#else
+    fprintf(f, "    \"library_build_type\": \"debug\",\n");
+#endif
+    fprintf(f, "    \"engines\": [");
+    first = true;
+    for (i = 0; i < NUM_ENGINES; i++) {
+        if (VM::hasEngine(i)) {
+            fprintf(f, "%s\"%s\"", first ? "" : ", ", engines[i]);
+            first = false;
+        }
+    }
+    fprintf(f, "],\n    \"flags\": [");
+    for (i = 0; flags[i]; i++) {
+        fprintf(f, "%s\"%s\"", i ? ", " : "", flags[i]);
+    }
+    fprintf(f, "]\n  },\n  \"benchmarks\": [");
+    for (i = 0; i < results.size(); i++) {
+        fprintf(f, "%s\n    {\n      \"name\": \"%s\",\n      \"run_name\": \"%s\",\n", i ? "," : "",
+                results[i].name.c_str(), results[i].name.c_str());
+        fprintf(f, "      \"run_type\": \"iteration\",\n      \"iterations\": %lu,\n",
+                (unsigned long) results[i].iterations);
+        fprintf(f, "      \"real_time\": %.4f,\n      \"cpu_time\": %.4f,\n      \"time_unit\": \"ns\"",
+                results[i].realtime, results[i].cputime);
+        if (results[i].items) {
+            fprintf(f, ",\n      \"%s\": %.4f", results[i].unit == UNIT_BYTES ? "bytes_per_second" : "items_per_second",
+                    results[i].items);
+        }
+        if (results[i].slowdown) {
+            fprintf(f, ",\n      \"slowdown\": %.4f", results[i].slowdown);
+        }
+        fprintf(f, "\n    }");
+    }
+    fprintf(f, "\n  ]\n}\n");
+}
@@ -0,0 +1,123 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <chrono>
+#include <regex>
+#include <string>
+#include <vector>
+#include <time.h>
+
+// seconds every benchmark runs for at least, --benchmark_min_time
+#define DEFAULT_MIN_TIME 0.5
+#define MAX_ITERATIONS 1000000000
+
+// what the bodies of run() count
+enum units {
+    UNIT_ITEMS, UNIT_BYTES
+};
+
+typedef struct bench_result {
+    std::string name;
+    uint64_t iterations;
+    // per iteration, in ns
+    double realtime;
+    double cputime;
+    // instructions, VMs, keys or bytes a second, 0 if the benchmark doesn't count any
+    double items;
+    uint8_t unit;
+    // how many times as fast the baseline went, 0 without one
+    double slowdown;
+} bench_result_t;
+
+/*
+ * A small harness in the way of Google Benchmark, whose flags and JSON
+ * output it follows so that its tools (compare.py) work on the results:
+ *
+ *     --benchmark_filter=<regex>     only the benchmarks matching it
+ *     --benchmark_min_time=<secs>    how long each of them runs for at least
+ *     --benchmark_format=json        JSON on stdout instead of a table
+ *     --benchmark_out=<file>         JSON to file, the table still on stdout
+ *
+ * run() calls body(iterations) with more and more iterations until it takes
+ * min_time; body returns how many items (or bytes) it went through, if it
+ * counts any, and run() how many a second. Given the rate of a baseline,
+ * the result also tells how many times slower it went.
+ */
+class Benchmarks {
+private:
+    std::vector<bench_result_t> results;
+    std::regex filter;
+    double mintime;
+    bool json;
+    FILE *out;
+    std::string executable;
+
+    static double cpuNow(void);
+
+    void report(const bench_result_t *r);
+
+    void writeJson(FILE *f);
+
+public:
+    Benchmarks(int argc, char *argv[]);
+
+    ~Benchmarks();
+
+    template<typename F>
+    double run(const std::string &name, F body, uint8_t unit = UNIT_ITEMS, double baseline = 0);
+
+    void finish(void);
+};
+
+template<typename F>
+double Benchmarks::run(const std::string &name, F body, uint8_t unit, double baseline) {
+    bench_result_t r;
+    uint64_t iterations = 1, items;
+    double elapsed, cpu, multiplier;
+
+    if (!std::regex_search(name, filter)) {
+        return 0;
+    }
+    for (;;) {
+        cpu = cpuNow();
+        auto start = std::chrono::steady_clock::now();
+        items = body(iterations);
+        auto end = std::chrono::steady_clock::now();
+        cpu = cpuNow() - cpu;
+        elapsed = std::chrono::duration<double>(end - start).count();
+        if (elapsed >= mintime || iterations >= MAX_ITERATIONS) {
+            break;
+        }
+        // aiming a bit past min_time, by at most 10 times as many iterations
+        multiplier = elapsed > mintime / 10 ? mintime * 1.4 / elapsed : 10;
+        iterations = std::min<uint64_t>(std::max<uint64_t>(iterations * std::min(multiplier, 10.0), iterations + 1),
+                                        MAX_ITERATIONS);
+    }
+    r.name = name;
+    r.iterations = iterations;
+    r.realtime = elapsed * 1e9 / iterations;
+    r.cputime = cpu * 1e9 / iterations;
+    r.items = items / elapsed;
+    r.unit = unit;
+    r.slowdown = baseline && r.items ? baseline / r.items : 0;
+    results.push_back(r);
+    report(&results.back());
+    return r.items;
+}
+
+// keeps the compiler from dropping the computation of value, as DoNotOptimize() does
+template<typename T>
+inline void keep(T const &value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+/*
+ * The benchmarks of the suite: instructions by operand kind on every engine,
+ * then building VMs, their opcode maps and whole TEA runs, then TEA against
+ * native code.
+ */
+void runSuite(Benchmarks *b);
+
+#endif
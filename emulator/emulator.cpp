@@ -1,31 +1,129 @@
 #include "../vm/debug.h"
 #include "../vm/vm.h"
-#include <fstream>
+#include "../vm/vmprofiler.h"
+#include "../vm/vmtrace.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static FILE *openReport(const char *path) {
+    FILE *f;
+
+    if (!VM::hasStats()) {
+        printf("Stats are not compiled in: build with PASTICCIOTTO_STATS.\n");
+        exit(1);
+    }
+    f = fopen(path, "w");
+    if (!f) {
+        printf("Couldn't open %s.\n", path);
+        exit(-1);
+    }
+    return f;
+}
 
 int main(int argc, char *argv[]) {
-    std::ifstream bytecode_if;
-    std::streamsize bytecode_size;
-    uint8_t *bytecode;
+    struct stat st;
+    uint8_t *bytecode = NULL;
+    FILE *stats = NULL, *blocks = NULL, *folded = NULL;
+    const char *symbols = NULL, *trace = NULL;
+    uint32_t hz = DEFAULT_PROFILER_HZ;
+    int fd, opt;
 
-    if (argc < 3) {
-        printf("Usage: %s <opcodes_key> <program>\n", argv[0]);
+    while ((opt = getopt(argc, argv, "b:f:y:r:t:")) != -1) {
+        switch (opt) {
+            case 'b':
+                blocks = openReport(optarg);
+                break;
+            case 'f':
+                folded = openReport(optarg);
+                break;
+            case 'y':
+                symbols = optarg;
+                break;
+            case 'r':
+                hz = strtoul(optarg, NULL, 0);
+                break;
+            case 't':
+                if (!VM::hasTrace()) {
+                    printf("Tracing is not compiled in: build with PASTICCIOTTO_TRACE.\n");
+                    return 1;
+                }
+                trace = optarg;
+                break;
+            default:
+                argc = 0;
+                break;
+        }
+    }
+    if (argc - optind < 2) {
+        printf("Usage: %s [-b blocks.txt] [-f folded.txt [-r hz]] [-y symbols] [-t trace] <opcodes_key> <program> "
+               "[stats.json]\n",
+               argv[0]);
+        printf("\t-b: hot blocks, -f: sampled call stacks for flamegraph.pl, -y: symbols of the assembler\n");
+        printf("\t-t: where the last instructions go if the program fails, for pasticciotto-trace\n");
         return 1;
     }
+    if (argc - optind > 2) {
+        stats = openReport(argv[optind + 2]);
+    }
 
     /*
-    reading bytecode
+    mapping bytecode: the VM runs it from the page cache, without copies
     */
-    bytecode_if.open(argv[2], std::ios::binary | std::ios::ate);
-    if (!bytecode_if.good()) {
+    fd = open(argv[optind + 1], O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) || !S_ISREG(st.st_mode)) {
         printf("File is not valid.\n");
         return -1;
     }
-    bytecode_size = bytecode_if.tellg();
-    bytecode_if.seekg(0, std::ios::beg);
-
-    bytecode = new uint8_t[bytecode_size];
-    bytecode_if.read((char *) bytecode, bytecode_size);
-    VM vm((uint8_t *) argv[1], bytecode, bytecode_size);
-    vm.run();
+    if (st.st_size > MAX_CODESIZE) {
+        printf("Program is too big.\n");
+        return -1;
+    }
+    if (st.st_size) {
+        bytecode = (uint8_t *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (bytecode == MAP_FAILED) {
+            printf("Couldn't map the program.\n");
+            return -1;
+        }
+    }
+    close(fd);
+    VM vm((uint8_t *) argv[optind]);
+    if (bytecode) {
+        vm.addressSpace()->borrowCode(bytecode, st.st_size);
+    }
+    std::unique_ptr<VMTrace> recorder(trace ? new VMTrace(&vm) : NULL);
+    if (recorder) {
+        recorder->flightRecorder(trace);
+    }
+    if (!blocks && !folded) {
+        vm.run();
+    } else {
+        VMProfiler profiler(&vm);
+        if (symbols && !profiler.loadSymbols(symbols)) {
+            printf("Couldn't read the symbols in %s.\n", symbols);
+        }
+        if (folded) {
+            profiler.start(hz);
+        }
+        vm.run();
+        profiler.stop();
+        if (blocks) {
+            profiler.hotBlocks(blocks);
+            fclose(blocks);
+        }
+        if (folded) {
+            profiler.foldedStacks(folded);
+            fclose(folded);
+        }
+    }
+    if (stats) {
+        vm.dumpStats(stats);
+        fclose(stats);
+    }
+    if (bytecode) {
+        munmap(bytecode, st.st_size);
+    }
     return 0;
-}
\ No newline at end of file
+}
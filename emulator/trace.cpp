@@ -0,0 +1,24 @@
+#include "../vm/vmtrace.h"
+
+int main(int argc, char *argv[]) {
+    FILE *f;
+    bool ok;
+
+    if (argc < 2) {
+        printf("Usage: %s <trace>\n", argv[0]);
+        printf("\tDecodes the flight recorder of a VM, e.g. pasticciotto-emulator -t <trace>\n");
+        return 1;
+    }
+    f = fopen(argv[1], "rb");
+    if (!f) {
+        printf("Couldn't open %s.\n", argv[1]);
+        return -1;
+    }
+    ok = VMTrace::decode(f, stdout);
+    fclose(f);
+    if (!ok) {
+        printf("%s is not a valid trace.\n", argv[1]);
+        return -1;
+    }
+    return 0;
+}
@@ -1,9 +1,13 @@
-#include "../../vm/vm.h"
+#include "../../vm/staticvm.h"
 #include <fstream>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+static constexpr uint8_t OPCODE_KEY[] = {0x48, 0x61, 0x76, 0x65, 0x46, 0x75, 0x6e,
+                                         0x21, 0x50, 0x6f, 0x6c, 0x69, 0x43, 0x54,
+                                         0x46, 0x32, 0x30, 0x31, 0x37, 0x21, 0x00};
+
 int main(int argc, char *argv[]) {
     unsigned char banner[] = {
             0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x5f, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20,
@@ -103,13 +107,10 @@ int main(int argc, char *argv[]) {
             0xcb, 0x05, 0x5c, 0x03, 0x5c, 0x02, 0x5c, 0x01, 0xbb};
     unsigned int bclen = 261;
 
-    unsigned char opcode_key[] = {0x48, 0x61, 0x76, 0x65, 0x46, 0x75, 0x6e,
-                                  0x21, 0x50, 0x6f, 0x6c, 0x69, 0x43, 0x54,
-                                  0x46, 0x32, 0x30, 0x31, 0x37, 0x21, 0x00};
-
     printf("%s", banner);
     printf("\nHmmm...\n");
-    VM vm(opcode_key, bc, bclen);
+    // the opcodes are shuffled at compile time
+    StaticVM<OPCODE_KEY> vm(bc, bclen);
     vm.run();
     return 0;
 }
\ No newline at end of file
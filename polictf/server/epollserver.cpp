@@ -0,0 +1,375 @@
+#include "epollserver.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <stdexcept>
+
+/*
+CONSTRUCTORS
+*/
+/*
+ * address is tcp:PORT, to listen on every interface, or unix:PATH. workers
+ * is the number of threads running the VMs, one per CPU if 0.
+ */
+EpollServer::EpollServer(const char *address, const challenge_t *challenge, uint32_t workers)
+    : sessions(SERVER_MAX_CLIENTS), rng(std::random_device()()), scheduler(workers) {
+    struct epoll_event ev = {};
+    uint32_t i;
+
+    this->challenge = challenge;
+    stopping = false;
+    unixsocket = false;
+    path[0] = 0;
+    listener = -1;
+    for (i = 0; i < SERVER_MAX_CLIENTS; i++) {
+        sessions[i].server = this;
+        sessions[i].state = SESSION_FREE;
+        sessions[i].vm = NULL;
+        freelist.push_back(&sessions[SERVER_MAX_CLIENTS - 1 - i]);
+    }
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epfd < 0 || wakefd < 0) {
+        throw std::runtime_error("Couldn't create the event loop");
+    }
+    listen(address);
+    // the listener is told apart by a NULL session, the workers by the server itself
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, listener, &ev);
+    ev.data.ptr = this;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev);
+    DBG_SUCC(("Listening on %s.\n", address));
+}
+
+EpollServer::~EpollServer() {
+    uint32_t i;
+
+    scheduler.wait();
+    for (i = 0; i < SERVER_MAX_CLIENTS; i++) {
+        if (sessions[i].state != SESSION_FREE) {
+            ::close(sessions[i].fd);
+            delete sessions[i].vm;
+        }
+    }
+    ::close(listener);
+    ::close(wakefd);
+    ::close(epfd);
+    if (unixsocket) {
+        unlink(path);
+    }
+}
+
+void EpollServer::listen(const char *address) {
+    listener = listenOn(address, SOCK_NONBLOCK);
+    if (!strncmp(address, "unix:", 5)) {
+        strcpy(path, address + 5);
+        unixsocket = true;
+    }
+}
+
+/*
+ * Returns a socket listening on address, tcp:PORT on every interface or
+ * unix:PATH. flags go to socket(), along with SOCK_CLOEXEC.
+ */
+int listenOn(const char *address, int flags) {
+    struct sockaddr_in in = {};
+    struct sockaddr_un un = {};
+    int one = 1, fd;
+
+    if (!strncmp(address, "tcp:", 4)) {
+        in.sin_family = AF_INET;
+        in.sin_addr.s_addr = htonl(INADDR_ANY);
+        in.sin_port = htons(strtoul(address + 4, NULL, 10));
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | flags, 0);
+        if (fd < 0) {
+            throw std::runtime_error("Couldn't create the socket");
+        }
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, (struct sockaddr *) &in, sizeof(in))) {
+            throw std::runtime_error("Couldn't bind the TCP port");
+        }
+    } else if (!strncmp(address, "unix:", 5)) {
+        if (strlen(address + 5) >= sizeof(un.sun_path)) {
+            throw std::invalid_argument("Unix socket path too long");
+        }
+        un.sun_family = AF_UNIX;
+        strcpy(un.sun_path, address + 5);
+        unlink(un.sun_path);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | flags, 0);
+        if (fd < 0) {
+            throw std::runtime_error("Couldn't create the socket");
+        }
+        if (bind(fd, (struct sockaddr *) &un, sizeof(un))) {
+            throw std::runtime_error("Couldn't bind the Unix socket");
+        }
+    } else {
+        throw std::invalid_argument("Addresses are tcp:PORT or unix:PATH");
+    }
+    if (::listen(fd, SOMAXCONN)) {
+        throw std::runtime_error("Couldn't listen");
+    }
+    return fd;
+}
+
+/*
+SESSIONS
+*/
+void EpollServer::accept(void) {
+    static const char alphanum[] = "0123456789"
+            "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+            "abcdefghijklmnopqrstuvwxyz";
+    session_t *s;
+    char greeting[64];
+    uint32_t i;
+    int fd;
+
+    while ((fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        if (freelist.empty()) {
+            DBG_ERROR(("Too many clients, dropping one.\n"));
+            ::close(fd);
+            continue;
+        }
+        s = freelist.back();
+        freelist.pop_back();
+        s->fd = fd;
+        s->state = SESSION_SIZE;
+        s->linesize = 0;
+        s->codesize = 0;
+        s->received = 0;
+        s->outsize = 0;
+        s->sent = 0;
+        for (i = 0; i < OPCODES_KEYLEN; i++) {
+            s->key[i] = alphanum[rng() % (sizeof(alphanum) - 1)];
+        }
+        s->key[OPCODES_KEYLEN] = 0;
+        watch(s, EPOLLIN, EPOLL_CTL_ADD);
+        snprintf(greeting, sizeof(greeting), "Use this: \"%s\"\n", s->key);
+        send(s, greeting);
+        send(s, "How much data are you sending me?\n");
+    }
+}
+
+// the size line, then the code: whatever comes after it is ignored
+void EpollServer::receive(session_t *s) {
+    uint8_t buf[CODESIZE + SERVER_LINESIZE];
+    uint32_t i, size;
+    ssize_t got;
+    char *end;
+
+    while ((got = recv(s->fd, buf, sizeof(buf), 0)) > 0) {
+        for (i = 0; i < (uint32_t) got && s->state == SESSION_SIZE; i++) {
+            if (buf[i] != '\n') {
+                if (s->linesize == SERVER_LINESIZE - 1) {
+                    send(s, "ERROR! Couldn't read everything!\n");
+                    s->state = SESSION_CLOSING;
+                    break;
+                }
+                s->line[s->linesize++] = buf[i];
+                continue;
+            }
+            s->line[s->linesize] = 0;
+            s->codesize = strtoul(s->line, &end, 10);
+            if (end == s->line || s->codesize > CODESIZE) {
+                send(s, "ERROR! Couldn't read everything!\n");
+                s->state = SESSION_CLOSING;
+                break;
+            }
+            send(s, "Go ahead then!\n");
+            s->state = SESSION_CODE;
+        }
+        if (s->state == SESSION_CODE) {
+            size = (uint32_t) got - i < s->codesize - s->received ? (uint32_t) got - i : s->codesize - s->received;
+            memcpy(s->code + s->received, buf + i, size);
+            s->received += size;
+            if (s->received == s->codesize) {
+                start(s);
+            }
+        }
+        if (s->state != SESSION_SIZE && s->state != SESSION_CODE) {
+            break;
+        }
+    }
+    if (got == 0 && (s->state == SESSION_SIZE || s->state == SESSION_CODE)) {
+        // hung up halfway
+        close(s);
+    } else if (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        close(s);
+    } else if (s->state == SESSION_CLOSING && flush(s)) {
+        close(s);
+    }
+}
+
+/*
+ * Hands the code to the workers. The client is left out of the loop until
+ * its VM stops: even with no events asked for, a hangup would wake it up
+ * over and over.
+ */
+void EpollServer::start(session_t *s) {
+    s->state = SESSION_RUNNING;
+    s->vm = new VM(s->key, s->code, s->codesize);
+    s->vm->addressSpace()->insData((uint8_t *) challenge->data, challenge->datasize);
+    epoll_ctl(epfd, EPOLL_CTL_DEL, s->fd, NULL);
+    scheduler.spawn(s->vm, onExit, s, challenge->budget);
+}
+
+// runs on a worker
+void EpollServer::onExit(VM *vm, uint8_t status, void *arg) {
+    session_t *s = (session_t *) arg;
+    EpollServer *server = s->server;
+    uint64_t one = 1;
+
+    s->status = status;
+    {
+        std::lock_guard<std::mutex> guard(server->lock);
+        server->finished.push_back(s);
+    }
+    if (write(server->wakefd, &one, sizeof(one)) < 0) {
+        DBG_ERROR(("Couldn't wake the event loop up.\n"));
+    }
+}
+
+void EpollServer::reply(session_t *s) {
+    char congrats[SERVER_OUTSIZE];
+
+    s->state = SESSION_CLOSING;
+    watch(s, EPOLLIN, EPOLL_CTL_ADD);
+    if (s->status == STOP_BUDGET) {
+        send(s, "Too slow!\n");
+    } else if (memcmp(s->vm->addressSpace()->getData(), challenge->decrypted, challenge->datasize)) {
+        send(s, "Nope!\n");
+    } else {
+        snprintf(congrats, sizeof(congrats), "Congratulations!\nThe flag is: %s\n", challenge->flag);
+        send(s, congrats);
+    }
+    delete s->vm;
+    s->vm = NULL;
+    if (flush(s)) {
+        close(s);
+    }
+}
+
+// queues str and sends what can be sent right away
+void EpollServer::send(session_t *s, const char *str) {
+    uint32_t size = strlen(str);
+
+    if (s->outsize + size > SERVER_OUTSIZE) {
+        size = SERVER_OUTSIZE - s->outsize;
+    }
+    memcpy(s->out + s->outsize, str, size);
+    s->outsize += size;
+    flush(s);
+}
+
+/*
+ * Returns true once everything queued was sent, or can't be anymore. What's
+ * left waits for EPOLLOUT.
+ */
+bool EpollServer::flush(session_t *s) {
+    ssize_t sent;
+
+    while (s->sent < s->outsize) {
+        sent = ::send(s->fd, s->out + s->sent, s->outsize - s->sent, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // what a running session has left goes with its reply
+                if (s->state != SESSION_RUNNING) {
+                    watch(s, EPOLLIN | EPOLLOUT, EPOLL_CTL_MOD);
+                }
+                return false;
+            }
+            return true;
+        }
+        s->sent += sent;
+    }
+    s->sent = 0;
+    s->outsize = 0;
+    return true;
+}
+
+void EpollServer::watch(session_t *s, uint32_t events, int op) {
+    struct epoll_event ev = {};
+
+    ev.events = events;
+    ev.data.ptr = s;
+    epoll_ctl(epfd, op, s->fd, &ev);
+}
+
+void EpollServer::close(session_t *s) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, s->fd, NULL);
+    ::close(s->fd);
+    s->state = SESSION_FREE;
+    freelist.push_back(s);
+}
+
+/*
+INTERFACE
+*/
+// serves clients until stop()
+void EpollServer::serve(void) {
+    struct epoll_event events[SERVER_EVENTS];
+    std::vector<session_t *> done;
+    session_t *s;
+    uint64_t count;
+    int i, n;
+
+    while (!stopping) {
+        n = epoll_wait(epfd, events, SERVER_EVENTS, -1);
+        if (n < 0 && errno != EINTR) {
+            throw std::runtime_error("epoll_wait failed");
+        }
+        for (i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                accept();
+                continue;
+            }
+            if (events[i].data.ptr == this) {
+                if (read(wakefd, &count, sizeof(count)) < 0) {
+                    DBG_ERROR(("Couldn't read the wakeups.\n"));
+                }
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    done.swap(finished);
+                }
+                for (session_t *f : done) {
+                    reply(f);
+                }
+                done.clear();
+                continue;
+            }
+            s = (session_t *) events[i].data.ptr;
+            if (s->state == SESSION_FREE) {
+                // closed by an earlier event of this batch
+                continue;
+            }
+            if (events[i].events & EPOLLOUT && flush(s)) {
+                if (s->state == SESSION_CLOSING) {
+                    close(s);
+                    continue;
+                }
+                watch(s, EPOLLIN, EPOLL_CTL_MOD);
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                receive(s);
+            }
+        }
+    }
+}
+
+// makes serve() return, from any thread
+void EpollServer::stop(void) {
+    uint64_t one = 1;
+
+    stopping = true;
+    if (write(wakefd, &one, sizeof(one)) < 0) {
+        DBG_ERROR(("Couldn't wake the event loop up.\n"));
+    }
+}
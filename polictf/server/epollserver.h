@@ -0,0 +1,99 @@
+#ifndef EPOLLSERVER_H
+#define EPOLLSERVER_H
+
+#include <stdint.h>
+#include <mutex>
+#include <random>
+#include <vector>
+#include "../../vm/vmscheduler.h"
+
+#define OPCODES_KEYLEN 15
+#define CODESIZE 0x300
+// clients served at once, each with its buffers allocated up front
+#define SERVER_MAX_CLIENTS 1024
+#define SERVER_LINESIZE 16
+#define SERVER_OUTSIZE 256
+#define SERVER_EVENTS 64
+
+// what a client has to decrypt, and what it gets for it
+typedef struct challenge {
+    const uint8_t *data;
+    uint32_t datasize;
+    const uint8_t *decrypted;
+    const char *flag;
+    uint64_t budget;
+} challenge_t;
+
+int listenOn(const char *address, int flags);
+
+/*
+ * The challenge server without xinetd: accepts clients on a TCP port or on
+ * a Unix socket and talks the same protocol to each of them from a single
+ * epoll loop, while their VMs run on a VMScheduler. Clients that would block
+ * the loop just wait for their next event.
+ */
+class EpollServer {
+private:
+    enum states {
+        SESSION_FREE, SESSION_SIZE, SESSION_CODE, SESSION_RUNNING, SESSION_CLOSING
+    };
+
+    typedef struct session {
+        EpollServer *server;
+        int fd;
+        uint8_t state;
+        uint8_t key[OPCODES_KEYLEN + 1];
+        char line[SERVER_LINESIZE];
+        uint32_t linesize;
+        uint8_t code[CODESIZE];
+        uint32_t codesize, received;
+        char out[SERVER_OUTSIZE];
+        uint32_t outsize, sent;
+        VM *vm;
+        uint8_t status;
+    } session_t;
+
+    const challenge_t *challenge;
+    int listener, epfd, wakefd;
+    bool unixsocket;
+    char path[108];
+    std::vector<session_t> sessions;
+    std::vector<session_t *> freelist;
+    // sessions whose VM stopped, filled by the workers
+    std::vector<session_t *> finished;
+    std::mutex lock;
+    std::mt19937 rng;
+    VMScheduler scheduler;
+    std::atomic<bool> stopping;
+
+    void listen(const char *address);
+
+    void accept(void);
+
+    void receive(session_t *s);
+
+    void start(session_t *s);
+
+    void reply(session_t *s);
+
+    void send(session_t *s, const char *str);
+
+    bool flush(session_t *s);
+
+    void watch(session_t *s, uint32_t events, int op);
+
+    void close(session_t *s);
+
+    static void onExit(VM *vm, uint8_t status, void *arg);
+
+public:
+    EpollServer(const char *address, const challenge_t *challenge, uint32_t workers = 0);
+
+    ~EpollServer();
+
+    void serve(void);
+
+    void stop(void);
+};
+
+#endif
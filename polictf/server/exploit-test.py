@@ -1,16 +1,180 @@
-from pwn import *
+"""
+Solves the challenge against a pasticciotto server, once or from many
+clients at a time:
+
+    python3 exploit-test.py                          # the PoliCTF 2017 server
+    python3 exploit-test.py --tcp localhost:31337 --clients 1000 --concurrency 64
+    python3 exploit-test.py --unix /tmp/pasticciotto.sock --clients 1000
+    python3 exploit-test.py --exec ./polictf-server --clients 300  # like xinetd
+
+decrypt.pstc is assembled once: every client only swaps the opcodes for the
+key it gets.
+"""
+import argparse
+import contextlib
+import io
+import os
+import re
+import socket
+import statistics
 import subprocess
+import sys
+import threading
+import time
+from concurrent.futures import ThreadPoolExecutor
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+sys.path.insert(0, os.path.join(HERE, "../../assembler"))
+import assembler  # noqa: E402
+
+key_re = re.compile(b".*\"(.*)\".*")
+
+
+def assemble(asmfile):
+    """
+    The code of asmfile and, for every instruction, its offset and the index
+    of its op.
+    """
+    with open(asmfile) as f:
+        lines = [x.strip() for x in f.readlines()
+                 if x.strip() and not assembler.commentline_re.match(x)]
+    # the assembler talks a lot
+    with contextlib.redirect_stdout(io.StringIO()):
+        vma = assembler.VMAssembler("template", lines)
+        vma.parse()
+    names = [o.name for o in assembler.ops]
+    opcodes = []
+    for f in vma.functions:
+        for idx, ins in enumerate(f.instructions):
+            opcodes.append((f.offset + f.offset_of_instruction(idx), names.index(ins.opcode.name)))
+    return bytes(vma.assembled_code), opcodes
+
+
+def encrypt(template, key):
+    code, opcodes = template
+    values = assembler.shuffled_values(key)
+    out = bytearray(code)
+    for offset, op in opcodes:
+        out[offset] = values[op]
+    return bytes(out)
+
+
+def recv_until(s, marker):
+    data = b""
+    while marker not in data:
+        chunk = s.recv(4096)
+        if not chunk:
+            break
+        data += chunk
+    return data
+
+
+def percentiles(values):
+    values = sorted(values)
+    return (statistics.median(values) * 1e3, values[min(len(values) - 1, int(len(values) * 0.99))] * 1e3,
+            values[-1] * 1e3)
+
+
+def solve(connect, template, verbose=False):
+    """
+    Runs one client, returns how long it took to get the key, how long it
+    took in total (in seconds) and the server's answer.
+    """
+    start = time.perf_counter()
+    s = connect()
+    try:
+        first = recv_until(s, b"sending me?\n")
+        setup = time.perf_counter() - start
+        key = key_re.match(first.split(b"\n")[0]).group(1).decode()
+        if verbose:
+            print("Using key: {}".format(key))
+        code = encrypt(template, key)
+        s.sendall("{}\n".format(len(code)).encode())
+        go = recv_until(s, b"then!\n")
+        if verbose:
+            print(go.decode())
+        s.sendall(code)
+        answer = b""
+        while True:
+            chunk = s.recv(4096)
+            if not chunk:
+                break
+            answer += chunk
+    finally:
+        s.close()
+    return setup, time.perf_counter() - start, answer
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    target = parser.add_mutually_exclusive_group()
+    target.add_argument("--tcp", default="52.15.107.159:31337", help="HOST:PORT of the server")
+    target.add_argument("--unix", help="Unix socket of the server")
+    target.add_argument("--exec", help="server binary to start for every client, the way xinetd does")
+    parser.add_argument("--clients", type=int, default=1, help="clients to run in total")
+    parser.add_argument("--concurrency", type=int, default=1, help="clients connected at once")
+    args = parser.parse_args()
+
+    if args.exec:
+        server = os.path.abspath(args.exec)
+
+        class Exec(socket.socket):
+            """A socket to a fresh server process, reaped on close."""
+
+            def close(self):
+                super().close()
+                self.process.wait()
+
+        def connect():
+            ours, theirs = socket.socketpair()
+            s = Exec(fileno=ours.detach())
+            s.process = subprocess.Popen([server], stdin=theirs, stdout=theirs, cwd=os.path.dirname(server))
+            theirs.close()
+            return s
+    elif args.unix:
+        def connect():
+            s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            s.connect(args.unix)
+            return s
+    else:
+        host, port = args.tcp.rsplit(":", 1)
+
+        def connect():
+            return socket.create_connection((host, int(port)))
+
+    template = assemble(os.path.join(HERE, "../asms/decrypt.pstc"))
+    if args.clients == 1:
+        print(solve(connect, template, verbose=True)[2].decode())
+        return
+
+    failures = []
+    lock = threading.Lock()
+
+    def client(i):
+        try:
+            setup, latency, answer = solve(connect, template)
+        except OSError as e:
+            answer, setup, latency = str(e).encode(), None, None
+        if latency is None or b"flag{" not in answer:
+            with lock:
+                failures.append(answer)
+        return setup, latency
+
+    start = time.perf_counter()
+    with ThreadPoolExecutor(max_workers=args.concurrency) as pool:
+        results = [x for x in pool.map(client, range(args.clients)) if x[1] is not None]
+    elapsed = time.perf_counter() - start
+    print("{} clients, {} at once: {:.2f} s, {:.1f} clients/s".format(
+        args.clients, args.concurrency, elapsed, args.clients / elapsed))
+    if results:
+        # setup: from connecting to having the key
+        print("setup:   median {:.2f} ms, p99 {:.2f} ms, max {:.2f} ms".format(*percentiles(x[0] for x in results)))
+        print("latency: median {:.2f} ms, p99 {:.2f} ms, max {:.2f} ms".format(*percentiles(x[1] for x in results)))
+    print("{} failed".format(len(failures)))
+    if failures:
+        print("first failure: {!r}".format(failures[0][:200]))
+        sys.exit(1)
+
 
-key_re = re.compile(".*\"(.*)\".*")
-r = remote("52.15.107.159", 31337)
-
-first = r.recv()
-key = key_re.match(first).group(1)
-print("Using key: {}".format(key))
-subprocess.check_call(["python3", "../../assembler/assembler.py", "{}".format(key), "../asms/decrypt.pstc", "./out.pasticciotto"])
-with open("./out.pasticciotto") as f:
-    data = f.read()
-r.send("{}\n".format(len(data)))
-print(r.recv())
-r.send("{}\n".format(data))
-print(r.recv(100000))
+if __name__ == "__main__":
+    main()
@@ -1,11 +1,24 @@
 #include "../../vm/debug.h"
 #include "../../vm/vm.h"
+#include "epollserver.h"
 #include <fstream>
+#include <random>
+#include <string>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
 #include <unistd.h>
+#include <stdexcept>
 
-#define OPCODES_KEYLEN 15
-#define CODESIZE 0x300
-#define FLAG_LEN 30
+// children of the zygote waiting for a client
+#define PREFORK_CHILDREN 16
+// seconds a child waits on a silent client before giving up on it
+#define PREFORK_TIMEOUT 10
+// decrypt.pstc takes ~71K instructions, a client spinning forever gets cut off
+#define MAX_INSTRUCTIONS 10000000
 
 unsigned char EN_DATASECTION[] = {
         0x8c, 0xea, 0xbe, 0xaa, 0xed, 0xa0, 0xd0, 0x6b, 0x99, 0x1c, 0x52, 0x25,
@@ -18,31 +31,70 @@ unsigned char EN_DATASECTION[] = {
 unsigned int DATASECTIONLEN = 72;
 
 void gen_random(uint8_t *s, const int len) {
-    srand(time(NULL));
+    // not srand(time(NULL)): connections within the same second got the same key
+    std::mt19937 rng(std::random_device{}());
     static const char alphanum[] = "0123456789"
             "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
             "abcdefghijklmnopqrstuvwxyz";
     for (int i = 0; i < len; ++i) {
-        s[i] = alphanum[rand() % (sizeof(alphanum) - 1)];
+        s[i] = alphanum[rng() % (sizeof(alphanum) - 1)];
     }
 
     s[len] = 0;
 }
 
-int main(int argc, char *argv[]) {
-    uint8_t *opcodes_key = new uint8_t[OPCODES_KEYLEN],
-            *decdatasec = new uint8_t[DATASECTIONLEN],
-            *flag = new uint8_t[FLAG_LEN];
+// what the clients have to decrypt the data section to, and what they get for it
+bool loadResources(std::string &decdatasec, std::string &flag) {
+    std::ifstream datafile("../res/decrypteddatasection.txt"), flagfile("../res/flag.txt");
+
+    if (!(datafile >> decdatasec) || decdatasec.size() < DATASECTIONLEN) {
+        printf("Couldn't open decrypteddatasection.txt!\n");
+        fflush(stdout);
+        return false;
+    }
+    if (!(flagfile >> flag)) {
+        printf("Couldn't open flag.txt!\n");
+        fflush(stdout);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Standalone mode: loads the resources once and serves every client from an
+ * EpollServer.
+ */
+int serve(const char *address, uint32_t workers) {
+    std::string decdatasec, flag;
+    challenge_t challenge;
+
+    if (!loadResources(decdatasec, flag)) {
+        return 1;
+    }
+    challenge.data = EN_DATASECTION;
+    challenge.datasize = DATASECTIONLEN;
+    challenge.decrypted = (const uint8_t *) decdatasec.data();
+    challenge.flag = flag.c_str();
+    challenge.budget = MAX_INSTRUCTIONS;
+    EpollServer server(address, &challenge, workers);
+    server.serve();
+    return 0;
+}
+
+// one client on stdin / stdout, for a vm holding the key and the data section already
+int session(VM *vm, uint8_t *opcodes_key, const std::string &decdatasec, const std::string &flag) {
     uint8_t *clientcode;
     uint8_t i;
     uint32_t clientcodesize, bytesread;
-    FILE *datap, *flagp;
 
-    gen_random(opcodes_key, OPCODES_KEYLEN);
     printf("Use this: \"%s\"\n", opcodes_key);
     printf("How much data are you sending me?\n");
     fflush(stdout);
-    scanf("%d", &clientcodesize);
+    if (scanf("%u", &clientcodesize) != 1) {
+        printf("ERROR! Couldn't read the size!\n");
+        fflush(stdout);
+        return 1;
+    }
     printf("Go ahead then!\n");
     fflush(stdout);
     clientcode = new uint8_t[clientcodesize];
@@ -50,39 +102,119 @@ int main(int argc, char *argv[]) {
     if (bytesread != clientcodesize) {
         printf("ERROR! Couldn't read everything!\n");
         fflush(stdout);
-        exit(1);
+        return 1;
     }
-    VM vm(opcodes_key, clientcode, clientcodesize);
-    vm.addressSpace()->insData(EN_DATASECTION, DATASECTIONLEN);
-    vm.run();
-
-    datap = fopen("../res/decrypteddatasection.txt", "r");
-    if (datap == NULL) {
-        printf("Couldn't open decrypteddatasection.txt!\n");
+    vm->addressSpace()->insCode(clientcode, clientcodesize);
+    delete[] clientcode;
+    if (vm->run(MAX_INSTRUCTIONS) == STOP_BUDGET) {
+        printf("Too slow!\n");
         fflush(stdout);
-        exit(1);
+        return 1;
     }
-    fscanf(datap, "%s", decdatasec);
-    fclose(datap);
 
     for (i = 0; i < DATASECTIONLEN; i++) {
         DBG_INFO(("Checking data[%d]..\n", i));
-        if (vm.addressSpace()->getData()[i] != decdatasec[i]) {
+        if (vm->addressSpace()->getData()[i] != (uint8_t) decdatasec[i]) {
             printf("Nope!\n");
             fflush(stdout);
-            exit(1);
+            return 1;
         }
     }
+    printf("Congratulations!\nThe flag is: %s\n", flag.c_str());
+    fflush(stdout);
+    return 0;
+}
 
-    flagp = fopen("../res/flag.txt", "r");
-    if (flagp == NULL) {
-        printf("Couldn't open flag.txt!\n");
-        fflush(stdout);
-        exit(1);
+// only there to interrupt the zygote's read(), so that it reaps the children
+void childExited(int) {
+}
+
+/*
+ * Zygote mode: loads the resources once, then keeps children ready to
+ * accept a client each, with their key scheduled and their data section
+ * inserted. A child tells the zygote through a pipe as soon as it has
+ * accepted a client, so that another one is forked right away, then serves
+ * its client like xinetd would and exits. Clients that stay silent for
+ * PREFORK_TIMEOUT seconds are dropped.
+ */
+int prefork(const char *address, uint32_t children) {
+    std::string decdatasec, flag;
+    uint8_t opcodes_key[OPCODES_KEYLEN + 1];
+    uint32_t ready = 0;
+    int listener, client, taken[2];
+    struct timeval timeout = {PREFORK_TIMEOUT, 0};
+    struct sigaction exited;
+    pid_t pid;
+    char token = 0;
+
+    if (!loadResources(decdatasec, flag)) {
+        return 1;
+    }
+    listener = listenOn(address, 0);
+    if (pipe(taken) < 0) {
+        throw std::runtime_error("Couldn't create the pipe");
     }
-    fscanf(flagp, "%s", flag);
-    fclose(flagp);
-    printf("Congratulations!\nThe flag is: %s\n", flag);
+    signal(SIGPIPE, SIG_IGN);
+    memset(&exited, 0, sizeof(exited));
+    exited.sa_handler = childExited;
+    sigaction(SIGCHLD, &exited, NULL);
     fflush(stdout);
-    return 0;
-}
\ No newline at end of file
+    while (true) {
+        for (; ready < children; ready++) {
+            pid = fork();
+            if (pid < 0) {
+                throw std::runtime_error("Couldn't fork");
+            }
+            if (pid) {
+                continue;
+            }
+            close(taken[0]);
+            // every child picks its own key, before its client shows up
+            gen_random(opcodes_key, OPCODES_KEYLEN);
+            VM vm(opcodes_key);
+            vm.addressSpace()->insData(EN_DATASECTION, DATASECTIONLEN);
+            while ((client = accept(listener, NULL, NULL)) < 0 && errno == EINTR);
+            // taken or broken, either way the zygote needs another child
+            if (write(taken[1], &token, 1) != 1) {
+                DBG_ERROR(("Couldn't tell the zygote.\n"));
+            }
+            close(taken[1]);
+            if (client < 0) {
+                _exit(1);
+            }
+            close(listener);
+            setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            dup2(client, 0);
+            dup2(client, 1);
+            close(client);
+            exit(session(&vm, opcodes_key, decdatasec, flag));
+        }
+        // a child took a client, or the ones done with theirs are reaped
+        if (read(taken[0], &token, 1) == 1) {
+            ready--;
+        } else if (errno != EINTR) {
+            throw std::runtime_error("Couldn't read from the pipe");
+        }
+        while (waitpid(-1, NULL, WNOHANG) > 0);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    uint8_t opcodes_key[OPCODES_KEYLEN + 1];
+    std::string decdatasec, flag;
+
+    // --listen / --prefork tcp:PORT | unix:PATH [--workers N], xinetd otherwise
+    if (argc > 2 && !strcmp(argv[1], "--listen")) {
+        return serve(argv[2], argc > 4 && !strcmp(argv[3], "--workers") ? strtoul(argv[4], NULL, 0) : 0);
+    }
+    if (argc > 2 && !strcmp(argv[1], "--prefork")) {
+        return prefork(argv[2], argc > 4 && !strcmp(argv[3], "--workers") ? strtoul(argv[4], NULL, 0) : PREFORK_CHILDREN);
+    }
+    gen_random(opcodes_key, OPCODES_KEYLEN);
+    VM vm(opcodes_key);
+    vm.addressSpace()->insData(EN_DATASECTION, DATASECTIONLEN);
+    if (!loadResources(decdatasec, flag)) {
+        return 1;
+    }
+    return session(&vm, opcodes_key, decdatasec, flag);
+}
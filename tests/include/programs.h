@@ -0,0 +1,223 @@
+#ifndef PROGRAMS_H
+#define PROGRAMS_H
+
+#include <stdint.h>
+#include <string.h>
+#include "../../vm/instruction.h"
+#include "../../vm/staticvm.h"
+
+/*
+ * The programs in polictf/asms, assembled with TEA_KEY:
+ * $ python3 assembler/assembler.py 'HaveFun!PoliCTF2017!' <program> <out>
+ */
+#define POLICTF_KEY "HaveFun!PoliCTF2017!"
+static uint8_t TEA_KEY[] = POLICTF_KEY;
+// the same key for StaticVM, which takes it as a template argument
+static constexpr uint8_t STATIC_KEY[] = POLICTF_KEY;
+
+static uint8_t TEA_ENCRYPT[] = {
+        0xc3, 0x48, 0x00, 0xde, 0xad, 0x48, 0x01, 0xb0, 0x0b, 0xd4, 0x00, 0x00,
+        0x00, 0xd4, 0x02, 0x00, 0x01, 0x48, 0x00, 0xb0, 0x0b, 0x48, 0x01, 0xfa,
+        0xce, 0xd4, 0x04, 0x00, 0x00, 0xd4, 0x06, 0x00, 0x01, 0x48, 0x00, 0x00,
+        0x00, 0xd8, 0xd6, 0x00, 0xcb, 0x20, 0x48, 0x04, 0x00, 0x00, 0xde, 0x04,
+        0x48, 0x00, 0x00, 0x00, 0x48, 0x01, 0x02, 0x00, 0x39, 0x04, 0x39, 0x14,
+        0xd8, 0x5b, 0x00, 0x5c, 0x04, 0x05, 0x04, 0x04, 0x00, 0xd7, 0x42, 0x93,
+        0x2e, 0x00, 0x22, 0x00, 0x00, 0x00, 0x22, 0x01, 0x02, 0x00, 0x22, 0x02,
+        0x04, 0x00, 0x22, 0x03, 0x06, 0x00, 0x5d, 0xde, 0x01, 0xde, 0x02, 0xde,
+        0x03, 0x12, 0x20, 0x12, 0x31, 0x48, 0x04, 0x00, 0x00, 0x48, 0x05, 0x00,
+        0x00, 0xde, 0x04, 0x05, 0x05, 0x6f, 0x62, 0xde, 0x05, 0xcb, 0x43, 0x20,
+        0x04, 0x04, 0x00, 0x05, 0x04, 0x65, 0x70, 0xcb, 0x53, 0x5c, 0x07, 0xde,
+        0x07, 0xb1, 0x45, 0xde, 0x04, 0xcb, 0x43, 0x36, 0x04, 0x05, 0x00, 0x05,
+        0x04, 0x65, 0x70, 0x5c, 0x05, 0xb1, 0x45, 0x39, 0x24, 0xcb, 0x42, 0x20,
+        0x04, 0x04, 0x00, 0x05, 0x04, 0x75, 0x72, 0xcb, 0x52, 0x5c, 0x07, 0xde,
+        0x07, 0xb1, 0x45, 0xde, 0x04, 0xcb, 0x42, 0x36, 0x04, 0x05, 0x00, 0x05,
+        0x04, 0x73, 0x6e, 0x5c, 0x05, 0xb1, 0x45, 0x39, 0x34, 0x5c, 0x05, 0x5c,
+        0x04, 0x05, 0x04, 0x01, 0x00, 0xf4, 0x04, 0x7f, 0x93, 0x6d, 0x00, 0x4e,
+        0x02, 0x4e, 0x13, 0x5c, 0x03, 0x5c, 0x02, 0x5c, 0x01, 0xbb, 0xde, 0x01,
+        0xde, 0x02, 0xde, 0x03, 0xcb, 0x60, 0x48, 0x05, 0x00, 0x00, 0x12, 0x46,
+        0xf4, 0x04, 0x00, 0x38, 0xfc, 0x00, 0x48, 0x06, 0x00, 0x00, 0x05, 0x05,
+        0x01, 0x00, 0x39, 0x65, 0x12, 0x46, 0xf4, 0x04, 0x00, 0xae, 0xea, 0x00,
+        0xcb, 0x05, 0x5c, 0x03, 0x5c, 0x02, 0x5c, 0x01, 0xbb};
+static uint32_t TEA_ENCRYPT_LEN = 261;
+
+static uint8_t TEA_DECRYPT[] = {
+        0x48, 0x00, 0x00, 0x00, 0xd8, 0x95, 0x00, 0xcb, 0x20, 0x48, 0x04, 0x00,
+        0x00, 0xde, 0x04, 0x48, 0x00, 0x00, 0x00, 0x48, 0x01, 0x02, 0x00, 0x39,
+        0x04, 0x39, 0x14, 0xd8, 0x2a, 0x00, 0x5c, 0x04, 0x05, 0x04, 0x04, 0x00,
+        0xd7, 0x42, 0x93, 0x0d, 0x00, 0x5d, 0xde, 0x01, 0xde, 0x02, 0xde, 0x03,
+        0x12, 0x20, 0x12, 0x31, 0x48, 0x04, 0x00, 0x00, 0x48, 0x05, 0x00, 0x00,
+        0xde, 0x04, 0xcb, 0x42, 0x20, 0x04, 0x04, 0x00, 0x05, 0x04, 0x75, 0x72,
+        0xcb, 0x52, 0xb1, 0x45, 0xde, 0x04, 0xcb, 0x42, 0x36, 0x04, 0x05, 0x00,
+        0x05, 0x04, 0x73, 0x6e, 0x5c, 0x05, 0xb1, 0x45, 0x57, 0x34, 0xcb, 0x43,
+        0x20, 0x04, 0x04, 0x00, 0x05, 0x04, 0x65, 0x70, 0xcb, 0x53, 0xb1, 0x45,
+        0xde, 0x04, 0xcb, 0x43, 0x36, 0x04, 0x05, 0x00, 0x05, 0x04, 0x65, 0x70,
+        0x5c, 0x05, 0xb1, 0x45, 0x57, 0x24, 0x5c, 0x04, 0x05, 0x04, 0x01, 0x00,
+        0xf4, 0x04, 0x7f, 0x93, 0x3c, 0x00, 0x4e, 0x02, 0x4e, 0x13, 0x5c, 0x03,
+        0x5c, 0x02, 0x5c, 0x01, 0xbb, 0xde, 0x01, 0xde, 0x02, 0xde, 0x03, 0xcb,
+        0x60, 0x48, 0x05, 0x00, 0x00, 0x12, 0x46, 0xf4, 0x04, 0x00, 0x38, 0xbb,
+        0x00, 0x48, 0x06, 0x00, 0x00, 0x05, 0x05, 0x01, 0x00, 0x39, 0x65, 0x12,
+        0x46, 0xf4, 0x04, 0x00, 0xae, 0xa9, 0x00, 0xcb, 0x05, 0x5c, 0x03, 0x5c,
+        0x02, 0x5c, 0x01, 0xbb};
+static uint32_t TEA_DECRYPT_LEN = 196;
+
+/*
+ * The encrypted data section pasticciotto_server feeds to the client's code.
+ */
+static uint8_t TEA_DATA[] = {
+        0x8c, 0xea, 0xbe, 0xaa, 0xed, 0xa0, 0xd0, 0x6b, 0x99, 0x1c, 0x52, 0x25,
+        0xb9, 0xe6, 0xd8, 0xff, 0xf9, 0xe9, 0x92, 0x7a, 0x1c, 0xc5, 0xc4, 0x7e,
+        0x2a, 0xec, 0x67, 0x32, 0x86, 0xca, 0xff, 0xf8, 0x3c, 0x1c, 0x77, 0x42,
+        0xe3, 0x20, 0x29, 0x4b, 0x34, 0x67, 0x4b, 0xc9, 0x9f, 0xa9, 0xf9, 0x0c,
+        0x0f, 0x9b, 0x8a, 0x5b, 0x72, 0x64, 0xe5, 0xd8, 0x5c, 0x52, 0x58, 0x46,
+        0xef, 0x36, 0x76, 0x87, 0xec, 0x1e, 0xfb, 0x5d, 0x42, 0x8e, 0xb7, 0x47};
+static uint32_t TEA_DATA_LEN = 72;
+static const char TEA_PLAINTEXT[] = "TheDataSectionHasBeenEncrypted...WhoAreYouGonnaCall...TheRuNasOfCourse..";
+
+/*
+ * Same shuffle as VM::encryptOpcodes and VMAssembler.encrypt_ops: returns
+ * the byte the given INSTR_ENUM value is assembled to.
+ */
+static inline uint8_t encryptOpcode(const uint8_t *key, uint8_t instr) {
+    uint8_t arr[256], tmp;
+    uint32_t i, j, keysize;
+    keysize = strlen((const char *) key);
+
+    for (i = 0; i < 256; i++) {
+        arr[i] = i;
+    }
+    j = 0;
+    for (i = 0; i < 256; i++) {
+        j = (j + arr[i] + key[i % keysize]) % 256;
+        tmp = arr[i];
+        arr[i] = arr[j];
+        arr[j] = tmp;
+    }
+    return arr[instr];
+}
+
+static inline uint32_t lcg(uint32_t *state) {
+    *state = *state * 1103515245 + 12345;
+    return *state >> 8;
+}
+
+static inline uint8_t randomReg(uint32_t *state) {
+    // mostly general purpose registers, sometimes IP / RP / SP
+    if (lcg(state) % 20 == 0) {
+        return lcg(state) % NUM_REGS;
+    }
+    return lcg(state) % (S3 + 1);
+}
+
+/*
+ * Fills code with random, well formed instructions ending with SHIT and
+ * returns the program length. Jumps and calls only go forward to an
+ * instruction boundary, so every program terminates; RETN and the register
+ * jumps are never emitted for the same reason.
+ */
+static inline uint32_t randomProgram(const uint8_t *key, uint8_t *code, uint32_t size, uint32_t seed) {
+    static const uint8_t ops[] = {
+            MOVI, MOVR, LODI, LODR, STRI, STRR, ADDI, ADDR, SUBI, SUBR, ANDB,
+            ANDW, ANDR, YORB, YORW, YORR, XORB, XORW, XORR, NOTR, MULI, MULR,
+            DIVI, DIVR, SHLI, SHLR, SHRI, SHRR, PUSH, POOP, CMPB, CMPW, CMPR,
+            JMPI, JPAI, JPBI, JPEI, JPNI, CALL, NOPE, GRMN};
+    static const uint8_t sizes[] = {
+            MOVI_SIZE, MOVR_SIZE, LODI_SIZE, LODR_SIZE, STRI_SIZE, STRR_SIZE,
+            ADDI_SIZE, ADDR_SIZE, SUBI_SIZE, SUBR_SIZE, ANDB_SIZE, ANDW_SIZE,
+            ANDR_SIZE, YORB_SIZE, YORW_SIZE, YORR_SIZE, XORB_SIZE, XORW_SIZE,
+            XORR_SIZE, NOTR_SIZE, MULI_SIZE, MULR_SIZE, DIVI_SIZE, DIVR_SIZE,
+            SHLI_SIZE, SHLR_SIZE, SHRI_SIZE, SHRR_SIZE, PUSH_SIZE, POOP_SIZE,
+            CMPB_SIZE, CMPW_SIZE, CMPR_SIZE, JMPI_SIZE, JPAI_SIZE, JPBI_SIZE,
+            JPEI_SIZE, JPNI_SIZE, CALL_SIZE, NOPE_SIZE, GRMN_SIZE};
+    uint32_t state = seed, len = 0, n = 0, i, k;
+    uint16_t imm;
+    uint8_t op;
+    uint32_t offsets[0x400 + 1];
+    uint8_t kinds[0x400];
+
+    // laying out the instructions first to know every jump target
+    while (n < sizeof(kinds) && len + IMM2REG + SINGLE < size) {
+        k = lcg(&state) % sizeof(ops);
+        if (ops[k] == POOP || ops[k] == DIVR || ops[k] == LODR || ops[k] == STRR) {
+            // these usually stop the program: make them rarer
+            k = lcg(&state) % sizeof(ops);
+        }
+        offsets[n] = len;
+        kinds[n++] = k;
+        len += sizes[k];
+    }
+    offsets[n] = len;
+    for (i = 0; i < n; i++) {
+        op = ops[kinds[i]];
+        code[offsets[i]] = encryptOpcode(key, op);
+        imm = lcg(&state);
+        if (op == LODI || lcg(&state) % 2) {
+            // keep a good part of the immediates inside the default data section
+            imm %= DEFAULT_DATASIZE + 4;
+        }
+        if (op == STRI && lcg(&state) % 8) {
+            // STRI checks its address with isRegValid
+            imm %= S3 + 1;
+        }
+        switch (op) {
+            case JMPI:
+            case JPAI:
+            case JPBI:
+            case JPEI:
+            case JPNI:
+            case CALL:
+                imm = offsets[i + 1 + lcg(&state) % (n - i)];
+                memcpy(&code[offsets[i] + 1], &imm, sizeof(imm));
+                break;
+            case STRI:
+                memcpy(&code[offsets[i] + 1], &imm, sizeof(imm));
+                code[offsets[i] + 3] = randomReg(&state);
+                break;
+            case NOTR:
+            case PUSH:
+            case POOP:
+                code[offsets[i] + 1] = randomReg(&state);
+                break;
+            default:
+                if (sizes[kinds[i]] == REG2REG) {
+                    code[offsets[i] + 1] = randomReg(&state) << 4 | randomReg(&state);
+                } else if (sizes[kinds[i]] == BYT2REG) {
+                    code[offsets[i] + 1] = randomReg(&state);
+                    code[offsets[i] + 2] = imm;
+                } else if (sizes[kinds[i]] == IMM2REG) {
+                    code[offsets[i] + 1] = randomReg(&state);
+                    memcpy(&code[offsets[i] + 2], &imm, sizeof(imm));
+                }
+                break;
+        }
+    }
+    code[len++] = encryptOpcode(key, SHIT);
+    return len;
+}
+
+/*
+ * Calls fn(vm, engine, run) with a VM for code on every engine compiled in
+ * from first on, then with a StaticVM<STATIC_KEY> and engine NUM_ENGINES,
+ * if its default data section holds ds bytes. fn sets the VM up and runs it
+ * with run(), which goes through StaticVM::run() for the static one.
+ */
+template<typename F>
+void forEachEngine(uint8_t *code, uint32_t codesize, F fn, uint8_t first = ENGINE_LOOP,
+                   uint16_t ds = DEFAULT_DATASIZE) {
+    uint8_t engine;
+
+    for (engine = first; engine < NUM_ENGINES; engine++) {
+        if (!VM::hasEngine(engine)) {
+            continue;
+        }
+        VM vm(TEA_KEY, code, codesize, DEFAULT_STACKSIZE, DEFAULT_CODESIZE, ds);
+        vm.setEngine(engine);
+        fn(&vm, engine, [&vm](void) { return vm.run(); });
+    }
+    if (ds > DEFAULT_DATASIZE) {
+        return;
+    }
+    StaticVM<STATIC_KEY> fixed(code, codesize);
+    fn(&fixed, NUM_ENGINES, [&fixed](void) { return fixed.run(); });
+}
+
+#endif
@@ -1,5 +1,15 @@
 #include "../include/catch.hpp"
-#include "../../vm/vm.h"
+#include "../../vm/staticvm.h"
+#include "../include/programs.h"
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <cstddef>
+#include <cstdlib>
 #include <cstring>
 
 
@@ -77,3 +87,651 @@ TEST_CASE("VM initialization", "[VM]") {
 
 }
 
+TEST_CASE("Running the TEA programs", "[VM]") {
+    VM vm(TEA_KEY, TEA_ENCRYPT, TEA_ENCRYPT_LEN);
+
+    vm.run();
+// The last instructions load the encrypted blocks into R0 -> R3
+    REQUIRE(vm.reg(R0) == 0xac04);
+    REQUIRE(vm.reg(R1) == 0xeab3);
+    REQUIRE(vm.reg(R2) == 0x793b);
+    REQUIRE(vm.reg(R3) == 0x3856);
+    REQUIRE(vm.executed() == 13972);
+
+// Decrypting the server's data section gives back the plaintext
+    VM vm_dec(TEA_KEY, TEA_DECRYPT, TEA_DECRYPT_LEN);
+    vm_dec.addressSpace()->insData(TEA_DATA, TEA_DATA_LEN);
+    vm_dec.run();
+    REQUIRE(memcmp(vm_dec.addressSpace()->getData(), TEA_PLAINTEXT, TEA_DATA_LEN) == 0);
+
+// The same, out of a caller supplied arena
+    uint8_t *arena = (uint8_t *) aligned_alloc(
+            SEGMENT_ALIGN, VMAddrSpace::arenaSize(DEFAULT_STACKSIZE, DEFAULT_CODESIZE, DEFAULT_DATASIZE));
+    {
+        VM vm_arena(TEA_KEY, TEA_DECRYPT, TEA_DECRYPT_LEN, arena);
+        vm_arena.addressSpace()->insData(TEA_DATA, TEA_DATA_LEN);
+        vm_arena.run();
+        REQUIRE(vm_arena.addressSpace()->getCode() == arena);
+        REQUIRE(memcmp(vm_arena.addressSpace()->getData(), TEA_PLAINTEXT, TEA_DATA_LEN) == 0);
+    }
+    free(arena);
+}
+
+TEST_CASE("Unassigned opcodes stop the VM", "[VM]") {
+    uint8_t nope = encryptOpcode(TEA_KEY, NOPE), shit = encryptOpcode(TEA_KEY, SHIT);
+    uint8_t wat;
+    uint32_t i;
+
+    for (wat = 0; ; wat++) {
+        for (i = 0; i < NUM_OPS; i++) {
+            if (encryptOpcode(TEA_KEY, i) == wat) {
+                break;
+            }
+        }
+        if (i == NUM_OPS) {
+            break;
+        }
+    }
+    uint8_t code[] = {nope, nope, wat, nope, shit};
+    VM vm(TEA_KEY, code, sizeof(code));
+
+    vm.run();
+    REQUIRE(vm.reg(IP) == 2);
+    REQUIRE(vm.executed() == 3);
+}
+
+void requireSameState(VM &a, VM &b) {
+    uint32_t i;
+
+    for (i = 0; i < NUM_REGS; i++) {
+        REQUIRE(a.reg(i) == b.reg(i));
+    }
+    REQUIRE(a.getFlags().ZF == b.getFlags().ZF);
+    REQUIRE(a.getFlags().CF == b.getFlags().CF);
+    REQUIRE(a.executed() == b.executed());
+    REQUIRE(memcmp(a.addressSpace()->getData(), b.addressSpace()->getData(), a.addressSpace()->getDatasize()) == 0);
+    REQUIRE(memcmp(a.addressSpace()->getStack(), b.addressSpace()->getStack(),
+                   a.addressSpace()->getStacksize()) == 0);
+}
+
+TEST_CASE("Engines agree with the loop engine", "[VM]") {
+    uint8_t code[DEFAULT_CODESIZE];
+    uint32_t seed, len, engine;
+
+    for (engine = ENGINE_LOOP + 1; engine < NUM_ENGINES; engine++) {
+        if (!VM::hasEngine(engine)) {
+            continue;
+        }
+        VM enc_ref(TEA_KEY, TEA_ENCRYPT, TEA_ENCRYPT_LEN), enc(TEA_KEY, TEA_ENCRYPT, TEA_ENCRYPT_LEN);
+        enc_ref.setEngine(ENGINE_LOOP);
+        enc.setEngine(engine);
+        enc_ref.run();
+        enc.run();
+        requireSameState(enc_ref, enc);
+
+        VM dec_ref(TEA_KEY, TEA_DECRYPT, TEA_DECRYPT_LEN), dec(TEA_KEY, TEA_DECRYPT, TEA_DECRYPT_LEN);
+        dec_ref.addressSpace()->insData(TEA_DATA, TEA_DATA_LEN);
+        dec.addressSpace()->insData(TEA_DATA, TEA_DATA_LEN);
+        dec_ref.setEngine(ENGINE_LOOP);
+        dec.setEngine(engine);
+        dec_ref.run();
+        dec.run();
+        requireSameState(dec_ref, dec);
+
+        for (seed = 0; seed < 2000; seed++) {
+            memset(code, 0, sizeof(code));
+            len = randomProgram(TEA_KEY, code, sizeof(code), seed);
+            VM ref(TEA_KEY, code, len), vm(TEA_KEY, code, len);
+            ref.setEngine(ENGINE_LOOP);
+            vm.setEngine(engine);
+            ref.run();
+            vm.run();
+            requireSameState(ref, vm);
+        }
+    }
+}
+
+TEST_CASE("Engines agree on loops, calls and failing instructions", "[VM]") {
+#define OP(_op_) encryptOpcode(TEA_KEY, _op_)
+    // backward loop ending with a stack overflow
+    uint8_t pushes[] = {OP(MOVI), R0, 0x00, 0x00, OP(ADDI), R0, 0x01, 0x00, OP(PUSH), R0,
+                        OP(CMPW), R0, 0xc8, 0x00, OP(JPNI), 0x04, 0x00, OP(SHIT)};
+    // CALL / RETN
+    uint8_t calls[] = {OP(MOVI), R1, 0x05, 0x00, OP(CALL), 0x0c, 0x00, OP(SUBI), R1, 0x01, 0x00, OP(SHIT),
+                       OP(ADDI), R1, 0x10, 0x00, OP(RETN)};
+    // DIVI is interpreted in between compiled instructions
+    uint8_t divs[] = {OP(MOVI), R0, 0xe8, 0x03, OP(DIVI), R0, 0x03, 0x00, OP(CMPW), R0, 0x00, 0x00,
+                      OP(JPNI), 0x04, 0x00, OP(POOP), R1, OP(SHIT)};
+#undef OP
+    uint8_t *programs[] = {pushes, calls, divs};
+    uint32_t sizes[] = {sizeof(pushes), sizeof(calls), sizeof(divs)};
+    uint32_t i, engine;
+
+    for (engine = ENGINE_LOOP + 1; engine < NUM_ENGINES; engine++) {
+        if (!VM::hasEngine(engine)) {
+            continue;
+        }
+        for (i = 0; i < sizeof(programs) / sizeof(*programs); i++) {
+            VM ref(TEA_KEY, programs[i], sizes[i]), vm(TEA_KEY, programs[i], sizes[i]);
+            ref.setEngine(ENGINE_LOOP);
+            vm.setEngine(engine);
+            ref.run();
+            vm.run();
+            requireSameState(ref, vm);
+        }
+    }
+}
+
+TEST_CASE("The JIT falls back where memory can't be made executable", "[VM]") {
+    // what SELinux execmem and PaX do: mprotect() asking for PROT_EXEC fails
+    struct sock_filter filter[] = {
+            BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr)),
+            BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, __NR_mprotect, 0, 3),
+            BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, args[2])),
+            BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, PROT_EXEC, 0, 1),
+            BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ERRNO | EPERM),
+            BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+    };
+    struct sock_fprog program = {sizeof(filter) / sizeof(filter[0]), filter};
+    int status;
+    pid_t pid;
+
+    if (!VM::hasEngine(ENGINE_JIT)) {
+        return;
+    }
+    // the filter can't be taken off, it goes on a child
+    pid = fork();
+    REQUIRE(pid >= 0);
+    if (!pid) {
+        if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) || prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &program)) {
+            _exit(2);
+        }
+        VM vm(TEA_KEY, TEA_ENCRYPT, TEA_ENCRYPT_LEN);
+        vm.setEngine(ENGINE_JIT);
+        _exit(vm.run() == STOP_HALTED && vm.reg(R0) == 0xac04 && vm.executed() == 13972 ? 0 : 1);
+    }
+    REQUIRE(waitpid(pid, &status, 0) == pid);
+    REQUIRE(WIFEXITED(status));
+    REQUIRE(WEXITSTATUS(status) == 0);
+}
+
+TEST_CASE("Superinstructions match the loop engine", "[VM]") {
+#define OP(_op_) encryptOpcode(TEA_KEY, _op_)
+    // CMPB + JPNI loop, then a PUSH chain overflowing the stack halfway
+    uint8_t pushes[] = {OP(ADDI), R0, 0x01, 0x00, OP(PUSH), R0, OP(PUSH), R1, OP(PUSH), R2, OP(CMPB), R0, 0x2b,
+                        OP(JPNI), 0x00, 0x00, OP(SHIT)};
+    // POOP chains, the second one underflowing the stack halfway
+    uint8_t poops[] = {OP(PUSH), R0, OP(PUSH), R1, OP(PUSH), R2, OP(POOP), R0, OP(POOP), R1, OP(NOPE),
+                       OP(POOP), R2, OP(POOP), R3, OP(SHIT)};
+    // MOVI + ADDR + LODR, then ADDR + LODR walking out of the data segment
+    uint8_t loads[] = {OP(MOVI), S2, 0x00, 0x00, OP(ADDR), 0x65, OP(LODR), 0x46, OP(ADDI), S1, 0x01, 0x00,
+                       OP(ADDR), 0x65, OP(LODR), 0x46, OP(CMPR), 0x46, OP(JPBI), 0x08, 0x00, OP(SHIT)};
+#undef OP
+    uint8_t *programs[] = {pushes, poops, loads};
+    uint32_t sizes[] = {sizeof(pushes), sizeof(poops), sizeof(loads)};
+    uint8_t fusions[][NUM_FUSIONS] = {
+            {1, 0, 0, 1, 0},
+            {0, 0, 0, 1, 1},
+            {1, 1, 1, 0, 0}
+    };
+    uint32_t i, j;
+
+    // stats and trace builds see every instruction on its own
+    if (!VM::hasEngine(ENGINE_DECODED) || VM::hasStats() || VM::hasTrace()) {
+        return;
+    }
+    for (i = 0; i < sizeof(programs) / sizeof(*programs); i++) {
+        VM ref(TEA_KEY, programs[i], sizes[i]), vm(TEA_KEY, programs[i], sizes[i]);
+        ref.setEngine(ENGINE_LOOP);
+        vm.setEngine(ENGINE_DECODED);
+        ref.run();
+        vm.run();
+        requireSameState(ref, vm);
+        REQUIRE(vm.dispatched() < vm.executed());
+        for (j = 0; j < NUM_FUSIONS; j++) {
+            REQUIRE((vm.fired(j) > 0) == fusions[i][j]);
+        }
+    }
+}
+
+TEST_CASE("insCode invalidates the decoded instructions", "[VM]") {
+    uint8_t movi = encryptOpcode(TEA_KEY, MOVI), nope = encryptOpcode(TEA_KEY, NOPE);
+    uint8_t shit = encryptOpcode(TEA_KEY, SHIT);
+    uint8_t first[] = {movi, R0, 0x01, 0x00, shit, shit, shit, shit, shit};
+    uint8_t second[] = {nope, nope, nope, nope, movi, R0, 0x02, 0x00, shit};
+    VM vm(TEA_KEY, first, sizeof(first));
+
+    vm.run();
+    REQUIRE(vm.reg(R0) == 1);
+    REQUIRE(vm.reg(IP) == 4);
+
+// Resuming from IP = 4 has to run the new code
+    vm.addressSpace()->insCode(second, sizeof(second));
+    vm.run();
+    REQUIRE(vm.reg(R0) == 2);
+    REQUIRE(vm.reg(IP) == 8);
+}
+
+TEST_CASE("Borrowed code runs in place", "[VM]") {
+    uint8_t nope = encryptOpcode(TEA_KEY, NOPE);
+    uint8_t *page = (uint8_t *) mmap(NULL, TEA_DECRYPT_LEN, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    uint8_t i;
+
+    REQUIRE(page != MAP_FAILED);
+    memcpy(page, TEA_DECRYPT, TEA_DECRYPT_LEN);
+    REQUIRE(mprotect(page, TEA_DECRYPT_LEN, PROT_READ) == 0);
+    for (i = 0; i < NUM_ENGINES; i++) {
+        if (!VM::hasEngine(i)) {
+            continue;
+        }
+        VM vm(TEA_KEY);
+
+        REQUIRE(vm.addressSpace()->borrowCode(page, TEA_DECRYPT_LEN));
+        REQUIRE(vm.addressSpace()->isCodeBorrowed());
+        REQUIRE(vm.addressSpace()->getCode() == page);
+        REQUIRE(vm.addressSpace()->getCodesize() == TEA_DECRYPT_LEN);
+        REQUIRE_FALSE(vm.addressSpace()->insCode(&nope, 1));
+        vm.addressSpace()->insData(TEA_DATA, TEA_DATA_LEN);
+        vm.setEngine(i);
+        REQUIRE(vm.run() == STOP_HALTED);
+        REQUIRE(memcmp(vm.addressSpace()->getData(), TEA_PLAINTEXT, TEA_DATA_LEN) == 0);
+    }
+
+// Running off the end of the borrowed code stops the VM
+    VM vm(TEA_KEY);
+    uint8_t nopes[] = {nope, nope};
+
+    vm.addressSpace()->borrowCode(nopes, sizeof(nopes));
+    REQUIRE(vm.run() == STOP_ERROR);
+    REQUIRE(vm.reg(IP) == 2);
+    REQUIRE_FALSE(vm.addressSpace()->borrowCode(page, MAX_CODESIZE + 1));
+    munmap(page, TEA_DECRYPT_LEN);
+}
+
+TEST_CASE("reset() gives back a VM as good as new", "[VM]") {
+    uint8_t code[DEFAULT_CODESIZE], data[DEFAULT_DATASIZE];
+    uint32_t seed, len, engine, i, rnd = 3;
+
+    for (engine = ENGINE_LOOP; engine < NUM_ENGINES; engine++) {
+        if (!VM::hasEngine(engine)) {
+            continue;
+        }
+        VM dec(TEA_KEY, TEA_DECRYPT, TEA_DECRYPT_LEN);
+        dec.setEngine(engine);
+        for (i = 0; i < 3; i++) {
+            dec.addressSpace()->insData(TEA_DATA, TEA_DATA_LEN);
+            dec.run();
+            REQUIRE(memcmp(dec.addressSpace()->getData(), TEA_PLAINTEXT, TEA_DATA_LEN) == 0);
+            dec.reset();
+        }
+
+        for (seed = 0; seed < 200; seed++) {
+            memset(code, 0, sizeof(code));
+            len = randomProgram(TEA_KEY, code, sizeof(code), seed);
+            VM vm(TEA_KEY, code, len);
+            vm.setEngine(engine);
+            for (i = 0; i < sizeof(data); i++) {
+                data[i] = lcg(&rnd);
+            }
+            vm.addressSpace()->insData(data, sizeof(data));
+            vm.run();
+            vm.reset();
+        // Registers, data and stack are back to zero
+            for (i = 0; i < NUM_REGS; i++) {
+                REQUIRE(vm.reg(i) == 0);
+            }
+            REQUIRE(vm.executed() == 0);
+            for (i = 0; i < DEFAULT_DATASIZE; i++) {
+                REQUIRE(vm.addressSpace()->getData()[i] == 0);
+            }
+            for (i = 0; i < DEFAULT_STACKSIZE; i++) {
+                REQUIRE(vm.addressSpace()->getStack()[i] == 0);
+            }
+        // and running again matches a new VM
+            for (i = 0; i < sizeof(data); i += 2) {
+                data[i] = lcg(&rnd);
+            }
+            VM ref(TEA_KEY, code, len);
+            ref.setEngine(engine);
+            ref.addressSpace()->insData(data, sizeof(data) / 2);
+            vm.addressSpace()->insData(data, sizeof(data) / 2);
+            ref.run();
+            vm.run();
+            requireSameState(ref, vm);
+        }
+    }
+}
+
+TEST_CASE("Guarded VMs stop where the bounds checks would", "[VM]") {
+#define OP(_op_) encryptOpcode(TEA_KEY, _op_)
+    // R1 = data[R0], data[R0] = R2, R3 = data[R0], then a stack overflow
+    uint8_t edges[] = {OP(LODR), 0x10, OP(STRR), 0x02, OP(LODR), 0x30, OP(PUSH), R3, OP(CMPR), 0x00,
+                       OP(JPEI), 0x06, 0x00, OP(SHIT)};
+    // CALL until the stack is full, then POOP the stack empty and past it
+    uint8_t calls[] = {OP(CALL), 0x00, 0x00, OP(SHIT)};
+    uint8_t poops[] = {OP(PUSH), R0, OP(PUSH), R1, OP(POOP), R2, OP(POOP), R2, OP(POOP), R2, OP(SHIT)};
+#undef OP
+    uint8_t *programs[] = {edges, calls, poops};
+    uint32_t lens[] = {sizeof(edges), sizeof(calls), sizeof(poops)};
+    // stack, data
+    uint32_t sizes[][2] = {{DEFAULT_STACKSIZE, DEFAULT_DATASIZE}, {0x101, 0x1001}, {0x3, 0x2},
+                           {0x10000, MAX_DATASIZE}};
+    uint8_t code[DEFAULT_CODESIZE];
+    uint32_t i, j, seed, len, addr;
+
+    if (!VM::hasEngine(ENGINE_DECODED)) {
+        return;
+    }
+    for (i = 0; i < sizeof(sizes) / sizeof(*sizes); i++) {
+        for (j = 0; j < sizeof(programs) / sizeof(*programs); j++) {
+            VM ref(TEA_KEY, programs[j], lens[j], sizes[i][0], DEFAULT_CODESIZE, sizes[i][1]);
+            VM vm(TEA_KEY, programs[j], lens[j], sizes[i][0], DEFAULT_CODESIZE, sizes[i][1], ARENA_GUARDED);
+            ref.setEngine(ENGINE_LOOP);
+            vm.setEngine(ENGINE_DECODED);
+            ref.run();
+            vm.run();
+            requireSameState(ref, vm);
+        }
+    }
+// Every address around the end of data, and the wrapping ones
+    for (i = 0; i < sizeof(sizes) / sizeof(*sizes); i++) {
+        for (addr = 0; addr < 6; addr++) {
+            // R0 = datasize - addr, then the edges program
+            uint8_t prefix[sizeof(edges) + 4];
+            uint16_t at = (sizes[i][1] - addr) & 0xffff;
+
+            prefix[0] = encryptOpcode(TEA_KEY, MOVI);
+            prefix[1] = R0;
+            memcpy(&prefix[2], &at, sizeof(at));
+            memcpy(&prefix[4], edges, sizeof(edges));
+            // the jump goes back to the loads
+            prefix[4 + 11] += 4;
+            VM ref(TEA_KEY, prefix, sizeof(prefix), sizes[i][0], DEFAULT_CODESIZE, sizes[i][1]);
+            VM vm(TEA_KEY, prefix, sizeof(prefix), sizes[i][0], DEFAULT_CODESIZE, sizes[i][1], ARENA_GUARDED);
+            ref.addressSpace()->getData()[0] = 0x11;
+            vm.addressSpace()->getData()[0] = 0x11;
+            ref.setEngine(ENGINE_LOOP);
+            vm.setEngine(ENGINE_DECODED);
+            ref.run();
+            vm.run();
+            requireSameState(ref, vm);
+        }
+    }
+
+// Random programs and TEA, over and over on the same VM
+    VM dec(TEA_KEY, TEA_DECRYPT, TEA_DECRYPT_LEN, ARENA_GUARDED);
+    dec.setEngine(ENGINE_DECODED);
+    for (i = 0; i < 3; i++) {
+        dec.addressSpace()->insData(TEA_DATA, TEA_DATA_LEN);
+        dec.run();
+        REQUIRE(memcmp(dec.addressSpace()->getData(), TEA_PLAINTEXT, TEA_DATA_LEN) == 0);
+        dec.reset();
+    }
+    for (seed = 0; seed < 2000; seed++) {
+        memset(code, 0, sizeof(code));
+        len = randomProgram(TEA_KEY, code, sizeof(code), seed);
+        VM ref(TEA_KEY, code, len), vm(TEA_KEY, code, len, ARENA_GUARDED);
+        ref.setEngine(ENGINE_LOOP);
+        vm.setEngine(ENGINE_DECODED);
+        ref.run();
+        vm.run();
+        requireSameState(ref, vm);
+    }
+}
+
+static constexpr uint8_t OTHER_STATIC_KEY[] = "another key";
+
+TEST_CASE("StaticVM matches the loop engine", "[VM]") {
+    uint8_t code[DEFAULT_CODESIZE];
+    uint32_t seed, len, i;
+
+// The compiler shuffles the opcodes like the key schedule does
+    static_assert(staticOpcodes<STATIC_KEY>().values[MOVI] == 0x48, "MOVI is 0x48 for the PoliCTF key");
+    for (i = 0; i < NUM_OPS; i++) {
+        REQUIRE(staticOpcodes<STATIC_KEY>().values[i] == encryptOpcode(TEA_KEY, i));
+        REQUIRE(staticOpcodes<OTHER_STATIC_KEY>().values[i] == encryptOpcode(OTHER_STATIC_KEY, i));
+    }
+
+    VM enc_ref(TEA_KEY, TEA_ENCRYPT, TEA_ENCRYPT_LEN);
+    StaticVM<STATIC_KEY> enc(TEA_ENCRYPT, TEA_ENCRYPT_LEN);
+    enc_ref.setEngine(ENGINE_LOOP);
+    enc_ref.run();
+    enc.run();
+    requireSameState(enc_ref, enc);
+
+    VM dec_ref(TEA_KEY, TEA_DECRYPT, TEA_DECRYPT_LEN);
+    StaticVM<STATIC_KEY> dec(TEA_DECRYPT, TEA_DECRYPT_LEN);
+    dec_ref.addressSpace()->insData(TEA_DATA, TEA_DATA_LEN);
+    dec.addressSpace()->insData(TEA_DATA, TEA_DATA_LEN);
+    dec_ref.setEngine(ENGINE_LOOP);
+    dec_ref.run();
+    dec.run();
+    requireSameState(dec_ref, dec);
+    REQUIRE(memcmp(dec.addressSpace()->getData(), TEA_PLAINTEXT, TEA_DATA_LEN) == 0);
+
+    for (seed = 0; seed < 2000; seed++) {
+        memset(code, 0, sizeof(code));
+        len = randomProgram(TEA_KEY, code, sizeof(code), seed);
+        VM ref(TEA_KEY, code, len);
+        StaticVM<STATIC_KEY> vm(code, len);
+        ref.setEngine(ENGINE_LOOP);
+        ref.run();
+        vm.run();
+        requireSameState(ref, vm);
+    }
+
+// Unassigned bytes and running off the code stop it
+    for (i = 0; staticOpcodes<STATIC_KEY>().opcodes[i] != NUM_OPS; i++);
+    code[0] = encryptOpcode(TEA_KEY, NOPE);
+    code[1] = i;
+    StaticVM<STATIC_KEY> wat(code, 2);
+    wat.run();
+    REQUIRE(wat.reg(IP) == 1);
+    REQUIRE(wat.executed() == 2);
+    StaticVM<STATIC_KEY> off(code, 1);
+    off.run();
+    REQUIRE(off.reg(IP) == 1);
+    REQUIRE(off.executed() == 2);
+}
+
+TEST_CASE("Budgeted runs stop at jumps and resume", "[VM]") {
+#define OP(_op_) encryptOpcode(TEA_KEY, _op_)
+    // never stops by itself
+    uint8_t spin[] = {OP(MOVI), R0, 0x00, 0x00, OP(ADDI), R0, 0x01, 0x00, OP(JMPI), 0x04, 0x00};
+#undef OP
+    uint8_t code[DEFAULT_CODESIZE];
+    uint32_t seed, len, engine, slices;
+    uint8_t status, got;
+
+    for (engine = ENGINE_LOOP; engine < NUM_ENGINES; engine++) {
+        if (!VM::hasEngine(engine)) {
+            continue;
+        }
+        VM vm(TEA_KEY, spin, sizeof(spin));
+        vm.setEngine(engine);
+        REQUIRE(vm.run(1000) == STOP_BUDGET);
+        // past the budget by at most the ADDI before the next JMPI
+        REQUIRE(vm.executed() >= 1000);
+        REQUIRE(vm.executed() <= 1002);
+        REQUIRE(vm.reg(IP) == 0x4);
+        REQUIRE(vm.reg(R0) == (vm.executed() - 1) / 2);
+        REQUIRE(vm.run(1000) == STOP_BUDGET);
+        REQUIRE(vm.executed() >= 2000);
+        REQUIRE(vm.executed() <= 2002);
+
+// Slices of any size end up where a single run does
+        VM dec_ref(TEA_KEY, TEA_DECRYPT, TEA_DECRYPT_LEN), dec(TEA_KEY, TEA_DECRYPT, TEA_DECRYPT_LEN);
+        dec_ref.addressSpace()->insData(TEA_DATA, TEA_DATA_LEN);
+        dec.addressSpace()->insData(TEA_DATA, TEA_DATA_LEN);
+        dec.setEngine(engine);
+        REQUIRE(dec_ref.run() == STOP_HALTED);
+        for (slices = 1; (status = dec.run(997)) == STOP_BUDGET; slices++);
+        REQUIRE(status == STOP_HALTED);
+        REQUIRE(slices > 10);
+        requireSameState(dec_ref, dec);
+
+        for (seed = 0; seed < 500; seed++) {
+            memset(code, 0, sizeof(code));
+            len = randomProgram(TEA_KEY, code, sizeof(code), seed);
+            VM ref(TEA_KEY, code, len), sliced(TEA_KEY, code, len);
+            ref.setEngine(ENGINE_LOOP);
+            sliced.setEngine(engine);
+            status = ref.run();
+            REQUIRE(status != STOP_BUDGET);
+            while ((got = sliced.run(seed % 13)) == STOP_BUDGET);
+            REQUIRE(got == status);
+            requireSameState(ref, sliced);
+        }
+    }
+
+// Guarded VMs and StaticVM too
+    VM guarded(TEA_KEY, spin, sizeof(spin), ARENA_GUARDED);
+    if (VM::hasEngine(ENGINE_DECODED)) {
+        guarded.setEngine(ENGINE_DECODED);
+    }
+    REQUIRE(guarded.run(1000) == STOP_BUDGET);
+    REQUIRE(guarded.executed() <= 1002);
+    StaticVM<STATIC_KEY> fixed(spin, sizeof(spin));
+    REQUIRE(fixed.run(1000) == STOP_BUDGET);
+    REQUIRE(fixed.executed() <= 1002);
+    StaticVM<STATIC_KEY> dec(TEA_DECRYPT, TEA_DECRYPT_LEN);
+    VM dec_ref(TEA_KEY, TEA_DECRYPT, TEA_DECRYPT_LEN);
+    dec.addressSpace()->insData(TEA_DATA, TEA_DATA_LEN);
+    dec_ref.addressSpace()->insData(TEA_DATA, TEA_DATA_LEN);
+    dec_ref.run();
+    while (dec.run(100) == STOP_BUDGET);
+    requireSameState(dec_ref, dec);
+
+// step() stops at the exact instruction
+    VM stepped(TEA_KEY, spin, sizeof(spin));
+    REQUIRE(stepped.step(1) == STOP_BUDGET);
+    REQUIRE(stepped.executed() == 1);
+    REQUIRE(stepped.reg(IP) == 0x4);
+    REQUIRE(stepped.step(1000) == STOP_BUDGET);
+    REQUIRE(stepped.executed() == 1001);
+    REQUIRE(stepped.reg(R0) == 500);
+    REQUIRE(stepped.reg(IP) == 0x4);
+    VM halting(TEA_KEY, TEA_DECRYPT, TEA_DECRYPT_LEN);
+    halting.addressSpace()->insData(TEA_DATA, TEA_DATA_LEN);
+    REQUIRE(halting.step(UINT64_MAX) == STOP_HALTED);
+    REQUIRE(halting.executed() == dec_ref.executed());
+}
+
+TEST_CASE("Banked instructions stream over far memory", "[VM]") {
+#define OP(_op_) encryptOpcode(TEA_KEY, _op_)
+    // for every bank of 64: for every 0x100 bytes: R2 += far[], far[] = bank
+    uint8_t stream[] = {OP(MOVI), R1, 0x00, 0x00, OP(BNKR), R1, OP(MOVI), R0, 0x00, 0x00,
+                        OP(LODF), S0 << 4 | R0, OP(ADDR), R2 << 4 | S0, OP(STRF), R0 << 4 | R1,
+                        OP(ADDI), R0, 0x00, 0x01, OP(CMPW), R0, 0x00, 0x00, OP(JPNI), 0x0a, 0x00,
+                        OP(ADDI), R1, 0x01, 0x00, OP(CMPW), R1, 0x40, 0x00, OP(JPNI), 0x04, 0x00, OP(SHIT)};
+    uint8_t banked[][4] = {{OP(BNKI), 0x01, 0x00, OP(SHIT)}, {OP(BNKR), R0, OP(SHIT)},
+                           {OP(LODF), R0 << 4 | R1, OP(SHIT)}, {OP(STRF), R0 << 4 | R1, OP(SHIT)}};
+    uint8_t outside[] = {OP(BNKI), 0x01, 0x00, OP(LODF), R0 << 4 | R1, OP(SHIT)};
+#undef OP
+    uint32_t size = 0x40 << 16, i, engine;
+    uint16_t sum = 0;
+    uint16_t *far = new uint16_t[size / sizeof(uint16_t)];
+
+    for (i = 0; i < size; i += 0x100) {
+        sum += (i * 7) >> 8;
+    }
+    forEachEngine(stream, sizeof(stream), [&](VM *vm, uint8_t engine, auto run) {
+        for (i = 0; i < size; i += 0x100) {
+            far[i / sizeof(uint16_t)] = (i * 7) >> 8;
+        }
+        REQUIRE(vm->addressSpace()->borrowFar((uint8_t *) far, size));
+        REQUIRE(run() == STOP_HALTED);
+        REQUIRE(vm->reg(R2) == sum);
+        REQUIRE(vm->getBank() == 0x3f);
+        for (i = 0; i < size; i += 0x100) {
+            REQUIRE(far[i / sizeof(uint16_t)] == i >> 16);
+        }
+    });
+
+// Without far memory they stop the VM like unassigned opcodes, with it they check its bounds
+    for (engine = ENGINE_LOOP; engine < NUM_ENGINES; engine++) {
+        if (!VM::hasEngine(engine)) {
+            continue;
+        }
+        for (i = 0; i < sizeof(banked) / sizeof(*banked); i++) {
+            VM vm(TEA_KEY, banked[i], sizeof(banked[i]));
+            vm.setEngine(engine);
+            REQUIRE(vm.run() == STOP_ERROR);
+            REQUIRE(vm.reg(IP) == 0);
+            REQUIRE(vm.executed() == 1);
+        }
+        VM vm(TEA_KEY, outside, sizeof(outside));
+        vm.setEngine(engine);
+        vm.addressSpace()->borrowFar((uint8_t *) far, 0x10001);
+        REQUIRE(vm.run() == STOP_ERROR);
+        REQUIRE(vm.reg(IP) == 3);
+        // reset() takes the far memory away, as it was after construction
+        vm.reset();
+        REQUIRE(vm.addressSpace()->getFar() == NULL);
+        REQUIRE(vm.run() == STOP_ERROR);
+        REQUIRE(vm.reg(IP) == 0);
+        vm.reset();
+        vm.addressSpace()->borrowFar((uint8_t *) far, 0x10002);
+        REQUIRE(vm.run() == STOP_HALTED);
+        REQUIRE(vm.reg(R0) == far[0x10000 / sizeof(uint16_t)]);
+    }
+    delete[] far;
+}
+
+TEST_CASE("Stats count what every engine runs", "[VM]") {
+    uint8_t code[DEFAULT_CODESIZE];
+    uint32_t seed, len, i;
+    uint64_t count, failures;
+    uint8_t status;
+    const opstats_t *ref, *stats;
+    char *json;
+    size_t jsonsize;
+    FILE *out;
+
+    if (!VM::hasStats()) {
+        VM vm(TEA_KEY, TEA_ENCRYPT, TEA_ENCRYPT_LEN);
+        vm.run();
+        REQUIRE(vm.stats() == NULL);
+        REQUIRE_THROWS(vm.dumpStats(stdout));
+        return;
+    }
+    for (seed = 0; seed < 500; seed++) {
+        memset(code, 0, sizeof(code));
+        len = randomProgram(TEA_KEY, code, sizeof(code), seed);
+        VM loop(TEA_KEY, code, len);
+        loop.setEngine(ENGINE_LOOP);
+        status = loop.run();
+        ref = loop.stats();
+        count = 0;
+        failures = 0;
+        for (i = 0; i <= NUM_OPS; i++) {
+            count += ref[i].count;
+            failures += ref[i].failures;
+            REQUIRE(ref[i].failures <= ref[i].count);
+        }
+        REQUIRE(count == loop.executed());
+        REQUIRE(failures == (status == STOP_ERROR));
+        forEachEngine(code, len, [&](VM *vm, uint8_t engine, auto run) {
+            run();
+            stats = vm->stats();
+            for (i = 0; i <= NUM_OPS; i++) {
+                REQUIRE(stats[i].count == ref[i].count);
+                REQUIRE(stats[i].failures == ref[i].failures);
+            }
+        }, ENGINE_THREADED);
+    }
+
+    VM vm(TEA_KEY, TEA_DECRYPT, TEA_DECRYPT_LEN);
+    vm.addressSpace()->insData(TEA_DATA, TEA_DATA_LEN);
+    REQUIRE(vm.run() == STOP_HALTED);
+    REQUIRE(vm.stats()[SHIT].count == 1);
+    REQUIRE(vm.stats()[SHIT].failures == 0);
+    REQUIRE(vm.stats()[XORR].cycles > 0);
+    out = open_memstream(&json, &jsonsize);
+    vm.dumpStats(out);
+    fclose(out);
+    REQUIRE(strstr(json, "{\"name\": \"SHIT\", \"count\": 1, ") != NULL);
+    free(json);
+    vm.reset();
+    REQUIRE(vm.stats()[SHIT].count == 0);
+}
@@ -128,6 +128,80 @@ TEST_CASE("VMAddrSpace initialization", "[VMAS]") {
 
 }
 
+TEST_CASE("VMAddrSpace segments share one arena", "[VMAS]") {
+    uint32_t size = VMAddrSpace::arenaSize(0x21, 0x41, 0x1);
+    alignas(SEGMENT_ALIGN) uint8_t arena[0x200];
+
+    REQUIRE(size == 0x100);
+    REQUIRE(VMAddrSpace::arenaSize(0, 0, 0) == SEGMENT_ALIGN);
+
+// The segments are aligned and don't overlap
+    VMAddrSpace vmas(0x21, 0x41, 0x1);
+
+    REQUIRE((uintptr_t) vmas.getCode() % SEGMENT_ALIGN == 0);
+    REQUIRE((uintptr_t) vmas.getData() % SEGMENT_ALIGN == 0);
+    REQUIRE((uintptr_t) vmas.getStack() % SEGMENT_ALIGN == 0);
+    REQUIRE(vmas.getData() >= vmas.getCode() + 0x41);
+    REQUIRE(vmas.getStack() >= vmas.getData() + 0x1);
+    REQUIRE(vmas.getStack() + 0x21 <= vmas.getCode() + size);
+
+// A caller supplied arena is used as it is and cleared
+    memset(arena, 0xff, sizeof(arena));
+    {
+        VMAddrSpace inarena(0x21, 0x41, 0x1, arena);
+
+        REQUIRE(inarena.getCode() == arena);
+        REQUIRE(inarena.getStack() + 0x21 <= arena + size);
+        REQUIRE(inarena.getCode()[0x40] == 0);
+        REQUIRE(inarena.getStack()[0x20] == 0);
+    }
+    // and left alone past its size
+    REQUIRE(arena[size] == 0xff);
+    REQUIRE_THROWS(VMAddrSpace(0x21, 0x41, 0x1, arena + 1));
+}
+
+TEST_CASE("Guarded VMAddrSpace windows", "[VMAS]") {
+    uint32_t i;
+    VMAddrSpace vmas(0x10000, 0x41, 0x1001, ARENA_GUARDED);
+    uint8_t *data = vmas.getData(), *stack = vmas.getStack();
+    uint8_t *gdata = vmas.getGuardedData(), *gstack = vmas.getGuardedStack();
+
+    REQUIRE(vmas.isGuarded());
+    REQUIRE_FALSE(VMAddrSpace(0x100, 0x41, 0x100).isGuarded());
+    REQUIRE(VMAddrSpace(0x100, 0x41, 0x100).getGuardedData() == NULL);
+    REQUIRE_THROWS(VMAddrSpace(0x10001, 0x41, 0x100, ARENA_GUARDED));
+    REQUIRE_THROWS(VMAddrSpace(0x100, 0x41, 0x100, ARENA_MAPPED));
+
+// Whole segments for the host, zeroed
+    for (i = 0; i < 0x1001; i++) {
+        REQUIRE(data[i] == 0);
+    }
+    for (i = 0; i < 0x10000; i++) {
+        REQUIRE(stack[i] == 0);
+    }
+    data[0x1000] = 0x12;
+    stack[0xffff] = 0x34;
+    vmas.dirtyData(0x1000, 1);
+    vmas.dirtyStack(0x10000);
+
+// The windows see what the host writes, up to the last byte they can't reach
+    data[0x0fff] = 0x56;
+    stack[0xfffe] = 0x78;
+    REQUIRE(gdata[0x0fff] == 0x56);
+    REQUIRE(gstack[0xfffe] == 0x78);
+    gdata[0] = 0x9a;
+    REQUIRE(data[0] == 0x9a);
+    REQUIRE(vmas.guards(gdata + 0x1000));
+    REQUIRE(vmas.guards(gdata + 0xffff + 1));
+    REQUIRE(vmas.guards(gstack + 0xffff + 1));
+    REQUIRE_FALSE(vmas.guards(data + 0x1000));
+    REQUIRE_FALSE(vmas.guards(&i));
+
+    vmas.clean();
+    REQUIRE(data[0x1000] == 0);
+    REQUIRE(stack[0xffff] == 0);
+}
+
 TEST_CASE("Getting operands from VMAddrSpace", "[VMAS]") {
     uint8_t dst8, src8;
     uint16_t dst16, src16;
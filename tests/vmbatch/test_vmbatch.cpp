@@ -0,0 +1,90 @@
+#include "../include/catch.hpp"
+#include "../../vm/vmbatch.h"
+#include "../include/programs.h"
+#include <cstring>
+
+#define JOBS 1000
+#define STRIDE 0x40
+
+// runs the program on its own VM, the way VMBatch is expected to
+void runAlone(uint8_t *code, uint32_t codesize, uint8_t *data, uint32_t datasize, vm_state_t *state) {
+    VM vm(TEA_KEY, code, codesize);
+    uint8_t i;
+
+    vm.addressSpace()->insData(data, datasize);
+    vm.run();
+    memcpy(data, vm.addressSpace()->getData(), datasize);
+    for (i = 0; i < NUM_REGS; i++) {
+        state->regs[i] = vm.reg(i);
+    }
+    state->flags = vm.getFlags();
+    state->executed = vm.executed();
+}
+
+void requireSameStates(vm_state_t *a, vm_state_t *b, uint32_t count) {
+    uint32_t i, j;
+
+    for (i = 0; i < count; i++) {
+        for (j = 0; j < NUM_REGS; j++) {
+            REQUIRE(a[i].regs[j] == b[i].regs[j]);
+        }
+        REQUIRE(a[i].flags.ZF == b[i].flags.ZF);
+        REQUIRE(a[i].flags.CF == b[i].flags.CF);
+        REQUIRE(a[i].executed == b[i].executed);
+    }
+}
+
+TEST_CASE("VMBatch runs every data section like a VM of its own", "[VMBATCH]") {
+    static uint8_t data[JOBS * STRIDE], expected[JOBS * STRIDE];
+    static vm_state_t states[JOBS], expected_states[JOBS];
+    uint32_t i, j, seed = 1;
+    VMBatch batch(TEA_KEY, TEA_ENCRYPT, TEA_ENCRYPT_LEN, 4);
+
+    REQUIRE(batch.size() == 4);
+    // strings of different lengths: nothing may leak from one job to the next
+    for (i = 0; i < JOBS; i++) {
+        for (j = 0; j < STRIDE; j++) {
+            data[i * STRIDE + j] = j < 8 + i % (STRIDE - 8) ? lcg(&seed) | 1 : 0;
+        }
+    }
+    memcpy(expected, data, sizeof(data));
+    for (i = 0; i < JOBS; i++) {
+        runAlone(TEA_ENCRYPT, TEA_ENCRYPT_LEN, &expected[i * STRIDE], STRIDE, &expected_states[i]);
+    }
+    batch.run(data, STRIDE, JOBS, states);
+    REQUIRE(memcmp(data, expected, sizeof(data)) == 0);
+    requireSameStates(states, expected_states, JOBS);
+
+// The pool can be reused, and with fewer jobs than workers
+    memcpy(data, TEA_DATA, TEA_DATA_LEN);
+    VMBatch decrypt(TEA_KEY, TEA_DECRYPT, TEA_DECRYPT_LEN, 4);
+    decrypt.run(data, TEA_DATA_LEN, 1, states);
+    REQUIRE(memcmp(data, TEA_PLAINTEXT, strlen(TEA_PLAINTEXT)) == 0);
+    decrypt.run(data, TEA_DATA_LEN, 0, states);
+
+// Data sections can't be bigger than the data segment
+    REQUIRE_THROWS(batch.run(data, DEFAULT_DATASIZE + 1, 1, states));
+}
+
+TEST_CASE("VMBatch agrees with single VMs on random programs", "[VMBATCH]") {
+    static uint8_t data[JOBS * STRIDE], expected[JOBS * STRIDE];
+    static vm_state_t states[JOBS], expected_states[JOBS];
+    uint8_t code[DEFAULT_CODESIZE];
+    uint32_t i, seed, len, rnd = 7;
+
+    for (seed = 0; seed < 20; seed++) {
+        memset(code, 0, sizeof(code));
+        len = randomProgram(TEA_KEY, code, sizeof(code), seed);
+        VMBatch batch(TEA_KEY, code, len);
+        for (i = 0; i < sizeof(data); i++) {
+            data[i] = lcg(&rnd);
+        }
+        memcpy(expected, data, sizeof(data));
+        for (i = 0; i < JOBS; i++) {
+            runAlone(code, len, &expected[i * STRIDE], STRIDE, &expected_states[i]);
+        }
+        batch.run(data, STRIDE, JOBS, states);
+        REQUIRE(memcmp(data, expected, sizeof(data)) == 0);
+        requireSameStates(states, expected_states, JOBS);
+    }
+}
@@ -0,0 +1,194 @@
+#include "../include/catch.hpp"
+#include "../include/programs.h"
+#include <cstring>
+#include <thread>
+
+#define WORDS 1000
+
+TEST_CASE("VMChannel hands out contiguous regions", "[VMCHANNEL]") {
+    VMChannel channel(8);
+    uint16_t *in, word;
+    const uint16_t *out;
+    uint32_t count, i;
+
+    REQUIRE_THROWS(VMChannel(0));
+    REQUIRE_THROWS(VMChannel(12));
+    REQUIRE(channel.capacity() == 8);
+    in = channel.writable(&count);
+    REQUIRE(count == 8);
+    for (i = 0; i < 6; i++) {
+        in[i] = i;
+    }
+    channel.commit(6);
+    REQUIRE(channel.size() == 6);
+    REQUIRE(channel.pop(&word));
+    REQUIRE(word == 0);
+    out = channel.readable(&count);
+    REQUIRE(count == 5);
+    REQUIRE(out[0] == 1);
+    channel.consume(4);
+
+    // 2 words up to the end of the ring, then 5 more from its start
+    in = channel.writable(&count);
+    REQUIRE(count == 2);
+    in[0] = 6;
+    in[1] = 7;
+    channel.commit(2);
+    in = channel.writable(&count);
+    REQUIRE(count == 5);
+    for (i = 0; i < 5; i++) {
+        REQUIRE(channel.push(8 + i));
+    }
+    REQUIRE_FALSE(channel.push(13));
+    channel.writable(&count);
+    REQUIRE(count == 0);
+    REQUIRE(channel.size() == 8);
+
+    out = channel.readable(&count);
+    REQUIRE(count == 3);
+    REQUIRE(out[0] == 5);
+    channel.consume(3);
+    out = channel.readable(&count);
+    REQUIRE(count == 5);
+    REQUIRE(out[4] == 12);
+    channel.close();
+    REQUIRE_FALSE(channel.finished());
+    channel.consume(5);
+    REQUIRE(channel.finished());
+    REQUIRE_FALSE(channel.pop(&word));
+    channel.reopen();
+    REQUIRE_FALSE(channel.finished());
+}
+
+TEST_CASE("Programs stream through channels", "[VMCHANNEL]") {
+#define OP(_op_) encryptOpcode(TEA_KEY, _op_)
+    // until input 0 ends: output 1 gets every word of it ^ 0x4747
+    uint8_t code[] = {OP(RECV), R0, 0x00, OP(JPEI), 0x10, 0x00, OP(XORW), R0, 0x47, 0x47,
+                      OP(SEND), R0, 0x01, OP(JMPI), 0x00, 0x00, OP(SHIT)};
+#undef OP
+    uint16_t *in, received[WORDS];
+    const uint16_t *out;
+    uint32_t count, sent, got, stops, i;
+    uint8_t status;
+
+    forEachEngine(code, sizeof(code), [&](VM *vm, uint8_t engine, auto run) {
+        VMChannel input(64), output(16);
+
+        vm->attach(0, &input, NULL);
+        vm->attach(1, NULL, &output);
+        sent = 0;
+        got = 0;
+        stops = 0;
+        for (;;) {
+            // the input in chunks of up to 37 words, the output drained whole
+            in = input.writable(&count);
+            for (i = 0; i < count && i < 37 && sent < WORDS; i++) {
+                in[i] = sent++ * 3;
+            }
+            input.commit(i);
+            if (sent == WORDS) {
+                input.close();
+            }
+            status = run();
+            while ((out = output.readable(&count)) && count) {
+                REQUIRE(got + count <= WORDS);
+                memcpy(&received[got], out, count * sizeof(uint16_t));
+                got += count;
+                output.consume(count);
+            }
+            if (status != STOP_IO) {
+                break;
+            }
+            stops++;
+        }
+        REQUIRE(status == STOP_HALTED);
+        REQUIRE(got == WORDS);
+        for (i = 0; i < WORDS; i++) {
+            REQUIRE(received[i] == (uint16_t) (i * 3 ^ 0x4747));
+        }
+        // waiting doesn't count: 5 instructions a word, then RECV, JPEI and SHIT
+        REQUIRE(vm->executed() == WORDS * 5 + 3);
+        REQUIRE(stops >= WORDS / 16);
+        REQUIRE(vm->getFlags().ZF == 1);
+    });
+}
+
+TEST_CASE("Channels are fed while the VM runs", "[VMCHANNEL]") {
+#define OP(_op_) encryptOpcode(TEA_KEY, _op_)
+    // R1 += every word of input 0
+    uint8_t code[] = {OP(RECV), R0, 0x00, OP(JPEI), 0x0b, 0x00, OP(ADDR), R1 << 4 | R0,
+                      OP(JMPI), 0x00, 0x00, OP(SHIT)};
+#undef OP
+    VMChannel input(16);
+    VM vm(TEA_KEY, code, sizeof(code));
+    uint16_t sum = 0;
+    uint32_t i;
+
+    for (i = 0; i < WORDS * 10; i++) {
+        sum += i;
+    }
+    vm.attach(0, &input, NULL);
+    std::thread producer([&input] {
+        uint32_t i;
+
+        for (i = 0; i < WORDS * 10; i++) {
+            while (!input.push(i)) {
+                std::this_thread::yield();
+            }
+        }
+        input.close();
+    });
+    while (vm.run() == STOP_IO) {
+        std::this_thread::yield();
+    }
+    producer.join();
+    REQUIRE(vm.reg(IP) == 0x0b);
+    REQUIRE(vm.reg(R1) == sum);
+}
+
+TEST_CASE("Missing and closed channels stop the VM", "[VMCHANNEL]") {
+#define OP(_op_) encryptOpcode(TEA_KEY, _op_)
+    uint8_t recv[] = {OP(RECV), R0, 0x00, OP(SHIT)};
+    uint8_t send[] = {OP(SEND), R0, 0x00, OP(SHIT)};
+    uint8_t outside[] = {OP(RECV), R0, IO_CHANNELS, OP(SHIT)};
+#undef OP
+    VMChannel channel;
+    uint32_t engine;
+
+    for (engine = ENGINE_LOOP; engine < NUM_ENGINES; engine++) {
+        if (!VM::hasEngine(engine)) {
+            continue;
+        }
+        VM vmrecv(TEA_KEY, recv, sizeof(recv));
+        VM vmsend(TEA_KEY, send, sizeof(send));
+        VM vmoutside(TEA_KEY, outside, sizeof(outside));
+
+        REQUIRE_THROWS(vmrecv.attach(IO_CHANNELS, &channel, NULL));
+        for (VM *vm : {&vmrecv, &vmsend, &vmoutside}) {
+            vm->setEngine(engine);
+            REQUIRE(vm->run() == STOP_ERROR);
+            REQUIRE(vm->reg(IP) == 0);
+            REQUIRE(vm->executed() == 1);
+        }
+        // attached the other way around
+        vmrecv.reset();
+        vmrecv.attach(0, NULL, &channel);
+        REQUIRE(vmrecv.run() == STOP_ERROR);
+
+        vmsend.reset();
+        vmsend.attach(0, NULL, &channel);
+        REQUIRE(vmsend.run() == STOP_HALTED);
+        REQUIRE(channel.size() == 1);
+        // reset() detaches the channels
+        vmsend.reset();
+        REQUIRE(vmsend.run() == STOP_ERROR);
+        REQUIRE(channel.size() == 1);
+        vmsend.reset();
+        vmsend.attach(0, NULL, &channel);
+        channel.close();
+        REQUIRE(vmsend.run() == STOP_ERROR);
+        REQUIRE(vmsend.reg(IP) == 0);
+        channel.consume(1);
+        channel.reopen();
+    }
+}
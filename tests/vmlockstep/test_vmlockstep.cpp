@@ -0,0 +1,109 @@
+#include "../include/catch.hpp"
+#include "../../vm/vmlockstep.h"
+#include "../include/programs.h"
+#include <cstring>
+
+#define JOBS 200
+#define STRIDE 0x40
+
+// runs the program on its own VM, the way VMLockstep is expected to
+static void runSingle(uint8_t *code, uint32_t codesize, uint8_t *data, uint32_t datasize, vm_state_t *state) {
+    VM vm(TEA_KEY, code, codesize);
+    uint8_t i;
+
+    vm.addressSpace()->insData(data, datasize);
+    vm.run();
+    memcpy(data, vm.addressSpace()->getData(), datasize);
+    for (i = 0; i < NUM_REGS; i++) {
+        state->regs[i] = vm.reg(i);
+    }
+    state->flags = vm.getFlags();
+    state->executed = vm.executed();
+}
+
+static void requireSameRuns(uint8_t *code, uint32_t codesize, uint8_t *data, uint32_t count, uint64_t *splits) {
+    static uint8_t expected[JOBS * STRIDE];
+    static vm_state_t states[JOBS], expected_states[JOBS];
+    uint32_t i, j;
+
+    memcpy(expected, data, count * STRIDE);
+    for (i = 0; i < count; i++) {
+        runSingle(code, codesize, &expected[i * STRIDE], STRIDE, &expected_states[i]);
+    }
+    VMLockstep<8> lanes8(TEA_KEY, code, codesize);
+    VMLockstep<16> lanes16(TEA_KEY, code, codesize);
+    VMLockstep<32> lanes32(TEA_KEY, code, codesize);
+    for (j = 0; j < 3; j++) {
+        uint8_t copy[JOBS * STRIDE];
+
+        memcpy(copy, data, count * STRIDE);
+        if (j == 0) {
+            lanes8.run(copy, STRIDE, count, states);
+        } else if (j == 1) {
+            lanes16.run(copy, STRIDE, count, states);
+        } else {
+            lanes32.run(copy, STRIDE, count, states);
+        }
+        REQUIRE(memcmp(copy, expected, count * STRIDE) == 0);
+        for (i = 0; i < count; i++) {
+            REQUIRE(memcmp(states[i].regs, expected_states[i].regs, sizeof(states[i].regs)) == 0);
+            REQUIRE(states[i].flags.ZF == expected_states[i].flags.ZF);
+            REQUIRE(states[i].flags.CF == expected_states[i].flags.CF);
+            REQUIRE(states[i].executed == expected_states[i].executed);
+        }
+    }
+    if (splits) {
+        *splits = lanes8.splits() + lanes16.splits() + lanes32.splits();
+    }
+}
+
+TEST_CASE("VMLockstep runs every lane like a VM of its own", "[VMLOCKSTEP]") {
+    static uint8_t data[JOBS * STRIDE];
+    static vm_state_t states[1];
+    uint32_t i, j, seed = 1;
+    uint64_t splits;
+
+    // strings of the same length stay in lockstep up to the final WAT?
+    for (i = 0; i < JOBS; i++) {
+        for (j = 0; j < STRIDE; j++) {
+            data[i * STRIDE + j] = j < 0x20 ? lcg(&seed) | 1 : 0;
+        }
+    }
+    requireSameRuns(TEA_ENCRYPT, TEA_ENCRYPT_LEN, data, JOBS, &splits);
+    REQUIRE(splits == 0);
+
+// Strings of different lengths diverge at the end of the shorter ones
+    for (i = 0; i < JOBS; i++) {
+        for (j = 0; j < STRIDE; j++) {
+            data[i * STRIDE + j] = j < 8 + i % (STRIDE - 8) ? lcg(&seed) | 1 : 0;
+        }
+    }
+    requireSameRuns(TEA_ENCRYPT, TEA_ENCRYPT_LEN, data, JOBS, &splits);
+    REQUIRE(splits > 0);
+    REQUIRE(splits < 3 * JOBS);
+    // a group that is not full
+    requireSameRuns(TEA_ENCRYPT, TEA_ENCRYPT_LEN, data, 13, NULL);
+
+    memcpy(data, TEA_DATA, TEA_DATA_LEN);
+    VMLockstep<8> decrypt(TEA_KEY, TEA_DECRYPT, TEA_DECRYPT_LEN);
+    decrypt.run(data, TEA_DATA_LEN, 1, states);
+    REQUIRE(memcmp(data, TEA_PLAINTEXT, strlen(TEA_PLAINTEXT)) == 0);
+
+// Data sections can't be bigger than the data segment
+    REQUIRE_THROWS(decrypt.run(data, DEFAULT_DATASIZE + 1, 1, states));
+}
+
+TEST_CASE("VMLockstep agrees with single VMs on random programs", "[VMLOCKSTEP]") {
+    static uint8_t data[JOBS * STRIDE];
+    uint8_t code[DEFAULT_CODESIZE];
+    uint32_t i, seed, len, rnd = 7;
+
+    for (seed = 0; seed < 20; seed++) {
+        memset(code, 0, sizeof(code));
+        len = randomProgram(TEA_KEY, code, sizeof(code), seed);
+        for (i = 0; i < sizeof(data); i++) {
+            data[i] = lcg(&rnd);
+        }
+        requireSameRuns(code, len, data, JOBS, NULL);
+    }
+}
@@ -0,0 +1,82 @@
+#include "../include/catch.hpp"
+#include "../../vm/vmopcodecache.h"
+#include "../include/programs.h"
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+static void requireMapOf(const uint8_t *key, const opcode_map_t *map) {
+    uint32_t i;
+
+    for (i = 0; i < NUM_OPS; i++) {
+        REQUIRE(map->values[i] == encryptOpcode(key, i));
+        REQUIRE(map->opcodes[map->values[i]] == i);
+    }
+    for (i = 0; i < 0x100; i++) {
+        REQUIRE(map->opcodes[i] <= NUM_OPS);
+    }
+}
+
+TEST_CASE("VMOpcodeCache shuffles every key once", "[VMOPCODECACHE]") {
+    uint8_t key[] = "opcode cache key";
+    uint8_t longer[] = "opcode cache key, longer";
+    opcode_map_t scratch;
+    const opcode_map_t *map;
+    uint64_t hits = VMOpcodeCache::hits(), misses = VMOpcodeCache::misses();
+
+    map = VMOpcodeCache::lookup(key, &scratch);
+    REQUIRE(map != &scratch);
+    requireMapOf(key, map);
+    REQUIRE(VMOpcodeCache::misses() == misses + 1);
+    REQUIRE(VMOpcodeCache::lookup(key, &scratch) == map);
+    REQUIRE(VMOpcodeCache::hits() == hits + 1);
+    REQUIRE(VMOpcodeCache::saved() > 0);
+
+// Keys sharing a prefix are different keys
+    REQUIRE(VMOpcodeCache::lookup(longer, &scratch) != map);
+    requireMapOf(longer, VMOpcodeCache::lookup(longer, &scratch));
+
+// VMs get the same opcodes from the cache
+    VM vm(key, TEA_ENCRYPT, 0);
+    uint8_t code[] = {encryptOpcode(key, MOVI), R0, 0x34, 0x12, encryptOpcode(key, SHIT)};
+    vm.addressSpace()->insCode(code, sizeof(code));
+    vm.run();
+    REQUIRE(vm.reg(R0) == 0x1234);
+}
+
+TEST_CASE("VMOpcodeCache from many threads and past its size", "[VMOPCODECACHE]") {
+    const opcode_map_t *seen[8][OPCODE_CACHE_KEYS + 16];
+    std::vector<std::thread> threads;
+    opcode_map_t scratch;
+    char key[32];
+    uint32_t t, i;
+
+    for (t = 0; t < 8; t++) {
+        threads.emplace_back([&seen, t]() {
+            opcode_map_t scratch;
+            char key[32];
+            uint32_t i;
+
+            for (i = 0; i < OPCODE_CACHE_KEYS + 16; i++) {
+                snprintf(key, sizeof(key), "threaded key %u", i);
+                seen[t][i] = VMOpcodeCache::lookup((uint8_t *) key, &scratch);
+                // maps falling back to scratch don't outlive the lookup
+                if (seen[t][i] == &scratch) {
+                    seen[t][i] = NULL;
+                }
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+// Every thread got the same maps, right ones even once the cache is full
+    for (i = 0; i < OPCODE_CACHE_KEYS + 16; i++) {
+        snprintf(key, sizeof(key), "threaded key %u", i);
+        for (t = 1; t < 8; t++) {
+            REQUIRE(seen[t][i] == seen[0][i]);
+        }
+        requireMapOf((uint8_t *) key, VMOpcodeCache::lookup((uint8_t *) key, &scratch));
+    }
+    REQUIRE(seen[0][OPCODE_CACHE_KEYS + 15] == NULL);
+}
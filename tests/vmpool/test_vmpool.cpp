@@ -0,0 +1,102 @@
+#include "../include/catch.hpp"
+#include "../../vm/vmpool.h"
+#include "../include/programs.h"
+#include <cstring>
+#include <sys/mman.h>
+
+TEST_CASE("VMPool hands out reset VMs by key and sizes", "[VMPOOL]") {
+    uint8_t other_key[] = "another key";
+    uint32_t i;
+    VMPool pool;
+    VM *vm, *again;
+
+    vm = pool.acquire(TEA_KEY, TEA_DECRYPT, TEA_DECRYPT_LEN);
+    REQUIRE(pool.misses() == 1);
+    vm->addressSpace()->insData(TEA_DATA, TEA_DATA_LEN);
+    vm->run();
+    REQUIRE(memcmp(vm->addressSpace()->getData(), TEA_PLAINTEXT, TEA_DATA_LEN) == 0);
+    pool.release(vm);
+
+// The same VM comes back, reset
+    again = pool.acquire(TEA_KEY, TEA_DECRYPT, TEA_DECRYPT_LEN);
+    REQUIRE(again == vm);
+    REQUIRE(pool.hits() == 1);
+    REQUIRE(again->executed() == 0);
+    for (i = 0; i < DEFAULT_DATASIZE; i++) {
+        REQUIRE(again->addressSpace()->getData()[i] == 0);
+    }
+    again->addressSpace()->insData(TEA_DATA, TEA_DATA_LEN);
+    again->run();
+    REQUIRE(memcmp(again->addressSpace()->getData(), TEA_PLAINTEXT, TEA_DATA_LEN) == 0);
+    pool.release(again);
+
+// Another program gets the code segment rewritten
+    again = pool.acquire(TEA_KEY, TEA_ENCRYPT, TEA_ENCRYPT_LEN);
+    REQUIRE(again == vm);
+    for (i = TEA_ENCRYPT_LEN; i < DEFAULT_CODESIZE; i++) {
+        REQUIRE(again->addressSpace()->getCode()[i] == 0);
+    }
+    again->run();
+    REQUIRE(again->reg(R0) == 0xac04);
+    REQUIRE(again->executed() == 13972);
+    pool.release(again);
+
+// Other keys and sizes don't share VMs
+    again = pool.acquire(other_key, TEA_ENCRYPT, TEA_ENCRYPT_LEN);
+    REQUIRE(again != vm);
+    pool.release(again);
+    again = pool.acquire(TEA_KEY, TEA_ENCRYPT, TEA_ENCRYPT_LEN, 0x200, 0x400, 0x200);
+    REQUIRE(again != vm);
+    REQUIRE(again->addressSpace()->getStacksize() == 0x200);
+    REQUIRE(again->addressSpace()->getCodesize() == 0x400);
+    REQUIRE(again->addressSpace()->getDatasize() == 0x200);
+    pool.release(again);
+    REQUIRE(pool.misses() == 3);
+    REQUIRE(pool.hits() == 2);
+
+// VMs go back to the pool once: two acquire() calls never share one
+    again = pool.acquire(TEA_KEY, TEA_ENCRYPT, TEA_ENCRYPT_LEN);
+    pool.release(again);
+    REQUIRE_THROWS(pool.release(again));
+    vm = pool.acquire(TEA_KEY, TEA_ENCRYPT, TEA_ENCRYPT_LEN);
+    again = pool.acquire(TEA_KEY, TEA_ENCRYPT, TEA_ENCRYPT_LEN);
+    REQUIRE(again != vm);
+    pool.release(vm);
+    pool.release(again);
+
+// Only VMs coming from the pool can go back to it
+    VM outsider(TEA_KEY, TEA_ENCRYPT, TEA_ENCRYPT_LEN);
+    REQUIRE_THROWS(pool.release(&outsider));
+    REQUIRE_THROWS(pool.acquire(TEA_KEY, TEA_ENCRYPT, DEFAULT_CODESIZE + 1));
+}
+
+TEST_CASE("Pooled VMs give borrowed code back", "[VMPOOL]") {
+    uint8_t *page = (uint8_t *) mmap(NULL, TEA_DECRYPT_LEN, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    VMPool pool;
+    VM *vm, *again;
+
+    REQUIRE(page != MAP_FAILED);
+    memcpy(page, TEA_DECRYPT, TEA_DECRYPT_LEN);
+    REQUIRE(mprotect(page, TEA_DECRYPT_LEN, PROT_READ) == 0);
+    vm = pool.acquire(TEA_KEY, TEA_ENCRYPT, TEA_ENCRYPT_LEN);
+    REQUIRE(vm->addressSpace()->borrowCode(page, TEA_DECRYPT_LEN));
+    vm->addressSpace()->insData(TEA_DATA, TEA_DATA_LEN);
+    REQUIRE(vm->run() == STOP_HALTED);
+    REQUIRE(memcmp(vm->addressSpace()->getData(), TEA_PLAINTEXT, TEA_DATA_LEN) == 0);
+    pool.release(vm);
+    munmap(page, TEA_DECRYPT_LEN);
+
+// The next user gets the VM's own code segment, with its program in it
+    again = pool.acquire(TEA_KEY, TEA_DECRYPT, TEA_DECRYPT_LEN);
+    REQUIRE(again == vm);
+    REQUIRE_FALSE(again->addressSpace()->isCodeBorrowed());
+    REQUIRE(again->addressSpace()->getCodesize() == DEFAULT_CODESIZE);
+    again->addressSpace()->insData(TEA_DATA, TEA_DATA_LEN);
+    REQUIRE(again->run() == STOP_HALTED);
+    REQUIRE(memcmp(again->addressSpace()->getData(), TEA_PLAINTEXT, TEA_DATA_LEN) == 0);
+    pool.release(again);
+    again = pool.acquire(TEA_KEY, TEA_ENCRYPT, TEA_ENCRYPT_LEN);
+    REQUIRE(again->run() == STOP_HALTED);
+    REQUIRE(again->reg(R0) == 0xac04);
+    pool.release(again);
+}
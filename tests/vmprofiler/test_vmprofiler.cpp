@@ -0,0 +1,165 @@
+#include "../include/catch.hpp"
+#include "../../vm/vmprofiler.h"
+#include "../include/programs.h"
+#include <chrono>
+#include <cstring>
+#include <thread>
+#include <unistd.h>
+
+#define CALLS 10
+#define SPINS 0xff
+
+/*
+ * main() calls spin() at 0x13 until R0 passes last, spin() counts up to
+ * SPINS + 1 in the block at 0x17.
+ */
+static uint32_t spinProgram(uint8_t *code, uint16_t last) {
+#define OP(_op_) encryptOpcode(TEA_KEY, _op_)
+    uint8_t program[] = {OP(MOVI), R0, 0x00, 0x00, OP(CALL), 0x13, 0x00, OP(ADDI), R0, 0x01, 0x00,
+                         OP(CMPW), R0, (uint8_t) (last & 0xff), (uint8_t) (last >> 8), OP(JPBI), 0x04, 0x00,
+                         OP(SHIT), OP(MOVI), R1, 0x00, 0x00, OP(ADDI), R1, 0x01, 0x00, OP(CMPW), R1, SPINS,
+                         0x00, OP(JPBI), 0x17, 0x00, OP(RETN)};
+#undef OP
+
+    memcpy(code, program, sizeof(program));
+    return sizeof(program);
+}
+
+static bool contains(char *text, const char *what) {
+    bool found = strstr(text, what) != NULL;
+
+    free(text);
+    return found;
+}
+
+TEST_CASE("Every engine counts the same block entries", "[VMPROFILER]") {
+    uint8_t code[64];
+    uint32_t len = spinProgram(code, CALLS - 1), ip;
+    char *report;
+    size_t reportsize;
+    FILE *out;
+
+    if (!VM::hasStats()) {
+        VM vm(TEA_KEY, code, len);
+        REQUIRE_THROWS(VMProfiler(&vm));
+        vm.run();
+        REQUIRE(vm.entries(0) == 0);
+        return;
+    }
+    VM loop(TEA_KEY, code, len);
+    loop.setEngine(ENGINE_LOOP);
+    REQUIRE(loop.run() == STOP_HALTED);
+    REQUIRE(loop.executed() == 2 + CALLS * (6 + 3 * (SPINS + 1)));
+    REQUIRE(loop.entries(0x00) == 1);
+    // the CALLs and the jumps back
+    REQUIRE(loop.entries(0x13) == CALLS);
+    REQUIRE(loop.entries(0x04) == CALLS - 1);
+    REQUIRE(loop.entries(0x17) == CALLS * SPINS);
+    // RETN and SHIT follow jumps not taken, ADDI follows RETN
+    REQUIRE(loop.entries(0x22) == CALLS);
+    REQUIRE(loop.entries(0x12) == 1);
+    REQUIRE(loop.entries(0x07) == CALLS);
+    REQUIRE(loop.entries(0x0b) == 0);
+
+    forEachEngine(code, len, [&](VM *vm, uint8_t engine, auto run) {
+        run();
+        for (ip = 0; ip < len; ip++) {
+            REQUIRE(vm->entries(ip) == loop.entries(ip));
+        }
+    }, ENGINE_THREADED);
+
+    VMProfiler profiler(&loop);
+    out = open_memstream(&report, &reportsize);
+    profiler.hotBlocks(out, 3);
+    fclose(out);
+    REQUIRE(contains(report, "\n   1  0x0017"));
+
+    // a new run starts counting over
+    loop.reset();
+    REQUIRE(loop.entries(0x17) == 0);
+}
+
+TEST_CASE("Samples follow the calls of the VM", "[VMPROFILER]") {
+    uint8_t code[64];
+    // calls spin() forever: R0 can't go past 0xffff
+    uint32_t len = spinProgram(code, 0xffff);
+    char symbols[] = "/tmp/test_vmprofiler_XXXXXX";
+    char *report;
+    size_t reportsize;
+    FILE *out;
+    int fd;
+
+    if (!VM::hasStats()) {
+        return;
+    }
+    VM vm(TEA_KEY, code, len);
+    VMProfiler profiler(&vm), other(&vm);
+    REQUIRE_THROWS(profiler.start(0));
+    REQUIRE_THROWS(profiler.start(2000000));
+    profiler.start(10000);
+    REQUIRE_THROWS(other.start());
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(30);
+    while (profiler.sampled() < 100 && std::chrono::steady_clock::now() < deadline) {
+        REQUIRE(vm.run(100000) == STOP_BUDGET);
+    }
+    profiler.stop();
+    REQUIRE(profiler.sampled() >= 100);
+
+    // nearly all of the time goes into spin()
+    out = open_memstream(&report, &reportsize);
+    profiler.foldedStacks(out);
+    fclose(out);
+    REQUIRE(contains(report, "0x0000;0x0013 "));
+
+    fd = mkstemp(symbols);
+    REQUIRE(fd >= 0);
+    REQUIRE(write(fd, "0x0 main\n0x13 spin\n", 19) == 19);
+    close(fd);
+    REQUIRE(profiler.loadSymbols(symbols));
+    unlink(symbols);
+    REQUIRE_FALSE(profiler.loadSymbols(symbols));
+    out = open_memstream(&report, &reportsize);
+    profiler.foldedStacks(out);
+    fclose(out);
+    REQUIRE(contains(report, "main;spin "));
+    out = open_memstream(&report, &reportsize);
+    profiler.hotBlocks(out);
+    fclose(out);
+    REQUIRE(contains(report, "spin+0x4"));
+
+    // the timer is free again
+    other.start();
+    other.stop();
+}
+
+TEST_CASE("Only the thread that started the profiler is sampled", "[VMPROFILER]") {
+    uint8_t code[64];
+    uint32_t len = spinProgram(code, 0xffff);
+    std::atomic<bool> done(false);
+    volatile uint64_t spins = 0;
+
+    if (!VM::hasStats()) {
+        return;
+    }
+    VM vm(TEA_KEY, code, len);
+    VMProfiler profiler(&vm);
+    profiler.start(10000);
+    // this thread burns CPU time, so the timer fires, while the VM runs on another one
+    std::thread runner([&] {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(200);
+
+        while (std::chrono::steady_clock::now() < deadline) {
+            vm.run(100000);
+        }
+        done = true;
+    });
+    while (!done) {
+        spins++;
+    }
+    runner.join();
+    profiler.stop();
+    REQUIRE(spins > 0);
+    REQUIRE(vm.executed() > 0);
+    REQUIRE(profiler.sampled() == 0);
+}
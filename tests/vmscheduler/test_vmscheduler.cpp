@@ -0,0 +1,148 @@
+#include "../include/catch.hpp"
+#include "../../vm/vmscheduler.h"
+#include "../include/programs.h"
+#include <chrono>
+#include <cstring>
+
+#define VMS 500
+
+typedef struct exited {
+    std::atomic<uint32_t> count;
+    // VMs in the order they stopped
+    uint32_t order[VMS];
+    uint8_t status[VMS];
+} exited_t;
+
+typedef struct job {
+    exited_t *exited;
+    uint32_t id;
+} job_t;
+
+static void onExit(VM *vm, uint8_t status, void *arg) {
+    job_t *job = (job_t *) arg;
+    uint32_t at = job->exited->count++;
+
+    job->exited->order[at] = job->id;
+    job->exited->status[job->id] = status;
+}
+
+TEST_CASE("VMScheduler runs every VM like run() does", "[VMSCHEDULER]") {
+    static exited_t exited;
+    static job_t jobs[VMS];
+    uint8_t code[DEFAULT_CODESIZE];
+    uint8_t status[VMS];
+    uint32_t i, len;
+    VM *vms[VMS], *refs[VMS];
+    VMScheduler scheduler(4, 1000);
+
+    REQUIRE(scheduler.size() == 4);
+    REQUIRE_THROWS(VMScheduler(1, 0));
+    exited.count = 0;
+    for (i = 0; i < VMS; i++) {
+        if (i % 3 == 0) {
+            vms[i] = new VM(TEA_KEY, TEA_DECRYPT, TEA_DECRYPT_LEN);
+            refs[i] = new VM(TEA_KEY, TEA_DECRYPT, TEA_DECRYPT_LEN);
+            vms[i]->addressSpace()->insData(TEA_DATA, TEA_DATA_LEN);
+            refs[i]->addressSpace()->insData(TEA_DATA, TEA_DATA_LEN);
+        } else {
+            memset(code, 0, sizeof(code));
+            len = randomProgram(TEA_KEY, code, sizeof(code), i);
+            vms[i] = new VM(TEA_KEY, code, len);
+            refs[i] = new VM(TEA_KEY, code, len);
+        }
+        if (VM::hasEngine(i % NUM_ENGINES)) {
+            vms[i]->setEngine(i % NUM_ENGINES);
+        }
+        status[i] = refs[i]->run();
+        jobs[i] = {&exited, i};
+    }
+    for (i = 0; i < VMS; i++) {
+        scheduler.spawn(vms[i], onExit, &jobs[i]);
+    }
+    scheduler.wait();
+    REQUIRE(exited.count == VMS);
+    // decrypt.pstc alone takes 72 slices
+    REQUIRE(scheduler.slices() >= VMS / 3 * 72);
+    for (i = 0; i < VMS; i++) {
+        REQUIRE(exited.status[i] == status[i]);
+        REQUIRE(vms[i]->executed() == refs[i]->executed());
+        REQUIRE(vms[i]->reg(IP) == refs[i]->reg(IP));
+        REQUIRE(memcmp(vms[i]->addressSpace()->getData(), refs[i]->addressSpace()->getData(),
+                       DEFAULT_DATASIZE) == 0);
+        delete vms[i];
+        delete refs[i];
+    }
+}
+
+TEST_CASE("Long running VMs don't hold the short ones back", "[VMSCHEDULER]") {
+#define OP(_op_) encryptOpcode(TEA_KEY, _op_)
+    uint8_t forever[] = {OP(MOVI), R0, 0x00, 0x00, OP(ADDI), R0, 0x01, 0x00, OP(JMPI), 0x04, 0x00};
+#undef OP
+    static exited_t exited;
+    static job_t jobs[VMS];
+    uint32_t i, longs = 4, shorts = 100;
+    uint64_t slices;
+    VM *vms[VMS];
+
+    exited.count = 0;
+    {
+        VMScheduler scheduler(2, 1000);
+
+        // the long ones are spawned first, and never stop: however fast the engine
+        for (i = 0; i < longs + shorts; i++) {
+            if (i < longs) {
+                vms[i] = new VM(TEA_KEY, forever, sizeof(forever));
+            } else {
+                vms[i] = new VM(TEA_KEY, TEA_ENCRYPT, TEA_ENCRYPT_LEN);
+            }
+            jobs[i] = {&exited, i};
+            scheduler.spawn(vms[i], onExit, &jobs[i]);
+        }
+        // a scheduler running VMs to completion never gets to the short ones
+        for (i = 0; i < 10000 && exited.count < shorts; i++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        if (exited.count < shorts) {
+            FAIL("Only " << exited.count << " of " << shorts << " short VMs exited in 10s");
+        }
+        // while the long ones are still being run
+        slices = scheduler.slices();
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        REQUIRE(scheduler.slices() > slices);
+    }
+    REQUIRE(exited.count == shorts);
+    for (i = 0; i < longs + shorts; i++) {
+        if (i >= longs) {
+            REQUIRE(exited.status[i] == STOP_HALTED);
+        } else {
+            // more than a slice each, none of them left out
+            REQUIRE(vms[i]->executed() > 1000);
+        }
+        delete vms[i];
+    }
+
+// VMs stop once out of budget
+    VM limited(TEA_KEY, forever, sizeof(forever));
+    {
+        VMScheduler scheduler(2, 1000);
+
+        jobs[0] = {&exited, 0};
+        scheduler.spawn(&limited, onExit, &jobs[0], 123456);
+        scheduler.wait();
+    }
+    REQUIRE(exited.count == shorts + 1);
+    REQUIRE(exited.status[0] == STOP_BUDGET);
+    REQUIRE(limited.executed() >= 123456);
+    REQUIRE(limited.executed() <= 123458);
+
+// VMs that never stop are dropped along with the scheduler, even when alone
+    VM spinning(TEA_KEY, forever, sizeof(forever));
+    {
+        VMScheduler scheduler(2, 100);
+
+        scheduler.spawn(&spinning, onExit, &jobs[0]);
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    REQUIRE(exited.count == shorts + 1);
+    REQUIRE(spinning.executed() > 100);
+}
@@ -0,0 +1,135 @@
+#include "../include/catch.hpp"
+#include "../../vm/vmsnapshot.h"
+#include "../include/programs.h"
+#include <cstring>
+
+static void requireSameVM(VM &a, VM &b) {
+    VMAddrSpace *as = a.addressSpace(), *bs = b.addressSpace();
+    uint8_t i;
+
+    for (i = 0; i < NUM_REGS; i++) {
+        REQUIRE(a.reg(i) == b.reg(i));
+    }
+    REQUIRE(a.getFlags().ZF == b.getFlags().ZF);
+    REQUIRE(a.getFlags().CF == b.getFlags().CF);
+    REQUIRE(a.executed() == b.executed());
+    REQUIRE(as->getCodesize() == bs->getCodesize());
+    REQUIRE(as->getDatasize() == bs->getDatasize());
+    REQUIRE(as->getStacksize() == bs->getStacksize());
+    REQUIRE(memcmp(as->getCode(), bs->getCode(), as->getCodesize()) == 0);
+    REQUIRE(memcmp(as->getData(), bs->getData(), as->getDatasize()) == 0);
+    REQUIRE(memcmp(as->getStack(), bs->getStack(), as->getStacksize()) == 0);
+}
+
+TEST_CASE("Forks resume from the snapshot", "[VMSNAPSHOT]") {
+#define OP(_op_) encryptOpcode(TEA_KEY, _op_)
+    // data[0x4] = 0x1234, pushed too, then stops on SHIT at 0xa
+    uint8_t prefix[] = {OP(MOVI), R0, 0x34, 0x12, OP(STRI), 0x04, 0x00, R0, OP(PUSH), R0, OP(SHIT)};
+    // from 0xa: data[0x6] = data[0x20] + R0
+    uint8_t branch[] = {OP(MOVI), R0, 0x34, 0x12, OP(STRI), 0x04, 0x00, R0, OP(PUSH), R0,
+                        OP(LODI), R1, 0x20, 0x00, OP(ADDR), 0x10, OP(STRI), 0x06, 0x00, R1, OP(SHIT)};
+#undef OP
+    VM *forks[4];
+    uint16_t sum;
+    uint32_t i;
+    VM vm(TEA_KEY, prefix, sizeof(prefix));
+
+    vm.run();
+    REQUIRE(vm.reg(IP) == 0xa);
+    VMSnapshot snapshot(&vm);
+
+    for (i = 0; i < 4; i++) {
+        forks[i] = snapshot.fork();
+        requireSameVM(vm, *forks[i]);
+    }
+// Every fork goes its own way
+    for (i = 0; i < 4; i++) {
+        VMAddrSpace *as = forks[i]->addressSpace();
+        as->insCode(branch, sizeof(branch));
+        as->getData()[0x20] = i;
+        as->dirtyData(0x20, 1);
+        forks[i]->run();
+        REQUIRE(forks[i]->reg(IP) == 0x14);
+        REQUIRE(forks[i]->executed() == 8);
+    }
+    for (i = 0; i < 4; i++) {
+        memcpy(&sum, &forks[i]->addressSpace()->getData()[0x6], sizeof(sum));
+        REQUIRE(sum == 0x1234 + i);
+        REQUIRE(forks[i]->addressSpace()->getStack()[0] == 0x34);
+    }
+// without touching the VM the snapshot was taken from
+    REQUIRE(vm.addressSpace()->getData()[0x20] == 0);
+    REQUIRE(vm.addressSpace()->getData()[0x6] == 0);
+    REQUIRE(vm.addressSpace()->getData()[0x4] == 0x34);
+    REQUIRE(vm.reg(IP) == 0xa);
+    // which still runs its own code
+    vm.run();
+    REQUIRE(vm.reg(IP) == 0xa);
+    REQUIRE(vm.executed() == 5);
+
+// Forks outlive their snapshot and reset like any VM
+    VMSnapshot *other = new VMSnapshot(&vm);
+    VM *late = other->fork();
+    delete other;
+    requireSameVM(vm, *late);
+    late->reset();
+    for (i = 0; i < DEFAULT_DATASIZE; i++) {
+        REQUIRE(late->addressSpace()->getData()[i] == 0);
+    }
+    for (i = 0; i < DEFAULT_STACKSIZE; i++) {
+        REQUIRE(late->addressSpace()->getStack()[i] == 0);
+    }
+    delete late;
+    for (i = 0; i < 4; i++) {
+        delete forks[i];
+    }
+}
+
+TEST_CASE("Forks match their VM on random programs", "[VMSNAPSHOT]") {
+    uint8_t code[DEFAULT_CODESIZE], data[DEFAULT_DATASIZE];
+    uint32_t seed, len, engine, i, rnd = 5;
+
+    for (engine = ENGINE_LOOP; engine < NUM_ENGINES; engine++) {
+        if (!VM::hasEngine(engine)) {
+            continue;
+        }
+        for (seed = 0; seed < 100; seed++) {
+            memset(code, 0, sizeof(code));
+            len = randomProgram(TEA_KEY, code, sizeof(code), seed);
+            for (i = 0; i < sizeof(data); i += 3) {
+                data[i] = lcg(&rnd);
+            }
+            VM vm(TEA_KEY, code, len);
+            vm.setEngine(engine);
+            vm.addressSpace()->insData(data, sizeof(data));
+            vm.run();
+            VMSnapshot snapshot(&vm);
+            VM *fork = snapshot.fork();
+            requireSameVM(vm, *fork);
+            delete fork;
+        }
+    }
+}
+
+TEST_CASE("Snapshots of the biggest address spaces", "[VMSNAPSHOT]") {
+    uint8_t input[] = "branching input";
+    VM *fork;
+    VM vm(TEA_KEY, TEA_DECRYPT, TEA_DECRYPT_LEN, 0x10000, MAX_CODESIZE, MAX_DATASIZE);
+
+    vm.addressSpace()->insData(TEA_DATA, TEA_DATA_LEN);
+    VMSnapshot snapshot(&vm);
+    fork = snapshot.fork();
+    requireSameVM(vm, *fork);
+    fork->run();
+    REQUIRE(memcmp(fork->addressSpace()->getData(), TEA_PLAINTEXT, TEA_DATA_LEN) == 0);
+    REQUIRE(memcmp(vm.addressSpace()->getData(), TEA_DATA, TEA_DATA_LEN) == 0);
+    fork->addressSpace()->getData()[MAX_DATASIZE - 1] = 0xff;
+    delete fork;
+
+    fork = snapshot.fork();
+    fork->addressSpace()->insData(input, sizeof(input));
+    REQUIRE(fork->addressSpace()->getData()[MAX_DATASIZE - 1] == 0);
+    REQUIRE(memcmp(fork->addressSpace()->getData() + sizeof(input), TEA_DATA + sizeof(input),
+                   TEA_DATA_LEN - sizeof(input)) == 0);
+    delete fork;
+}
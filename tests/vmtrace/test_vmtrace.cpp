@@ -0,0 +1,165 @@
+#include "../include/catch.hpp"
+#include "../include/programs.h"
+#include <atomic>
+#include <cstring>
+#include <thread>
+#include <unistd.h>
+
+#define RECORDS 64
+
+static bool contains(char *text, const char *what) {
+    bool found = strstr(text, what) != NULL;
+
+    free(text);
+    return found;
+}
+
+TEST_CASE("Every engine records the same trace", "[VMTRACE]") {
+    uint8_t code[DEFAULT_CODESIZE];
+    uint32_t seed, len;
+    uint64_t first;
+    uint8_t status;
+    std::vector<trace_record_t> ref, records;
+
+    if (!VM::hasTrace()) {
+        VM vm(TEA_KEY, TEA_ENCRYPT, TEA_ENCRYPT_LEN);
+        REQUIRE_THROWS(VMTrace(&vm));
+        return;
+    }
+    for (seed = 0; seed < 500; seed++) {
+        memset(code, 0, sizeof(code));
+        len = randomProgram(TEA_KEY, code, sizeof(code), seed);
+        VM loop(TEA_KEY, code, len);
+        VMTrace trace(&loop, RECORDS);
+        loop.setEngine(ENGINE_LOOP);
+        status = loop.run();
+        REQUIRE(trace.recorded() == loop.executed());
+        first = trace.snapshot(&ref);
+        REQUIRE(ref.size() == std::min<uint64_t>(loop.executed(), RECORDS - 1));
+        REQUIRE(first + ref.size() == loop.executed());
+        // the last record is the instruction the VM stopped on
+        REQUIRE(ref.back().ip == loop.reg(IP));
+        REQUIRE((status == STOP_HALTED) == (ref.back().op == SHIT));
+        forEachEngine(code, len, [&](VM *vm, uint8_t engine, auto run) {
+            VMTrace other(vm, RECORDS);
+
+            run();
+            REQUIRE(other.snapshot(&records) == first);
+            REQUIRE(records.size() == ref.size());
+            REQUIRE(memcmp(records.data(), ref.data(), ref.size() * sizeof(trace_record_t)) == 0);
+        }, ENGINE_THREADED);
+    }
+
+    VM vm(TEA_KEY, TEA_ENCRYPT, TEA_ENCRYPT_LEN);
+    REQUIRE_THROWS(VMTrace(&vm, 0));
+    REQUIRE_THROWS(VMTrace(&vm, 100));
+    VMTrace trace(&vm);
+    REQUIRE_THROWS(VMTrace(&vm));
+}
+
+TEST_CASE("Failing runs dump the flight recorder", "[VMTRACE]") {
+#define OP(_op_) encryptOpcode(TEA_KEY, _op_)
+    // POOP R1 on an empty stack fails
+    uint8_t code[] = {OP(MOVI), R0, 0x05, 0x00, OP(ADDI), R0, 0x01, 0x00, OP(CMPW), R0, 0x06, 0x00,
+                      OP(POOP), R1, OP(SHIT)};
+    uint8_t halts[] = {OP(MOVI), R0, 0x05, 0x00, OP(SHIT)};
+#undef OP
+    char path[] = "/tmp/test_vmtrace_XXXXXX";
+    char *text;
+    size_t textsize;
+    FILE *in, *out;
+    int fd;
+
+    if (!VM::hasTrace()) {
+        return;
+    }
+    fd = mkstemp(path);
+    REQUIRE(fd >= 0);
+    close(fd);
+    unlink(path);
+
+    VM fine(TEA_KEY, halts, sizeof(halts));
+    VMTrace finetrace(&fine);
+    finetrace.flightRecorder(path);
+    REQUIRE(fine.run() == STOP_HALTED);
+    REQUIRE(access(path, F_OK) != 0);
+
+    VM vm(TEA_KEY, code, sizeof(code));
+    VMTrace trace(&vm);
+    trace.flightRecorder(path);
+    REQUIRE(vm.run() == STOP_ERROR);
+    in = fopen(path, "rb");
+    REQUIRE(in);
+    unlink(path);
+    out = open_memstream(&text, &textsize);
+    REQUIRE(VMTrace::decode(in, out));
+    fclose(in);
+    fclose(out);
+    REQUIRE(strstr(text, "# 4 records after the first 0, 4 instructions run\n"));
+    REQUIRE(strstr(text, "0x0000  MOVI R0, 0x0005"));
+    REQUIRE(strstr(text, "0x0004  ADDI R0, 0x0001      R0=0x0005"));
+    REQUIRE(strstr(text, "0x0008  CMPW R0, 0x0006      R0=0x0006               ZF=0 CF=0"));
+    REQUIRE(contains(text, "0x000c  POOP R1              R1=0x0000               ZF=1 CF=1\n# R0=0x0006"));
+
+    // step() fails the same way
+    VM stepped(TEA_KEY, code, sizeof(code));
+    VMTrace steptrace(&stepped);
+    steptrace.flightRecorder(path);
+    REQUIRE(stepped.step(2) == STOP_BUDGET);
+    REQUIRE(access(path, F_OK) != 0);
+    REQUIRE(stepped.step(10) == STOP_ERROR);
+    in = fopen(path, "rb");
+    REQUIRE(in);
+    unlink(path);
+    out = open_memstream(&text, &textsize);
+    REQUIRE(VMTrace::decode(in, out));
+    fclose(in);
+    fclose(out);
+    REQUIRE(contains(text, "# 4 records after the first 0, 4 instructions run\n"));
+
+    // anything else is not a trace
+    in = fopen("/dev/null", "rb");
+    out = open_memstream(&text, &textsize);
+    REQUIRE_FALSE(VMTrace::decode(in, out));
+    fclose(in);
+    fclose(out);
+    free(text);
+}
+
+TEST_CASE("Traces are read while the VM runs", "[VMTRACE]") {
+#define OP(_op_) encryptOpcode(TEA_KEY, _op_)
+    uint8_t code[] = {OP(ADDI), R0, 0x01, 0x00, OP(JMPI), 0x00, 0x00};
+#undef OP
+    std::vector<trace_record_t> records;
+    std::atomic<bool> done(false);
+    uint32_t snapshots = 0, i;
+    uint64_t first;
+
+    if (!VM::hasTrace()) {
+        return;
+    }
+    VM vm(TEA_KEY, code, sizeof(code));
+    VMTrace trace(&vm, RECORDS);
+    std::thread runner([&] {
+        uint32_t run;
+
+        for (run = 0; run < 2000; run++) {
+            vm.run(1000);
+        }
+        done = true;
+    });
+    while (!done || !snapshots) {
+        first = trace.snapshot(&records);
+        REQUIRE(records.size() < RECORDS);
+        // ADDI and JMPI in turn, ADDI seeing R0 go up by one
+        for (i = 0; i < records.size(); i++) {
+            REQUIRE(records[i].ip == ((first + i) % 2) * 4);
+            if (records[i].op == ADDI) {
+                REQUIRE(records[i].dstval == (uint16_t) ((first + i) / 2));
+            }
+        }
+        snapshots++;
+    }
+    runner.join();
+    REQUIRE(trace.recorded() == vm.executed());
+}
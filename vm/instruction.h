@@ -3,6 +3,8 @@
 
 /*
 MEMORY LOCATIONS AND IMMEDIATES ARE 16 BITS LONG
+FAR MEMORY IS ADDRESSED WITH THE BANK REGISTER AS THE HIGH 16 BITS
+CHANNELS ARE NUMBERED BY AN 8 BIT IMMEDIATE
 */
 
 #ifdef DBG
@@ -55,6 +57,12 @@ enum INSTR_ENUM {
     SHIT,
     NOPE,
     GRMN,
+    BNKI,
+    BNKR,
+    LODF,
+    STRF,
+    RECV,
+    SEND,
     DEBG,
     NUM_OPS
 };
@@ -108,6 +116,12 @@ enum INSTR_ENUM {
     SHIT,
     NOPE,
     GRMN,
+    BNKI,
+    BNKR,
+    LODF,
+    STRF,
+    RECV,
+    SEND,
     NUM_OPS
 };
 #endif
@@ -173,6 +187,12 @@ INSTRUCTION SIZES
 #define SHIT_SIZE SINGLE
 #define NOPE_SIZE SINGLE
 #define GRMN_SIZE SINGLE
+#define BNKI_SIZE IMMONLY
+#define BNKR_SIZE REGONLY
+#define LODF_SIZE REG2REG
+#define STRF_SIZE REG2REG
+#define RECV_SIZE BYT2REG
+#define SEND_SIZE BYT2REG
 #define DEBG_SIZE SINGLE
 
 #endif
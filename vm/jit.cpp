@@ -0,0 +1,645 @@
+#ifdef JIT
+
+#include "jit.h"
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <new>
+#include <stdexcept>
+
+enum hostregs {
+    X86_RAX, X86_RCX, X86_RDX, X86_RBX, X86_RSP, X86_RBP, X86_RSI, X86_RDI, X86_R8
+};
+enum conditions {
+    CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5
+};
+
+// guest R0 -> S3 are pinned to r8 -> r15
+#define HOST(_r_) (X86_R8 + (_r_))
+#define CTX_OFF(_field_) ((uint8_t) offsetof(jit_ctx_t, _field_))
+#define CTX_REG(_r_) ((uint8_t) (offsetof(jit_ctx_t, regs) + (_r_) * sizeof(uint16_t)))
+
+/*
+CONSTRUCTORS
+*/
+VMJit::VMJit(VM *vm) {
+    this->vm = vm;
+    buf = (uint8_t *) mmap(NULL, JIT_BUFSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED) {
+        throw std::bad_alloc();
+    }
+    cur = buf;
+    enter = (entry_t) cur;
+    emitEnter();
+    epilogue = cur;
+    emitEpilogue();
+    start = cur;
+    codeversion = 0;
+    codesize = 0;
+    datasize = 0;
+    stacksize = 0;
+    flush();
+    // kernels refusing executable anonymous memory (PaX, SELinux execmem) stop here
+    if (!setWritable(false)) {
+        munmap(buf, JIT_BUFSIZE);
+        throw std::runtime_error("Couldn't make the JIT buffer executable");
+    }
+}
+
+VMJit::~VMJit() {
+    munmap(buf, JIT_BUFSIZE);
+}
+
+/*
+ * Drops every compiled block. Called when the address space the blocks were
+ * compiled for changes or when the buffer is full.
+ */
+void VMJit::flush(void) {
+    VMAddrSpace *as = &vm->as;
+
+    DBG_INFO(("Flushing the compiled blocks.\n"));
+    cur = start;
+    codeversion = as->getCodeVersion();
+    codesize = as->getCodesize();
+    datasize = as->getDatasize();
+    stacksize = as->getStacksize();
+    blocks.assign(codesize, NULL);
+    unlinked.clear();
+}
+
+// W^X: the buffer is never writable and executable at the same time
+bool VMJit::setWritable(bool writable) {
+    if (mprotect(buf, JIT_BUFSIZE, writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC) < 0) {
+        DBG_ERROR(("Couldn't make the JIT buffer %s.\n", writable ? "writable" : "executable"));
+        return false;
+    }
+    return true;
+}
+
+// the protection of the buffer changing under a run is not recoverable
+void VMJit::protect(bool writable) {
+    if (!setWritable(writable)) {
+        throw std::runtime_error("Couldn't change the protection of the JIT buffer");
+    }
+}
+
+void VMJit::syncIn(void) {
+    memcpy(ctx.regs, vm->regs, sizeof(ctx.regs));
+    ctx.zf = vm->flags.ZF;
+    ctx.cf = vm->flags.CF;
+    ctx.data = vm->as.getData();
+    ctx.stack = vm->as.getStack();
+    ctx.icount = vm->icount;
+    ctx.deadline = vm->deadline;
+}
+
+void VMJit::syncOut(void) {
+    memcpy(vm->regs, ctx.regs, sizeof(ctx.regs));
+    vm->flags.ZF = ctx.zf;
+    vm->flags.CF = ctx.cf;
+    vm->icount = ctx.icount;
+}
+
+/*
+EMITTERS
+*/
+void VMJit::emit8(uint8_t b) {
+    *cur++ = b;
+}
+
+void VMJit::emit16(uint16_t w) {
+    memcpy(cur, &w, sizeof(w));
+    cur += sizeof(w);
+}
+
+void VMJit::emit32(uint32_t d) {
+    memcpy(cur, &d, sizeof(d));
+    cur += sizeof(d);
+}
+
+void VMJit::emitBytes(const uint8_t *bytes, uint32_t size) {
+    memcpy(cur, bytes, size);
+    cur += size;
+}
+
+/*
+ * Operand size prefix, REX and opcode. Two bytes opcodes are passed as
+ * 0x0fXX.
+ */
+void VMJit::emitOpcode(bool word, uint32_t op, uint8_t rex) {
+    if (word) {
+        emit8(0x66);
+    }
+    if (rex != 0x40) {
+        emit8(rex);
+    }
+    if (op > 0xff) {
+        emit8(op >> 8);
+    }
+    emit8(op & 0xff);
+}
+
+/*
+ * op reg, rm with both operands in registers. For the group opcodes reg is
+ * the /digit.
+ */
+void VMJit::emitRR(bool word, uint32_t op, uint8_t reg, uint8_t rm) {
+    emitOpcode(word, op, 0x40 | (reg >> 3) << 2 | rm >> 3);
+    emit8(0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+// op reg, [base + index]; base can't be rbp / r13
+void VMJit::emitRBI(bool word, uint32_t op, uint8_t reg, uint8_t base, uint8_t index) {
+    emitOpcode(word, op, 0x40 | (reg >> 3) << 2 | (index >> 3) << 1 | base >> 3);
+    emit8(0x04 | (reg & 7) << 3);
+    emit8((index & 7) << 3 | (base & 7));
+}
+
+// op reg, [base + disp32]; base can't be rsp / r12
+void VMJit::emitRBD(bool word, uint32_t op, uint8_t reg, uint8_t base, uint32_t disp) {
+    emitOpcode(word, op, 0x40 | (reg >> 3) << 2 | base >> 3);
+    emit8(0x80 | (reg & 7) << 3 | (base & 7));
+    emit32(disp);
+}
+
+void VMJit::emitJmp(uint8_t *target) {
+    emit8(0xe9);
+    emit32((uint32_t) (target - (cur + sizeof(uint32_t))));
+}
+
+// jcc rel8 to be fixed by patchShort
+uint8_t *VMJit::emitJccShort(uint8_t cc) {
+    emit8(0x70 | cc);
+    emit8(0);
+    return cur;
+}
+
+void VMJit::patchShort(uint8_t *jcc) {
+    jcc[-1] = (uint8_t) (cur - jcc);
+}
+
+void VMJit::emitCount(uint16_t executed) {
+    if (executed) {
+        // add qword [rdi + icount], executed
+        emit8(0x48);
+        emit8(0x81);
+        emit8(0x47);
+        emit8(CTX_OFF(icount));
+        emit32(executed);
+    }
+}
+
+/*
+ * Leaves the block for a constant target: chains straight into the target
+ * block when it exists, otherwise returns the target to the dispatcher and
+ * records the exit so that link can chain it later on. Out of budget, it
+ * returns to the dispatcher before chaining.
+ */
+void VMJit::emitExit(uint32_t ip, uint16_t executed) {
+    uint8_t *skip;
+
+    emitCount(executed);
+    if (ip < codesize) {
+        // mov rax, [rdi + icount]; cmp rax, [rdi + deadline]
+        emitOpcode(false, 0x8b, 0x48);
+        emit8(0x47);
+        emit8(CTX_OFF(icount));
+        emitOpcode(false, 0x3b, 0x48);
+        emit8(0x47);
+        emit8(CTX_OFF(deadline));
+        skip = emitJccShort(CC_B);
+        emit8(0xb8);
+        emit32(ip);
+        emitJmp(epilogue);
+        patchShort(skip);
+    }
+    if (ip < codesize && blocks[ip]) {
+        emitJmp(blocks[ip]);
+        return;
+    }
+    if (ip < codesize) {
+        unlinked.push_back({(uint32_t) (cur - buf), (uint16_t) ip});
+    }
+    // mov eax, ip: same size as the jmp rel32 it gets patched to
+    emit8(0xb8);
+    emit32(ip);
+    emitJmp(epilogue);
+}
+
+// hands the instruction at ip to the interpreter
+void VMJit::emitInterpret(uint16_t ip, uint16_t executed) {
+    emitCount(executed);
+    emit8(0xb8);
+    emit32(ip | JIT_INTERPRET);
+    emitJmp(epilogue);
+}
+
+// interprets the instruction at ip if the last comparison satisfies cc
+void VMJit::emitSideExit(uint8_t cc, uint16_t ip, uint16_t executed) {
+    uint8_t *skip = emitJccShort(cc ^ 1);
+
+    emitInterpret(ip, executed);
+    patchShort(skip);
+}
+
+/*
+ * uint32_t enter(jit_ctx_t *ctx, uint8_t *block): saves the callee saved
+ * registers, loads the guest state and jumps to the block.
+ */
+void VMJit::emitEnter(void) {
+    // push rbx, rbp, r12, r13, r14, r15
+    const uint8_t pushes[] = {0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57};
+    uint8_t i;
+
+    emitBytes(pushes, sizeof(pushes));
+    // mov rax, rsi
+    emitOpcode(false, 0x89, 0x48);
+    emit8(0xf0);
+    for (i = R0; i <= S3; i++) {
+        // movzx r8d + i, word [rdi + regs[i]]
+        emitOpcode(false, 0x0fb7, 0x44);
+        emit8(0x47 | (i & 7) << 3);
+        emit8(CTX_REG(i));
+    }
+    // movzx ebp, word [rdi + regs[SP]]
+    emitOpcode(false, 0x0fb7, 0x40);
+    emit8(0x6f);
+    emit8(CTX_REG(SP));
+    // movzx edx, word [rdi + zf]: ZF in dl, CF in dh
+    emitOpcode(false, 0x0fb7, 0x40);
+    emit8(0x57);
+    emit8(CTX_OFF(zf));
+    // mov rsi, [rdi + data]
+    emitOpcode(false, 0x8b, 0x48);
+    emit8(0x77);
+    emit8(CTX_OFF(data));
+    // mov rbx, [rdi + stack]
+    emitOpcode(false, 0x8b, 0x48);
+    emit8(0x5f);
+    emit8(CTX_OFF(stack));
+    // jmp rax
+    emit8(0xff);
+    emit8(0xe0);
+}
+
+// writes the guest state back and returns eax to the dispatcher
+void VMJit::emitEpilogue(void) {
+    // pop r15, r14, r13, r12, rbp, rbx
+    const uint8_t pops[] = {0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5d, 0x5b, 0xc3};
+    uint8_t i;
+
+    for (i = R0; i <= S3; i++) {
+        // mov word [rdi + regs[i]], r8w + i
+        emitOpcode(true, 0x89, 0x44);
+        emit8(0x47 | (i & 7) << 3);
+        emit8(CTX_REG(i));
+    }
+    // mov word [rdi + regs[SP]], bp
+    emitOpcode(true, 0x89, 0x40);
+    emit8(0x6f);
+    emit8(CTX_REG(SP));
+    // mov word [rdi + zf], dx
+    emitOpcode(true, 0x89, 0x40);
+    emit8(0x57);
+    emit8(CTX_OFF(zf));
+    emitBytes(pops, sizeof(pops));
+}
+
+/*
+COMPILER
+*/
+
+/*
+ * Compiles the instruction described by rec, executed being the number of
+ * instructions of the block preceding it. Returns false if the instruction
+ * has to be left to the interpreter.
+ */
+bool VMJit::compileInstr(uint16_t ip, uint16_t executed, VM::decoded_t *rec) {
+    const uint8_t SETFLAGS[] = {0x0f, 0x94, 0xc2, 0x0f, 0x96, 0xc6};
+    uint8_t dst = HOST(rec->dst), src = HOST(rec->src), i, *taken;
+
+    switch (rec->op) {
+        case MOVI:
+            // mov dst32, imm32
+            emitOpcode(false, 0xb8 | (dst & 7), 0x41);
+            emit32(rec->imm);
+            return true;
+        case MOVR:
+            emitRR(false, 0x89, src, dst);
+            return true;
+        case LODI:
+            // movzx dst32, word [rsi + imm]
+            emitRBD(false, 0x0fb7, dst, X86_RSI, rec->imm);
+            return true;
+        case LODR:
+            if (datasize <= sizeof(uint16_t)) {
+                return false;
+            }
+            // cmp src32, datasize - 2
+            emitRR(false, 0x81, 7, src);
+            emit32(datasize - sizeof(uint16_t));
+            emitSideExit(CC_AE, ip, executed);
+            emitRBI(false, 0x0fb7, dst, X86_RSI, src);
+            return true;
+        case STRI:
+            emitRBD(true, 0x89, src, X86_RSI, rec->imm);
+            return true;
+        case STRR:
+            if (datasize <= sizeof(uint16_t)) {
+                return false;
+            }
+            emitRR(false, 0x81, 7, dst);
+            emit32(datasize - sizeof(uint16_t));
+            emitSideExit(CC_AE, ip, executed);
+            emitRBI(true, 0x89, src, X86_RSI, dst);
+            return true;
+        case ADDI:
+        case SUBI:
+        case ANDB:
+        case ANDW:
+        case YORB:
+        case YORW:
+        case XORB:
+        case XORW:
+            // op dst16, imm16 (group 1)
+            emitRR(true, 0x81, rec->op == ADDI ? 0 : rec->op == SUBI ? 5 :
+                               rec->op == ANDB || rec->op == ANDW ? 4 :
+                               rec->op == YORB || rec->op == YORW ? 1 : 6, dst);
+            emit16(rec->imm);
+            return true;
+        case ADDR:
+            emitRR(true, 0x01, src, dst);
+            return true;
+        case SUBR:
+            emitRR(true, 0x29, src, dst);
+            return true;
+        case ANDR:
+            emitRR(true, 0x21, src, dst);
+            return true;
+        case YORR:
+            emitRR(true, 0x09, src, dst);
+            return true;
+        case XORR:
+            emitRR(true, 0x31, src, dst);
+            return true;
+        case NOTR:
+            emitRR(false, 0x89, src, dst);
+            emitRR(true, 0xf7, 2, dst);
+            return true;
+        case MULI:
+            // imul dst16, dst16, imm16
+            emitRR(true, 0x69, dst, dst);
+            emit16(rec->imm);
+            return true;
+        case MULR:
+            emitRR(true, 0x0faf, dst, src);
+            return true;
+        case SHLI:
+        case SHRI:
+            if ((rec->imm & 0x1f) >= 16) {
+                // xor dst32, dst32
+                emitRR(false, 0x31, dst, dst);
+            } else {
+                // shl / shr dst16, imm8 is well defined below 16
+                emitRR(true, 0xc1, rec->op == SHLI ? 4 : 5, dst);
+                emit8(rec->imm & 0x1f);
+            }
+            return true;
+        case SHLR:
+        case SHRR:
+            // mov ecx, src32; and ecx, 0x1f; shl / shr dst32, cl; movzx dst32, dst16
+            emitRR(false, 0x89, src, X86_RCX);
+            emit8(0x83);
+            emit8(0xe1);
+            emit8(0x1f);
+            emitRR(false, 0xd3, rec->op == SHLR ? 4 : 5, dst);
+            emitRR(false, 0x0fb7, dst, dst);
+            return true;
+        case PUSH:
+            // cmp ebp, stacksize - 2
+            if (stacksize <= sizeof(uint16_t)) {
+                return false;
+            }
+            emitRR(false, 0x81, 7, X86_RBP);
+            emit32(stacksize - sizeof(uint16_t));
+            emitSideExit(CC_AE, ip, executed);
+            // mov word [rbx + rbp], dst16; add bp, 2
+            emitRBI(true, 0x89, dst, X86_RBX, X86_RBP);
+            emitRR(true, 0x83, 0, X86_RBP);
+            emit8(sizeof(uint16_t));
+            return true;
+        case POOP:
+            emitRR(false, 0x83, 7, X86_RBP);
+            emit8(sizeof(uint16_t));
+            emitSideExit(CC_B, ip, executed);
+            // sub bp, 2; movzx dst32, word [rbx + rbp]
+            emitRR(true, 0x83, 5, X86_RBP);
+            emit8(sizeof(uint16_t));
+            emitRBI(false, 0x0fb7, dst, X86_RBX, X86_RBP);
+            return true;
+        case CMPB:
+            // cmp dst8, imm8
+            emitRR(false, 0x80, 7, dst);
+            emit8(rec->imm);
+            break;
+        case CMPW:
+            emitRR(true, 0x81, 7, dst);
+            emit16(rec->imm);
+            break;
+        case CMPR:
+            emitRR(true, 0x39, src, dst);
+            break;
+        case JMPI:
+            emitExit(rec->imm, executed + 1);
+            return true;
+        case JMPR:
+            // mov eax, dst32
+            emitRR(false, 0x89, dst, X86_RAX);
+            emitCount(executed + 1);
+            emitJmp(epilogue);
+            return true;
+        case JPAI:
+        case JPAR:
+            // test edx, edx: neither ZF nor CF
+            emitRR(false, 0x85, X86_RDX, X86_RDX);
+            taken = emitJccShort(CC_E);
+            goto CONDITIONAL;
+        case JPBI:
+        case JPBR:
+            // test dh, dh
+            emit8(0x84);
+            emit8(0xf6);
+            taken = emitJccShort(CC_NE);
+            goto CONDITIONAL;
+        case JPEI:
+        case JPER:
+        case JPNI:
+        case JPNR:
+            // test dl, dl
+            emit8(0x84);
+            emit8(0xd2);
+            taken = emitJccShort(rec->op == JPEI || rec->op == JPER ? CC_NE : CC_E);
+        CONDITIONAL:
+            emitExit(rec->next, executed + 1);
+            patchShort(taken);
+            // the register jumps go to the register index, like execJPxR
+            emitExit(rec->op == JPAR || rec->op == JPBR || rec->op == JPER || rec->op == JPNR ? rec->dst : rec->imm,
+                     executed + 1);
+            return true;
+        case CALL:
+            if (stacksize <= sizeof(uint16_t)) {
+                return false;
+            }
+            emitRR(false, 0x81, 7, X86_RBP);
+            emit32(stacksize - sizeof(uint16_t));
+            emitSideExit(CC_AE, ip, executed);
+            // mov word [rdi + regs[RP]], next; mov word [rbx + rbp], next; add bp, 2
+            emitOpcode(true, 0xc7, 0x40);
+            emit8(0x47);
+            emit8(CTX_REG(RP));
+            emit16(rec->next);
+            emitOpcode(true, 0xc7, 0x40);
+            emit8(0x04);
+            emit8(0x2b);
+            emit16(rec->next);
+            emitRR(true, 0x83, 0, X86_RBP);
+            emit8(sizeof(uint16_t));
+            emitExit(rec->imm, executed + 1);
+            return true;
+        case RETN:
+            emitRR(false, 0x83, 7, X86_RBP);
+            emit8(sizeof(uint16_t));
+            emitSideExit(CC_B, ip, executed);
+            emitRR(true, 0x83, 5, X86_RBP);
+            emit8(sizeof(uint16_t));
+            // movzx eax, word [rdi + regs[RP]]
+            emitOpcode(false, 0x0fb7, 0x40);
+            emit8(0x47);
+            emit8(CTX_REG(RP));
+            emitCount(executed + 1);
+            emitJmp(epilogue);
+            return true;
+        case GRMN:
+            for (i = R0; i <= S3; i++) {
+                emitOpcode(false, 0xb8 | (HOST(i) & 7), 0x41);
+                emit32(0x4747);
+            }
+            return true;
+        case NOPE:
+            return true;
+        default:
+            return false;
+    }
+    // comparisons: sete dl; setbe dh
+    emitBytes(SETFLAGS, sizeof(SETFLAGS));
+    return true;
+}
+
+/*
+ * Compiles the basic block starting at ip. The block ends at the first jump,
+ * at the first instruction left to the interpreter or after
+ * JIT_MAX_BLOCKINSTR instructions.
+ */
+uint8_t *VMJit::compile(uint16_t ip) {
+    VM::decoded_t rec;
+    uint16_t executed;
+    uint8_t *block;
+
+    if (cur + JIT_MAX_BLOCKSIZE > buf + JIT_BUFSIZE) {
+        flush();
+    }
+    block = cur;
+    // set before compiling so that loops back to ip chain to the block itself
+    blocks[ip] = block;
+    DBG_INFO(("Compiling block at 0x%x.\n", ip));
+    for (executed = 0; ; executed++) {
+        if (executed == JIT_MAX_BLOCKINSTR) {
+            emitExit(ip, executed);
+            break;
+        }
+        if (!vm->decodeAt(ip, &rec) || !compileInstr(ip, executed, &rec)) {
+            emitInterpret(ip, executed);
+            break;
+        }
+        if (vm->INSTR[rec.op].isJump) {
+            break;
+        }
+        ip = rec.next;
+    }
+    return block;
+}
+
+// chains the exits whose target block has been compiled since
+void VMJit::link(void) {
+    uint32_t i, j;
+    uint8_t *at, *save;
+
+    save = cur;
+    for (i = 0, j = 0; i < unlinked.size(); i++) {
+        if (!blocks[unlinked[i].ip]) {
+            unlinked[j++] = unlinked[i];
+            continue;
+        }
+        at = buf + unlinked[i].at;
+        cur = at;
+        emitJmp(blocks[unlinked[i].ip]);
+    }
+    unlinked.resize(j);
+    cur = save;
+}
+
+/*
+ * Dispatcher: runs compiled blocks until one of them leaves to the
+ * interpreter, which executes a single instruction through VM::execNext.
+ */
+void VMJit::run(void) {
+    VMAddrSpace *as = &vm->as;
+    uint32_t i, ret;
+    uint16_t ip;
+
+    if (codeversion != as->getCodeVersion() || codesize != as->getCodesize() ||
+        datasize != as->getDatasize() || stacksize != as->getStacksize()) {
+        protect(true);
+        flush();
+        protect(false);
+    }
+    syncIn();
+    while (true) {
+        ip = ctx.regs[IP];
+        if (ip < codesize) {
+            if (!blocks[ip]) {
+                protect(true);
+                compile(ip);
+                /*
+                 * Every mprotect costs a few microseconds: compile what is
+                 * reachable through constant exits in the same window, as
+                 * long as that can't flush the buffer.
+                 */
+                for (i = 0; i < unlinked.size() && cur + 2 * JIT_MAX_BLOCKSIZE <= buf + JIT_BUFSIZE; i++) {
+                    if (!blocks[unlinked[i].ip]) {
+                        compile(unlinked[i].ip);
+                    }
+                }
+                link();
+                protect(false);
+            }
+            ret = enter(&ctx, blocks[ip]);
+            ctx.regs[IP] = ret & 0xffff;
+            if (!(ret & JIT_INTERPRET)) {
+                if (ctx.icount >= ctx.deadline) {
+                    syncOut();
+                    vm->preempted = true;
+                    return;
+                }
+                continue;
+            }
+        }
+        syncOut();
+        if (!vm->execNext()) {
+            return;
+        }
+        syncIn();
+    }
+}
+
+#endif
@@ -0,0 +1,117 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <stdint.h>
+#include <vector>
+#include "vm.h"
+
+#define JIT_BUFSIZE 0x400000
+// worst case room needed by a single block
+#define JIT_MAX_BLOCKSIZE 0x4000
+#define JIT_MAX_BLOCKINSTR 0x100
+// bit set in a block's return value when the instruction at IP has to be interpreted
+#define JIT_INTERPRET 0x10000
+
+/*
+ * Guest state as seen by the compiled code. While a block runs R0 -> S3 live
+ * in r8 -> r15, SP in bp and the flags in dx (ZF in dl, CF in dh).
+ */
+typedef struct jit_ctx {
+    uint16_t regs[NUM_REGS];
+    uint8_t zf;
+    uint8_t cf;
+    uint8_t *data;
+    uint8_t *stack;
+    uint64_t icount;
+    // VM::deadline: constant exits leave to the dispatcher once icount reaches it
+    uint64_t deadline;
+} jit_ctx_t;
+
+/*
+ * Baseline x86-64 compiler: translates the basic blocks found by
+ * VM::decodeAt and hands everything it does not compile (DIVx, SHIT, DEBG,
+ * failing checks...) back to VM::execNext.
+ */
+class VMJit {
+private:
+    typedef uint32_t (*entry_t)(jit_ctx_t *, uint8_t *);
+
+    // exit whose target block did not exist yet when it was emitted
+    typedef struct unlinked {
+        uint32_t at;
+        uint16_t ip;
+    } unlinked_t;
+
+    VM *vm;
+    uint8_t *buf, *cur, *start;
+    entry_t enter;
+    uint8_t *epilogue;
+    // compiled block for every code offset, NULL if not compiled yet
+    std::vector<uint8_t *> blocks;
+    std::vector<unlinked_t> unlinked;
+    // the address space the blocks were compiled for
+    uint32_t codeversion, codesize, datasize, stacksize;
+    jit_ctx_t ctx;
+
+    void flush(void);
+
+    bool setWritable(bool writable);
+
+    void protect(bool writable);
+
+    uint8_t *compile(uint16_t ip);
+
+    bool compileInstr(uint16_t ip, uint16_t executed, VM::decoded_t *rec);
+
+    void link(void);
+
+    void syncIn(void);
+
+    void syncOut(void);
+
+    /*
+    EMITTERS
+    */
+    void emit8(uint8_t b);
+
+    void emit16(uint16_t w);
+
+    void emit32(uint32_t d);
+
+    void emitBytes(const uint8_t *bytes, uint32_t size);
+
+    void emitOpcode(bool word, uint32_t op, uint8_t rex);
+
+    void emitRR(bool word, uint32_t op, uint8_t reg, uint8_t rm);
+
+    void emitRBI(bool word, uint32_t op, uint8_t reg, uint8_t base, uint8_t index);
+
+    void emitRBD(bool word, uint32_t op, uint8_t reg, uint8_t base, uint32_t disp);
+
+    void emitJmp(uint8_t *target);
+
+    uint8_t *emitJccShort(uint8_t cc);
+
+    void patchShort(uint8_t *jcc);
+
+    void emitCount(uint16_t executed);
+
+    void emitExit(uint32_t ip, uint16_t executed);
+
+    void emitInterpret(uint16_t ip, uint16_t executed);
+
+    void emitSideExit(uint8_t cc, uint16_t ip, uint16_t executed);
+
+    void emitEnter(void);
+
+    void emitEpilogue(void);
+
+public:
+    VMJit(VM *vm);
+
+    ~VMJit();
+
+    void run(void);
+};
+
+#endif
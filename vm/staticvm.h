@@ -0,0 +1,153 @@
+#ifndef STATICVM_H
+#define STATICVM_H
+
+#include "vm.h"
+#include "vmexec.h"
+
+// the opcodes KEY shuffles the instructions to, worked out by the compiler
+template<const uint8_t *KEY>
+constexpr opcode_map_t staticOpcodes(void) {
+    opcode_map_t map = {};
+
+    VMOpcodeCache::shuffle(KEY, &map);
+    return map;
+}
+
+/*
+ * A VM for an opcode key known at compile time, e.g.
+ *
+ *     static constexpr uint8_t KEY[] = "HaveFun!PoliCTF2017!";
+ *     StaticVM<KEY> vm(code, codesize);
+ *
+ * The key schedule is done by the compiler and run() dispatches with a
+ * switch over the literal bytes of the instructions, running the handlers
+ * of VM inlined. run() hides VM::run(), budget and return value included:
+ * through a VM * or a VM & the engine set with setEngine() runs instead,
+ * with the same opcodes.
+ */
+template<const uint8_t *KEY>
+class StaticVM : public VM {
+private:
+    static constexpr opcode_map_t MAP = staticOpcodes<KEY>();
+
+public:
+    StaticVM(uint8_t *code, uint32_t codesize) : VM(&MAP, code, codesize) {
+    }
+
+    uint8_t run(uint64_t budget = RUN_FOREVER);
+};
+
+template<const uint8_t *KEY>
+uint8_t StaticVM<KEY>::run(uint64_t budget) {
+// every instruction is a case on its byte for KEY
+#define STEP(_op_)                                                             \
+    case MAP.values[_op_]:                                                     \
+        STATS_NEXT(_op_, regs[IP]);                                            \
+        TRACE_NEXT(_op_, regs[IP]);                                            \
+        if (!exec##_op_()) {                                                   \
+            STATS_STOP(false);                                                 \
+            DBG_ERROR(("%s failed.\n", INSTR[_op_].name));                     \
+            return stopRun();                                                  \
+        }                                                                      \
+        STATS_STOP(true);                                                      \
+        regs[IP] += _op_##_SIZE;                                               \
+        break;
+#define JUMP(_op_)                                                             \
+    case MAP.values[_op_]:                                                     \
+        STATS_NEXT(_op_, regs[IP]);                                            \
+        TRACE_NEXT(_op_, regs[IP]);                                            \
+        if (!exec##_op_()) {                                                   \
+            STATS_STOP(false);                                                 \
+            DBG_ERROR(("%s failed.\n", INSTR[_op_].name));                     \
+            return stopRun();                                                  \
+        }                                                                      \
+        STATS_STOP(true);                                                      \
+        if (icount >= deadline) {                                              \
+            preempted = true;                                                  \
+            return stopRun();                                                  \
+        }                                                                      \
+        break;
+
+    startRun(budget);
+    for (;;) {
+        icount++;
+        if (regs[IP] >= as.getCodesize()) {
+            STATS_NEXT(NUM_OPS, regs[IP]);
+            TRACE_NEXT(NUM_OPS, regs[IP]);
+            execWAT();
+            STATS_STOP(false);
+            DBG_ERROR(("%s failed.\n", INSTR[NUM_OPS].name));
+            return stopRun();
+        }
+        switch (as.getCode()[regs[IP]]) {
+            STEP(MOVI)
+            STEP(MOVR)
+            STEP(LODI)
+            STEP(LODR)
+            STEP(STRI)
+            STEP(STRR)
+            STEP(ADDI)
+            STEP(ADDR)
+            STEP(SUBI)
+            STEP(SUBR)
+            STEP(ANDB)
+            STEP(ANDW)
+            STEP(ANDR)
+            STEP(YORB)
+            STEP(YORW)
+            STEP(YORR)
+            STEP(XORB)
+            STEP(XORW)
+            STEP(XORR)
+            STEP(NOTR)
+            STEP(MULI)
+            STEP(MULR)
+            STEP(DIVI)
+            STEP(DIVR)
+            STEP(SHLI)
+            STEP(SHLR)
+            STEP(SHRI)
+            STEP(SHRR)
+            STEP(PUSH)
+            STEP(POOP)
+            STEP(CMPB)
+            STEP(CMPW)
+            STEP(CMPR)
+            JUMP(JMPI)
+            JUMP(JMPR)
+            JUMP(JPAI)
+            JUMP(JPAR)
+            JUMP(JPBI)
+            JUMP(JPBR)
+            JUMP(JPEI)
+            JUMP(JPER)
+            JUMP(JPNI)
+            JUMP(JPNR)
+            JUMP(CALL)
+            JUMP(RETN)
+            STEP(SHIT)
+            STEP(NOPE)
+            STEP(GRMN)
+            STEP(BNKI)
+            STEP(BNKR)
+            STEP(LODF)
+            STEP(STRF)
+            STEP(RECV)
+            STEP(SEND)
+#ifdef DBG
+            STEP(DEBG)
+#endif
+            default:
+                STATS_NEXT(NUM_OPS, regs[IP]);
+                TRACE_NEXT(NUM_OPS, regs[IP]);
+                execWAT();
+                STATS_STOP(false);
+                DBG_ERROR(("%s failed.\n", INSTR[NUM_OPS].name));
+                return stopRun();
+        }
+    }
+#undef JUMP
+#undef STEP
+}
+
+#endif
@@ -1,28 +1,35 @@
 #include "vm.h"
+#include "vmexec.h"
+#include <setjmp.h>
+#include <signal.h>
 #include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <mutex>
+#include <new>
 #include <stdexcept>
 
+#ifdef JIT
+#include "jit.h"
+#endif
+
+// the key schedule only runs for keys the process hasn't seen yet
 void VM::encryptOpcodes(uint8_t *key) {
-    uint8_t arr[256];
-    uint32_t i, j, tmp, keysize;
-    keysize = strlen((char *) key);
+    opcode_map_t scratch;
+    const opcode_map_t *map;
 
     DBG_INFO(("Encrypting instructions using key: %s\n", key));
-    /*
-    RC4 KSA! :-D
-    */
-    for (i = 0; i < 256; i++) {
-        arr[i] = i;
-    }
-    j = 0;
-    for (i = 0; i < 256; i++) {
-        j = (j + arr[i] + key[i % keysize]) % 256;
-        tmp = arr[i];
-        arr[i] = arr[j];
-        arr[j] = tmp;
-    }
+    map = VMOpcodeCache::lookup(key, &scratch);
+    loadOpcodes(map);
+    return;
+}
+
+void VM::loadOpcodes(const opcode_map_t *map) {
+    uint32_t i;
+
+    memcpy(OPCODES, map->opcodes, sizeof(OPCODES));
     for (i = 0; i < NUM_OPS; i++) {
-        INSTR[i].value = arr[i];
+        INSTR[i].value = map->values[i];
     }
 #ifdef DBG
     DBG_INFO(("~~~~~~~~~~\nOPCODES:\n"));
@@ -79,6 +86,7 @@ void VM::status(void) {
       DBG_INFO(("%s:\t0x%04x\n", getRegName(i), regs[i]));
     }
     DBG_INFO(("Flags: ZF = %d, CF = %d\n", flags.ZF, flags.CF));
+    DBG_INFO(("Bank: 0x%04x\n", bank));
     DBG_SUCC(("~~~~~~~~~~\n"));
 #endif
     return;
@@ -100,944 +108,1204 @@ VM::VM(uint8_t *key, uint8_t *code, uint32_t codesize) {
     encryptOpcodes(key);
 }
 
+/*
+ * The address space lives in arena, which has to hold
+ * VMAddrSpace::arenaSize(DEFAULT_STACKSIZE, DEFAULT_CODESIZE, DEFAULT_DATASIZE)
+ * bytes aligned to SEGMENT_ALIGN and to outlive the VM.
+ */
+VM::VM(uint8_t *key, uint8_t *code, uint32_t codesize, uint8_t *arena)
+    : as(DEFAULT_STACKSIZE, DEFAULT_CODESIZE, DEFAULT_DATASIZE, arena) {
+    DBG_SUCC(("Creating VM with code in an arena.\n"));
+    as.insCode(code, codesize);
+    initVariables();
+    encryptOpcodes(key);
+}
+
+/*
+ * kind is ARENA_HEAP or ARENA_GUARDED: the decoded engine of a guarded VM
+ * leaves the bounds checks of LODR, STRR, PUSH, POOP and CALL to the guard
+ * pages.
+ */
+VM::VM(uint8_t *key, uint8_t *code, uint32_t codesize, enum arenas kind)
+    : as(DEFAULT_STACKSIZE, DEFAULT_CODESIZE, DEFAULT_DATASIZE, kind) {
+    DBG_SUCC(("Creating VM with code in a %s address space.\n", kind == ARENA_GUARDED ? "guarded" : "plain"));
+    as.insCode(code, codesize);
+    initVariables();
+    encryptOpcodes(key);
+}
+
+VM::VM(uint8_t *key, uint8_t *code, uint32_t codesize, uint32_t ss, uint16_t cs, uint16_t ds, enum arenas kind)
+    : as(ss, cs, ds, kind) {
+    DBG_SUCC(("Creating VM with code and custom segment sizes.\n"));
+    as.insCode(code, codesize);
+    initVariables();
+    encryptOpcodes(key);
+}
+
+// for VMSnapshot: the opcodes and the state are filled in by the caller
+VM::VM(uint32_t ss, uint16_t cs, uint16_t ds, int fd) : as(ss, cs, ds, fd) {
+    DBG_SUCC(("Creating VM from a snapshot.\n"));
+    initVariables();
+}
+
+// for StaticVM: the opcodes were shuffled at compile time
+VM::VM(const opcode_map_t *map, uint8_t *code, uint32_t codesize) {
+    DBG_SUCC(("Creating VM with code and static opcodes.\n"));
+    as.insCode(code, codesize);
+    initVariables();
+    loadOpcodes(map);
+}
+
+#ifdef STATS
+// the kernel's id of the calling thread, what the profiler's timer targets
+static pid_t threadId(void) {
+    static thread_local pid_t tid = syscall(SYS_gettid);
+
+    return tid;
+}
+#endif
+
+VM::~VM() {
+#ifdef JIT
+    delete jit;
+#endif
+#ifdef STATS
+    free(blocks);
+#endif
+}
+
 void VM::initVariables(void) {
     uint8_t i;
 
-    for (i = R0; i < NUM_REGS; i++) {
-        this->regs[i] = 0;
-    }
+#ifdef STATS
+    blocks = NULL;
+    runner = 0;
+#endif
+    resetState();
+    decodedversion = 0;
+    faultrec = NULL;
+    deadline = RUN_FOREVER;
+    preempted = false;
+    blocked = false;
+    for (i = 0; i < IO_CHANNELS; i++) {
+        inputs[i] = NULL;
+        outputs[i] = NULL;
+    }
+#ifdef TRACE
+    trace = NULL;
+#endif
+#ifdef JIT
+    jit = NULL;
+#endif
+#if defined(JIT) && !defined(DBG)
+    engine = ENGINE_JIT;
+#elif defined(THREADED) && !defined(DBG)
+    engine = ENGINE_DECODED;
+#else
+    // the loop engine is the only one tracing every instruction
+    engine = ENGINE_LOOP;
+#endif
     return;
 }
 
-bool VM::isRegValid(uint8_t reg) {
-    // invalid register
-    if (reg < 0 || reg > NUM_REGS) {
-        DBG_ERROR(("Unknown register: 0x%x.\n", reg));
-        return false;
-    }
-    if (reg == IP || reg == SP || reg == RP) {
-        DBG_ERROR(("Can't modify %s.\n", getRegName(reg)));
-        return false;
+// registers, flags and counters as they are in a new VM
+void VM::resetState(void) {
+    uint8_t i;
+
+    for (i = R0; i < NUM_REGS; i++) {
+        this->regs[i] = 0;
     }
-    return true;
+    flags.ZF = 0;
+    flags.CF = 0;
+    bank = 0;
+    icount = 0;
+    for (i = 0; i < NUM_FUSIONS; i++) {
+        fusions[i] = 0;
+    }
+    skipped = 0;
+#ifdef STATS
+    memset(opstats, 0, sizeof(opstats));
+    statop = NUM_OPS + 1;
+    // zeroed by allocating it again: untouched pages cost nothing
+    free(blocks);
+    blocks = (uint64_t *) calloc(0x10000, sizeof(uint64_t));
+    if (blocks == NULL) {
+        DBG_ERROR(("Couldn't allocate the block counters.\n"));
+        throw std::bad_alloc();
+    }
+    // the program starts a block
+    statjump = true;
+    statentry = false;
+#endif
+    return;
 }
 
-
 /*
-INSTRUCTIONS IMPLEMENTATION
-*/
+ * Decodes the instruction at ip the same way its execXXXX would, doing every
+ * check that only depends on the code and on the segment sizes.
+ */
+bool VM::decodeAt(uint32_t ip, decoded_t *rec) {
+    uint8_t reg, byte;
+    uint16_t imm;
 
-bool VM::execMOVI(void) {
-    /*
-    MOVI R0, 0x2400 | R0 = 0x2400
-    */
-    uint8_t dst;
-    uint16_t src;
-    if (!as.getArgs(regs[IP], &src, &dst)) {
-        return false;
-    }
-    DBG_INFO(("MOVI %s, 0x%x\n", getRegName(dst), src));
-    if (!isRegValid(dst)) {
-        return false;
+    rec->dst = 0;
+    rec->src = 0;
+    rec->imm = 0;
+    if (ip >= as.getCodesize()) {
+        rec->op = NUM_OPS;
+        rec->next = ip;
+        return false;
+    }
+    rec->op = OPCODES[as.getCode()[ip]];
+    rec->next = ip + INSTR[rec->op].length;
+    switch (rec->op) {
+        case MOVI:
+        case LODI:
+        case ADDI:
+        case SUBI:
+        case ANDW:
+        case YORW:
+        case XORW:
+        case MULI:
+        case DIVI:
+        case SHLI:
+        case SHRI:
+        case CMPW:
+            if (!as.getArgs(ip, &rec->imm, &rec->dst) || !isRegValid(rec->dst)) {
+                return false;
+            }
+            if (rec->op == LODI && rec->imm + sizeof(uint16_t) >= as.getDatasize()) {
+                return false;
+            }
+            if (rec->op == DIVI && !isDivArgValid<uint16_t>(rec->imm)) {
+                return false;
+            }
+            return true;
+        case MOVR:
+        case LODR:
+        case STRR:
+        case LODF:
+        case STRF:
+        case ADDR:
+        case SUBR:
+        case ANDR:
+        case YORR:
+        case XORR:
+        case NOTR:
+        case MULR:
+        case DIVR:
+        case SHLR:
+        case SHRR:
+        case CMPR:
+            return as.getArgs(ip, &rec->src, &rec->dst) && isRegValid(rec->src) && isRegValid(rec->dst);
+        case ANDB:
+        case YORB:
+        case XORB:
+        case CMPB:
+        case RECV:
+        case SEND:
+            if (!as.getArgs(ip, &byte, &rec->dst, 1) || !isRegValid(rec->dst)) {
+                return false;
+            }
+            rec->imm = byte;
+            return (rec->op != RECV && rec->op != SEND) || byte < IO_CHANNELS;
+        case STRI:
+            if (!as.getArgs(ip, &rec->src, &imm) || !isRegValid(imm) || !isRegValid(rec->src)) {
+                return false;
+            }
+            rec->imm = imm;
+            return imm + sizeof(uint16_t) < as.getDatasize();
+        case PUSH:
+        case POOP:
+        case BNKR:
+        case JMPR:
+        case JPAR:
+        case JPBR:
+        case JPER:
+        case JPNR:
+            if (!as.getArgs(ip, &reg) || !isRegValid(reg)) {
+                return false;
+            }
+            rec->dst = reg;
+            return true;
+        case JMPI:
+        case JPAI:
+        case JPBI:
+        case JPEI:
+        case JPNI:
+        case BNKI:
+            return as.getArgs(ip, &rec->imm);
+        case CALL:
+            return as.getArgs(ip, &rec->imm) && ip + 1 + sizeof(uint16_t) < as.getCodesize();
+        case NUM_OPS:
+            return false;
+        default:
+            return true;
     }
-    regs[dst] = src;
-    return true;
 }
 
-bool VM::execMOVR(void) {
+bool VM::execNext(void) {
+    uint8_t op = fetch();
+    instruction_t *instr_p = &INSTR[op];
+    bool ok;
+
+    icount++;
+    STATS_NEXT(op, regs[IP]);
+    TRACE_NEXT(op, regs[IP]);
     /*
-    MOVR R1, R0 -> R1 = R0
-    ---------------------
-    R1, R0 = 0x10 <- DST / SRC are nibbles!
-    */
-    uint8_t dst, src;
-    if (!as.getArgs(regs[IP], &src, &dst)) {
+     * Eye bleeding ahead
+     */
+    ok = (this->*(instr_p->exec))();
+    STATS_STOP(ok);
+    if (!ok) {
+        DBG_ERROR(("%s failed.\n", instr_p->name));
         return false;
     }
-    DBG_INFO(("MOVR %s, %s\n", getRegName(dst), getRegName(src)));
-    if (!isRegValid(src) || !isRegValid(dst)) {
+    if (!instr_p->isJump) {
+        regs[IP] += instr_p->length;
+    } else if (icount >= deadline) {
+        preempted = true;
         return false;
     }
-    regs[dst] = regs[src];
     return true;
 }
 
-bool VM::execLODI(void) {
-    /*
-    LODI R0, 0x1000 -> R0 = data[0x1000]
-    */
-    uint8_t dst;
-    uint16_t src;
-    if (!as.getArgs(regs[IP], &src, &dst)) {
-        return false;
-    }
-    DBG_INFO(("LODI %s, 0x%x\n", getRegName(dst), src));
-    if (!isRegValid(dst)) {
-        return false;
-    }
-    if (src < 0 || src + sizeof(uint16_t) >= as.getDatasize()) {
-        DBG_ERROR(("Out of bounds: trying to access to invalid data address.\n"));
-        return false;
-    }
-    regs[dst] = *((uint16_t *) &as.getData()[src]);
-    return true;
+void VM::runLoop(void) {
+    while (execNext());
 }
 
-bool VM::execLODR(void) {
-    /*
-    LODR R1, R0 -> R1 = data[R0]
-    */
-    uint8_t dst;
-    uint8_t src;
-    if (!as.getArgs(regs[IP], &src, &dst)) {
-        return false;
-    }
-    DBG_INFO(("LODR %s, %s\n", getRegName(dst), getRegName(src)));
-    if (!isRegValid(src) || !isRegValid(dst)) {
-        return false;
-    }
-    if (regs[src] < 0 || regs[src] + sizeof(uint16_t) >= as.getDatasize()) {
-        DBG_ERROR(("Out of bounds: trying to access to invalid data address.\n"));
-        return false;
-    }
-    regs[dst] = *((uint16_t *) &as.getData()[regs[src]]);
-    return true;
+#ifdef THREADED
+/*
+ * Direct threaded version of runLoop: every handler jumps straight to the
+ * next one through a computed goto (GCC / Clang labels as values) instead
+ * of returning to a shared dispatch point.
+ */
+void VM::runThreaded(void) {
+    static void *const labels[NUM_OPS + 1] = {
+            &&MOVI, &&MOVR, &&LODI, &&LODR, &&STRI, &&STRR, &&ADDI, &&ADDR,
+            &&SUBI, &&SUBR, &&ANDB, &&ANDW, &&ANDR, &&YORB, &&YORW, &&YORR,
+            &&XORB, &&XORW, &&XORR, &&NOTR, &&MULI, &&MULR, &&DIVI, &&DIVR,
+            &&SHLI, &&SHLR, &&SHRI, &&SHRR, &&PUSH, &&POOP, &&CMPB, &&CMPW,
+            &&CMPR, &&JMPI, &&JMPR, &&JPAI, &&JPAR, &&JPBI, &&JPBR, &&JPEI,
+            &&JPER, &&JPNI, &&JPNR, &&CALL, &&RETN, &&SHIT, &&NOPE, &&GRMN,
+            &&BNKI, &&BNKR, &&LODF, &&STRF, &&RECV, &&SEND,
+#ifdef DBG
+            &&DEBG,
+#endif
+            &&WAT
+    };
+    void *dispatch[0x100];
+    uint8_t *code = as.getCode();
+    uint32_t i, codesize = as.getCodesize();
+
+    for (i = 0; i < 0x100; i++) {
+        dispatch[i] = labels[OPCODES[i]];
+    }
+
+#define DISPATCH()                                                             \
+    do {                                                                       \
+        icount++;                                                              \
+        if (regs[IP] >= codesize) {                                            \
+            goto WAT;                                                          \
+        }                                                                      \
+        goto *dispatch[code[regs[IP]]];                                        \
+    } while (0)
+#define HANDLER(_op_, _jump_)                                                  \
+    _op_:                                                                      \
+    STATS_NEXT(_op_, regs[IP]);                                                \
+    TRACE_NEXT(_op_, regs[IP]);                                                \
+    if (!exec##_op_()) {                                                       \
+        STATS_STOP(false);                                                     \
+        DBG_ERROR(("%s failed.\n", INSTR[_op_].name));                         \
+        return;                                                                \
+    }                                                                          \
+    STATS_STOP(true);                                                          \
+    if (!_jump_) {                                                             \
+        regs[IP] += _op_##_SIZE;                                               \
+    } else if (icount >= deadline) {                                           \
+        preempted = true;                                                      \
+        return;                                                                \
+    }                                                                          \
+    DISPATCH();
+
+    DISPATCH();
+    HANDLER(MOVI, false)
+    HANDLER(MOVR, false)
+    HANDLER(LODI, false)
+    HANDLER(LODR, false)
+    HANDLER(STRI, false)
+    HANDLER(STRR, false)
+    HANDLER(ADDI, false)
+    HANDLER(ADDR, false)
+    HANDLER(SUBI, false)
+    HANDLER(SUBR, false)
+    HANDLER(ANDB, false)
+    HANDLER(ANDW, false)
+    HANDLER(ANDR, false)
+    HANDLER(YORB, false)
+    HANDLER(YORW, false)
+    HANDLER(YORR, false)
+    HANDLER(XORB, false)
+    HANDLER(XORW, false)
+    HANDLER(XORR, false)
+    HANDLER(NOTR, false)
+    HANDLER(MULI, false)
+    HANDLER(MULR, false)
+    HANDLER(DIVI, false)
+    HANDLER(DIVR, false)
+    HANDLER(SHLI, false)
+    HANDLER(SHLR, false)
+    HANDLER(SHRI, false)
+    HANDLER(SHRR, false)
+    HANDLER(PUSH, false)
+    HANDLER(POOP, false)
+    HANDLER(CMPB, false)
+    HANDLER(CMPW, false)
+    HANDLER(CMPR, false)
+    HANDLER(JMPI, true)
+    HANDLER(JMPR, true)
+    HANDLER(JPAI, true)
+    HANDLER(JPAR, true)
+    HANDLER(JPBI, true)
+    HANDLER(JPBR, true)
+    HANDLER(JPEI, true)
+    HANDLER(JPER, true)
+    HANDLER(JPNI, true)
+    HANDLER(JPNR, true)
+    HANDLER(CALL, true)
+    HANDLER(RETN, true)
+    HANDLER(SHIT, false)
+    HANDLER(NOPE, false)
+    HANDLER(GRMN, false)
+    HANDLER(BNKI, false)
+    HANDLER(BNKR, false)
+    HANDLER(LODF, false)
+    HANDLER(STRF, false)
+    HANDLER(RECV, false)
+    HANDLER(SEND, false)
+#ifdef DBG
+    HANDLER(DEBG, false)
+#endif
+    WAT:
+    STATS_NEXT(NUM_OPS, regs[IP]);
+    TRACE_NEXT(NUM_OPS, regs[IP]);
+    execWAT();
+    STATS_STOP(false);
+    DBG_ERROR(("%s failed.\n", INSTR[NUM_OPS].name));
+#undef HANDLER
+#undef DISPATCH
 }
 
-bool VM::execSTRI(void) {
+/*
+ * Threaded engine running the records of the pre-decode pass instead of the
+ * raw code: handlers read their operands from the record and only do the
+ * checks that depend on registers and flags. The records are rebuilt
+ * whenever insCode rewrites the code segment.
+ */
+void VM::runDecoded(void) {
+    static void *const labels[NUM_OPS + 1] = {
+            &&MOVI, &&MOVR, &&LODI, &&LODR, &&STRI, &&STRR, &&ADDI, &&ADDR,
+            &&SUBI, &&SUBR, &&ANDB, &&ANDW, &&ANDR, &&YORB, &&YORW, &&YORR,
+            &&XORB, &&XORW, &&XORR, &&NOTR, &&MULI, &&MULR, &&DIVI, &&DIVR,
+            &&SHLI, &&SHLR, &&SHRI, &&SHRR, &&PUSH, &&POOP, &&CMPB, &&CMPW,
+            &&CMPR, &&JMPI, &&JMPR, &&JPAI, &&JPAR, &&JPBI, &&JPBR, &&JPEI,
+            &&JPER, &&JPNI, &&JPNR, &&CALL, &&RETN, &&SHIT, &&NOPE, &&GRMN,
+            &&BNKI, &&BNKR, &&LODF, &&STRF, &&RECV, &&SEND,
+#ifdef DBG
+            &&DEBG,
+#endif
+            &&WAT
+    };
+    // the same for guarded address spaces, where the memory accesses check nothing
+    static void *const unchecked[NUM_OPS + 1] = {
+            &&MOVI, &&MOVR, &&LODI, &&LODR_GUARDED, &&STRI, &&STRR_GUARDED, &&ADDI, &&ADDR,
+            &&SUBI, &&SUBR, &&ANDB, &&ANDW, &&ANDR, &&YORB, &&YORW, &&YORR,
+            &&XORB, &&XORW, &&XORR, &&NOTR, &&MULI, &&MULR, &&DIVI, &&DIVR,
+            &&SHLI, &&SHLR, &&SHRI, &&SHRR, &&PUSH_GUARDED, &&POOP_GUARDED, &&CMPB, &&CMPW,
+            &&CMPR, &&JMPI, &&JMPR, &&JPAI, &&JPAR, &&JPBI, &&JPBR, &&JPEI,
+            &&JPER, &&JPNI, &&JPNR, &&CALL_GUARDED, &&RETN, &&SHIT, &&NOPE, &&GRMN,
+            &&BNKI, &&BNKR, &&LODF, &&STRF, &&RECV, &&SEND,
+#ifdef DBG
+            &&DEBG,
+#endif
+            &&WAT
+    };
+    static void *const fused[NUM_FUSIONS] = {
+            NULL, &&MOVI_ADDR_LODR, &&ADDR_LODR, &&PUSH_CHAIN, &&POOP_CHAIN
+    };
+    // indexed by the comparison and by the immediate jump
+    static void *const cmpjcc[3][4] = {
+            {&&CMPB_JPAI, &&CMPB_JPBI, &&CMPB_JPEI, &&CMPB_JPNI},
+            {&&CMPW_JPAI, &&CMPW_JPBI, &&CMPW_JPEI, &&CMPW_JPNI},
+            {&&CMPR_JPAI, &&CMPR_JPBI, &&CMPR_JPEI, &&CMPR_JPNI}
+    };
+    uint32_t i, codesize = as.getCodesize();
+    uint32_t datasize = as.getDatasize(), stacksize = as.getStacksize();
+    uint8_t *data = as.getData(), *stack = as.getStack();
+    uint8_t *gdata = as.getGuardedData(), *gstack = as.getGuardedStack();
+    uint8_t *far = as.getFar();
+    uint32_t farsize = as.getFarsize(), faraddr;
+    void *const *handlers = as.isGuarded() ? unchecked : labels;
+    uint8_t fusion, count;
+    uint16_t target, addr;
+    decoded_t *base, *rec;
+
+    if (!decoded || decoded->size() != codesize + 1 || decodedversion != as.getCodeVersion()) {
+        // forks may still be running the old records
+        if (!decoded || decoded.use_count() > 1) {
+            decoded = std::make_shared<std::vector<decoded_t>>();
+        }
+        decoded->resize(codesize + 1);
+        base = decoded->data();
+        for (i = 0; i <= codesize; i++) {
+            if (decodeAt(i, &base[i])) {
+                base[i].handler = handlers[base[i].op];
+                base[i].count = 1;
+            } else {
+                base[i].handler = i < codesize ? &&FAIL : &&WAT;
+                base[i].count = 0;
+            }
+        }
+        // stats builds time every instruction through its own handler
+        for (i = 0; i < codesize && !hasStats() && !hasTrace(); i++) {
+            fusion = fusionAt(i, &count);
+            if (fusion == NUM_FUSIONS) {
+                continue;
+            }
+            base[i].count = count;
+            if (fusion == FUSE_CMP_JCC) {
+                base[i].handler = cmpjcc[base[i].op - CMPB][(base[base[i].next].op - JPAI) / 2];
+            } else {
+                base[i].handler = fused[fusion];
+            }
+        }
+        decodedversion = as.getCodeVersion();
+    }
+    base = decoded->data();
+
+#define DISPATCH()                                                             \
+    do {                                                                       \
+        icount++;                                                              \
+        STATS_NEXT(rec->op, rec - base);                                       \
+        TRACE_NEXT(rec->op, rec - base);                                       \
+        goto *rec->handler;                                                    \
+    } while (0)
+#define NEXT()                                                                 \
+    do {                                                                       \
+        rec = &base[rec->next];                                                \
+        DISPATCH();                                                            \
+    } while (0)
+#define JUMP(_target_)                                                         \
+    do {                                                                       \
+        target = (_target_);                                                   \
+        if (target >= codesize) {                                              \
+            regs[IP] = target;                                                 \
+            icount++;                                                          \
+            STATS_NEXT(NUM_OPS, target);                                       \
+            TRACE_NEXT(NUM_OPS, target);                                       \
+            goto OUT;                                                          \
+        }                                                                      \
+        rec = &base[target];                                                   \
+        if (icount >= deadline) {                                              \
+            goto PREEMPT;                                                      \
+        }                                                                      \
+        DISPATCH();                                                            \
+    } while (0)
+#define REG(_r_) regs[rec->_r_]
+#define CHECK(_cond_)                                                          \
+    do {                                                                       \
+        if (!(_cond_)) {                                                       \
+            goto FAIL;                                                         \
+        }                                                                      \
+    } while (0)
+// superinstructions that would fail halfway run their first instruction alone
+#define CHECK_FUSED(_cond_)                                                    \
+    do {                                                                       \
+        if (!(_cond_)) {                                                       \
+            goto *labels[rec->op];                                             \
+        }                                                                      \
+    } while (0)
+/*
+ * Accesses to the guard windows: the state has to be in memory when they
+ * fault, as runGuarded picks it up from there. A faulting store writes
+ * nothing on x86, where a store touching two pages checks both first.
+ */
+#define FAULTING(_access_)                                                     \
+    do {                                                                       \
+        faultrec = rec;                                                        \
+        asm volatile("" ::: "memory");                                         \
+        _access_;                                                              \
+    } while (0)
+#define FUSED(_fusion_, _count_)                                               \
+    do {                                                                       \
+        fusions[_fusion_]++;                                                   \
+        skipped += (_count_) - 1;                                              \
+        icount += (_count_) - 1;                                               \
+    } while (0)
+#define CMP_JCC(_label_, _lhs_, _rhs_, _taken_)                                \
+    _label_:                                                                   \
+    flags.ZF = (_lhs_) == (_rhs_);                                             \
+    flags.CF = (_lhs_) <= (_rhs_);                                             \
+    FUSED(FUSE_CMP_JCC, 2);                                                    \
+    rec = &base[rec->next];                                                    \
+    JUMP(_taken_ ? rec->imm : rec->next);
+#define CMP_JCCS(_cmp_, _lhs_, _rhs_)                                          \
+    CMP_JCC(_cmp_##_JPAI, _lhs_, _rhs_, flags.CF == 0 && flags.ZF == 0)        \
+    CMP_JCC(_cmp_##_JPBI, _lhs_, _rhs_, flags.CF == 1)                         \
+    CMP_JCC(_cmp_##_JPEI, _lhs_, _rhs_, flags.ZF == 1)                         \
+    CMP_JCC(_cmp_##_JPNI, _lhs_, _rhs_, flags.ZF == 0)
+
+    // like JUMP, but a run always gets to its first jump, whatever the budget
+    if (regs[IP] >= codesize) {
+        icount++;
+        goto OUT;
+    }
+    rec = &base[regs[IP]];
+    DISPATCH();
+    MOVI:
+    REG(dst) = rec->imm;
+    NEXT();
+    MOVR:
+    REG(dst) = REG(src);
+    NEXT();
+    LODI:
+    REG(dst) = *((uint16_t *) &data[rec->imm]);
+    NEXT();
+    LODR:
+    CHECK(REG(src) + sizeof(uint16_t) < datasize);
+    REG(dst) = *((uint16_t *) &data[REG(src)]);
+    NEXT();
+    STRI:
+    *((uint16_t *) &data[rec->imm]) = REG(src);
+    as.dirtyData(rec->imm, sizeof(uint16_t));
+    NEXT();
+    STRR:
+    CHECK(REG(dst) + sizeof(uint16_t) < datasize);
+    *((uint16_t *) &data[REG(dst)]) = REG(src);
+    as.dirtyData(REG(dst), sizeof(uint16_t));
+    NEXT();
+    ADDI:
+    REG(dst) += rec->imm;
+    NEXT();
+    ADDR:
+    REG(dst) += REG(src);
+    NEXT();
+    SUBI:
+    REG(dst) -= rec->imm;
+    NEXT();
+    SUBR:
+    REG(dst) -= REG(src);
+    NEXT();
+    ANDB:
+    ANDW:
+    REG(dst) &= rec->imm;
+    NEXT();
+    ANDR:
+    REG(dst) &= REG(src);
+    NEXT();
+    YORB:
+    YORW:
+    REG(dst) |= rec->imm;
+    NEXT();
+    YORR:
+    REG(dst) |= REG(src);
+    NEXT();
+    XORB:
+    XORW:
+    REG(dst) ^= rec->imm;
+    NEXT();
+    XORR:
+    REG(dst) ^= REG(src);
+    NEXT();
+    NOTR:
+    REG(dst) = ~REG(src);
+    NEXT();
+    MULI:
+    REG(dst) *= rec->imm;
+    NEXT();
+    MULR:
+    REG(dst) *= REG(src);
+    NEXT();
+    DIVI:
+    REG(dst) /= rec->imm;
+    NEXT();
+    DIVR:
+    CHECK(isDivArgValid<uint8_t>(REG(src)));
+    REG(dst) /= REG(src);
+    NEXT();
+    SHLI:
+    REG(dst) = REG(dst) << (rec->imm & 0x1f);
+    NEXT();
+    SHLR:
+    REG(dst) = REG(dst) << (REG(src) & 0x1f);
+    NEXT();
+    SHRI:
+    REG(dst) = REG(dst) >> (rec->imm & 0x1f);
+    NEXT();
+    SHRR:
+    REG(dst) = REG(dst) >> (REG(src) & 0x1f);
+    NEXT();
+    PUSH:
+    CHECK(regs[SP] + sizeof(uint16_t) < stacksize);
+    memcpy(&stack[regs[SP]], &REG(dst), sizeof(uint16_t));
+    regs[SP] += sizeof(uint16_t);
+    as.dirtyStack(regs[SP]);
+    NEXT();
+    POOP:
+    CHECK(regs[SP] >= sizeof(uint16_t));
+    regs[SP] -= sizeof(uint16_t);
+    memcpy(&REG(dst), &stack[regs[SP]], sizeof(uint16_t));
+    NEXT();
+    CMPB:
+    flags.ZF = *((uint8_t *) &REG(dst)) == rec->imm;
+    flags.CF = *((uint8_t *) &REG(dst)) <= rec->imm;
+    NEXT();
+    CMPW:
+    flags.ZF = REG(dst) == rec->imm;
+    flags.CF = REG(dst) <= rec->imm;
+    NEXT();
+    CMPR:
+    flags.ZF = REG(dst) == REG(src);
+    flags.CF = REG(dst) <= REG(src);
+    NEXT();
+    JMPI:
+    JUMP(rec->imm);
+    JMPR:
+    JUMP(REG(dst));
+    // the conditional register jumps go to the register index, like execJPxR
+    JPAI:
+    JUMP(flags.CF == 0 && flags.ZF == 0 ? rec->imm : rec->next);
+    JPAR:
+    JUMP(flags.CF == 0 && flags.ZF == 0 ? rec->dst : rec->next);
+    JPBI:
+    JUMP(flags.CF == 1 ? rec->imm : rec->next);
+    JPBR:
+    JUMP(flags.CF == 1 ? rec->dst : rec->next);
+    JPEI:
+    JUMP(flags.ZF == 1 ? rec->imm : rec->next);
+    JPER:
+    JUMP(flags.ZF == 1 ? rec->dst : rec->next);
+    JPNI:
+    JUMP(flags.ZF == 0 ? rec->imm : rec->next);
+    JPNR:
+    JUMP(flags.ZF == 0 ? rec->dst : rec->next);
+    CALL:
+    CHECK(regs[SP] + sizeof(uint16_t) < stacksize);
+    regs[RP] = rec->next;
+    *((uint16_t *) &stack[regs[SP]]) = regs[RP];
+    regs[SP] += sizeof(uint16_t);
+    as.dirtyStack(regs[SP]);
+    JUMP(rec->imm);
+    RETN:
+    CHECK(regs[SP] >= sizeof(uint16_t));
+    regs[SP] -= sizeof(uint16_t);
+    JUMP(regs[RP]);
+    GRMN:
+    for (i = 0; i < NUM_REGS; i++) {
+        if (i != IP && i != RP && i != SP) {
+            regs[i] = 0x4747;
+        }
+    }
+    NEXT();
+    NOPE:
+    NEXT();
+    BNKI:
+    CHECK(farsize);
+    bank = rec->imm;
+    NEXT();
+    BNKR:
+    CHECK(farsize);
+    bank = REG(dst);
+    NEXT();
+    LODF:
+    faraddr = (uint32_t) bank << 16 | REG(src);
+    CHECK((uint64_t) faraddr + sizeof(uint16_t) <= farsize);
+    REG(dst) = *((uint16_t *) &far[faraddr]);
+    NEXT();
+    STRF:
+    faraddr = (uint32_t) bank << 16 | REG(dst);
+    CHECK((uint64_t) faraddr + sizeof(uint16_t) <= farsize);
+    *((uint16_t *) &far[faraddr]) = REG(src);
+    NEXT();
+    RECV:
+    CHECK(recvWord(rec->imm, &REG(dst)));
+    NEXT();
+    SEND:
+    CHECK(sendWord(rec->imm, REG(dst)));
+    NEXT();
     /*
-    STRI 0x1000, R0 -> data[0x1000] = R0
+    GUARDED
     */
-    uint16_t dst;
-    uint8_t src;
-    if (!as.getArgs(regs[IP], &src, &dst)) {
-        return false;
-    }
-    DBG_INFO(("STRI 0x%x, %s\n", dst, getRegName(src)));
-    if (!isRegValid(dst)) {
-        return false;
-    }
-    if (dst < 0 || dst + sizeof(uint16_t) >= as.getDatasize()) {
-        DBG_ERROR(("Out of bounds: trying to access to invalid data address.\n"));
-        return false;
-    }
-    *((uint16_t *) &as.getData()[dst]) = regs[src];
-    return true;
-}
-
-bool VM::execSTRR(void) {
+    LODR_GUARDED:
+    FAULTING(REG(dst) = *((uint16_t *) &gdata[REG(src)]));
+    NEXT();
+    STRR_GUARDED:
+    FAULTING(*((uint16_t *) &gdata[REG(dst)]) = REG(src));
+    as.dirtyData(REG(dst), sizeof(uint16_t));
+    NEXT();
+    PUSH_GUARDED:
+    FAULTING(memcpy(&gstack[regs[SP]], &REG(dst), sizeof(uint16_t)));
+    regs[SP] += sizeof(uint16_t);
+    as.dirtyStack(regs[SP]);
+    NEXT();
+    POOP_GUARDED:
+    // an empty stack wraps SP - 2 onto the guard pages
+    addr = regs[SP] - sizeof(uint16_t);
+    FAULTING(memcpy(&REG(dst), &gstack[addr], sizeof(uint16_t)));
+    regs[SP] = addr;
+    NEXT();
+    CALL_GUARDED:
+    FAULTING(*((uint16_t *) &gstack[regs[SP]]) = rec->next);
+    regs[RP] = rec->next;
+    regs[SP] += sizeof(uint16_t);
+    as.dirtyStack(regs[SP]);
+    JUMP(rec->imm);
     /*
-    STRR R1, R0 -> data[R1] = R0
+    SUPERINSTRUCTIONS
     */
-    uint8_t dst, src;
+    CMP_JCCS(CMPB, *((uint8_t *) &REG(dst)), rec->imm)
+    CMP_JCCS(CMPW, REG(dst), rec->imm)
+    CMP_JCCS(CMPR, REG(dst), REG(src))
+    MOVI_ADDR_LODR:
+    // MOVI x, 0; ADDR x, y; LODR z, x -> x = y; z = data[y]
+    addr = regs[base[rec->next].src];
+    CHECK_FUSED(addr + sizeof(uint16_t) < datasize);
+    REG(dst) = addr;
+    rec = &base[base[rec->next].next];
+    REG(dst) = *((uint16_t *) &data[addr]);
+    FUSED(FUSE_MOVI_ADDR_LODR, 3);
+    NEXT();
+    ADDR_LODR:
+    // ADDR x, y; LODR z, x -> x += y; z = data[x]
+    addr = REG(dst) + REG(src);
+    CHECK_FUSED(addr + sizeof(uint16_t) < datasize);
+    REG(dst) = addr;
+    rec = &base[rec->next];
+    REG(dst) = *((uint16_t *) &data[addr]);
+    FUSED(FUSE_ADDR_LODR, 2);
+    NEXT();
+    PUSH_CHAIN:
+    count = rec->count;
+    CHECK_FUSED(regs[SP] + count * sizeof(uint16_t) < stacksize);
+    for (i = 0; i < count; i++) {
+        memcpy(&stack[regs[SP]], &REG(dst), sizeof(uint16_t));
+        regs[SP] += sizeof(uint16_t);
+        rec = &base[rec->next];
+    }
+    as.dirtyStack(regs[SP]);
+    FUSED(FUSE_PUSH, count);
+    DISPATCH();
+    POOP_CHAIN:
+    count = rec->count;
+    CHECK_FUSED(regs[SP] >= count * sizeof(uint16_t));
+    for (i = 0; i < count; i++) {
+        regs[SP] -= sizeof(uint16_t);
+        memcpy(&REG(dst), &stack[regs[SP]], sizeof(uint16_t));
+        rec = &base[rec->next];
+    }
+    FUSED(FUSE_POOP, count);
+    DISPATCH();
+#ifdef DBG
+    DEBG:
+    regs[IP] = rec - base;
+    status();
+    NEXT();
+#endif
+    SHIT:
+    FAIL:
+    regs[IP] = rec - base;
+    STATS_STOP(false);
+    DBG_ERROR(("%s failed.\n", INSTR[rec->op].name));
+    return;
+    PREEMPT:
+    regs[IP] = rec - base;
+    preempted = true;
+    STATS_STOP(true);
+    return;
+    WAT:
+    regs[IP] = rec - base;
+    OUT:
+    STATS_STOP(false);
+    execWAT();
+    DBG_ERROR(("%s failed.\n", INSTR[NUM_OPS].name));
+#undef CMP_JCCS
+#undef CMP_JCC
+#undef FUSED
+#undef FAULTING
+#undef CHECK_FUSED
+#undef CHECK
+#undef REG
+#undef JUMP
+#undef NEXT
+#undef DISPATCH
+}
 
-    if (!as.getArgs(regs[IP], &src, &dst)) {
-        return false;
-    }
-    DBG_INFO(("STRR %s, %s\n", getRegName(dst), getRegName(src)));
-    if (!isRegValid(src) || !isRegValid(dst)) {
-        return false;
-    }
-    if (regs[dst] < 0 || regs[dst] + sizeof(uint16_t) >= as.getDatasize()) {
-        DBG_ERROR(("Out of bounds: trying to access to invalid data address.\n"));
-        return false;
+/*
+ * The guarded run of the current thread: faults in the guard windows of as
+ * jump back to env.
+ */
+typedef struct guard {
+    VMAddrSpace *as;
+    sigjmp_buf env;
+} guard_t;
+
+static thread_local guard_t guard;
+static struct sigaction unguarded;
+static std::once_flag guardInstalled;
+
+static void guardFault(int sig, siginfo_t *info, void *context) {
+    if (guard.as && guard.as->guards(info->si_addr)) {
+        siglongjmp(guard.env, 1);
+    }
+    // not ours: let whoever was there before deal with it
+    if (unguarded.sa_flags & SA_SIGINFO) {
+        unguarded.sa_sigaction(sig, info, context);
+    } else if (unguarded.sa_handler != SIG_DFL && unguarded.sa_handler != SIG_IGN) {
+        unguarded.sa_handler(sig);
+    } else {
+        // the access faults again once back, this time for good
+        signal(SIGSEGV, SIG_DFL);
     }
-    *((uint16_t *) &as.getData()[regs[dst]]) = regs[src];
-    return true;
 }
 
-bool VM::execADDI(void) {
-    /*
-    ADDI R0, 0x2 -> R0 += 2
-    */
-    uint8_t dst;
-    uint16_t src;
+static void installGuard(void) {
+    struct sigaction action;
 
-    if (!as.getArgs(regs[IP], &src, &dst)) {
-        return false;
-    }
-    DBG_INFO(("ADDI %s, 0x%x\n", getRegName(dst), src));
-    if (!isRegValid(dst)) {
-        return false;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = guardFault;
+    // siglongjmp doesn't restore the mask, so SIGSEGV must not be blocked
+    action.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGSEGV, &action, &unguarded)) {
+        throw std::runtime_error("Couldn't install the SIGSEGV handler");
     }
-    regs[dst] += src;
-    return true;
 }
 
-bool VM::execADDR(void) {
-    /*
-    ADDR R0, R1 -> R0 += R1
-    */
-    uint8_t dst, src;
+/*
+ * runDecoded for guarded address spaces: an access faulting on a guard page
+ * lands back here and stops the VM on its instruction, as the check it
+ * replaces would have.
+ */
+void VM::runGuarded(void) {
+    std::call_once(guardInstalled, installGuard);
+    if (sigsetjmp(guard.env, 0)) {
+        guard.as = NULL;
+        regs[IP] = faultrec - decoded->data();
+        STATS_STOP(false);
+        DBG_ERROR(("%s failed.\n", INSTR[faultrec->op].name));
+        return;
+    }
+    guard.as = &as;
+    runDecoded();
+    guard.as = NULL;
+}
 
-    if (!as.getArgs(regs[IP], &src, &dst)) {
-        return false;
+/*
+ * Looks for a superinstruction starting at ip once every record has been
+ * decoded. Returns its FUSE_XXXX kind and the number of instructions it
+ * covers, NUM_FUSIONS if the instruction at ip runs alone.
+ */
+uint8_t VM::fusionAt(uint32_t ip, uint8_t *count) {
+    uint32_t codesize = as.getCodesize();
+    decoded_t *base = decoded->data(), *rec = &base[ip], *next, *last;
+
+    if (!rec->count || rec->next >= codesize || !base[rec->next].count) {
+        return NUM_FUSIONS;
+    }
+    next = &base[rec->next];
+    *count = 2;
+    switch (rec->op) {
+        case CMPB:
+        case CMPW:
+        case CMPR:
+            if (next->op == JPAI || next->op == JPBI || next->op == JPEI || next->op == JPNI) {
+                return FUSE_CMP_JCC;
+            }
+            break;
+        case MOVI:
+            if (rec->imm != 0 || next->op != ADDR || next->dst != rec->dst || next->src == rec->dst ||
+                next->next >= codesize) {
+                break;
+            }
+            last = &base[next->next];
+            if (last->count && last->op == LODR && last->src == rec->dst) {
+                *count = 3;
+                return FUSE_MOVI_ADDR_LODR;
+            }
+            break;
+        case ADDR:
+            if (next->op == LODR && next->src == rec->dst) {
+                return FUSE_ADDR_LODR;
+            }
+            break;
+        case PUSH:
+        case POOP:
+            *count = 1;
+            while (*count < MAX_CHAIN && next->op == rec->op) {
+                (*count)++;
+                if (next->next >= codesize || !base[next->next].count) {
+                    break;
+                }
+                next = &base[next->next];
+            }
+            if (*count == 1) {
+                break;
+            }
+            return rec->op == PUSH ? FUSE_PUSH : FUSE_POOP;
+        default:
+            break;
     }
-    DBG_INFO(("ADDR %s, %s\n", getRegName(dst), getRegName(src)));
-    if (!isRegValid(src) || !isRegValid(dst)) {
-        return false;
+    return NUM_FUSIONS;
+}
+#endif
+
+#ifdef JIT
+/*
+ * Builds the JIT on the first run through it. Where the kernel doesn't let
+ * the buffer become executable, the VM goes on with the decoded engine, or
+ * the loop one without THREADED.
+ */
+void VM::startJit(void) {
+    try {
+        jit = new VMJit(this);
+    } catch (std::runtime_error &) {
+        DBG_ERROR(("No JIT on this kernel, falling back to another engine.\n"));
+#ifdef THREADED
+        engine = ENGINE_DECODED;
+#else
+        engine = ENGINE_LOOP;
+#endif
     }
-    regs[dst] += regs[src];
-    return true;
 }
 
-bool VM::execSUBI(void) {
-    /*
-    SUBI R0, 0x2 -> R0 -= 2
-    */
-    uint8_t dst;
-    uint16_t src;
+void VM::runJit(void) {
+    jit->run();
+    // the translated stores don't record what they write
+    as.dirtyData(0, as.getDatasize());
+    as.dirtyStack(as.getStacksize());
+}
+#endif
 
-    if (!as.getArgs(regs[IP], &src, &dst)) {
-        return false;
+void VM::startRun(uint64_t budget) {
+    deadline = budget > RUN_FOREVER - icount ? RUN_FOREVER : icount + budget;
+    preempted = false;
+    blocked = false;
+#ifdef STATS
+    runner = threadId();
+#endif
+}
+
+uint8_t VM::stopRun(void) {
+    deadline = RUN_FOREVER;
+#ifdef STATS
+    runner = 0;
+#endif
+    if (preempted) {
+        DBG_INFO(("Out of budget at IP 0x%x.\n", regs[IP]));
+        return STOP_BUDGET;
     }
-    DBG_INFO(("SUBI %s, 0x%x\n", getRegName(dst), src));
-    if (!isRegValid(dst)) {
-        return false;
+    if (blocked) {
+        DBG_INFO(("Waiting on a channel at IP 0x%x.\n", regs[IP]));
+        return STOP_IO;
     }
-    regs[dst] -= src;
-    return true;
+    DBG_INFO(("Finished.\n"));
+    if (fetch() == SHIT) {
+        return STOP_HALTED;
+    }
+#ifdef TRACE
+    if (trace) {
+        trace->failed();
+    }
+#endif
+    return STOP_ERROR;
 }
 
-bool VM::execSUBR(void) {
-    /*
-    SUBR R0, R1 -> R0 -= R1
-    */
-    uint8_t dst, src;
-
-    if (!as.getArgs(regs[IP], &src, &dst)) {
-        return false;
+/*
+ * Runs the program until it stops by itself or, once budget instructions
+ * have run, until the next jump: the budget is only checked at jumps, so a
+ * run can go past it by a stretch of straight code. Returns STOP_HALTED if
+ * it stopped on SHIT, STOP_ERROR on any other failing instruction,
+ * STOP_BUDGET if the budget ran out and STOP_IO if it has to wait for the
+ * host to feed or drain a channel. The next run() resumes from there in the
+ * last two cases.
+ */
+uint8_t VM::run(uint64_t budget) {
+    startRun(budget);
+#ifdef JIT
+    if (engine == ENGINE_JIT && !jit) {
+        startJit();
     }
-    DBG_INFO(("SUBR %s, %s\n", getRegName(dst), getRegName(src)));
-    if (!isRegValid(src) || !isRegValid(dst)) {
-        return false;
+#endif
+    switch (engine) {
+#ifdef THREADED
+        case ENGINE_THREADED:
+            runThreaded();
+            break;
+        case ENGINE_DECODED:
+            if (as.isGuarded()) {
+                runGuarded();
+            } else {
+                runDecoded();
+            }
+            break;
+#endif
+#ifdef JIT
+        case ENGINE_JIT:
+            runJit();
+            break;
+#endif
+        default:
+            runLoop();
+            break;
     }
-    regs[dst] -= regs[src];
-    return true;
+    return stopRun();
 }
 
-bool VM::execANDB(void) {
-    /*
-    ANDB R0, 0x2 -> R0 &= 0x02 or R0 &= [BYTE] 0x02 (low byte)
-    */
-    uint8_t dst, src;
+// runs exactly count instructions, or less if the program stops, through the loop engine
+uint8_t VM::step(uint64_t count) {
+    uint64_t end = count > RUN_FOREVER - icount ? RUN_FOREVER : icount + count;
 
-    if (!as.getArgs(regs[IP], &src, &dst, 1)) {
-        return false;
-    }
-    DBG_INFO(("ANDB %s, 0x%x\n", getRegName(dst), src));
-    if (!isRegValid(dst)) {
-        return false;
+    // no deadline: the count is checked after every instruction instead
+    startRun(RUN_FOREVER);
+    while (icount < end) {
+        if (!execNext()) {
+            return stopRun();
+        }
     }
-    regs[dst] &= src;
-    return true;
+    preempted = true;
+    return stopRun();
 }
 
-bool VM::execANDW(void) {
-    /*
-    ANDW R0, 0x2 -> R0 &= 0x0002 or R0, ^= [WORD] 0x2
-    */
-    uint8_t dst;
-    uint16_t src;
 
-    if (!as.getArgs(regs[IP], &src, &dst)) {
-        return false;
-    }
-    DBG_INFO(("ANDW %s, 0x%x\n", getRegName(dst), src));
-    if (!isRegValid(dst)) {
-        return false;
+/*
+ * Brings the VM back to how it was after construction, without going through
+ * the key schedule and the allocations again: registers, flags and counters
+ * are cleared and only the bytes written to data and stack are zeroed. The
+ * code segment, the engine and its translations are kept. What the caller
+ * lent is forgotten, so that a pooled VM never reaches its previous user's
+ * memory: borrowed code gives way to the VM's own code segment again, the
+ * far memory is taken away and the channels are detached.
+ */
+void VM::reset(void) {
+    uint8_t i;
+
+    resetState();
+    as.clean();
+    as.returnCode();
+    as.borrowFar(NULL, 0);
+    for (i = 0; i < IO_CHANNELS; i++) {
+        inputs[i] = NULL;
+        outputs[i] = NULL;
     }
-    regs[dst] &= src;
-    return true;
 }
 
-bool VM::execANDR(void) {
-    /*
-    ANDR R0, R1 -> R0 ^= R1
-    */
-    uint8_t dst, src;
+bool VM::hasEngine(uint8_t e) {
+    switch (e) {
+        case ENGINE_LOOP:
+            return true;
+#ifdef THREADED
+        case ENGINE_THREADED:
+        case ENGINE_DECODED:
+            return true;
+#endif
+#ifdef JIT
+        case ENGINE_JIT:
+            return true;
+#endif
+        default:
+            return false;
+    }
+}
 
-    if (!as.getArgs(regs[IP], &src, &dst)) {
-        return false;
+void VM::setEngine(uint8_t e) {
+    if (e >= NUM_ENGINES) {
+        throw std::invalid_argument("Invalid engine");
     }
-    DBG_INFO(("ANDR %s, %s\n", getRegName(dst), getRegName(src)));
-    if (!isRegValid(src) || !isRegValid(dst)) {
-        return false;
+    if (!hasEngine(e)) {
+        throw std::invalid_argument("Engine not compiled in");
     }
-    regs[dst] &= regs[src];
-    return true;
+    engine = e;
 }
 
-bool VM::execYORB(void) {
-    /*
-    YORB R0, 0x2 -> R0 |= 0x02 or R0 |= [BYTE] 0x02 (low byte)
-    */
-    uint8_t dst, src;
+bool VM::hasStats(void) {
+#ifdef STATS
+    return true;
+#else
+    return false;
+#endif
+}
 
-    if (!as.getArgs(regs[IP], &src, &dst, 1)) {
-        return false;
-    }
-    DBG_INFO(("YORB %s, 0x%x\n", getRegName(dst), src));
-    if (!isRegValid(dst)) {
-        return false;
-    }
-    regs[dst] |= src;
+bool VM::hasTrace(void) {
+#ifdef TRACE
     return true;
+#else
+    return false;
+#endif
 }
 
-bool VM::execYORW(void) {
-    /*
-    YORW R0, 0x2 -> R0 |= 0x0002 or R0, |= [WORD] 0x2
-    */
-    uint8_t dst;
-    uint16_t src;
+VMAddrSpace *VM::addressSpace() {
+    return &as;
+}
 
-    if (!as.getArgs(regs[IP], &src, &dst)) {
-        return false;
-    }
-    DBG_INFO(("YORW %s, 0x%x\n", getRegName(dst), src));
-    if (!isRegValid(dst)) {
-        return false;
-    }
-    regs[dst] |= src;
-    return true;
+uint64_t VM::executed(void) {
+    return icount;
 }
 
-bool VM::execYORR(void) {
-    /*
-    YORR R0, R1 -> R0 |= R1
-    */
-    uint8_t dst;
-    uint8_t src;
+// instructions run through their own dispatch, not as part of a superinstruction
+uint64_t VM::dispatched(void) {
+    return icount - skipped;
+}
 
-    if (!as.getArgs(regs[IP], &src, &dst)) {
-        return false;
-    }
-    DBG_INFO(("YORR %s, %s\n", getRegName(dst), getRegName(src)));
-    if (!isRegValid(src) || !isRegValid(dst)) {
-        return false;
+uint64_t VM::fired(uint8_t fusion) {
+    if (fusion >= NUM_FUSIONS) {
+        throw std::invalid_argument("Invalid fusion");
     }
-    regs[dst] |= regs[src];
-    return true;
+    return fusions[fusion];
 }
 
-bool VM::execXORB(void) {
-    /*
-    XORB R0, 0x2 -> R0 ^= 0x02 or R0 ^= [BYTE] 0x02 (low byte)
-    */
-    uint8_t dst, src;
-
-    if (!as.getArgs(regs[IP], &src, &dst, 1)) {
-        return false;
-    }
-    DBG_INFO(("XORB %s, 0x%x\n", getRegName(dst), src));
-    if (!isRegValid(dst)) {
-        return false;
-    }
-    regs[dst] ^= src;
-    return true;
-}
-
-bool VM::execXORW(void) {
-    /*
-    XORW R0, 0x2 -> R0 ^= 0x0002 or R0, ^= [WORD] 0x2
-    */
-    uint8_t dst;
-    uint16_t src;
-
-    if (!as.getArgs(regs[IP], &src, &dst)) {
-        return false;
-    }
-    DBG_INFO(("XORW %s, 0x%x\n", getRegName(dst), src));
-    if (!isRegValid(dst)) {
-        return false;
-    }
-    regs[dst] ^= src;
-    return true;
-}
-
-bool VM::execXORR(void) {
-    /*
-    XORR R0, R1 -> R0 ^= R1
-    */
-    uint8_t dst, src;
-
-    if (!as.getArgs(regs[IP], &src, &dst)) {
-        return false;
-    }
-    DBG_INFO(("XORR %s, %s\n", getRegName(dst), getRegName(src)));
-    if (!isRegValid(src) || !isRegValid(dst)) {
-        return false;
-    }
-    regs[dst] ^= regs[src];
-    return true;
-}
-
-bool VM::execNOTR(void) {
-    /*
-    NOTR R0, R1 -> R0 = ~R1
-    */
-    uint8_t dst, src;
-
-    if (!as.getArgs(regs[IP], &src, &dst)) {
-        return false;
-    }
-    DBG_INFO(("NOTR %s, %s\n", getRegName(dst), getRegName(src)));
-    if (!isRegValid(src) || !isRegValid(dst)) {
-        return false;
-    }
-    regs[dst] = ~regs[src];
-    return true;
-}
-
-bool VM::execMULI(void) {
-    /*
-    MULI R0, 0x2 | R0 *= 2
-    */
-    uint8_t dst;
-    uint16_t src;
-
-    if (!as.getArgs(regs[IP], &src, &dst)) {
-        return false;
-    }
-    DBG_INFO(("MULI %s, 0x%x\n", getRegName(dst), src));
-    if (!isRegValid(dst)) {
-        return false;
-    }
-    regs[dst] *= src;
-    return true;
-}
-
-bool VM::execMULR(void) {
-    /*
-    MULR R0, R1 -> R0 *= R1
-    */
-    uint8_t dst, src;
-
-    if (!as.getArgs(regs[IP], &src, &dst)) {
-        return false;
-    }
-    DBG_INFO(("MULR %s, %s\n", getRegName(dst), getRegName(src)));
-    if (!isRegValid(src) || !isRegValid(dst)) {
-        return false;
-    }
-    regs[dst] *= regs[src];
-    return true;
-}
-
-bool VM::execDIVI(void) {
-    /*
-    DIVI R0, 0x2 | R0 /= 2
-    */
-    uint8_t dst;
-    uint16_t src;
-
-    if (!as.getArgs(regs[IP], &src, &dst)) {
-        return false;
-    }
-    DBG_INFO(("DIVI %s, 0x%x\n", getRegName(dst), src));
-    if (!isRegValid(dst) || !isDivArgValid<uint16_t>(src)) {
-        return false;
-    }
-    regs[dst] /= src;
-    return true;
-}
-
-bool VM::execDIVR(void) {
-    /*
-    DIVR R0, R1 -> R0 /= R1
-    */
-    uint8_t dst, src;
-
-    if (!as.getArgs(regs[IP], &src, &dst)) {
-        return false;
-    }
-    DBG_INFO(("DIVR %s, %s\n", getRegName(dst), getRegName(src)));
-    if (!isRegValid(src) || !isRegValid(dst) || !isDivArgValid<uint8_t>(regs[src])) {
-        return false;
-    }
-    regs[dst] /= regs[src];
-    return true;
-}
-
-bool VM::execSHLI(void) {
-    /*
-    SHLI R0, 0x2 | R0 << 2
-    */
-    uint8_t dst;
-    uint16_t src;
-
-    if (!as.getArgs(regs[IP], &src, &dst)) {
-        return false;
-    }
-    DBG_INFO(("SHLI %s, 0x%x\n", getRegName(dst), src));
-    if (!isRegValid(dst)) {
-        return false;
-    }
-    regs[dst] = regs[dst] << src;
-    return true;
-}
-
-bool VM::execSHLR(void) {
-    /*
-    SHLR R0, R1 -> R0 << R1
-    */
-    uint8_t dst, src;
-
-    if (!as.getArgs(regs[IP], &src, &dst)) {
-        return false;
-    }
-    DBG_INFO(("SHLR %s, %s\n", getRegName(dst), getRegName(src)));
-    if (!isRegValid(src) || !isRegValid(dst)) {
-        return false;
-    }
-    regs[dst] = regs[dst] << regs[src];
-    return true;
-}
-
-bool VM::execSHRI(void) {
-    /*
-    SHRI R0, 0x2 | R0 >> 2
-    */
-    uint8_t dst;
-    uint16_t src;
-
-    if (!as.getArgs(regs[IP], &src, &dst)) {
-        return false;
-    }
-    DBG_INFO(("SHRI %s, 0x%x\n", getRegName(dst), src));
-    if (!isRegValid(dst)) {
-        return false;
-    }
-    regs[dst] = regs[dst] >> src;
-    return true;
-}
-
-bool VM::execSHRR(void) {
-    /*
-    SHRR R0, R1 -> R0 >> R1
-    */
-    uint8_t dst, src;
-
-    if (!as.getArgs(regs[IP], &src, &dst)) {
-        return false;
-    }
-    DBG_INFO(("SHRR %s, %s\n", getRegName(dst), getRegName(src)));
-    if (!isRegValid(src) || !isRegValid(dst)) {
-        return false;
-    }
-    regs[dst] = regs[dst] >> regs[src];
-    return true;
-}
-
-bool VM::execPUSH(void) {
-    uint8_t reg;
-
-    if (!as.getArgs(regs[IP], &reg)) {
-        return false;
-    }
-    DBG_INFO(("PUSH %s\n", getRegName(reg)));
-    if (!isRegValid(reg)) {
-        return false;
-    }
-    if (regs[SP] + sizeof(uint16_t) >= as.getStacksize()) {
-        DBG_ERROR(("Out of bounds: stack is going over the stack size!\n"));
-        return false;
-    }
-    memcpy(&as.getStack()[regs[SP]], &regs[reg], sizeof(uint16_t));
-    regs[SP] += sizeof(uint16_t);
-    return true;
-}
-
-bool VM::execPOOP(void) {
-    uint8_t reg;
-
-    if (!as.getArgs(regs[IP], &reg)) {
-        return false;
-    }
-    DBG_INFO(("POOP %s\n", getRegName(reg)));
-    if (!isRegValid(reg)) {
-        return false;
-    }
-    if (regs[SP] - sizeof(uint16_t) < 0) {
-        DBG_ERROR(("Out of bounds: stack is going below 0!\n"));
-        return false;
-    }
-    regs[SP] -= sizeof(uint16_t);
-    memcpy(&regs[reg], &as.getStack()[regs[SP]], sizeof(uint16_t));
-    return true;
-}
-
-bool VM::execCMPB(void) {
-    /*
-    CMPB R0, 0x2 -> Compare immediate with lower half (BYTE) register
-    */
-    uint8_t dst, src;
-
-    if (!as.getArgs(regs[IP], &src, &dst, 1)) {
-        return false;
-    }
-    DBG_INFO(("CMPB %s, 0x%x\n", getRegName(dst), src));
-    if (!isRegValid(dst)) {
-        return false;
-    }
-    if (*((uint8_t *) &regs[dst]) == src) {
-        flags.ZF = 1;
-    } else {
-        flags.ZF = 0;
-    }
-    if (*((uint8_t *) &regs[dst]) > src) {
-        flags.CF = 0;
-    } else {
-        flags.CF = 1;
-    }
-    return true;
-}
-
-bool VM::execCMPW(void) {
-    /*
-    CMPW R0, 0x2 -> Compare immediate with whole (WORD) register
-    */
-    uint8_t dst;
-    uint16_t src;
-
-    if (!as.getArgs(regs[IP], &src, &dst)) {
-        return false;
-    }
-    DBG_INFO(("CMPW %s, 0x%x\n", getRegName(dst), src));
-    if (!isRegValid(dst)) {
-        return false;
-    }
-    if (regs[dst] == src) {
-        flags.ZF = 1;
-    } else {
-        flags.ZF = 0;
-    }
-    if (regs[dst] > src) {
-        flags.CF = 0;
-    } else {
-        flags.CF = 1;
-    }
-    return true;
-}
-
-bool VM::execCMPR(void) {
-    /*
-    CMPR R0, R1 -> Compares 2 registers
-    */
-    uint8_t dst;
-    uint8_t src;
-
-    if (!as.getArgs(regs[IP], &src, &dst)) {
-        return false;
-    }
-    DBG_INFO(("CMPR %s, %s\n", getRegName(dst), getRegName(src)));
-    if (!isRegValid(dst) || !isRegValid(src)) {
-        return false;
-    }
-    if (regs[dst] == regs[src]) {
-        flags.ZF = 1;
-    } else {
-        flags.ZF = 0;
-    }
-    if (regs[dst] > regs[src]) {
-        flags.CF = 0;
-    } else {
-        flags.CF = 1;
-    }
-    return true;
-}
-
-bool VM::execJMPI(void) {
-    /*
-    JMPI 0x2000 -> IP = 0x2000
-    */
-    uint16_t imm;
-
-    if (!as.getArgs(regs[IP], &imm)) {
-        return false;
-    }
-    DBG_INFO(("JMPI 0x%x\n", imm));
-    regs[IP] = imm;
-    return true;
-}
-
-bool VM::execJMPR(void) {
-    /*
-    JMPR R0 -> IP = R0
-    */
-    uint8_t reg;
-
-    if (!as.getArgs(regs[IP], &reg)) {
-        return false;
-    }
-    DBG_INFO(("JMPR %s = 0x%x\n", getRegName(reg), regs[reg]));
-    if (!isRegValid(reg)) {
-        return false;
-    }
-    regs[IP] = regs[reg];
-    return true;
-}
-
-bool VM::execJPAI(void) {
-    /*
-    JPAI 0x2000 -> Jump to 0x2000 if above
-    */
-    uint16_t imm;
-
-    if (!as.getArgs(regs[IP], &imm)) {
-        return false;
-    }
-    DBG_INFO(("JPAI 0x%x\n", imm));
-    if (flags.CF == 0 && flags.ZF == 0) {
-        regs[IP] = imm;
-    } else {
-        regs[IP] += JPAI_SIZE;
-    }
-    return true;
-}
-
-bool VM::execJPAR(void) {
-    /*
-    JPAR R0 -> Jump to [R0] if above
-    */
-    uint8_t reg;
-
-    if (!as.getArgs(regs[IP], &reg)) {
-        return false;
-    }
-    DBG_INFO(("JPAR %s = 0x%x\n", getRegName(reg), regs[reg]));
-    if (!isRegValid(reg)) {
-        return false;
-    }
-    if (flags.CF == 0 && flags.ZF == 0) {
-        regs[IP] = reg;
-    } else {
-        regs[IP] += JPAR_SIZE;
-    }
-    return true;
-}
-
-bool VM::execJPBI(void) {
-    /*
-    JPBI 0x2000 -> Jump to 0x2000 if below
-    */
-    uint16_t imm;
-
-    if (!as.getArgs(regs[IP], &imm)) {
-        return false;
-    }
-    DBG_INFO(("JPBI 0x%x\n", imm));
-    if (flags.CF == 1) {
-        regs[IP] = imm;
-    } else {
-        regs[IP] += JPBI_SIZE;
-    }
-    return true;
-}
-
-bool VM::execJPBR(void) {
-    /*
-    JPBR R0 -> Jump to [R0] if below
-    */
-    uint8_t reg;
-
-    if (!as.getArgs(regs[IP], &reg)) {
-        return false;
-    }
-    DBG_INFO(("JPBR %s = 0x%x\n", getRegName(reg), regs[reg]));
-    if (!isRegValid(reg)) {
-        return false;
-    }
-    if (flags.CF == 1) {
-        regs[IP] = reg;
-    } else {
-        regs[IP] += JPBR_SIZE;
-    }
-    return true;
-}
-
-bool VM::execJPEI(void) {
-    /*
-    JPEI 0x2000 -> Jump to 0x2000 if equal
-    */
-    uint16_t imm;
-
-    if (!as.getArgs(regs[IP], &imm)) {
-        return false;
-    }
-    DBG_INFO(("JPEI 0x%x\n", imm));
-    if (flags.ZF == 1) {
-        regs[IP] = imm;
-    } else {
-        regs[IP] += JPEI_SIZE;
-    }
-    return true;
-}
-
-bool VM::execJPER(void) {
-    /*
-    JPNR R0 -> Jump to [R0] if equal
-    */
-    uint8_t reg;
-
-    if (!as.getArgs(regs[IP], &reg)) {
-        return false;
-    }
-    DBG_INFO(("JPER %s = 0x%x\n", getRegName(reg), regs[reg]));
-    if (!isRegValid(reg)) {
-        return false;
-    }
-    if (flags.ZF == 1) {
-        regs[IP] = reg;
-    } else {
-        regs[IP] += JPER_SIZE;
-    }
-    return true;
-}
-
-bool VM::execJPNI(void) {
-    /*
-    JPEI 0x2000 -> Jump to 0x2000 if not equal
-    */
-    uint16_t imm;
-
-    if (!as.getArgs(regs[IP], &imm)) {
-        return false;
-    }
-    DBG_INFO(("JPNI 0x%x\n", imm));
-    if (flags.ZF == 0) {
-        regs[IP] = imm;
-    } else {
-        regs[IP] += JPNI_SIZE;
-    }
-    return true;
-}
-
-bool VM::execJPNR(void) {
-    /*
-    JPER R0 -> Jump to [R0] if not equal
-    */
-    uint8_t reg;
-
-    if (!as.getArgs(regs[IP], &reg)) {
-        return false;
-    }
-    DBG_INFO(("JPNR %s = 0x%x\n", getRegName(reg), regs[reg]));
-    if (!isRegValid(reg)) {
-        return false;
-    }
-    if (flags.ZF == 0) {
-        regs[IP] = reg;
-    } else {
-        regs[IP] += JPNR_SIZE;
-    }
-    return true;
-}
-
-bool VM::execCALL(void) {
-    /*
-    CALL 0x1000 -> Jump to data[0x1000] and saves the RP onto the stack
-    */
-    uint16_t dst;
-
-    if (!as.getArgs(regs[IP], &dst)) {
-        return false;
-    }
-    DBG_INFO(("CALL 0x%x\n", dst));
-    if (regs[SP] + sizeof(uint16_t) >= as.getStacksize()) {
-        DBG_ERROR(("Out of bounds: stack is going over the stack size!\n"));
-        return false;
-    }
-    if (regs[IP] + 1 + sizeof(dst) >= as.getCodesize()) {
-        DBG_ERROR(("Out of bounds: trying to read over codesize.\n"));
-        return false;
-    }
-    regs[RP] = regs[IP] + 1 + sizeof(dst);
-    *((uint16_t *) &as.getStack()[regs[SP]]) = regs[RP];
-    regs[SP] += sizeof(uint16_t);
-    regs[IP] = dst;
-    return true;
-}
-
-bool VM::execRETN(void) {
-    /*
-    RETN -> IP = RP , restores saved return IP
-    */
-    if (regs[SP] - sizeof(uint16_t) < 0) {
-        DBG_ERROR(("Out of bounds: stack is going below 0!\n"));
-        return false;
-    }
-    regs[SP] -= sizeof(uint16_t);
-    DBG_INFO(("RETN 0x%x\n", regs[RP]));
-    regs[IP] = regs[RP];
-    return true;
+// one entry per INSTR entry, WAT? last, or NULL if stats are not compiled in
+const opstats_t *VM::stats(void) {
+#ifdef STATS
+    return opstats;
+#else
+    return NULL;
+#endif
 }
 
-bool VM::execGRMN(void) {
+// the stats of the instructions that ran, as a JSON object
+void VM::dumpStats(FILE *out) {
+#ifdef STATS
+    bool first = true;
     uint8_t i;
-    for (i = 0; i < NUM_REGS; i++) {
-        if (i != IP && i != RP && i != SP) {
-            regs[i] = 0x4747;
-        }
-    }
-    return true;
-}
 
-bool VM::execSHIT(void) {
-    DBG_INFO(("SHIT\n"));
-    return false;
-}
-
-bool VM::execNOPE(void) {
-    return true;
-}
-
-bool VM::execDEBG(void) {
-    status();
-    return true;
-}
-
-void VM::run(void) {
-    uint8_t next_instr, i;
-    instruction_t *instr_p = NULL;
-    bool success;
-    bool finished = false;
-    while (!finished) {
-        next_instr = (uint8_t) as.getCode()[regs[IP]];
-
-        // getting pointer to correct instruction_t
-        for (i = 0; i < NUM_OPS; i++) {
-            if (next_instr == INSTR[i].value) {
-                instr_p = &INSTR[i];
-            }
+    fprintf(out, "{\"clock\": \"%s\", \"executed\": %lu, \"instructions\": [", STATS_CLOCK,
+            (unsigned long) icount);
+    for (i = 0; i <= NUM_OPS; i++) {
+        if (!opstats[i].count) {
+            continue;
         }
+        fprintf(out, "%s\n  {\"name\": \"%s\", \"count\": %lu, \"cycles\": %lu, \"failures\": %lu}",
+                first ? "" : ",", INSTR[i].name, (unsigned long) opstats[i].count,
+                (unsigned long) opstats[i].cycles, (unsigned long) opstats[i].failures);
+        first = false;
+    }
+    fprintf(out, "\n]}\n");
+#else
+    throw std::runtime_error("Stats not compiled in");
+#endif
+}
 
-        if (instr_p == NULL) {
-            DBG_ERROR(("WAT: 0x%x", next_instr));
-            finished = true;
-        } else {
-            /*
-             * Eye bleeding ahead
-             */
-            success = (this->*(instr_p->exec))();
-
-            if (!success) {
-                DBG_ERROR(("%s failed.\n", instr_p->name));
-                finished = true;
-            } else {
-                if (!instr_p->isJump) {
-                    regs[IP] += instr_p->length;
-                }
-            }
-        }
-    }
-    DBG_INFO(("Finished.\n"));
-    return;
+// how many times a block started at ip, 0 if stats are not compiled in
+uint64_t VM::entries(uint16_t ip) {
+#ifdef STATS
+    return blocks[ip];
+#else
+    return 0;
+#endif
 }
 
-VMAddrSpace *VM::addressSpace() {
-    return &as;
+flags_t VM::getFlags(void) {
+    return flags;
 }
 
 uint16_t VM::reg(uint8_t reg) {
@@ -1046,3 +1314,21 @@ uint16_t VM::reg(uint8_t reg) {
     }
     return regs[reg];
 }
+
+uint16_t VM::getBank(void) {
+    return bank;
+}
+
+/*
+ * RECV reads from input and SEND writes to output on chan, either of them can
+ * be NULL. The VM is their only consumer and producer respectively until they
+ * are detached, by attaching others or by reset(); the host keeps them alive
+ * until then.
+ */
+void VM::attach(uint8_t chan, VMChannel *input, VMChannel *output) {
+    if (chan >= IO_CHANNELS) {
+        throw std::invalid_argument("Invalid channel");
+    }
+    inputs[chan] = input;
+    outputs[chan] = output;
+}
@@ -2,19 +2,91 @@
 #define VM_H
 
 #include "vmas.h"
+#include "vmchannel.h"
+#include "vmopcodecache.h"
+#include "vmstats.h"
+#include "vmtrace.h"
 #include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <atomic>
+#include <memory>
+#include <vector>
 #include "instruction.h"
 
 
 enum regs {
     R0, R1, R2, R3, S0, S1, S2, S3, IP, RP, SP, NUM_REGS
 };
+enum engines {
+    ENGINE_LOOP, ENGINE_THREADED, ENGINE_DECODED, ENGINE_JIT, NUM_ENGINES
+};
+// why run() and step() returned
+enum stops {
+    STOP_HALTED, STOP_ERROR, STOP_BUDGET, STOP_IO
+};
+// budget of a run() going on until the program stops by itself
+#define RUN_FOREVER UINT64_MAX
+// longest PUSH / POOP chain run by a single superinstruction
+#define MAX_CHAIN 8
+// superinstructions of the decoded engine
+enum fusions {
+    FUSE_CMP_JCC, FUSE_MOVI_ADDR_LODR, FUSE_ADDR_LODR, FUSE_PUSH, FUSE_POOP, NUM_FUSIONS
+};
 typedef struct flags {
     uint8_t ZF : 1;
     uint8_t CF : 1;
 } flags_t;
+// what is left of a VM once its job is done
+typedef struct vm_state {
+    uint16_t regs[NUM_REGS];
+    flags_t flags;
+    uint64_t executed;
+} vm_state_t;
+// what STATS builds keep for every INSTR entry
+typedef struct opstats {
+    // times it ran, failures included
+    uint64_t count;
+    // time spent in it, in STATS_CLOCK units
+    uint64_t cycles;
+    // times it stopped the VM with STOP_ERROR
+    uint64_t failures;
+} opstats_t;
+
+#if defined(JIT) && defined(STATS)
+#error "The JIT doesn't keep stats"
+#endif
+
+#if defined(JIT) && defined(TRACE)
+#error "The JIT doesn't trace"
+#endif
+
+#ifdef JIT
+class VMJit;
+#endif
+
+template<uint8_t LANES>
+class VMLockstep;
+
+template<const uint8_t *KEY>
+class StaticVM;
+
+class VMProfiler;
 
 class VM {
+    friend class VMBatch;
+    friend class VMProfiler;
+    friend class VMSnapshot;
+    friend class VMTrace;
+
+    template<uint8_t LANES>
+    friend class VMLockstep;
+
+    template<const uint8_t *KEY>
+    friend class StaticVM;
+#ifdef JIT
+    friend class VMJit;
+#endif
 private:
     typedef bool (VM::*FuncPointer)(void);
 
@@ -26,11 +98,87 @@ private:
         bool isJump;
     } instruction_t;
 
+    /*
+     * An instruction as found by the pre-decode pass: operands are already
+     * split and every check that does not depend on the VM state has been
+     * done. Records that can only fail point handler to a failing label.
+     * Superinstructions keep the operands of their first instruction and
+     * read the others from the records that follow it.
+     */
+    typedef struct decoded {
+        const void *handler;
+        uint16_t imm;
+        uint16_t next;
+        uint8_t op;
+        uint8_t dst;
+        uint8_t src;
+        // instructions run by the handler, 0 if the record can only fail
+        uint8_t count;
+    } decoded_t;
+
     uint16_t regs[0xb];
     flags_t flags;
+    // high 16 bits of the far memory addresses
+    uint16_t bank;
     VMAddrSpace as;
+    uint64_t icount;
+    /*
+     * Engines stop at the first jump reached with icount >= deadline and
+     * set preempted.
+     */
+    uint64_t deadline;
+    bool preempted;
+    /*
+     * Channels attached by the host, NULL if not. RECV on an empty input
+     * and SEND to a full output stop the run with blocked set, before they
+     * count as executed, so that the next run retries them.
+     */
+    VMChannel *inputs[IO_CHANNELS];
+    VMChannel *outputs[IO_CHANNELS];
+    bool blocked;
+    uint8_t engine;
+    /*
+     * One record per code offset plus one for IP == codesize, shared with
+     * the forks of the VM until they rewrite their code.
+     */
+    std::shared_ptr<std::vector<decoded_t>> decoded;
+    uint32_t decodedversion;
+    // how many times each superinstruction ran and the dispatches they saved
+    uint64_t fusions[NUM_FUSIONS];
+    uint64_t skipped;
+    // the record of the last access that could fault on a guard page
+    const decoded_t *faultrec;
+#ifdef STATS
+    opstats_t opstats[NUM_OPS + 1];
+    // the instruction being timed, NUM_OPS + 1 if none, where and since when
+    uint8_t statop;
+    uint16_t statip;
+    uint64_t statstart;
+    /*
+     * How many times a block started at every IP, allocated along with the
+     * VM and on reset(), never while running. statjump is set after a jump
+     * ran, statentry while the instruction being timed starts a block.
+     */
+    uint64_t *blocks;
+    bool statjump, statentry;
+    // the thread between startRun() and stopRun(), 0 if none, for the sampling profiler
+    std::atomic<pid_t> runner;
+#endif
+#ifdef TRACE
+    // set by the VMTrace recording the VM, if any
+    VMTrace *trace;
+#endif
+#ifdef JIT
+    // created by the first run with ENGINE_JIT
+    VMJit *jit;
+#endif
+    /*
+     * OPCODES maps every byte to its index in INSTR. Bytes not assigned
+     * to any instruction point to the trailing WAT? entry.
+     */
+    uint8_t OPCODES[0x100];
 #ifdef DBG
-    instruction_t INSTR[NUM_OPS]{
+    instruction_t INSTR[NUM_OPS + 1]{
             {"MOVI", 0, MOVI_SIZE, &VM::execMOVI, false},
             {"MOVR", 0, MOVR_SIZE, &VM::execMOVR, false},
             {"LODI", 0, LODI_SIZE, &VM::execLODI, false},
@@ -79,10 +227,17 @@ private:
             {"SHIT", 0, SHIT_SIZE, &VM::execSHIT, false},
             {"NOPE", 0, NOPE_SIZE, &VM::execNOPE, false},
             {"GRMN", 0, GRMN_SIZE, &VM::execGRMN, false},
-            {"DEBG", 0, DEBG_SIZE, &VM::execDEBG, false}
+            {"BNKI", 0, BNKI_SIZE, &VM::execBNKI, false},
+            {"BNKR", 0, BNKR_SIZE, &VM::execBNKR, false},
+            {"LODF", 0, LODF_SIZE, &VM::execLODF, false},
+            {"STRF", 0, STRF_SIZE, &VM::execSTRF, false},
+            {"RECV", 0, RECV_SIZE, &VM::execRECV, false},
+            {"SEND", 0, SEND_SIZE, &VM::execSEND, false},
+            {"DEBG", 0, DEBG_SIZE, &VM::execDEBG, false},
+            {"WAT?", 0, SINGLE, &VM::execWAT, false}
     };
 #else
-    instruction_t INSTR[NUM_OPS]{
+    instruction_t INSTR[NUM_OPS + 1]{
             {"MOVI", 0, MOVI_SIZE, &VM::execMOVI, false},
             {"MOVR", 0, MOVR_SIZE, &VM::execMOVR, false},
             {"LODI", 0, LODI_SIZE, &VM::execLODI, false},
@@ -131,18 +286,86 @@ private:
             {"SHIT", 0, SHIT_SIZE, &VM::execSHIT, false},
             {"NOPE", 0, NOPE_SIZE, &VM::execNOPE, false},
             {"GRMN", 0, GRMN_SIZE, &VM::execGRMN, false},
+            {"BNKI", 0, BNKI_SIZE, &VM::execBNKI, false},
+            {"BNKR", 0, BNKR_SIZE, &VM::execBNKR, false},
+            {"LODF", 0, LODF_SIZE, &VM::execLODF, false},
+            {"STRF", 0, STRF_SIZE, &VM::execSTRF, false},
+            {"RECV", 0, RECV_SIZE, &VM::execRECV, false},
+            {"SEND", 0, SEND_SIZE, &VM::execSEND, false},
+            {"WAT?", 0, SINGLE, &VM::execWAT, false}
     };
 #endif
 
     ////////////////////////
     // FUNCTIONS
     ///////////////////////
+    VM(uint32_t ss, uint16_t cs, uint16_t ds, int fd);
+
+    VM(const opcode_map_t *map, uint8_t *code, uint32_t codesize);
+
     void initVariables(void);
 
+    void resetState(void);
+
     void encryptOpcodes(uint8_t *key);
 
+    void loadOpcodes(const opcode_map_t *map);
+
     bool isRegValid(uint8_t reg);
 
+    bool recvWord(uint8_t chan, uint16_t *word);
+
+    bool sendWord(uint8_t chan, uint16_t word);
+
+#ifdef STATS
+    void statsClose(uint64_t now, bool ok);
+
+    void statsNext(uint8_t op, uint16_t ip);
+
+    void statsStop(bool ok);
+#endif
+
+#ifdef TRACE
+    void traceNext(uint8_t op, uint16_t ip);
+#endif
+
+    uint8_t fetch(void) {
+        // running off the code segment is decoded to WAT? as well
+        if (regs[IP] >= as.getCodesize()) {
+            return NUM_OPS;
+        }
+        return OPCODES[as.getCode()[regs[IP]]];
+    }
+
+    bool decodeAt(uint32_t ip, decoded_t *rec);
+
+    /*
+    ENGINES
+    */
+    bool execNext(void);
+
+    void runLoop(void);
+
+    void startRun(uint64_t budget);
+
+    uint8_t stopRun(void);
+
+#ifdef THREADED
+    void runThreaded(void);
+
+    void runDecoded(void);
+
+    void runGuarded(void);
+
+    uint8_t fusionAt(uint32_t ip, uint8_t *count);
+#endif
+
+#ifdef JIT
+    void startJit(void);
+
+    void runJit(void);
+#endif
+
     template<typename T>
     bool isDivArgValid(T arg) {
         if (arg == 0) {
@@ -251,24 +474,77 @@ private:
 
     bool execGRMN(void);
 
+    bool execBNKI(void);
+
+    bool execBNKR(void);
+
+    bool execLODF(void);
+
+    bool execSTRF(void);
+
+    bool execRECV(void);
+
+    bool execSEND(void);
+
     bool execSHIT(void);
 
     bool execNOPE(void);
 
     bool execDEBG(void);
 
+    bool execWAT(void);
+
 public:
     VM(uint8_t *key);
 
     VM(uint8_t *key, uint8_t *code, uint32_t codesize);
 
+    VM(uint8_t *key, uint8_t *code, uint32_t codesize, uint8_t *arena);
+
+    VM(uint8_t *key, uint8_t *code, uint32_t codesize, enum arenas kind);
+
+    VM(uint8_t *key, uint8_t *code, uint32_t codesize, uint32_t ss, uint16_t cs, uint16_t ds,
+       enum arenas kind = ARENA_HEAP);
+
+    ~VM();
+
+    static bool hasEngine(uint8_t);
+
+    static bool hasStats(void);
+
+    static bool hasTrace(void);
+
     void status(void);
 
-    void run();
+    uint8_t run(uint64_t budget = RUN_FOREVER);
+
+    uint8_t step(uint64_t count);
+
+    void reset(void);
+
+    void setEngine(uint8_t);
 
     VMAddrSpace *addressSpace();
 
     uint16_t reg(uint8_t);
+
+    uint16_t getBank(void);
+
+    void attach(uint8_t chan, VMChannel *input, VMChannel *output);
+
+    flags_t getFlags(void);
+
+    uint64_t executed(void);
+
+    uint64_t dispatched(void);
+
+    uint64_t fired(uint8_t fusion);
+
+    const opstats_t *stats(void);
+
+    uint64_t entries(uint16_t ip);
+
+    void dumpStats(FILE *out);
 };
 
 
@@ -1,24 +1,79 @@
 #include "vmas.h"
+#include <errno.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #include <new>
 #include <stdexcept>
 
-VMAddrSpace::VMAddrSpace() {
+#define ALIGNED(_size_) (((_size_) + SEGMENT_ALIGN - 1) & ~(SEGMENT_ALIGN - 1))
+
+VMAddrSpace::VMAddrSpace() : VMAddrSpace(DEFAULT_STACKSIZE, DEFAULT_CODESIZE, DEFAULT_DATASIZE, (uint8_t *) NULL) {
+}
+
+VMAddrSpace::VMAddrSpace(uint32_t ss, uint16_t cs, uint16_t ds) : VMAddrSpace(ss, cs, ds, (uint8_t *) NULL) {
+}
+
+/*
+ * buf, if not NULL, has to hold arenaSize(ss, cs, ds) bytes aligned to
+ * SEGMENT_ALIGN and to outlive the address space.
+ */
+VMAddrSpace::VMAddrSpace(uint32_t ss, uint16_t cs, uint16_t ds, uint8_t *buf) {
     stack = NULL;
     code = NULL;
     data = NULL;
-    stacksize = DEFAULT_STACKSIZE;
-    codesize = DEFAULT_CODESIZE;
-    datasize = DEFAULT_DATASIZE;
-    allocate();
+    arena = NULL;
+    arenaKind = ARENA_BORROWED;
+    mapsize = 0;
+    codeversion = 0;
+    borrowedCode = false;
+    arenaCodesize = 0;
+    arenaCodeHigh = 0;
+    far = NULL;
+    farsize = 0;
+    guardedData = NULL;
+    guardedStack = NULL;
+    if (cs > MAX_CODESIZE) {
+        throw std::invalid_argument("Trying to initialize the address space with a bigger codesize.");
+    }
+    if (ds > MAX_DATASIZE) {
+        throw std::invalid_argument("Trying to initialize the address space with a bigger datasize.");
+    }
+    if ((uintptr_t) buf % SEGMENT_ALIGN) {
+        throw std::invalid_argument("Trying to initialize the address space with a misaligned arena.");
+    }
+    stacksize = ss;
+    codesize = cs;
+    datasize = ds;
+    allocate(buf);
     return;
 }
 
-VMAddrSpace::VMAddrSpace(uint32_t ss, uint16_t cs, uint16_t ds) {
+/*
+ * Maps the segments privately from fd, which holds mappingSize(ss, cs, ds)
+ * bytes laid out like an arena: pages are shared with every other mapping of
+ * fd until they are written. The bytes the file holds are not known here, so
+ * they are not recorded as written.
+ */
+VMAddrSpace::VMAddrSpace(uint32_t ss, uint16_t cs, uint16_t ds, int fd) {
+    void *mapping;
+
     stack = NULL;
     code = NULL;
     data = NULL;
+    arena = NULL;
+    arenaKind = ARENA_BORROWED;
+    mapsize = 0;
+    codeversion = 0;
+    borrowedCode = false;
+    arenaCodesize = 0;
+    arenaCodeHigh = 0;
+    far = NULL;
+    farsize = 0;
+    guardedData = NULL;
+    guardedStack = NULL;
     if (cs > MAX_CODESIZE) {
         throw std::invalid_argument("Trying to initialize the address space with a bigger codesize.");
     }
@@ -28,54 +83,258 @@ VMAddrSpace::VMAddrSpace(uint32_t ss, uint16_t cs, uint16_t ds) {
     stacksize = ss;
     codesize = cs;
     datasize = ds;
-    allocate();
+    DBG_INFO(("Mapping sections...\n"));
+    mapping = mmap(NULL, mappingSize(ss, cs, ds), PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED) {
+        DBG_ERROR(("Couldn't map the address space.\n"));
+        throw std::bad_alloc();
+    }
+    arena = (uint8_t *) mapping;
+    arenaKind = ARENA_MAPPED;
+    mapsize = mappingSize(ss, cs, ds);
+    layout();
+    dataLow = datasize;
+    dataHigh = 0;
+    stackHigh = 0;
+    codeHigh = 0;
+    DBG_SUCC(("Done!\n"));
     return;
 }
 
-VMAddrSpace::~VMAddrSpace() {
-    if (stack) {
-        delete[] stack;
+/*
+ * Data and stack are backed by an anonymous file mapped twice: once as a
+ * plain arena for getData() / getStack(), and once in a GUARD_WINDOW window
+ * each for getGuardedData() / getGuardedStack(). In the windows a segment is
+ * placed so that its last byte starts a PROT_NONE page: the 16 bit accesses
+ * that fail the bounds checks, addr + 2 >= size, are exactly the ones
+ * touching it or anything after it. Engines can then skip the checks and
+ * let the faults stop the VM. ss can't be more than 0x10000, for POOP from
+ * an empty stack to wrap onto the guard pages.
+ */
+VMAddrSpace::VMAddrSpace(uint32_t ss, uint16_t cs, uint16_t ds, enum arenas kind) {
+    stack = NULL;
+    code = NULL;
+    data = NULL;
+    arena = NULL;
+    arenaKind = ARENA_BORROWED;
+    mapsize = 0;
+    codeversion = 0;
+    borrowedCode = false;
+    arenaCodesize = 0;
+    arenaCodeHigh = 0;
+    far = NULL;
+    farsize = 0;
+    guardedData = NULL;
+    guardedStack = NULL;
+    if (cs > MAX_CODESIZE) {
+        throw std::invalid_argument("Trying to initialize the address space with a bigger codesize.");
     }
-    if (code) {
-        delete[] code;
+    if (ds > MAX_DATASIZE) {
+        throw std::invalid_argument("Trying to initialize the address space with a bigger datasize.");
     }
-    if (data) {
-        delete[] data;
+    stacksize = ss;
+    codesize = cs;
+    datasize = ds;
+    switch (kind) {
+        case ARENA_HEAP:
+            allocate(NULL);
+            break;
+        case ARENA_GUARDED:
+            if (ss > 0x10000) {
+                throw std::invalid_argument("Trying to guard a stack bigger than 0x10000.");
+            }
+            map();
+            break;
+        default:
+            throw std::invalid_argument("Trying to initialize the address space with a foreign arena.");
     }
     return;
 }
 
-bool VMAddrSpace::allocate(void) {
+VMAddrSpace::~VMAddrSpace() {
+    release();
+    return;
+}
+
+void VMAddrSpace::release(void) {
+    switch (arenaKind) {
+        case ARENA_HEAP:
+            free(arena);
+            break;
+        case ARENA_MAPPED:
+            munmap(arena, mapsize);
+            break;
+        case ARENA_GUARDED:
+            if (arena) {
+                munmap(arena, mapsize);
+            }
+            if (guardedData) {
+                munmap((void *) ((uintptr_t) guardedData & ~(uintptr_t) (GUARD_WINDOW - 1)), GUARD_WINDOW);
+            }
+            if (guardedStack) {
+                munmap((void *) ((uintptr_t) guardedStack & ~(uintptr_t) (GUARD_WINDOW - 1)), GUARD_WINDOW);
+            }
+            break;
+        default:
+            break;
+    }
+    return;
+}
+
+// bytes needed to hold the segments of an address space
+uint32_t VMAddrSpace::arenaSize(uint32_t ss, uint16_t cs, uint16_t ds) {
+    uint32_t size = ALIGNED(cs) + ALIGNED(ds) + ALIGNED(ss);
+
+    return size ? size : SEGMENT_ALIGN;
+}
+
+// arenaSize rounded up to whole pages
+uint32_t VMAddrSpace::mappingSize(uint32_t ss, uint16_t cs, uint16_t ds) {
+    uint32_t page = sysconf(_SC_PAGESIZE);
+
+    return (arenaSize(ss, cs, ds) + page - 1) / page * page;
+}
+
+// where data and stack start in an arena
+uint32_t VMAddrSpace::dataOffset(uint16_t cs) {
+    return ALIGNED(cs);
+}
+
+uint32_t VMAddrSpace::stackOffset(uint16_t cs, uint16_t ds) {
+    return ALIGNED(cs) + ALIGNED(ds);
+}
+
+void VMAddrSpace::layout(void) {
+    code = arena;
+    data = arena + dataOffset(codesize);
+    stack = arena + stackOffset(codesize, datasize);
+}
+
+bool VMAddrSpace::allocate(uint8_t *buf) {
+    uint32_t size = arenaSize(stacksize, codesize, datasize);
+
     DBG_INFO(("Allocating sections...\n"));
+    if (buf) {
+        arena = buf;
+    } else {
+        arena = (uint8_t *) aligned_alloc(SEGMENT_ALIGN, size);
+        if (arena == NULL) {
+            DBG_ERROR(("Couldn't allocate the address space.\n"));
+            throw std::bad_alloc();
+        }
+        arenaKind = ARENA_HEAP;
+    }
+    layout();
+    memset(arena, 0x0, size);
+    dataLow = datasize;
+    dataHigh = 0;
+    stackHigh = 0;
+    codeHigh = 0;
+    DBG_SUCC(("Done!\n"));
+    return true;
+}
 
-    DBG_INFO(("\tcode...\n"));
-    code = new uint8_t[codesize];
-    DBG_INFO(("\tdata...\n"));
-    data = new uint8_t[datasize];
-    DBG_INFO(("\tstack...\n"));
-    stack = new uint8_t[stacksize];
+// where a segment of size bytes starts in its page for its last byte to start the next one
+static uint32_t guardOffset(uint32_t size, uint32_t page) {
+    uint32_t reachable = size ? size - 1 : 0;
 
-    if (code == NULL) {
-        DBG_ERROR(("Couldn't allocate code section.\n"));
-        throw std::bad_alloc();
+    return (page - reachable % page) % page;
+}
+
+// a GUARD_WINDOW bytes PROT_NONE window aligned to its size, NULL on failure
+static uint8_t *reserveWindow(void) {
+    uint8_t *reserved, *window;
+
+    reserved = (uint8_t *) mmap(NULL, 2 * GUARD_WINDOW, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                                -1, 0);
+    if (reserved == MAP_FAILED) {
+        return NULL;
     }
-    if (data == NULL) {
-        DBG_ERROR(("Couldn't allocate data section.\n"));
-        throw std::bad_alloc();
+    window = (uint8_t *) (((uintptr_t) reserved + GUARD_WINDOW - 1) & ~(uintptr_t) (GUARD_WINDOW - 1));
+    if (window > reserved) {
+        munmap(reserved, window - reserved);
     }
-    if (stack == NULL) {
-        DBG_ERROR(("Couldn't allocate stack section.\n"));
-        throw std::bad_alloc();
+    munmap(window + GUARD_WINDOW, reserved + GUARD_WINDOW - window);
+    return window;
+}
+
+// maps the reachable bytes of a segment from fd at offset in a new window
+static uint8_t *guardSegment(int fd, uint32_t offset, uint32_t size, uint32_t page) {
+    uint32_t start = guardOffset(size, page), reachable = size ? size - 1 : 0;
+    uint8_t *window = reserveWindow();
+
+    if (window == NULL) {
+        return NULL;
+    }
+    // start + reachable is a multiple of the page size
+    if (start + reachable &&
+        mmap(window, start + reachable, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, offset) == MAP_FAILED) {
+        munmap(window, GUARD_WINDOW);
+        return NULL;
     }
+    return window + start;
+}
+
+void VMAddrSpace::map(void) {
+    uint32_t page = sysconf(_SC_PAGESIZE);
+    uint32_t dataStart = guardOffset(datasize, page), stackStart = guardOffset(stacksize, page);
+    uint32_t dataFile = (codesize + page - 1) / page * page;
+    uint32_t stackFile = dataFile + (dataStart + datasize + page - 1) / page * page;
+    uint32_t size = stackFile + (stackStart + stacksize + page - 1) / page * page;
+    void *mapping;
+    int fd;
+
+    DBG_INFO(("Mapping guarded sections...\n"));
+#ifdef __linux__
+    fd = memfd_create("pasticciotto-guarded", MFD_CLOEXEC);
+#else
+    char path[] = "/tmp/pasticciotto-guarded-XXXXXX";
 
-    memset(code, 0x0, codesize);
-    memset(stack, 0x0, stacksize);
-    memset(data, 0x0, datasize);
+    fd = mkstemp(path);
+    if (fd >= 0) {
+        unlink(path);
+    }
+#endif
+    if (fd < 0) {
+        DBG_ERROR(("Couldn't create the address space file: %s.\n", strerror(errno)));
+        throw std::runtime_error("Couldn't create the address space file");
+    }
+    size = size ? size : page;
+    mapping = MAP_FAILED;
+    if (ftruncate(fd, size) == 0) {
+        mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (mapping == MAP_FAILED) {
+        close(fd);
+        DBG_ERROR(("Couldn't map the address space.\n"));
+        throw std::runtime_error("Couldn't map the address space");
+    }
+    arena = (uint8_t *) mapping;
+    arenaKind = ARENA_GUARDED;
+    mapsize = size;
+    code = arena;
+    data = arena + dataFile + dataStart;
+    stack = arena + stackFile + stackStart;
+    guardedData = guardSegment(fd, dataFile, datasize, page);
+    guardedStack = guardedData ? guardSegment(fd, stackFile, stacksize, page) : NULL;
+    close(fd);
+    if (guardedStack == NULL) {
+        release();
+        DBG_ERROR(("Couldn't map the guard windows.\n"));
+        throw std::runtime_error("Couldn't map the guard windows");
+    }
+    dataLow = datasize;
+    dataHigh = 0;
+    stackHigh = 0;
+    codeHigh = 0;
     DBG_SUCC(("Done!\n"));
-    return true;
 }
 
 bool VMAddrSpace::insCode(uint8_t *buf, uint32_t size) {
+    if (borrowedCode) {
+        DBG_ERROR(("The code section is read-only!\n"));
+        return false;
+    }
     if (code) {
         if (size > codesize) {
             DBG_ERROR(("The injected code size is too big!\n"));
@@ -83,6 +342,10 @@ bool VMAddrSpace::insCode(uint8_t *buf, uint32_t size) {
         }
         DBG_INFO(("Copying buffer into code section.\n"));
         memcpy(code, buf, size);
+        if (size > codeHigh) {
+            codeHigh = size;
+        }
+        codeversion++;
     } else {
         DBG_ERROR(("Couldn't write into code section.\n"));
         return false;
@@ -90,6 +353,67 @@ bool VMAddrSpace::insCode(uint8_t *buf, uint32_t size) {
     return true;
 }
 
+/*
+ * Runs the code in buf, e.g. a read-only mmap of a program, without copying
+ * it: the code segment becomes buf, size bytes long, and is never written.
+ * buf has to outlive the address space, and insCode fails from now on. The
+ * room for code in the arena is left unused.
+ */
+bool VMAddrSpace::borrowCode(const uint8_t *buf, uint32_t size) {
+    if (size > MAX_CODESIZE) {
+        DBG_ERROR(("The borrowed code size is too big!\n"));
+        return false;
+    }
+    DBG_INFO(("Borrowing 0x%x bytes of code.\n", size));
+    if (!borrowedCode) {
+        arenaCodesize = codesize;
+        arenaCodeHigh = codeHigh;
+    }
+    code = (uint8_t *) buf;
+    codesize = size;
+    codeHigh = size;
+    borrowedCode = true;
+    codeversion++;
+    return true;
+}
+
+bool VMAddrSpace::isCodeBorrowed(void) {
+    return borrowedCode;
+}
+
+/*
+ * Undoes borrowCode(): the code segment is the room in the arena again, with
+ * the code it held before, and buf is not touched anymore.
+ */
+void VMAddrSpace::returnCode(void) {
+    if (!borrowedCode) {
+        return;
+    }
+    DBG_INFO(("Giving back 0x%x bytes of borrowed code.\n", codesize));
+    code = arena;
+    codesize = arenaCodesize;
+    codeHigh = arenaCodeHigh;
+    borrowedCode = false;
+    codeversion++;
+}
+
+/*
+ * Lends buf, size bytes, to the program as its far memory: LODF and STRF
+ * reach all of it at (bank << 16) + a 16 bit register, past the 64 KiB of
+ * the data segment. buf has to outlive the address space, and is read and
+ * written in place. A NULL buf takes the far memory away.
+ */
+bool VMAddrSpace::borrowFar(uint8_t *buf, uint32_t size) {
+    if (buf == NULL && size) {
+        DBG_ERROR(("Far memory of 0x%x bytes at NULL!\n", size));
+        return false;
+    }
+    DBG_INFO(("Borrowing 0x%x bytes of far memory.\n", size));
+    far = buf;
+    farsize = buf ? size : 0;
+    return true;
+}
+
 bool VMAddrSpace::insStack(uint8_t *buf, uint32_t size) {
     if (stack) {
         if (size > stacksize) {
@@ -98,6 +422,7 @@ bool VMAddrSpace::insStack(uint8_t *buf, uint32_t size) {
         }
         DBG_INFO(("Copying buffer into stack section.\n"));
         memcpy(stack, buf, size);
+        dirtyStack(size);
     } else {
         DBG_ERROR(("Couldn't write into stack section.\n"));
         return false;
@@ -113,6 +438,7 @@ bool VMAddrSpace::insData(uint8_t *buf, uint32_t size) {
         }
         DBG_INFO(("Copying buffer into data section.\n"));
         memcpy(data, buf, size);
+        dirtyData(0, size);
     } else {
         DBG_ERROR(("Couldn't write into data section.\n"));
         return false;
@@ -120,26 +446,41 @@ bool VMAddrSpace::insData(uint8_t *buf, uint32_t size) {
     return true;
 }
 
-uint32_t VMAddrSpace::getStacksize() {
-    return stacksize;
+// zeroes only what was written to data and stack since the last clean
+void VMAddrSpace::clean(void) {
+    if (dataLow < dataHigh) {
+        DBG_INFO(("Clearing data[0x%x:0x%x].\n", dataLow, dataHigh));
+        memset(data + dataLow, 0x0, dataHigh - dataLow);
+    }
+    if (stackHigh) {
+        DBG_INFO(("Clearing stack[0x0:0x%x].\n", stackHigh));
+        memset(stack, 0x0, stackHigh);
+    }
+    dataLow = datasize;
+    dataHigh = 0;
+    stackHigh = 0;
 }
 
-uint32_t VMAddrSpace::getCodesize() {
-    return codesize;
+uint32_t VMAddrSpace::getCodeVersion() {
+    return codeversion;
 }
 
-uint32_t VMAddrSpace::getDatasize() {
-    return datasize;
+bool VMAddrSpace::isGuarded(void) {
+    return arenaKind == ARENA_GUARDED;
 }
 
-uint8_t *VMAddrSpace::getStack() {
-    return stack;
+uint8_t *VMAddrSpace::getGuardedData() {
+    return guardedData;
 }
 
-uint8_t *VMAddrSpace::getCode() {
-    return code;
+uint8_t *VMAddrSpace::getGuardedStack() {
+    return guardedStack;
 }
 
-uint8_t *VMAddrSpace::getData() {
-    return data;
+// whether addr is in the guard window of data or stack
+bool VMAddrSpace::guards(const void *addr) {
+    uintptr_t window = (uintptr_t) addr & ~(uintptr_t) (GUARD_WINDOW - 1);
+
+    return guardedData && (window == ((uintptr_t) guardedData & ~(uintptr_t) (GUARD_WINDOW - 1)) ||
+                           window == ((uintptr_t) guardedStack & ~(uintptr_t) (GUARD_WINDOW - 1)));
 }
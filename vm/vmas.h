@@ -9,43 +9,164 @@
 #define DEFAULT_DATASIZE 0x100
 #define MAX_CODESIZE 0xFFFF
 #define MAX_DATASIZE 0xFFFF
+// segments start on their own cache line
+#define SEGMENT_ALIGN 64
+/*
+ * Guarded address spaces map data and stack again for the engines, each in
+ * its own window: a 16 bit address can't go past it from anywhere in the
+ * first page, so any access out of the segment lands on a PROT_NONE page.
+ */
+#define GUARD_WINDOW 0x20000
+
+enum arenas {
+    ARENA_BORROWED, ARENA_HEAP, ARENA_MAPPED, ARENA_GUARDED
+};
+
+class VMSnapshot;
 
 class VMAddrSpace {
+    friend class VMSnapshot;
+
 private:
     uint32_t stacksize, codesize, datasize;
     uint8_t *stack, *code, *data;
-
-    bool allocate(void);
+    /*
+     * code, data and stack are carved out of this single block, which is
+     * only released if the address space allocated or mapped it itself.
+     */
+    uint8_t *arena;
+    uint8_t arenaKind;
+    uint32_t mapsize;
+    // bytes written since the last clean: data [dataLow, dataHigh), stack [0, stackHigh)
+    uint32_t dataLow, dataHigh, stackHigh;
+    // code [0, codeHigh) may be non zero
+    uint32_t codeHigh;
+    // bumped every time the code segment is rewritten through insCode or replaced
+    uint32_t codeversion;
+    // code points to a read-only buffer of the caller instead of the arena
+    bool borrowedCode;
+    // codesize and codeHigh of the arena's code segment while it is
+    uint32_t arenaCodesize, arenaCodeHigh;
+    /*
+     * Memory of the caller reached by LODF / STRF through the bank register,
+     * NULL if there is none. It is not part of the arena: clean() leaves it
+     * alone, VM::reset() takes it away, and writes to it are not recorded.
+     */
+    uint8_t *far;
+    uint32_t farsize;
+    // data and stack as seen from their guard windows, NULL if not guarded
+    uint8_t *guardedData, *guardedStack;
+
+    bool allocate(uint8_t *buf);
+
+    void layout(void);
+
+    void map(void);
+
+    void release(void);
+
+    static uint32_t dataOffset(uint16_t cs);
+
+    static uint32_t stackOffset(uint16_t cs, uint16_t ds);
 
 public:
     VMAddrSpace();
 
     VMAddrSpace(uint32_t ss, uint16_t cs, uint16_t ds);
 
+    VMAddrSpace(uint32_t ss, uint16_t cs, uint16_t ds, uint8_t *buf);
+
+    VMAddrSpace(uint32_t ss, uint16_t cs, uint16_t ds, int fd);
+
+    VMAddrSpace(uint32_t ss, uint16_t cs, uint16_t ds, enum arenas kind);
+
     ~VMAddrSpace();
 
-    uint8_t *getStack();
+    uint8_t *getStack() {
+        return stack;
+    }
+
+    uint8_t *getCode() {
+        return code;
+    }
+
+    uint8_t *getData() {
+        return data;
+    }
+
+    uint32_t getStacksize() {
+        return stacksize;
+    }
+
+    uint32_t getCodesize() {
+        return codesize;
+    }
+
+    uint32_t getDatasize() {
+        return datasize;
+    }
+
+    uint8_t *getFar() {
+        return far;
+    }
+
+    uint32_t getFarsize() {
+        return farsize;
+    }
+
+    uint32_t getCodeVersion();
 
-    uint8_t *getCode();
+    bool isGuarded(void);
 
-    uint8_t *getData();
+    uint8_t *getGuardedData();
 
-    uint32_t getStacksize();
+    uint8_t *getGuardedStack();
 
-    uint32_t getCodesize();
+    bool guards(const void *addr);
 
-    uint32_t getDatasize();
+    static uint32_t arenaSize(uint32_t ss, uint16_t cs, uint16_t ds);
+
+    static uint32_t mappingSize(uint32_t ss, uint16_t cs, uint16_t ds);
 
     bool insStack(uint8_t *buf, uint32_t size);
 
     bool insCode(uint8_t *buf, uint32_t size);
 
+    bool borrowCode(const uint8_t *buf, uint32_t size);
+
+    bool isCodeBorrowed(void);
+
+    void returnCode(void);
+
+    bool borrowFar(uint8_t *buf, uint32_t size);
+
     bool insData(uint8_t *buf, uint32_t size);
 
+    void clean(void);
+
+    /*
+     * Writes going straight through getData() and getStack() have to be
+     * recorded with these for clean() to undo them.
+     */
+    void dirtyData(uint32_t addr, uint32_t size) {
+        if (addr < dataLow) {
+            dataLow = addr;
+        }
+        if (addr + size > dataHigh) {
+            dataHigh = addr + size;
+        }
+    }
+
+    void dirtyStack(uint32_t end) {
+        if (end > stackHigh) {
+            stackHigh = end;
+        }
+    }
+
     template<typename src_t, typename dst_t>
     bool getArgs(uint32_t idx, src_t *src, dst_t *dst, uint8_t flag_byte_op = 0) {
         if (sizeof(*src) == sizeof(*dst)) {
-            if (idx + 1 >= codesize) {
+            if (idx + (flag_byte_op ? 2 : 1) >= codesize) {
                 DBG_ERROR(("Argument out of code segment bounds.\n"));
                 return false;
             }
@@ -63,7 +184,7 @@ public:
              * DST = IP + 1
              * SRC = IP + 1 + SIZE(DST)
              */
-            if (idx + sizeof(*dst) >= codesize) {
+            if (idx + sizeof(*dst) + sizeof(*src) >= codesize) {
                 DBG_ERROR(("Argument out of code segment bounds.\n"));
                 return false;
             }
@@ -76,7 +197,7 @@ public:
 
     template<typename T>
     bool getArgs(uint32_t ip, T *arg) {
-        if (ip + 1 >= codesize) {
+        if (ip + sizeof(*arg) >= codesize) {
             DBG_ERROR(("Argument out of code segment bounds.\n"));
             return false;
         }
@@ -0,0 +1,178 @@
+#include "vmbatch.h"
+#include <string.h>
+#include <stdexcept>
+
+#define PACK(_begin_, _end_) ((uint64_t) (_end_) << 32 | (uint32_t) (_begin_))
+#define BEGIN(_range_) ((uint32_t) (_range_))
+#define END(_range_) ((uint32_t) ((_range_) >> 32))
+
+/*
+CONSTRUCTORS
+*/
+VMBatch::VMBatch(uint8_t *key, uint8_t *code, uint32_t codesize, uint32_t threads) {
+    uint32_t i;
+    worker_t *w;
+
+    if (!threads) {
+        threads = std::thread::hardware_concurrency();
+    }
+    if (!threads) {
+        threads = 1;
+    }
+    DBG_SUCC(("Creating a batch of %u workers.\n", threads));
+    generation = 0;
+    stopping = false;
+    pending = 0;
+    data = NULL;
+    stride = 0;
+    states = NULL;
+    for (i = 0; i < threads; i++) {
+        w = new worker_t;
+        w->range = PACK(0, 0);
+        w->vm = new VM(key, code, codesize);
+        workers.push_back(w);
+    }
+    for (i = 0; i < threads; i++) {
+        workers[i]->thread = std::thread(&VMBatch::work, this, i);
+    }
+}
+
+VMBatch::~VMBatch() {
+    uint32_t i;
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    start.notify_all();
+    // workers look at each other's ranges until they go back to sleep
+    for (i = 0; i < workers.size(); i++) {
+        workers[i]->thread.join();
+    }
+    for (i = 0; i < workers.size(); i++) {
+        delete workers[i]->vm;
+        delete workers[i];
+    }
+}
+
+/*
+WORKERS
+*/
+void VMBatch::work(uint32_t id) {
+    worker_t *self = workers[id];
+    uint32_t seen = 0, job;
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            start.wait(guard, [&] { return stopping || generation != seen; });
+            if (stopping) {
+                return;
+            }
+            seen = generation;
+        }
+        while (take(self, &job) || steal(id, &job)) {
+            runJob(self->vm, job);
+            if (--pending == 0) {
+                std::lock_guard<std::mutex> guard(lock);
+                done.notify_one();
+            }
+        }
+    }
+}
+
+// takes the first job of the worker's own range
+bool VMBatch::take(worker_t *w, uint32_t *job) {
+    uint64_t range = w->range.load();
+
+    while (BEGIN(range) < END(range)) {
+        if (w->range.compare_exchange_weak(range, PACK(BEGIN(range) + 1, END(range)))) {
+            *job = BEGIN(range);
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Moves the back half of another worker's range to the (empty) range of
+ * worker id and takes its first job.
+ */
+bool VMBatch::steal(uint32_t id, uint32_t *job) {
+    uint32_t i, half, size = workers.size();
+    uint64_t range;
+    worker_t *victim;
+
+    for (i = 1; i < size; i++) {
+        victim = workers[(id + i) % size];
+        range = victim->range.load();
+        while (BEGIN(range) < END(range)) {
+            half = (END(range) - BEGIN(range) + 1) / 2;
+            if (victim->range.compare_exchange_weak(range, PACK(BEGIN(range), END(range) - half))) {
+                *job = END(range) - half;
+                workers[id]->range = PACK(*job + 1, END(range));
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void VMBatch::runJob(VM *vm, uint32_t job) {
+    VMAddrSpace *as = vm->addressSpace();
+    uint8_t *section = data + (uint64_t) job * stride;
+    vm_state_t *state = &states[job];
+    uint8_t i;
+
+    vm->reset();
+    as->insData(section, stride);
+    vm->run();
+    memcpy(section, as->getData(), stride);
+    for (i = 0; i < NUM_REGS; i++) {
+        state->regs[i] = vm->reg(i);
+    }
+    state->flags = vm->getFlags();
+    state->executed = vm->executed();
+}
+
+/*
+INTERFACE
+*/
+void VMBatch::setEngine(uint8_t engine) {
+    uint32_t i;
+
+    for (i = 0; i < workers.size(); i++) {
+        workers[i]->vm->setEngine(engine);
+    }
+}
+
+uint32_t VMBatch::size(void) {
+    return workers.size();
+}
+
+/*
+ * Runs the program once for each of the count data sections found every
+ * stride bytes from data, replacing them with their final contents. The
+ * final registers of job i go to states[i].
+ */
+void VMBatch::run(uint8_t *data, uint32_t stride, uint32_t count, vm_state_t *states) {
+    uint32_t i, size = workers.size();
+
+    if (stride > workers[0]->vm->addressSpace()->getDatasize()) {
+        throw std::invalid_argument("Data sections bigger than the data segment");
+    }
+    if (!count) {
+        return;
+    }
+    std::unique_lock<std::mutex> guard(lock);
+    this->data = data;
+    this->stride = stride;
+    this->states = states;
+    pending = count;
+    for (i = 0; i < size; i++) {
+        workers[i]->range = PACK((uint64_t) count * i / size, (uint64_t) count * (i + 1) / size);
+    }
+    generation++;
+    start.notify_all();
+    done.wait(guard, [this] { return pending == 0; });
+}
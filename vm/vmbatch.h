@@ -0,0 +1,62 @@
+#ifndef VMBATCH_H
+#define VMBATCH_H
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "vm.h"
+
+/*
+ * Runs one program over many data sections on a pool of worker threads.
+ * Every worker owns a VM built once with the key and the code, which is
+ * reset between jobs: no allocation nor key scheduling happens per job.
+ * A batch runs one job list at a time.
+ */
+class VMBatch {
+private:
+    /*
+     * Jobs still owned by a worker, as [begin, end) packed in a single word:
+     * the owner takes from the front, thieves take half of it from the back.
+     */
+    typedef struct alignas(64) worker {
+        std::atomic<uint64_t> range;
+        VM *vm;
+        std::thread thread;
+    } worker_t;
+
+    std::vector<worker_t *> workers;
+    std::mutex lock;
+    std::condition_variable start, done;
+    uint32_t generation;
+    bool stopping;
+    std::atomic<uint32_t> pending;
+
+    // the batch being run
+    uint8_t *data;
+    uint32_t stride;
+    vm_state_t *states;
+
+    void work(uint32_t id);
+
+    bool take(worker_t *w, uint32_t *job);
+
+    bool steal(uint32_t id, uint32_t *job);
+
+    void runJob(VM *vm, uint32_t job);
+
+public:
+    VMBatch(uint8_t *key, uint8_t *code, uint32_t codesize, uint32_t threads = 0);
+
+    ~VMBatch();
+
+    void setEngine(uint8_t);
+
+    uint32_t size(void);
+
+    void run(uint8_t *data, uint32_t stride, uint32_t count, vm_state_t *states);
+};
+
+#endif
@@ -0,0 +1,104 @@
+#include "vmchannel.h"
+#include <stdexcept>
+
+/*
+CONSTRUCTORS
+*/
+VMChannel::VMChannel(uint32_t capacity) {
+    if (!capacity || capacity & (capacity - 1)) {
+        throw std::invalid_argument("Channels hold a power of two words");
+    }
+    ring = new uint16_t[capacity];
+    mask = capacity - 1;
+    head = 0;
+    tail = 0;
+    closed = false;
+}
+
+VMChannel::~VMChannel() {
+    delete[] ring;
+}
+
+/*
+PRODUCER
+*/
+// the free words from the tail on, up to the end of the ring
+uint16_t *VMChannel::writable(uint32_t *count) {
+    uint32_t t = tail.load(std::memory_order_relaxed), h = head.load(std::memory_order_acquire);
+    uint32_t free = mask + 1 - (t - h), end = mask + 1 - (t & mask);
+
+    *count = free < end ? free : end;
+    return &ring[t & mask];
+}
+
+// hands the first count words of the last writable() to the consumer
+void VMChannel::commit(uint32_t count) {
+    tail.store(tail.load(std::memory_order_relaxed) + count, std::memory_order_release);
+}
+
+bool VMChannel::push(uint16_t word) {
+    uint32_t t = tail.load(std::memory_order_relaxed);
+
+    if (t - head.load(std::memory_order_acquire) > mask) {
+        return false;
+    }
+    ring[t & mask] = word;
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+}
+
+// no more words are coming: the consumer gets the ones left, then the end
+void VMChannel::close(void) {
+    closed.store(true, std::memory_order_release);
+}
+
+/*
+CONSUMER
+*/
+// the words from the head on, up to the end of the ring
+const uint16_t *VMChannel::readable(uint32_t *count) {
+    uint32_t h = head.load(std::memory_order_relaxed), t = tail.load(std::memory_order_acquire);
+    uint32_t used = t - h, end = mask + 1 - (h & mask);
+
+    *count = used < end ? used : end;
+    return &ring[h & mask];
+}
+
+// gives the first count words of the last readable() back to the producer
+void VMChannel::consume(uint32_t count) {
+    head.store(head.load(std::memory_order_relaxed) + count, std::memory_order_release);
+}
+
+bool VMChannel::pop(uint16_t *word) {
+    uint32_t h = head.load(std::memory_order_relaxed);
+
+    if (h == tail.load(std::memory_order_acquire)) {
+        return false;
+    }
+    *word = ring[h & mask];
+    head.store(h + 1, std::memory_order_release);
+    return true;
+}
+
+bool VMChannel::finished(void) {
+    // closed first: words pushed before close() are seen by the tail load
+    return closed.load(std::memory_order_acquire) &&
+           head.load(std::memory_order_relaxed) == tail.load(std::memory_order_acquire);
+}
+
+uint32_t VMChannel::size(void) {
+    return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+}
+
+uint32_t VMChannel::capacity(void) {
+    return mask + 1;
+}
+
+bool VMChannel::isClosed(void) {
+    return closed.load(std::memory_order_acquire);
+}
+
+// for channels reused for another stream, once finished
+void VMChannel::reopen(void) {
+    closed.store(false, std::memory_order_release);
+}
@@ -0,0 +1,76 @@
+#ifndef VMCHANNEL_H
+#define VMCHANNEL_H
+
+#include <stdint.h>
+#include <atomic>
+
+// channels a VM can be attached to, numbered from 0
+#define IO_CHANNELS 16
+// words a channel holds by default, a power of two
+#define DEFAULT_CHANNELSIZE 0x1000
+
+/*
+ * A ring of 16 bit words between a single producer and a single consumer,
+ * which can be on different threads. RECV pops from the input channels of a
+ * VM and SEND pushes to its output channels; the host fills and drains them
+ * in place, e.g.
+ *
+ *     uint16_t *words = in.writable(&count);     // producer
+ *     n = read(fd, words, count * 2) / 2;
+ *     in.commit(n);
+ *
+ *     const uint16_t *words = out.readable(&count); // consumer
+ *     write(fd, words, count * 2);
+ *     out.consume(count);
+ *
+ * The regions are contiguous, so they stop at the end of the ring: the
+ * rest, if any, comes with the next call.
+ */
+class VMChannel {
+private:
+    uint16_t *ring;
+    uint32_t mask;
+    // words taken so far, by the consumer
+    alignas(64) std::atomic<uint32_t> head;
+    // words put so far, by the producer
+    alignas(64) std::atomic<uint32_t> tail;
+    std::atomic<bool> closed;
+
+public:
+    VMChannel(uint32_t capacity = DEFAULT_CHANNELSIZE);
+
+    ~VMChannel();
+
+    /*
+    PRODUCER
+    */
+    uint16_t *writable(uint32_t *count);
+
+    void commit(uint32_t count);
+
+    bool push(uint16_t word);
+
+    void close(void);
+
+    /*
+    CONSUMER
+    */
+    const uint16_t *readable(uint32_t *count);
+
+    void consume(uint32_t count);
+
+    bool pop(uint16_t *word);
+
+    // closed and drained: nothing is ever going to come out of it
+    bool finished(void);
+
+    uint32_t size(void);
+
+    uint32_t capacity(void);
+
+    bool isClosed(void);
+
+    void reopen(void);
+};
+
+#endif
@@ -0,0 +1,1154 @@
+#ifndef VMEXEC_H
+#define VMEXEC_H
+
+/*
+ * The instruction handlers of VM. They live here, inline, for StaticVM to
+ * inline them into its dispatch as well.
+ */
+#include "vm.h"
+#include <stdlib.h>
+#include <string.h>
+
+inline bool VM::isRegValid(uint8_t reg) {
+    // invalid register
+    if (reg >= NUM_REGS) {
+        DBG_ERROR(("Unknown register: 0x%x.\n", reg));
+        return false;
+    }
+    if (reg == IP || reg == SP || reg == RP) {
+        DBG_ERROR(("Can't modify %s.\n", getRegName(reg)));
+        return false;
+    }
+    return true;
+}
+
+/*
+ * RECV and SEND through chan. Waiting on the channel takes the instruction
+ * back from icount and sets blocked: the engines stop on it as if it had
+ * failed, and run() tells the two cases apart.
+ */
+inline bool VM::recvWord(uint8_t chan, uint16_t *word) {
+    VMChannel *c = chan < IO_CHANNELS ? inputs[chan] : NULL;
+
+    if (!c) {
+        DBG_ERROR(("No input channel 0x%x.\n", chan));
+        return false;
+    }
+    if (c->pop(word)) {
+        flags.ZF = 0;
+        return true;
+    }
+    if (c->finished()) {
+        // end of stream
+        *word = 0;
+        flags.ZF = 1;
+        return true;
+    }
+    DBG_INFO(("Input channel 0x%x is empty.\n", chan));
+    icount--;
+    blocked = true;
+    return false;
+}
+
+inline bool VM::sendWord(uint8_t chan, uint16_t word) {
+    VMChannel *c = chan < IO_CHANNELS ? outputs[chan] : NULL;
+
+    if (!c) {
+        DBG_ERROR(("No output channel 0x%x.\n", chan));
+        return false;
+    }
+    if (c->isClosed()) {
+        DBG_ERROR(("Output channel 0x%x is closed.\n", chan));
+        return false;
+    }
+    if (c->push(word)) {
+        return true;
+    }
+    DBG_INFO(("Output channel 0x%x is full.\n", chan));
+    icount--;
+    blocked = true;
+    return false;
+}
+
+#ifdef STATS
+/*
+ * SHIT stops the VM by failing, and waiting on a channel is not running at
+ * all: the instruction runs again, and starts its block again, next time.
+ */
+inline void VM::statsClose(uint64_t now, bool ok) {
+    if (statop > NUM_OPS) {
+        return;
+    }
+    if (blocked) {
+        if (statentry) {
+            blocks[statip]--;
+            statjump = true;
+        }
+    } else {
+        opstats[statop].count++;
+        opstats[statop].cycles += now - statstart;
+        if (!ok && statop != SHIT) {
+            opstats[statop].failures++;
+        }
+        statjump = ok && INSTR[statop].isJump;
+    }
+    statop = NUM_OPS + 1;
+}
+
+// closes the interval of the instruction before op, which succeeded, and opens op's
+inline void VM::statsNext(uint8_t op, uint16_t ip) {
+    uint64_t now = statsClock();
+
+    statsClose(now, true);
+    statentry = statjump;
+    if (statjump) {
+        blocks[ip]++;
+        statjump = false;
+    }
+    statop = op;
+    statip = ip;
+    statstart = now;
+}
+
+inline void VM::statsStop(bool ok) {
+    statsClose(statsClock(), ok);
+}
+#endif
+
+#ifdef TRACE
+// decodes the operands again, whatever the engine: instructions that can't run too
+inline void VM::traceNext(uint8_t op, uint16_t ip) {
+    trace_record_t *r = trace->next();
+    decoded_t rec;
+
+    decodeAt(ip, &rec);
+    r->ip = ip;
+    r->op = op;
+    r->flags = flags.ZF | flags.CF << 1;
+    r->dst = rec.dst;
+    r->src = rec.src;
+    r->imm = rec.imm;
+    r->dstval = rec.dst < NUM_REGS ? regs[rec.dst] : 0;
+    r->srcval = rec.src < NUM_REGS ? regs[rec.src] : 0;
+    // the decoded engine only writes IP back when it stops
+    if (rec.dst == IP) {
+        r->dstval = ip;
+    }
+    if (rec.src == IP) {
+        r->srcval = ip;
+    }
+    trace->commit();
+}
+#endif
+
+
+/*
+INSTRUCTIONS IMPLEMENTATION
+*/
+
+inline bool VM::execMOVI(void) {
+    /*
+    MOVI R0, 0x2400 | R0 = 0x2400
+    */
+    uint8_t dst;
+    uint16_t src;
+    if (!as.getArgs(regs[IP], &src, &dst)) {
+        return false;
+    }
+    DBG_INFO(("MOVI %s, 0x%x\n", getRegName(dst), src));
+    if (!isRegValid(dst)) {
+        return false;
+    }
+    regs[dst] = src;
+    return true;
+}
+
+inline bool VM::execMOVR(void) {
+    /*
+    MOVR R1, R0 -> R1 = R0
+    ---------------------
+    R1, R0 = 0x10 <- DST / SRC are nibbles!
+    */
+    uint8_t dst, src;
+    if (!as.getArgs(regs[IP], &src, &dst)) {
+        return false;
+    }
+    DBG_INFO(("MOVR %s, %s\n", getRegName(dst), getRegName(src)));
+    if (!isRegValid(src) || !isRegValid(dst)) {
+        return false;
+    }
+    regs[dst] = regs[src];
+    return true;
+}
+
+inline bool VM::execLODI(void) {
+    /*
+    LODI R0, 0x1000 -> R0 = data[0x1000]
+    */
+    uint8_t dst;
+    uint16_t src;
+    if (!as.getArgs(regs[IP], &src, &dst)) {
+        return false;
+    }
+    DBG_INFO(("LODI %s, 0x%x\n", getRegName(dst), src));
+    if (!isRegValid(dst)) {
+        return false;
+    }
+    if (src < 0 || src + sizeof(uint16_t) >= as.getDatasize()) {
+        DBG_ERROR(("Out of bounds: trying to access to invalid data address.\n"));
+        return false;
+    }
+    regs[dst] = *((uint16_t *) &as.getData()[src]);
+    return true;
+}
+
+inline bool VM::execLODR(void) {
+    /*
+    LODR R1, R0 -> R1 = data[R0]
+    */
+    uint8_t dst;
+    uint8_t src;
+    if (!as.getArgs(regs[IP], &src, &dst)) {
+        return false;
+    }
+    DBG_INFO(("LODR %s, %s\n", getRegName(dst), getRegName(src)));
+    if (!isRegValid(src) || !isRegValid(dst)) {
+        return false;
+    }
+    if (regs[src] < 0 || regs[src] + sizeof(uint16_t) >= as.getDatasize()) {
+        DBG_ERROR(("Out of bounds: trying to access to invalid data address.\n"));
+        return false;
+    }
+    regs[dst] = *((uint16_t *) &as.getData()[regs[src]]);
+    return true;
+}
+
+inline bool VM::execSTRI(void) {
+    /*
+    STRI 0x1000, R0 -> data[0x1000] = R0
+    */
+    uint16_t dst;
+    uint8_t src;
+    if (!as.getArgs(regs[IP], &src, &dst)) {
+        return false;
+    }
+    DBG_INFO(("STRI 0x%x, %s\n", dst, getRegName(src)));
+    if (!isRegValid(dst) || !isRegValid(src)) {
+        return false;
+    }
+    if (dst < 0 || dst + sizeof(uint16_t) >= as.getDatasize()) {
+        DBG_ERROR(("Out of bounds: trying to access to invalid data address.\n"));
+        return false;
+    }
+    *((uint16_t *) &as.getData()[dst]) = regs[src];
+    as.dirtyData(dst, sizeof(uint16_t));
+    return true;
+}
+
+inline bool VM::execSTRR(void) {
+    /*
+    STRR R1, R0 -> data[R1] = R0
+    */
+    uint8_t dst, src;
+
+    if (!as.getArgs(regs[IP], &src, &dst)) {
+        return false;
+    }
+    DBG_INFO(("STRR %s, %s\n", getRegName(dst), getRegName(src)));
+    if (!isRegValid(src) || !isRegValid(dst)) {
+        return false;
+    }
+    if (regs[dst] < 0 || regs[dst] + sizeof(uint16_t) >= as.getDatasize()) {
+        DBG_ERROR(("Out of bounds: trying to access to invalid data address.\n"));
+        return false;
+    }
+    *((uint16_t *) &as.getData()[regs[dst]]) = regs[src];
+    as.dirtyData(regs[dst], sizeof(uint16_t));
+    return true;
+}
+
+inline bool VM::execADDI(void) {
+    /*
+    ADDI R0, 0x2 -> R0 += 2
+    */
+    uint8_t dst;
+    uint16_t src;
+
+    if (!as.getArgs(regs[IP], &src, &dst)) {
+        return false;
+    }
+    DBG_INFO(("ADDI %s, 0x%x\n", getRegName(dst), src));
+    if (!isRegValid(dst)) {
+        return false;
+    }
+    regs[dst] += src;
+    return true;
+}
+
+inline bool VM::execADDR(void) {
+    /*
+    ADDR R0, R1 -> R0 += R1
+    */
+    uint8_t dst, src;
+
+    if (!as.getArgs(regs[IP], &src, &dst)) {
+        return false;
+    }
+    DBG_INFO(("ADDR %s, %s\n", getRegName(dst), getRegName(src)));
+    if (!isRegValid(src) || !isRegValid(dst)) {
+        return false;
+    }
+    regs[dst] += regs[src];
+    return true;
+}
+
+inline bool VM::execSUBI(void) {
+    /*
+    SUBI R0, 0x2 -> R0 -= 2
+    */
+    uint8_t dst;
+    uint16_t src;
+
+    if (!as.getArgs(regs[IP], &src, &dst)) {
+        return false;
+    }
+    DBG_INFO(("SUBI %s, 0x%x\n", getRegName(dst), src));
+    if (!isRegValid(dst)) {
+        return false;
+    }
+    regs[dst] -= src;
+    return true;
+}
+
+inline bool VM::execSUBR(void) {
+    /*
+    SUBR R0, R1 -> R0 -= R1
+    */
+    uint8_t dst, src;
+
+    if (!as.getArgs(regs[IP], &src, &dst)) {
+        return false;
+    }
+    DBG_INFO(("SUBR %s, %s\n", getRegName(dst), getRegName(src)));
+    if (!isRegValid(src) || !isRegValid(dst)) {
+        return false;
+    }
+    regs[dst] -= regs[src];
+    return true;
+}
+
+inline bool VM::execANDB(void) {
+    /*
+    ANDB R0, 0x2 -> R0 &= 0x02 or R0 &= [BYTE] 0x02 (low byte)
+    */
+    uint8_t dst, src;
+
+    if (!as.getArgs(regs[IP], &src, &dst, 1)) {
+        return false;
+    }
+    DBG_INFO(("ANDB %s, 0x%x\n", getRegName(dst), src));
+    if (!isRegValid(dst)) {
+        return false;
+    }
+    regs[dst] &= src;
+    return true;
+}
+
+inline bool VM::execANDW(void) {
+    /*
+    ANDW R0, 0x2 -> R0 &= 0x0002 or R0, ^= [WORD] 0x2
+    */
+    uint8_t dst;
+    uint16_t src;
+
+    if (!as.getArgs(regs[IP], &src, &dst)) {
+        return false;
+    }
+    DBG_INFO(("ANDW %s, 0x%x\n", getRegName(dst), src));
+    if (!isRegValid(dst)) {
+        return false;
+    }
+    regs[dst] &= src;
+    return true;
+}
+
+inline bool VM::execANDR(void) {
+    /*
+    ANDR R0, R1 -> R0 ^= R1
+    */
+    uint8_t dst, src;
+
+    if (!as.getArgs(regs[IP], &src, &dst)) {
+        return false;
+    }
+    DBG_INFO(("ANDR %s, %s\n", getRegName(dst), getRegName(src)));
+    if (!isRegValid(src) || !isRegValid(dst)) {
+        return false;
+    }
+    regs[dst] &= regs[src];
+    return true;
+}
+
+inline bool VM::execYORB(void) {
+    /*
+    YORB R0, 0x2 -> R0 |= 0x02 or R0 |= [BYTE] 0x02 (low byte)
+    */
+    uint8_t dst, src;
+
+    if (!as.getArgs(regs[IP], &src, &dst, 1)) {
+        return false;
+    }
+    DBG_INFO(("YORB %s, 0x%x\n", getRegName(dst), src));
+    if (!isRegValid(dst)) {
+        return false;
+    }
+    regs[dst] |= src;
+    return true;
+}
+
+inline bool VM::execYORW(void) {
+    /*
+    YORW R0, 0x2 -> R0 |= 0x0002 or R0, |= [WORD] 0x2
+    */
+    uint8_t dst;
+    uint16_t src;
+
+    if (!as.getArgs(regs[IP], &src, &dst)) {
+        return false;
+    }
+    DBG_INFO(("YORW %s, 0x%x\n", getRegName(dst), src));
+    if (!isRegValid(dst)) {
+        return false;
+    }
+    regs[dst] |= src;
+    return true;
+}
+
+inline bool VM::execYORR(void) {
+    /*
+    YORR R0, R1 -> R0 |= R1
+    */
+    uint8_t dst;
+    uint8_t src;
+
+    if (!as.getArgs(regs[IP], &src, &dst)) {
+        return false;
+    }
+    DBG_INFO(("YORR %s, %s\n", getRegName(dst), getRegName(src)));
+    if (!isRegValid(src) || !isRegValid(dst)) {
+        return false;
+    }
+    regs[dst] |= regs[src];
+    return true;
+}
+
+inline bool VM::execXORB(void) {
+    /*
+    XORB R0, 0x2 -> R0 ^= 0x02 or R0 ^= [BYTE] 0x02 (low byte)
+    */
+    uint8_t dst, src;
+
+    if (!as.getArgs(regs[IP], &src, &dst, 1)) {
+        return false;
+    }
+    DBG_INFO(("XORB %s, 0x%x\n", getRegName(dst), src));
+    if (!isRegValid(dst)) {
+        return false;
+    }
+    regs[dst] ^= src;
+    return true;
+}
+
+inline bool VM::execXORW(void) {
+    /*
+    XORW R0, 0x2 -> R0 ^= 0x0002 or R0, ^= [WORD] 0x2
+    */
+    uint8_t dst;
+    uint16_t src;
+
+    if (!as.getArgs(regs[IP], &src, &dst)) {
+        return false;
+    }
+    DBG_INFO(("XORW %s, 0x%x\n", getRegName(dst), src));
+    if (!isRegValid(dst)) {
+        return false;
+    }
+    regs[dst] ^= src;
+    return true;
+}
+
+inline bool VM::execXORR(void) {
+    /*
+    XORR R0, R1 -> R0 ^= R1
+    */
+    uint8_t dst, src;
+
+    if (!as.getArgs(regs[IP], &src, &dst)) {
+        return false;
+    }
+    DBG_INFO(("XORR %s, %s\n", getRegName(dst), getRegName(src)));
+    if (!isRegValid(src) || !isRegValid(dst)) {
+        return false;
+    }
+    regs[dst] ^= regs[src];
+    return true;
+}
+
+inline bool VM::execNOTR(void) {
+    /*
+    NOTR R0, R1 -> R0 = ~R1
+    */
+    uint8_t dst, src;
+
+    if (!as.getArgs(regs[IP], &src, &dst)) {
+        return false;
+    }
+    DBG_INFO(("NOTR %s, %s\n", getRegName(dst), getRegName(src)));
+    if (!isRegValid(src) || !isRegValid(dst)) {
+        return false;
+    }
+    regs[dst] = ~regs[src];
+    return true;
+}
+
+inline bool VM::execMULI(void) {
+    /*
+    MULI R0, 0x2 | R0 *= 2
+    */
+    uint8_t dst;
+    uint16_t src;
+
+    if (!as.getArgs(regs[IP], &src, &dst)) {
+        return false;
+    }
+    DBG_INFO(("MULI %s, 0x%x\n", getRegName(dst), src));
+    if (!isRegValid(dst)) {
+        return false;
+    }
+    regs[dst] *= src;
+    return true;
+}
+
+inline bool VM::execMULR(void) {
+    /*
+    MULR R0, R1 -> R0 *= R1
+    */
+    uint8_t dst, src;
+
+    if (!as.getArgs(regs[IP], &src, &dst)) {
+        return false;
+    }
+    DBG_INFO(("MULR %s, %s\n", getRegName(dst), getRegName(src)));
+    if (!isRegValid(src) || !isRegValid(dst)) {
+        return false;
+    }
+    regs[dst] *= regs[src];
+    return true;
+}
+
+inline bool VM::execDIVI(void) {
+    /*
+    DIVI R0, 0x2 | R0 /= 2
+    */
+    uint8_t dst;
+    uint16_t src;
+
+    if (!as.getArgs(regs[IP], &src, &dst)) {
+        return false;
+    }
+    DBG_INFO(("DIVI %s, 0x%x\n", getRegName(dst), src));
+    if (!isRegValid(dst) || !isDivArgValid<uint16_t>(src)) {
+        return false;
+    }
+    regs[dst] /= src;
+    return true;
+}
+
+inline bool VM::execDIVR(void) {
+    /*
+    DIVR R0, R1 -> R0 /= R1
+    */
+    uint8_t dst, src;
+
+    if (!as.getArgs(regs[IP], &src, &dst)) {
+        return false;
+    }
+    DBG_INFO(("DIVR %s, %s\n", getRegName(dst), getRegName(src)));
+    if (!isRegValid(src) || !isRegValid(dst) || !isDivArgValid<uint8_t>(regs[src])) {
+        return false;
+    }
+    regs[dst] /= regs[src];
+    return true;
+}
+
+inline bool VM::execSHLI(void) {
+    /*
+    SHLI R0, 0x2 | R0 << 2
+    */
+    uint8_t dst;
+    uint16_t src;
+
+    if (!as.getArgs(regs[IP], &src, &dst)) {
+        return false;
+    }
+    DBG_INFO(("SHLI %s, 0x%x\n", getRegName(dst), src));
+    if (!isRegValid(dst)) {
+        return false;
+    }
+    regs[dst] = regs[dst] << (src & 0x1f);
+    return true;
+}
+
+inline bool VM::execSHLR(void) {
+    /*
+    SHLR R0, R1 -> R0 << R1
+    */
+    uint8_t dst, src;
+
+    if (!as.getArgs(regs[IP], &src, &dst)) {
+        return false;
+    }
+    DBG_INFO(("SHLR %s, %s\n", getRegName(dst), getRegName(src)));
+    if (!isRegValid(src) || !isRegValid(dst)) {
+        return false;
+    }
+    regs[dst] = regs[dst] << (regs[src] & 0x1f);
+    return true;
+}
+
+inline bool VM::execSHRI(void) {
+    /*
+    SHRI R0, 0x2 | R0 >> 2
+    */
+    uint8_t dst;
+    uint16_t src;
+
+    if (!as.getArgs(regs[IP], &src, &dst)) {
+        return false;
+    }
+    DBG_INFO(("SHRI %s, 0x%x\n", getRegName(dst), src));
+    if (!isRegValid(dst)) {
+        return false;
+    }
+    regs[dst] = regs[dst] >> (src & 0x1f);
+    return true;
+}
+
+inline bool VM::execSHRR(void) {
+    /*
+    SHRR R0, R1 -> R0 >> R1
+    */
+    uint8_t dst, src;
+
+    if (!as.getArgs(regs[IP], &src, &dst)) {
+        return false;
+    }
+    DBG_INFO(("SHRR %s, %s\n", getRegName(dst), getRegName(src)));
+    if (!isRegValid(src) || !isRegValid(dst)) {
+        return false;
+    }
+    regs[dst] = regs[dst] >> (regs[src] & 0x1f);
+    return true;
+}
+
+inline bool VM::execPUSH(void) {
+    uint8_t reg;
+
+    if (!as.getArgs(regs[IP], &reg)) {
+        return false;
+    }
+    DBG_INFO(("PUSH %s\n", getRegName(reg)));
+    if (!isRegValid(reg)) {
+        return false;
+    }
+    if (regs[SP] + sizeof(uint16_t) >= as.getStacksize()) {
+        DBG_ERROR(("Out of bounds: stack is going over the stack size!\n"));
+        return false;
+    }
+    memcpy(&as.getStack()[regs[SP]], &regs[reg], sizeof(uint16_t));
+    regs[SP] += sizeof(uint16_t);
+    as.dirtyStack(regs[SP]);
+    return true;
+}
+
+inline bool VM::execPOOP(void) {
+    uint8_t reg;
+
+    if (!as.getArgs(regs[IP], &reg)) {
+        return false;
+    }
+    DBG_INFO(("POOP %s\n", getRegName(reg)));
+    if (!isRegValid(reg)) {
+        return false;
+    }
+    if (regs[SP] < sizeof(uint16_t)) {
+        DBG_ERROR(("Out of bounds: stack is going below 0!\n"));
+        return false;
+    }
+    regs[SP] -= sizeof(uint16_t);
+    memcpy(&regs[reg], &as.getStack()[regs[SP]], sizeof(uint16_t));
+    return true;
+}
+
+inline bool VM::execCMPB(void) {
+    /*
+    CMPB R0, 0x2 -> Compare immediate with lower half (BYTE) register
+    */
+    uint8_t dst, src;
+
+    if (!as.getArgs(regs[IP], &src, &dst, 1)) {
+        return false;
+    }
+    DBG_INFO(("CMPB %s, 0x%x\n", getRegName(dst), src));
+    if (!isRegValid(dst)) {
+        return false;
+    }
+    if (*((uint8_t *) &regs[dst]) == src) {
+        flags.ZF = 1;
+    } else {
+        flags.ZF = 0;
+    }
+    if (*((uint8_t *) &regs[dst]) > src) {
+        flags.CF = 0;
+    } else {
+        flags.CF = 1;
+    }
+    return true;
+}
+
+inline bool VM::execCMPW(void) {
+    /*
+    CMPW R0, 0x2 -> Compare immediate with whole (WORD) register
+    */
+    uint8_t dst;
+    uint16_t src;
+
+    if (!as.getArgs(regs[IP], &src, &dst)) {
+        return false;
+    }
+    DBG_INFO(("CMPW %s, 0x%x\n", getRegName(dst), src));
+    if (!isRegValid(dst)) {
+        return false;
+    }
+    if (regs[dst] == src) {
+        flags.ZF = 1;
+    } else {
+        flags.ZF = 0;
+    }
+    if (regs[dst] > src) {
+        flags.CF = 0;
+    } else {
+        flags.CF = 1;
+    }
+    return true;
+}
+
+inline bool VM::execCMPR(void) {
+    /*
+    CMPR R0, R1 -> Compares 2 registers
+    */
+    uint8_t dst;
+    uint8_t src;
+
+    if (!as.getArgs(regs[IP], &src, &dst)) {
+        return false;
+    }
+    DBG_INFO(("CMPR %s, %s\n", getRegName(dst), getRegName(src)));
+    if (!isRegValid(dst) || !isRegValid(src)) {
+        return false;
+    }
+    if (regs[dst] == regs[src]) {
+        flags.ZF = 1;
+    } else {
+        flags.ZF = 0;
+    }
+    if (regs[dst] > regs[src]) {
+        flags.CF = 0;
+    } else {
+        flags.CF = 1;
+    }
+    return true;
+}
+
+inline bool VM::execJMPI(void) {
+    /*
+    JMPI 0x2000 -> IP = 0x2000
+    */
+    uint16_t imm;
+
+    if (!as.getArgs(regs[IP], &imm)) {
+        return false;
+    }
+    DBG_INFO(("JMPI 0x%x\n", imm));
+    regs[IP] = imm;
+    return true;
+}
+
+inline bool VM::execJMPR(void) {
+    /*
+    JMPR R0 -> IP = R0
+    */
+    uint8_t reg;
+
+    if (!as.getArgs(regs[IP], &reg)) {
+        return false;
+    }
+    DBG_INFO(("JMPR %s = 0x%x\n", getRegName(reg), regs[reg]));
+    if (!isRegValid(reg)) {
+        return false;
+    }
+    regs[IP] = regs[reg];
+    return true;
+}
+
+inline bool VM::execJPAI(void) {
+    /*
+    JPAI 0x2000 -> Jump to 0x2000 if above
+    */
+    uint16_t imm;
+
+    if (!as.getArgs(regs[IP], &imm)) {
+        return false;
+    }
+    DBG_INFO(("JPAI 0x%x\n", imm));
+    if (flags.CF == 0 && flags.ZF == 0) {
+        regs[IP] = imm;
+    } else {
+        regs[IP] += JPAI_SIZE;
+    }
+    return true;
+}
+
+inline bool VM::execJPAR(void) {
+    /*
+    JPAR R0 -> Jump to [R0] if above
+    */
+    uint8_t reg;
+
+    if (!as.getArgs(regs[IP], &reg)) {
+        return false;
+    }
+    DBG_INFO(("JPAR %s = 0x%x\n", getRegName(reg), regs[reg]));
+    if (!isRegValid(reg)) {
+        return false;
+    }
+    if (flags.CF == 0 && flags.ZF == 0) {
+        regs[IP] = reg;
+    } else {
+        regs[IP] += JPAR_SIZE;
+    }
+    return true;
+}
+
+inline bool VM::execJPBI(void) {
+    /*
+    JPBI 0x2000 -> Jump to 0x2000 if below
+    */
+    uint16_t imm;
+
+    if (!as.getArgs(regs[IP], &imm)) {
+        return false;
+    }
+    DBG_INFO(("JPBI 0x%x\n", imm));
+    if (flags.CF == 1) {
+        regs[IP] = imm;
+    } else {
+        regs[IP] += JPBI_SIZE;
+    }
+    return true;
+}
+
+inline bool VM::execJPBR(void) {
+    /*
+    JPBR R0 -> Jump to [R0] if below
+    */
+    uint8_t reg;
+
+    if (!as.getArgs(regs[IP], &reg)) {
+        return false;
+    }
+    DBG_INFO(("JPBR %s = 0x%x\n", getRegName(reg), regs[reg]));
+    if (!isRegValid(reg)) {
+        return false;
+    }
+    if (flags.CF == 1) {
+        regs[IP] = reg;
+    } else {
+        regs[IP] += JPBR_SIZE;
+    }
+    return true;
+}
+
+inline bool VM::execJPEI(void) {
+    /*
+    JPEI 0x2000 -> Jump to 0x2000 if equal
+    */
+    uint16_t imm;
+
+    if (!as.getArgs(regs[IP], &imm)) {
+        return false;
+    }
+    DBG_INFO(("JPEI 0x%x\n", imm));
+    if (flags.ZF == 1) {
+        regs[IP] = imm;
+    } else {
+        regs[IP] += JPEI_SIZE;
+    }
+    return true;
+}
+
+inline bool VM::execJPER(void) {
+    /*
+    JPNR R0 -> Jump to [R0] if equal
+    */
+    uint8_t reg;
+
+    if (!as.getArgs(regs[IP], &reg)) {
+        return false;
+    }
+    DBG_INFO(("JPER %s = 0x%x\n", getRegName(reg), regs[reg]));
+    if (!isRegValid(reg)) {
+        return false;
+    }
+    if (flags.ZF == 1) {
+        regs[IP] = reg;
+    } else {
+        regs[IP] += JPER_SIZE;
+    }
+    return true;
+}
+
+inline bool VM::execJPNI(void) {
+    /*
+    JPEI 0x2000 -> Jump to 0x2000 if not equal
+    */
+    uint16_t imm;
+
+    if (!as.getArgs(regs[IP], &imm)) {
+        return false;
+    }
+    DBG_INFO(("JPNI 0x%x\n", imm));
+    if (flags.ZF == 0) {
+        regs[IP] = imm;
+    } else {
+        regs[IP] += JPNI_SIZE;
+    }
+    return true;
+}
+
+inline bool VM::execJPNR(void) {
+    /*
+    JPER R0 -> Jump to [R0] if not equal
+    */
+    uint8_t reg;
+
+    if (!as.getArgs(regs[IP], &reg)) {
+        return false;
+    }
+    DBG_INFO(("JPNR %s = 0x%x\n", getRegName(reg), regs[reg]));
+    if (!isRegValid(reg)) {
+        return false;
+    }
+    if (flags.ZF == 0) {
+        regs[IP] = reg;
+    } else {
+        regs[IP] += JPNR_SIZE;
+    }
+    return true;
+}
+
+inline bool VM::execCALL(void) {
+    /*
+    CALL 0x1000 -> Jump to data[0x1000] and saves the RP onto the stack
+    */
+    uint16_t dst;
+
+    if (!as.getArgs(regs[IP], &dst)) {
+        return false;
+    }
+    DBG_INFO(("CALL 0x%x\n", dst));
+    if (regs[SP] + sizeof(uint16_t) >= as.getStacksize()) {
+        DBG_ERROR(("Out of bounds: stack is going over the stack size!\n"));
+        return false;
+    }
+    if (regs[IP] + 1 + sizeof(dst) >= as.getCodesize()) {
+        DBG_ERROR(("Out of bounds: trying to read over codesize.\n"));
+        return false;
+    }
+    regs[RP] = regs[IP] + 1 + sizeof(dst);
+    *((uint16_t *) &as.getStack()[regs[SP]]) = regs[RP];
+    regs[SP] += sizeof(uint16_t);
+    as.dirtyStack(regs[SP]);
+    regs[IP] = dst;
+    return true;
+}
+
+inline bool VM::execRETN(void) {
+    /*
+    RETN -> IP = RP , restores saved return IP
+    */
+    if (regs[SP] < sizeof(uint16_t)) {
+        DBG_ERROR(("Out of bounds: stack is going below 0!\n"));
+        return false;
+    }
+    regs[SP] -= sizeof(uint16_t);
+    DBG_INFO(("RETN 0x%x\n", regs[RP]));
+    regs[IP] = regs[RP];
+    return true;
+}
+
+inline bool VM::execGRMN(void) {
+    uint8_t i;
+    for (i = 0; i < NUM_REGS; i++) {
+        if (i != IP && i != RP && i != SP) {
+            regs[i] = 0x4747;
+        }
+    }
+    return true;
+}
+
+/*
+ * The banked instructions fail without far memory, like the unassigned
+ * opcodes they used to be.
+ */
+inline bool VM::execBNKI(void) {
+    /*
+    BNKI 0x12 -> LODF / STRF reach far[0x120000:0x130000]
+    */
+    uint16_t imm;
+
+    if (!as.getArgs(regs[IP], &imm)) {
+        return false;
+    }
+    DBG_INFO(("BNKI 0x%x\n", imm));
+    if (!as.getFarsize()) {
+        DBG_ERROR(("No far memory to bank.\n"));
+        return false;
+    }
+    bank = imm;
+    return true;
+}
+
+inline bool VM::execBNKR(void) {
+    /*
+    BNKR R0 -> LODF / STRF reach far[R0 << 16:(R0 + 1) << 16]
+    */
+    uint8_t reg;
+
+    if (!as.getArgs(regs[IP], &reg)) {
+        return false;
+    }
+    DBG_INFO(("BNKR %s\n", getRegName(reg)));
+    if (!isRegValid(reg)) {
+        return false;
+    }
+    if (!as.getFarsize()) {
+        DBG_ERROR(("No far memory to bank.\n"));
+        return false;
+    }
+    bank = regs[reg];
+    return true;
+}
+
+inline bool VM::execLODF(void) {
+    /*
+    LODF R1, R0 -> R1 = far[bank << 16 | R0]
+    */
+    uint8_t dst, src;
+    uint32_t addr;
+
+    if (!as.getArgs(regs[IP], &src, &dst)) {
+        return false;
+    }
+    DBG_INFO(("LODF %s, %s\n", getRegName(dst), getRegName(src)));
+    if (!isRegValid(src) || !isRegValid(dst)) {
+        return false;
+    }
+    addr = (uint32_t) bank << 16 | regs[src];
+    if ((uint64_t) addr + sizeof(uint16_t) > as.getFarsize()) {
+        DBG_ERROR(("Out of bounds: trying to access to invalid far address 0x%x.\n", addr));
+        return false;
+    }
+    regs[dst] = *((uint16_t *) &as.getFar()[addr]);
+    return true;
+}
+
+inline bool VM::execSTRF(void) {
+    /*
+    STRF R1, R0 -> far[bank << 16 | R1] = R0
+    */
+    uint8_t dst, src;
+    uint32_t addr;
+
+    if (!as.getArgs(regs[IP], &src, &dst)) {
+        return false;
+    }
+    DBG_INFO(("STRF %s, %s\n", getRegName(dst), getRegName(src)));
+    if (!isRegValid(src) || !isRegValid(dst)) {
+        return false;
+    }
+    addr = (uint32_t) bank << 16 | regs[dst];
+    if ((uint64_t) addr + sizeof(uint16_t) > as.getFarsize()) {
+        DBG_ERROR(("Out of bounds: trying to access to invalid far address 0x%x.\n", addr));
+        return false;
+    }
+    *((uint16_t *) &as.getFar()[addr]) = regs[src];
+    return true;
+}
+
+inline bool VM::execRECV(void) {
+    /*
+    RECV R0, 0x1 -> R0 = next word of input channel 1, ZF = 1 at its end
+    */
+    uint8_t dst, chan;
+
+    if (!as.getArgs(regs[IP], &chan, &dst, 1)) {
+        return false;
+    }
+    DBG_INFO(("RECV %s, 0x%x\n", getRegName(dst), chan));
+    if (!isRegValid(dst)) {
+        return false;
+    }
+    return recvWord(chan, &regs[dst]);
+}
+
+inline bool VM::execSEND(void) {
+    /*
+    SEND R0, 0x1 -> output channel 1 gets R0
+    */
+    uint8_t src, chan;
+
+    if (!as.getArgs(regs[IP], &chan, &src, 1)) {
+        return false;
+    }
+    DBG_INFO(("SEND %s, 0x%x\n", getRegName(src), chan));
+    if (!isRegValid(src)) {
+        return false;
+    }
+    return sendWord(chan, regs[src]);
+}
+
+inline bool VM::execSHIT(void) {
+    DBG_INFO(("SHIT\n"));
+    return false;
+}
+
+inline bool VM::execNOPE(void) {
+    return true;
+}
+
+inline bool VM::execDEBG(void) {
+    status();
+    return true;
+}
+
+inline bool VM::execWAT(void) {
+    if (regs[IP] >= as.getCodesize()) {
+        DBG_ERROR(("Out of bounds: IP 0x%x is over codesize.\n", regs[IP]));
+    } else {
+        DBG_ERROR(("WAT: 0x%x\n", as.getCode()[regs[IP]]));
+    }
+    return false;
+}
+
+#endif
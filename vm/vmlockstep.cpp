@@ -0,0 +1,422 @@
+#include "vmlockstep.h"
+#include <string.h>
+#include <stdexcept>
+
+#define LANE(_l_) for (_l_ = 0; _l_ < LANES; _l_++)
+#define LOAD16(_mem_, _addr_, _l_)                                             \
+    ((uint16_t) ((_mem_)[(_addr_) * LANES + (_l_)] |                           \
+                 (_mem_)[((_addr_) + 1) * LANES + (_l_)] << 8))
+#define STORE16(_mem_, _addr_, _l_, _value_)                                   \
+    do {                                                                       \
+        (_mem_)[(_addr_) * LANES + (_l_)] = (_value_) & 0xff;                  \
+        (_mem_)[((_addr_) + 1) * LANES + (_l_)] = (_value_) >> 8;              \
+    } while (0)
+
+/*
+CONSTRUCTORS
+*/
+template<uint8_t LANES>
+VMLockstep<LANES>::VMLockstep(uint8_t *key, uint8_t *code, uint32_t codesize) : vm(key, code, codesize) {
+    VMAddrSpace *as = vm.addressSpace();
+    uint32_t i;
+
+    this->codesize = as->getCodesize();
+    datasize = as->getDatasize();
+    stacksize = as->getStacksize();
+    decoded.resize(this->codesize);
+    for (i = 0; i < this->codesize; i++) {
+        decoded[i].count = vm.decodeAt(i, &decoded[i]);
+    }
+    data = new uint8_t[datasize * LANES];
+    stack = new uint8_t[stacksize * LANES];
+    splitcount = 0;
+}
+
+template<uint8_t LANES>
+VMLockstep<LANES>::~VMLockstep() {
+    delete[] data;
+    delete[] stack;
+}
+
+/*
+SPLITTING
+*/
+
+// resumes lane on the scalar VM and runs it to the end
+template<uint8_t LANES>
+void VMLockstep<LANES>::split(uint8_t lane) {
+    VMAddrSpace *as = vm.addressSpace();
+    uint32_t i;
+
+    vm.resetState();
+    for (i = R0; i <= S3; i++) {
+        vm.regs[i] = regs[i][lane];
+    }
+    vm.regs[IP] = ip;
+    vm.regs[RP] = rp;
+    vm.regs[SP] = sp;
+    vm.flags.ZF = zf[lane];
+    vm.flags.CF = cf[lane];
+    vm.icount = icount;
+    for (i = 0; i < datasize; i++) {
+        as->getData()[i] = data[i * LANES + lane];
+    }
+    for (i = 0; i < sp; i++) {
+        as->getStack()[i] = stack[i * LANES + lane];
+    }
+    as->dirtyData(0, datasize);
+    as->dirtyStack(sp);
+    vm.run();
+    memcpy(sections[lane], as->getData(), stride);
+    for (i = 0; i < NUM_REGS; i++) {
+        states[lane]->regs[i] = vm.regs[i];
+    }
+    states[lane]->flags = vm.flags;
+    states[lane]->executed = vm.icount;
+    active[lane] = 0;
+}
+
+/*
+ * Splits off the active lanes for which ok is false, and counts them as
+ * diverging. Returns whether any lane is left.
+ */
+template<uint8_t LANES>
+bool VMLockstep<LANES>::splitUnless(const uint8_t *ok) {
+    uint8_t l, diverging = 0, left = 0;
+
+    LANE(l) {
+        diverging |= active[l] & !ok[l];
+    }
+    if (diverging) {
+        LANE(l) {
+            if (active[l] && !ok[l]) {
+                split(l);
+                splitcount++;
+            }
+        }
+    }
+    LANE(l) {
+        left |= active[l];
+    }
+    return left;
+}
+
+template<uint8_t LANES>
+void VMLockstep<LANES>::splitAll(void) {
+    uint8_t l;
+
+    LANE(l) {
+        if (active[l]) {
+            split(l);
+        }
+    }
+}
+
+/*
+ * Conditional jumps follow the majority of the active lanes, the others are
+ * split off before jumping.
+ */
+template<uint8_t LANES>
+bool VMLockstep<LANES>::branch(const uint8_t *taken) {
+    uint8_t l, ok[LANES], jump;
+    uint32_t count = 0, total = 0;
+
+    LANE(l) {
+        count += active[l] & taken[l];
+        total += active[l];
+    }
+    jump = 2 * count > total;
+    if (count != 0 && count != total) {
+        LANE(l) {
+            ok[l] = taken[l] == jump;
+        }
+        splitUnless(ok);
+    }
+    return jump;
+}
+
+/*
+ENGINE
+*/
+
+/*
+ * Runs the current group until every lane has been split off. Anything but
+ * the plain data flow (SHIT, WAT?, DEBG, failing records, stack errors...)
+ * splits off all the lanes so that the scalar VM reproduces it exactly.
+ */
+template<uint8_t LANES>
+void VMLockstep<LANES>::runGroup(void) {
+    VM::decoded_t *rec;
+    uint16_t *d, *s, addr;
+    uint8_t l, ok[LANES], taken[LANES];
+
+    while (true) {
+        if (ip >= codesize || !decoded[ip].count) {
+            splitAll();
+            return;
+        }
+        rec = &decoded[ip];
+        d = regs[rec->dst];
+        s = regs[rec->src];
+        switch (rec->op) {
+            case MOVI:
+                LANE(l) d[l] = rec->imm;
+                break;
+            case MOVR:
+                LANE(l) d[l] = s[l];
+                break;
+            case LODI:
+                LANE(l) d[l] = LOAD16(data, rec->imm, l);
+                break;
+            case LODR:
+                LANE(l) ok[l] = s[l] + sizeof(uint16_t) < datasize;
+                if (!splitUnless(ok)) {
+                    return;
+                }
+                LANE(l) {
+                    addr = ok[l] ? s[l] : 0;
+                    d[l] = LOAD16(data, addr, l);
+                }
+                break;
+            case STRI:
+                LANE(l) STORE16(data, rec->imm, l, s[l]);
+                break;
+            case STRR:
+                LANE(l) ok[l] = d[l] + sizeof(uint16_t) < datasize;
+                if (!splitUnless(ok)) {
+                    return;
+                }
+                LANE(l) {
+                    if (ok[l]) {
+                        STORE16(data, d[l], l, s[l]);
+                    }
+                }
+                break;
+            case ADDI:
+                LANE(l) d[l] += rec->imm;
+                break;
+            case ADDR:
+                LANE(l) d[l] += s[l];
+                break;
+            case SUBI:
+                LANE(l) d[l] -= rec->imm;
+                break;
+            case SUBR:
+                LANE(l) d[l] -= s[l];
+                break;
+            case ANDB:
+            case ANDW:
+                LANE(l) d[l] &= rec->imm;
+                break;
+            case ANDR:
+                LANE(l) d[l] &= s[l];
+                break;
+            case YORB:
+            case YORW:
+                LANE(l) d[l] |= rec->imm;
+                break;
+            case YORR:
+                LANE(l) d[l] |= s[l];
+                break;
+            case XORB:
+            case XORW:
+                LANE(l) d[l] ^= rec->imm;
+                break;
+            case XORR:
+                LANE(l) d[l] ^= s[l];
+                break;
+            case NOTR:
+                LANE(l) d[l] = ~s[l];
+                break;
+            case MULI:
+                LANE(l) d[l] *= rec->imm;
+                break;
+            case MULR:
+                LANE(l) d[l] *= s[l];
+                break;
+            case DIVI:
+                LANE(l) d[l] /= rec->imm;
+                break;
+            case DIVR:
+                LANE(l) ok[l] = (uint8_t) s[l] != 0;
+                if (!splitUnless(ok)) {
+                    return;
+                }
+                // lanes already split off may hold anything
+                LANE(l) d[l] = ok[l] ? d[l] / s[l] : d[l];
+                break;
+            case SHLI:
+                LANE(l) d[l] = d[l] << (rec->imm & 0x1f);
+                break;
+            case SHLR:
+                LANE(l) d[l] = d[l] << (s[l] & 0x1f);
+                break;
+            case SHRI:
+                LANE(l) d[l] = d[l] >> (rec->imm & 0x1f);
+                break;
+            case SHRR:
+                LANE(l) d[l] = d[l] >> (s[l] & 0x1f);
+                break;
+            case PUSH:
+                if (sp + sizeof(uint16_t) >= stacksize) {
+                    splitAll();
+                    return;
+                }
+                LANE(l) STORE16(stack, sp, l, d[l]);
+                sp += sizeof(uint16_t);
+                break;
+            case POOP:
+                if (sp < sizeof(uint16_t)) {
+                    splitAll();
+                    return;
+                }
+                sp -= sizeof(uint16_t);
+                LANE(l) d[l] = LOAD16(stack, sp, l);
+                break;
+            case CMPB:
+                LANE(l) {
+                    zf[l] = (uint8_t) d[l] == rec->imm;
+                    cf[l] = (uint8_t) d[l] <= rec->imm;
+                }
+                break;
+            case CMPW:
+                LANE(l) {
+                    zf[l] = d[l] == rec->imm;
+                    cf[l] = d[l] <= rec->imm;
+                }
+                break;
+            case CMPR:
+                LANE(l) {
+                    zf[l] = d[l] == s[l];
+                    cf[l] = d[l] <= s[l];
+                }
+                break;
+            case JMPI:
+                icount++;
+                ip = rec->imm;
+                continue;
+            case JMPR:
+                // the first active lane decides where to go
+                for (l = 0; !active[l]; l++);
+                addr = d[l];
+                LANE(l) ok[l] = d[l] == addr;
+                if (!splitUnless(ok)) {
+                    return;
+                }
+                icount++;
+                ip = addr;
+                continue;
+            case JPAI:
+            case JPAR:
+                LANE(l) taken[l] = !cf[l] & !zf[l];
+                goto CONDITIONAL;
+            case JPBI:
+            case JPBR:
+                LANE(l) taken[l] = cf[l];
+                goto CONDITIONAL;
+            case JPEI:
+            case JPER:
+                LANE(l) taken[l] = zf[l];
+                goto CONDITIONAL;
+            case JPNI:
+            case JPNR:
+                LANE(l) taken[l] = !zf[l];
+            CONDITIONAL:
+                if (!branch(taken)) {
+                    icount++;
+                    ip = rec->next;
+                    continue;
+                }
+                icount++;
+                // the register jumps go to the register index, like execJPxR
+                ip = rec->op == JPAR || rec->op == JPBR || rec->op == JPER || rec->op == JPNR ? rec->dst : rec->imm;
+                continue;
+            case CALL:
+                if (sp + sizeof(uint16_t) >= stacksize) {
+                    splitAll();
+                    return;
+                }
+                rp = rec->next;
+                LANE(l) STORE16(stack, sp, l, rp);
+                sp += sizeof(uint16_t);
+                icount++;
+                ip = rec->imm;
+                continue;
+            case RETN:
+                if (sp < sizeof(uint16_t)) {
+                    splitAll();
+                    return;
+                }
+                sp -= sizeof(uint16_t);
+                icount++;
+                ip = rp;
+                continue;
+            case GRMN:
+                for (addr = R0; addr <= S3; addr++) {
+                    LANE(l) regs[addr][l] = 0x4747;
+                }
+                break;
+            case NOPE:
+                break;
+            default:
+                splitAll();
+                return;
+        }
+        icount++;
+        ip = rec->next;
+    }
+}
+
+/*
+ * Runs the program once for each of the count data sections found every
+ * stride bytes from data, LANES of them at a time. Data sections and states
+ * are filled in as with VMBatch::run.
+ */
+template<uint8_t LANES>
+void VMLockstep<LANES>::run(uint8_t *data, uint32_t stride, uint32_t count, vm_state_t *states) {
+    uint32_t job, i;
+    uint8_t l, r;
+
+    if (stride > datasize) {
+        throw std::invalid_argument("Data sections bigger than the data segment");
+    }
+    this->stride = stride;
+    for (job = 0; job < count; job += LANES) {
+        memset(this->data, 0, datasize * LANES);
+        LANE(l) {
+            for (r = R0; r <= S3; r++) {
+                regs[r][l] = 0;
+            }
+            zf[l] = 0;
+            cf[l] = 0;
+            active[l] = job + l < count;
+            if (!active[l]) {
+                continue;
+            }
+            sections[l] = data + (uint64_t) (job + l) * stride;
+            this->states[l] = &states[job + l];
+            for (i = 0; i < stride; i++) {
+                this->data[i * LANES + l] = sections[l][i];
+            }
+        }
+        ip = 0;
+        rp = 0;
+        sp = 0;
+        icount = 0;
+        runGroup();
+    }
+}
+
+/*
+ * Lanes split off by a branch or a failing check, while other lanes of their
+ * group went on in lockstep. Lanes finishing together, at the end of the
+ * program or on a stack error, aren't counted.
+ */
+template<uint8_t LANES>
+uint64_t VMLockstep<LANES>::splits(void) {
+    return splitcount;
+}
+
+template class VMLockstep<8>;
+template class VMLockstep<16>;
+template class VMLockstep<32>;
@@ -0,0 +1,69 @@
+#ifndef VMLOCKSTEP_H
+#define VMLOCKSTEP_H
+
+#include <stdint.h>
+#include <vector>
+#include "vm.h"
+
+#if defined(__x86_64__) && defined(__linux__) && defined(__GNUC__) && !defined(__clang__)
+// lanes are run with AVX-512 or AVX2 when the host has them
+#define LOCKSTEP_CLONES __attribute__((target_clones("arch=skylake-avx512", "avx2", "default")))
+#else
+#define LOCKSTEP_CLONES
+#endif
+
+/*
+ * Runs LANES instances of one program in lockstep over different data
+ * sections. Registers, flags, data and stack are stored lane by lane, so that
+ * every decoded instruction is executed once for all the lanes with vector
+ * instructions. Lanes leaving the common control flow, and lanes about to
+ * fail, are split off: a scalar VM resumes them from the instruction where
+ * they diverged and runs them to the end.
+ */
+template<uint8_t LANES>
+class VMLockstep {
+private:
+    // decodes the program and runs the lanes split off
+    VM vm;
+    std::vector<VM::decoded_t> decoded;
+    uint32_t codesize, datasize, stacksize;
+    /*
+     * R0 -> S3 of every lane. IP, RP and SP only change with the control
+     * flow, so they are the same for all the lanes still in lockstep.
+     */
+    alignas(64) uint16_t regs[S3 + 1][LANES];
+    alignas(64) uint8_t zf[LANES];
+    alignas(64) uint8_t cf[LANES];
+    alignas(64) uint8_t active[LANES];
+    uint16_t ip, rp, sp;
+    uint64_t icount;
+    // byte addr of lane l is at [addr * LANES + l]
+    uint8_t *data, *stack;
+    uint64_t splitcount;
+
+    // the group of jobs being run
+    uint8_t *sections[LANES];
+    vm_state_t *states[LANES];
+    uint32_t stride;
+
+    void split(uint8_t lane);
+
+    bool splitUnless(const uint8_t *ok);
+
+    void splitAll(void);
+
+    bool branch(const uint8_t *taken);
+
+    LOCKSTEP_CLONES void runGroup(void);
+
+public:
+    VMLockstep(uint8_t *key, uint8_t *code, uint32_t codesize);
+
+    ~VMLockstep();
+
+    void run(uint8_t *data, uint32_t stride, uint32_t count, vm_state_t *states);
+
+    uint64_t splits(void);
+};
+
+#endif
@@ -0,0 +1,103 @@
+#include "vmopcodecache.h"
+#include <string.h>
+#include <chrono>
+#include "debug.h"
+
+std::atomic<const opcode_map_t *> VMOpcodeCache::slots[OPCODE_CACHE_SLOTS];
+std::mutex VMOpcodeCache::lock;
+uint32_t VMOpcodeCache::count = 0;
+std::atomic<uint64_t> VMOpcodeCache::hitcount(0), VMOpcodeCache::misscount(0), VMOpcodeCache::shufflens(0);
+
+// FNV-1a
+uint64_t VMOpcodeCache::hash(const uint8_t *key, uint32_t keysize) {
+    uint64_t h = 0xcbf29ce484222325;
+    uint32_t i;
+
+    for (i = 0; i < keysize; i++) {
+        h = (h ^ key[i]) * 0x100000001b3;
+    }
+    return h;
+}
+
+/*
+ * Linear probing from the slot of h. Returns the map of key, or NULL with
+ * slot set to the first free slot.
+ */
+const opcode_map_t *VMOpcodeCache::find(uint64_t h, const uint8_t *key, uint32_t keysize, uint32_t *slot) {
+    const opcode_map_t *map;
+    uint32_t i;
+
+    for (i = h % OPCODE_CACHE_SLOTS;; i = (i + 1) % OPCODE_CACHE_SLOTS) {
+        map = slots[i].load(std::memory_order_acquire);
+        if (map == NULL) {
+            *slot = i;
+            return NULL;
+        }
+        if (map->hash == h && strlen(map->key) == keysize && memcmp(map->key, key, keysize) == 0) {
+            return map;
+        }
+    }
+}
+
+/*
+INTERFACE
+*/
+
+/*
+ * Returns the map of key, shuffling and caching it the first time. Once the
+ * cache is full, keys not in it are shuffled into scratch instead.
+ */
+const opcode_map_t *VMOpcodeCache::lookup(const uint8_t *key, opcode_map_t *scratch) {
+    uint32_t keysize = strlen((const char *) key), slot;
+    uint64_t h = hash(key, keysize);
+    const opcode_map_t *map;
+    opcode_map_t *created;
+
+    map = find(h, key, keysize, &slot);
+    if (map) {
+        hitcount.fetch_add(1, std::memory_order_relaxed);
+        return map;
+    }
+    misscount.fetch_add(1, std::memory_order_relaxed);
+    auto start = std::chrono::steady_clock::now();
+    shuffle(key, scratch);
+    auto end = std::chrono::steady_clock::now();
+    shufflens.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count(),
+                        std::memory_order_relaxed);
+
+    std::lock_guard<std::mutex> guard(lock);
+    // another thread may have added it meanwhile
+    map = find(h, key, keysize, &slot);
+    if (map) {
+        return map;
+    }
+    if (count >= OPCODE_CACHE_KEYS) {
+        DBG_INFO(("Opcode cache full, not caching key: %s\n", key));
+        return scratch;
+    }
+    created = new opcode_map_t(*scratch);
+    created->hash = h;
+    created->key = new char[keysize + 1];
+    memcpy(created->key, key, keysize + 1);
+    slots[slot].store(created, std::memory_order_release);
+    count++;
+    return created;
+}
+
+uint64_t VMOpcodeCache::hits(void) {
+    return hitcount.load(std::memory_order_relaxed);
+}
+
+uint64_t VMOpcodeCache::misses(void) {
+    return misscount.load(std::memory_order_relaxed);
+}
+
+// seconds of key schedule the hits saved, at the average cost of a miss
+double VMOpcodeCache::saved(void) {
+    uint64_t missed = misses();
+
+    if (!missed) {
+        return 0;
+    }
+    return hits() * (shufflens.load(std::memory_order_relaxed) / 1e9 / missed);
+}
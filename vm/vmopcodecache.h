@@ -0,0 +1,77 @@
+#ifndef VMOPCODECACHE_H
+#define VMOPCODECACHE_H
+
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include "instruction.h"
+
+// keys the cache holds at most, the others are shuffled on every lookup
+#define OPCODE_CACHE_KEYS 192
+#define OPCODE_CACHE_SLOTS 256
+
+// the opcodes a key shuffles the instructions to
+typedef struct opcode_map {
+    uint64_t hash;
+    char *key;
+    // OPCODES of a VM: the instruction each byte decodes to
+    uint8_t opcodes[0x100];
+    // INSTR[i].value of a VM: the byte each instruction is assembled to
+    uint8_t values[NUM_OPS];
+} opcode_map_t;
+
+/*
+ * Process-wide cache of the RC4 shuffles done by VM::encryptOpcodes, so that
+ * VMs built with a key seen before skip the key schedule. Maps are never
+ * freed nor changed once published: lookups don't take any lock, only
+ * inserting a new key does.
+ */
+class VMOpcodeCache {
+private:
+    static std::atomic<const opcode_map_t *> slots[OPCODE_CACHE_SLOTS];
+    static std::mutex lock;
+    static uint32_t count;
+    static std::atomic<uint64_t> hitcount, misscount, shufflens;
+
+    static uint64_t hash(const uint8_t *key, uint32_t keysize);
+
+    static const opcode_map_t *find(uint64_t h, const uint8_t *key, uint32_t keysize, uint32_t *slot);
+
+public:
+    // RC4 KSA! :-D constexpr, for StaticVM to shuffle its key at compile time
+    static constexpr void shuffle(const uint8_t *key, opcode_map_t *map) {
+        uint8_t arr[256] = {};
+        uint32_t i = 0, j = 0, tmp = 0, keysize = 0;
+
+        while (key[keysize]) {
+            keysize++;
+        }
+        for (i = 0; i < 256; i++) {
+            arr[i] = i;
+        }
+        j = 0;
+        for (i = 0; i < 256; i++) {
+            j = (j + arr[i] + key[i % keysize]) % 256;
+            tmp = arr[i];
+            arr[i] = arr[j];
+            arr[j] = tmp;
+        }
+        for (i = 0; i < 0x100; i++) {
+            map->opcodes[i] = NUM_OPS;
+        }
+        for (i = 0; i < NUM_OPS; i++) {
+            map->values[i] = arr[i];
+            map->opcodes[arr[i]] = i;
+        }
+    }
+
+    static const opcode_map_t *lookup(const uint8_t *key, opcode_map_t *scratch);
+
+    static uint64_t hits(void);
+
+    static uint64_t misses(void);
+
+    static double saved(void);
+};
+
+#endif
@@ -0,0 +1,112 @@
+#include "vmpool.h"
+#include <string.h>
+#include <stdexcept>
+
+/*
+CONSTRUCTORS
+*/
+VMPool::VMPool() {
+    hitcount = 0;
+    misscount = 0;
+}
+
+// VMs still handed out belong to their users from now on
+VMPool::~VMPool() {
+    for (auto &entry : idle) {
+        for (VM *vm : entry.second) {
+            delete vm;
+        }
+    }
+}
+
+/*
+ * Puts code in the code segment of a pooled VM. The code segment is only
+ * rewritten, and the VM's translations dropped, if it holds something else.
+ */
+void VMPool::load(VM *vm, uint8_t *code, uint32_t codesize) {
+    VMAddrSpace *as = vm->addressSpace();
+    uint8_t *segment = as->getCode();
+    uint32_t i;
+
+    if (!memcmp(segment, code, codesize)) {
+        for (i = codesize; i < as->getCodesize() && !segment[i]; i++);
+        if (i == as->getCodesize()) {
+            return;
+        }
+    }
+    DBG_INFO(("Loading new code into a pooled VM.\n"));
+    memset(segment, 0, as->getCodesize());
+    as->insCode(code, codesize);
+}
+
+/*
+INTERFACE
+*/
+
+/*
+ * Returns a VM with the given opcode key and segment sizes running code, as
+ * if it was just built but for the engine, which stays the one picked by its
+ * last user. It has to be given back with release().
+ */
+VM *VMPool::acquire(uint8_t *key, uint8_t *code, uint32_t codesize, uint32_t ss, uint16_t cs, uint16_t ds) {
+    pool_key_t id((char *) key, ss, cs, ds);
+    std::vector<VM *> *spare;
+    VM *vm = NULL;
+
+    if (codesize > cs) {
+        throw std::invalid_argument("The code is bigger than the code segment");
+    }
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        spare = &idle[id];
+        if (!spare->empty()) {
+            vm = spare->back();
+            spare->pop_back();
+            home[vm].out = true;
+            hitcount++;
+        } else {
+            misscount++;
+        }
+    }
+    if (vm) {
+        load(vm, code, codesize);
+        return vm;
+    }
+    DBG_INFO(("No pooled VM for key %s, building one.\n", key));
+    vm = new VM(key, code, codesize, ss, cs, ds);
+    std::lock_guard<std::mutex> guard(lock);
+    home[vm] = {spare, true};
+    return vm;
+}
+
+// vm must not be used after giving it back, nor given back twice
+void VMPool::release(VM *vm) {
+    std::map<VM *, pooled_t>::iterator it;
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        it = home.find(vm);
+        if (it == home.end()) {
+            throw std::invalid_argument("VM not acquired from this pool");
+        }
+        if (!it->second.out) {
+            throw std::invalid_argument("VM already released");
+        }
+        it->second.out = false;
+    }
+    vm->reset();
+    std::lock_guard<std::mutex> guard(lock);
+    it->second.idle->push_back(vm);
+}
+
+// acquire() calls served with a pooled VM
+uint64_t VMPool::hits(void) {
+    std::lock_guard<std::mutex> guard(lock);
+    return hitcount;
+}
+
+// acquire() calls that had to build a new VM
+uint64_t VMPool::misses(void) {
+    std::lock_guard<std::mutex> guard(lock);
+    return misscount;
+}
@@ -0,0 +1,53 @@
+#ifndef VMPOOL_H
+#define VMPOOL_H
+
+#include <stdint.h>
+#include <map>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+#include "vm.h"
+
+/*
+ * Hands out ready VMs instead of building a new one for every run. Released
+ * VMs are reset and kept aside by opcode key and segment sizes, so that
+ * acquiring one again skips the key schedule and the allocations. A VM
+ * acquired for the program it already holds also keeps its translations.
+ */
+class VMPool {
+private:
+    // opcode key, stack size, code size, data size
+    typedef std::tuple<std::string, uint32_t, uint32_t, uint32_t> pool_key_t;
+
+    typedef struct pooled {
+        // the idle list the VM goes back to
+        std::vector<VM *> *idle;
+        // acquired and not released yet
+        bool out;
+    } pooled_t;
+
+    std::map<pool_key_t, std::vector<VM *>> idle;
+    // every VM built by the pool
+    std::map<VM *, pooled_t> home;
+    std::mutex lock;
+    uint64_t hitcount, misscount;
+
+    void load(VM *vm, uint8_t *code, uint32_t codesize);
+
+public:
+    VMPool();
+
+    ~VMPool();
+
+    VM *acquire(uint8_t *key, uint8_t *code, uint32_t codesize, uint32_t ss = DEFAULT_STACKSIZE,
+                uint16_t cs = DEFAULT_CODESIZE, uint16_t ds = DEFAULT_DATASIZE);
+
+    void release(VM *vm);
+
+    uint64_t hits(void);
+
+    uint64_t misses(void);
+};
+
+#endif
@@ -0,0 +1,258 @@
+#include "vmprofiler.h"
+#include <signal.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <mutex>
+#include <stdexcept>
+
+// older glibc only names the field
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+// the profiler SIGPROF samples for, a single one as the handler is per process
+static std::atomic<VMProfiler *> active(NULL);
+static std::once_flag profilerInstalled;
+
+void VMProfiler::onSignal(int sig) {
+    VMProfiler *profiler = active.load();
+
+    if (profiler) {
+        profiler->sample();
+    }
+}
+
+// SIGPROF can still be pending once the timer stops: the handler stays
+void VMProfiler::install(void) {
+    struct sigaction action;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = VMProfiler::onSignal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, NULL)) {
+        throw std::runtime_error("Couldn't install the SIGPROF handler");
+    }
+}
+
+/*
+CONSTRUCTORS
+*/
+VMProfiler::VMProfiler(VM *vm) {
+    if (!VM::hasStats()) {
+        throw std::runtime_error("Stats not compiled in");
+    }
+    this->vm = vm;
+    samples.resize(PROFILER_SAMPLES);
+    taken = 0;
+    thread = 0;
+}
+
+VMProfiler::~VMProfiler() {
+    stop();
+}
+
+/*
+SAMPLING
+*/
+/*
+ * From the signal handler, on the thread that started the profiler: only
+ * reads the VM, if it is running on this very thread, and writes a free slot.
+ */
+void VMProfiler::sample(void) {
+#ifdef STATS
+    VMAddrSpace *as = &vm->as;
+    uint8_t *code = as->getCode(), *stack = as->getStack();
+    uint32_t codesize = as->getCodesize(), at, i, depth;
+    uint16_t ret, calls[PROFILER_DEPTH];
+    sample_t *s;
+
+    if (vm->runner != thread) {
+        return;
+    }
+    // return addresses point right after a CALL
+    depth = 0;
+    for (at = vm->regs[SP] & ~1; at >= sizeof(uint16_t) && depth < PROFILER_DEPTH; at -= sizeof(uint16_t)) {
+        ret = *((uint16_t *) &stack[at - sizeof(uint16_t)]);
+        if (ret >= CALL_SIZE && ret < codesize && vm->OPCODES[code[ret - CALL_SIZE]] == CALL) {
+            calls[depth++] = *((uint16_t *) &code[ret - CALL_SIZE + 1]);
+        }
+    }
+    at = taken.fetch_add(1);
+    if (at >= samples.size()) {
+        return;
+    }
+    s = &samples[at];
+    s->ip = vm->statip;
+    s->depth = depth;
+    for (i = 0; i < depth; i++) {
+        s->calls[i] = calls[depth - 1 - i];
+    }
+#endif
+}
+
+/*
+INTERFACE
+*/
+/*
+ * Reads the symbols written by the assembler with --symbols: one
+ * "0x<offset> <name>" line per function.
+ */
+bool VMProfiler::loadSymbols(const char *path) {
+    FILE *f = fopen(path, "r");
+    unsigned int offset;
+    char name[64];
+
+    if (!f) {
+        return false;
+    }
+    while (fscanf(f, "%x %63s", &offset, name) == 2) {
+        symbols[offset] = name;
+    }
+    fclose(f);
+    return true;
+}
+
+// samples the VM hz times per second of CPU time of the calling thread, which runs it
+void VMProfiler::start(uint32_t hz) {
+    struct sigevent event;
+    struct itimerspec spec;
+    VMProfiler *none = NULL;
+
+    if (!hz || hz > 1000000) {
+        throw std::invalid_argument("Invalid sampling rate");
+    }
+    std::call_once(profilerInstalled, install);
+    if (!active.compare_exchange_strong(none, this) && none != this) {
+        throw std::runtime_error("Another profiler is sampling");
+    }
+    // started again, the same timer at the new rate
+    if (none != this) {
+        thread = syscall(SYS_gettid);
+        memset(&event, 0, sizeof(event));
+        event.sigev_notify = SIGEV_THREAD_ID;
+        event.sigev_signo = SIGPROF;
+        event.sigev_notify_thread_id = thread;
+        if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &timer)) {
+            active = NULL;
+            throw std::runtime_error("Couldn't create the profiling timer");
+        }
+    }
+    spec.it_interval.tv_sec = 0;
+    spec.it_interval.tv_nsec = 1000000000 / hz;
+    spec.it_value = spec.it_interval;
+    if (timer_settime(timer, 0, &spec, NULL)) {
+        timer_delete(timer);
+        active = NULL;
+        throw std::runtime_error("Couldn't start the profiling timer");
+    }
+}
+
+void VMProfiler::stop(void) {
+    if (active.load() != this) {
+        return;
+    }
+    timer_delete(timer);
+    active = NULL;
+}
+
+uint32_t VMProfiler::sampled(void) {
+    return std::min<uint32_t>(taken, samples.size());
+}
+
+/*
+ * The blocks that ran the most instructions, as entries times the
+ * instructions up to the jump (or SHIT) ending them, with the samples that
+ * fell in their code.
+ */
+void VMProfiler::hotBlocks(FILE *out, uint32_t top) {
+    std::vector<std::pair<uint64_t, uint32_t>> hot;
+    std::vector<uint32_t> hits(UINT16_MAX + 1);
+    uint64_t entries, executed = vm->executed();
+    uint32_t ip, i, at, end, length, sampledhere;
+
+    for (ip = 0; ip <= UINT16_MAX; ip++) {
+        entries = vm->entries(ip);
+        if (entries) {
+            hot.push_back(std::make_pair(entries * blockLength(ip, &end), ip));
+        }
+    }
+    for (i = 0; i < sampled(); i++) {
+        hits[samples[i].ip]++;
+    }
+    std::sort(hot.begin(), hot.end(), [](const std::pair<uint64_t, uint32_t> &a,
+                                         const std::pair<uint64_t, uint32_t> &b) {
+        return a.first > b.first || (a.first == b.first && a.second < b.second);
+    });
+    fprintf(out, "%4s  %-6s  %-24s  %12s  %6s  %14s  %6s  %8s\n", "rank", "block", "function", "entries",
+            "length", "instructions", "share", "samples");
+    for (i = 0; i < hot.size() && i < top; i++) {
+        ip = hot[i].second;
+        length = blockLength(ip, &end);
+        sampledhere = 0;
+        for (at = ip; at < end && at <= UINT16_MAX; at++) {
+            sampledhere += hits[at];
+        }
+        fprintf(out, "%4u  0x%04x  %-24s  %12lu  %6u  %14lu  %5.1f%%  %8u\n", i + 1, ip, nameOf(ip).c_str(),
+                (unsigned long) vm->entries(ip), length, (unsigned long) hot[i].first,
+                executed ? 100.0 * hot[i].first / executed : 0.0, sampledhere);
+    }
+}
+
+// one "outer;...;inner count" line per call stack, for flamegraph.pl
+void VMProfiler::foldedStacks(FILE *out) {
+    std::map<std::string, uint64_t> stacks;
+    std::string stack;
+    uint32_t i, j;
+
+    for (i = 0; i < sampled(); i++) {
+        // the program starts at 0
+        stack = nameOf(0);
+        for (j = 0; j < samples[i].depth; j++) {
+            stack += ";" + nameOf(samples[i].calls[j]);
+        }
+        stacks[stack]++;
+    }
+    for (auto &s : stacks) {
+        fprintf(out, "%s %lu\n", s.first.c_str(), (unsigned long) s.second);
+    }
+}
+
+/*
+WORKERS
+*/
+// the function ip is in, and where in it, if any symbols are loaded
+std::string VMProfiler::nameOf(uint16_t ip) {
+    auto f = symbols.upper_bound(ip);
+    char name[96];
+
+    if (f == symbols.begin()) {
+        snprintf(name, sizeof(name), "0x%04x", ip);
+    } else if ((--f)->first == ip) {
+        return f->second;
+    } else {
+        snprintf(name, sizeof(name), "%s+0x%x", f->second.c_str(), ip - f->first);
+    }
+    return name;
+}
+
+/*
+ * Instructions from ip to the first jump, SHIT or invalid instruction
+ * included, and the offset right after the last one.
+ */
+uint32_t VMProfiler::blockLength(uint16_t ip, uint32_t *end) {
+    VM::decoded_t rec;
+    uint32_t at = ip, length = 0;
+
+    for (;;) {
+        length++;
+        if (!vm->decodeAt(at, &rec) || vm->INSTR[rec.op].isJump || rec.op == SHIT) {
+            break;
+        }
+        at = rec.next;
+    }
+    *end = rec.next;
+    return length;
+}
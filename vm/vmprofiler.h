@@ -0,0 +1,83 @@
+#ifndef VMPROFILER_H
+#define VMPROFILER_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <time.h>
+#include <atomic>
+#include <map>
+#include <string>
+#include <vector>
+#include "vm.h"
+
+// samples kept by a profiler, the later ones are dropped
+#define PROFILER_SAMPLES 0x10000
+// calls a sample goes up the VM stack for, the outer ones are dropped
+#define PROFILER_DEPTH 16
+#define DEFAULT_PROFILER_HZ 1000
+
+/*
+ * Where the guest time of a VM goes, for STATS builds. The VM counts how
+ * many times every block, a run of instructions entered through a jump (or
+ * the start of the program), starts; hotBlocks() ranks them by the
+ * instructions they ran. start() also samples the VM from SIGPROF: each
+ * sample is the IP being run, which hotBlocks() adds up per block, and the
+ * functions called to get there, which foldedStacks() writes in the format
+ * of flamegraph.pl. The timer counts the CPU time of the thread calling
+ * start() and only signals that thread, so the VM has to run on it: while
+ * it runs anywhere else, e.g. on a VMScheduler worker, nothing is sampled.
+ *
+ * The VM stack only holds the return addresses of CALL, mixed with PUSHed
+ * words: samples take every word following a CALL in the code for one, so
+ * a PUSHed word can now and then show up as a call. Functions are named by
+ * the symbols of the assembler (--symbols) if loaded, by their address
+ * otherwise.
+ */
+class VMProfiler {
+private:
+    typedef struct sample {
+        uint16_t ip;
+        uint8_t depth;
+        // call targets, the outermost first
+        uint16_t calls[PROFILER_DEPTH];
+    } sample_t;
+
+    VM *vm;
+    std::vector<sample_t> samples;
+    // samples taken, those past PROFILER_SAMPLES included
+    std::atomic<uint32_t> taken;
+    std::map<uint16_t, std::string> symbols;
+    // the thread start() was called from, and its CPU time timer
+    pid_t thread;
+    timer_t timer;
+
+    void sample(void);
+
+    static void onSignal(int sig);
+
+    static void install(void);
+
+    std::string nameOf(uint16_t ip);
+
+    uint32_t blockLength(uint16_t ip, uint32_t *end);
+
+public:
+    VMProfiler(VM *vm);
+
+    ~VMProfiler();
+
+    bool loadSymbols(const char *path);
+
+    void start(uint32_t hz = DEFAULT_PROFILER_HZ);
+
+    void stop(void);
+
+    uint32_t sampled(void);
+
+    void hotBlocks(FILE *out, uint32_t top = 20);
+
+    void foldedStacks(FILE *out);
+};
+
+#endif
@@ -0,0 +1,246 @@
+#include "vmscheduler.h"
+#include <chrono>
+#include <stdexcept>
+
+/*
+CONSTRUCTORS
+*/
+VMScheduler::VMScheduler(uint32_t threads, uint64_t slice) {
+    uint32_t i;
+    worker_t *w;
+
+    if (!slice) {
+        throw std::invalid_argument("Slices must run at least one instruction");
+    }
+    if (!threads) {
+        threads = std::thread::hardware_concurrency();
+    }
+    if (!threads) {
+        threads = 1;
+    }
+    DBG_SUCC(("Creating a scheduler of %u workers.\n", threads));
+    this->slice = slice;
+    waiting = 0;
+    live = 0;
+    sleepers = 0;
+    stopping = false;
+    for (i = 0; i < threads; i++) {
+        w = new worker_t;
+        w->top = 0;
+        w->bottom = 0;
+        w->slicecount = 0;
+        w->stealcount = 0;
+        workers.push_back(w);
+    }
+    for (i = 0; i < threads; i++) {
+        workers[i]->thread = std::thread(&VMScheduler::work, this, i);
+    }
+}
+
+// VMs still running are dropped without calling their exit callbacks
+VMScheduler::~VMScheduler() {
+    task_t *task;
+    uint32_t i;
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    ready.notify_all();
+    for (i = 0; i < workers.size(); i++) {
+        workers[i]->thread.join();
+    }
+    for (i = 0; i < workers.size(); i++) {
+        while (take(workers[i], &task, 1)) {
+            delete task;
+        }
+        delete workers[i];
+    }
+    for (task_t *left : spawned) {
+        delete left;
+    }
+}
+
+/*
+RUN QUEUES
+*/
+// appends task to the queue of w, which has to be the calling worker's
+bool VMScheduler::push(worker_t *w, task_t *task) {
+    uint32_t b = w->bottom.load(std::memory_order_relaxed), t = w->top.load(std::memory_order_acquire);
+
+    if (b - t >= SCHEDULER_QUEUE) {
+        return false;
+    }
+    w->slots[b % SCHEDULER_QUEUE].store(task, std::memory_order_relaxed);
+    w->bottom.store(b + 1, std::memory_order_release);
+    return true;
+}
+
+/*
+ * Takes up to max tasks from the front of the queue of w. The slots are
+ * read before claiming them: the owner can't reuse them until top moves
+ * past them, and if someone else moved it first the claim fails.
+ */
+uint32_t VMScheduler::take(worker_t *w, task_t **tasks, uint32_t max) {
+    uint32_t t = w->top.load(std::memory_order_acquire), b, n, i;
+
+    while (true) {
+        b = w->bottom.load(std::memory_order_acquire);
+        if ((int32_t) (b - t) <= 0) {
+            return 0;
+        }
+        n = b - t < max ? b - t : max;
+        for (i = 0; i < n; i++) {
+            tasks[i] = w->slots[(t + i) % SCHEDULER_QUEUE].load(std::memory_order_relaxed);
+        }
+        if (w->top.compare_exchange_weak(t, t + n, std::memory_order_acq_rel, std::memory_order_acquire)) {
+            return n;
+        }
+    }
+}
+
+/*
+ * Moves half of the queue of the first other worker that has something to
+ * the (empty) queue of worker id, and takes the first of them.
+ */
+bool VMScheduler::steal(uint32_t id, task_t **task) {
+    task_t *stolen[SCHEDULER_QUEUE / 2];
+    uint32_t i, j, n, half, size = workers.size();
+    worker_t *victim, *self = workers[id];
+
+    for (i = 1; i < size; i++) {
+        victim = workers[(id + i) % size];
+        half = (victim->bottom.load(std::memory_order_relaxed) - victim->top.load(std::memory_order_relaxed) + 1) / 2;
+        if ((int32_t) half <= 0) {
+            continue;
+        }
+        n = take(victim, stolen, half < SCHEDULER_QUEUE / 2 ? half : SCHEDULER_QUEUE / 2);
+        if (!n) {
+            continue;
+        }
+        for (j = 1; j < n; j++) {
+            push(self, stolen[j]);
+        }
+        self->stealcount.fetch_add(n, std::memory_order_relaxed);
+        *task = stolen[0];
+        return true;
+    }
+    return false;
+}
+
+// moves up to SCHEDULER_BATCH spawned VMs to the back of the queue of w
+void VMScheduler::pickup(worker_t *w) {
+    uint32_t i;
+
+    std::lock_guard<std::mutex> guard(lock);
+    for (i = 0; i < SCHEDULER_BATCH && !spawned.empty() && push(w, spawned.front()); i++) {
+        spawned.pop_front();
+        waiting--;
+    }
+}
+
+/*
+WORKERS
+*/
+void VMScheduler::work(uint32_t id) {
+    worker_t *self = workers[id];
+    task_t *task;
+
+    // VMs that never stop would keep a worker from ever going to sleep
+    while (!stopping) {
+        // new VMs get their first turn after those already running
+        if (waiting.load(std::memory_order_relaxed)) {
+            pickup(self);
+        }
+        if (take(self, &task, 1) || steal(id, &task)) {
+            runSlice(self, task);
+            continue;
+        }
+        std::unique_lock<std::mutex> guard(lock);
+        /*
+         * Spawns wake sleepers up, queues growing past one VM only do if
+         * someone is asleep: the timeout covers a steal missed in between.
+         */
+        sleepers++;
+        ready.wait_for(guard, std::chrono::milliseconds(1), [this] { return stopping || waiting; });
+        sleepers--;
+    }
+}
+
+void VMScheduler::runSlice(worker_t *w, task_t *task) {
+    uint64_t left = task->deadline - task->vm->executed();
+    uint8_t status = task->vm->run(left < slice ? left : slice);
+
+    w->slicecount.fetch_add(1, std::memory_order_relaxed);
+    if (status == STOP_BUDGET && task->vm->executed() < task->deadline) {
+        if (!push(w, task)) {
+            std::lock_guard<std::mutex> guard(lock);
+            spawned.push_back(task);
+            waiting++;
+        }
+        if (sleepers.load(std::memory_order_relaxed) &&
+            w->bottom.load(std::memory_order_relaxed) - w->top.load(std::memory_order_relaxed) > 1) {
+            ready.notify_one();
+        }
+        return;
+    }
+    DBG_INFO(("VM stopped after %lu instructions.\n", (unsigned long) task->vm->executed()));
+    if (task->onexit) {
+        task->onexit(task->vm, status, task->arg);
+    }
+    delete task;
+    if (--live == 0) {
+        std::lock_guard<std::mutex> guard(lock);
+        idle.notify_all();
+    }
+}
+
+/*
+INTERFACE
+*/
+/*
+ * Runs vm from where it is until it stops by itself or has run budget more
+ * instructions, give or take the straight code before its next jump, then
+ * calls onexit.
+ */
+void VMScheduler::spawn(VM *vm, exit_t onexit, void *arg, uint64_t budget) {
+    uint64_t deadline = budget > RUN_FOREVER - vm->executed() ? RUN_FOREVER : vm->executed() + budget;
+
+    live++;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        spawned.push_back(new task_t{vm, onexit, arg, deadline});
+        waiting++;
+    }
+    ready.notify_one();
+}
+
+// waits for every spawned VM to stop
+void VMScheduler::wait(void) {
+    std::unique_lock<std::mutex> guard(lock);
+    idle.wait(guard, [this] { return live == 0; });
+}
+
+uint32_t VMScheduler::size(void) {
+    return workers.size();
+}
+
+// slices run so far
+uint64_t VMScheduler::slices(void) {
+    uint64_t total = 0;
+
+    for (worker_t *w : workers) {
+        total += w->slicecount.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+// VMs moved from a worker to another so far
+uint64_t VMScheduler::steals(void) {
+    uint64_t total = 0;
+
+    for (worker_t *w : workers) {
+        total += w->stealcount.load(std::memory_order_relaxed);
+    }
+    return total;
+}
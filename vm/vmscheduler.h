@@ -0,0 +1,97 @@
+#ifndef VMSCHEDULER_H
+#define VMSCHEDULER_H
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "vm.h"
+
+// guest instructions a VM runs before going back to its run queue
+#define DEFAULT_SLICE 10000
+// VMs a run queue holds, a power of two
+#define SCHEDULER_QUEUE 0x1000
+// VMs a worker moves at once from the spawned ones to its run queue
+#define SCHEDULER_BATCH 32
+
+/*
+ * Runs many VMs on a few worker threads, a slice of instructions at a time:
+ * a VM spinning forever only delays the others by a slice per turn. Every
+ * worker round-robins over its own run queue, appends the newly spawned VMs
+ * to it between slices and steals half of someone else's when it runs dry.
+ * The queues don't take any lock, only spawning and going to sleep do. A VM
+ * must not be touched between spawn() and its exit callback.
+ */
+class VMScheduler {
+public:
+    /*
+     * Called on the worker that ran the VM once it stops by itself, or with
+     * STOP_BUDGET once it ran out of the instructions it was spawned with.
+     * VMs waiting on a channel stop with STOP_IO: spawn them again once the
+     * host fed or drained it.
+     */
+    typedef void (*exit_t)(VM *vm, uint8_t status, void *arg);
+
+private:
+    typedef struct task {
+        VM *vm;
+        exit_t onexit;
+        void *arg;
+        // VM::executed() at which the VM is stopped
+        uint64_t deadline;
+    } task_t;
+
+    /*
+     * Only the owner pushes, at bottom. Anyone takes from top, the owner
+     * included, so that its VMs get their turns in order.
+     */
+    typedef struct alignas(64) worker {
+        std::atomic<uint32_t> top;
+        std::atomic<uint32_t> bottom;
+        std::atomic<task_t *> slots[SCHEDULER_QUEUE];
+        std::atomic<uint64_t> slicecount, stealcount;
+        std::thread thread;
+    } worker_t;
+
+    std::vector<worker_t *> workers;
+    uint64_t slice;
+    // spawned VMs no worker picked up yet, and how many
+    std::deque<task_t *> spawned;
+    std::atomic<uint32_t> waiting;
+    std::mutex lock;
+    std::condition_variable ready, idle;
+    std::atomic<uint32_t> live, sleepers;
+    std::atomic<bool> stopping;
+
+    void work(uint32_t id);
+
+    bool push(worker_t *w, task_t *task);
+
+    uint32_t take(worker_t *w, task_t **tasks, uint32_t max);
+
+    bool steal(uint32_t id, task_t **task);
+
+    void pickup(worker_t *w);
+
+    void runSlice(worker_t *w, task_t *task);
+
+public:
+    VMScheduler(uint32_t threads = 0, uint64_t slice = DEFAULT_SLICE);
+
+    ~VMScheduler();
+
+    void spawn(VM *vm, exit_t onexit = NULL, void *arg = NULL, uint64_t budget = RUN_FOREVER);
+
+    void wait(void);
+
+    uint32_t size(void);
+
+    uint64_t slices(void);
+
+    uint64_t steals(void);
+};
+
+#endif
@@ -0,0 +1,152 @@
+#include "vmsnapshot.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdexcept>
+
+/*
+CONSTRUCTORS
+*/
+VMSnapshot::VMSnapshot(VM *vm) {
+    VMAddrSpace *as = &vm->as;
+    uint8_t *p;
+    uint32_t i;
+
+    fd = -1;
+    stacksize = as->stacksize;
+    codesize = as->codesize;
+    datasize = as->datasize;
+    // forks get a plain arena whatever the address space of the VM
+    dataoff = VMAddrSpace::dataOffset(codesize);
+    stackoff = VMAddrSpace::stackOffset(codesize, datasize);
+    dataLow = as->dataLow;
+    dataHigh = as->dataHigh > as->dataLow ? as->dataHigh : as->dataLow;
+    stackHigh = as->stackHigh;
+    codeHigh = as->codeHigh;
+    for (i = 0; i < NUM_REGS; i++) {
+        regs[i] = vm->regs[i];
+    }
+    flags = vm->flags;
+    bank = vm->bank;
+    far = as->far;
+    farsize = as->farsize;
+    icount = vm->icount;
+    engine = vm->engine;
+    memcpy(opcodes, vm->OPCODES, sizeof(opcodes));
+    for (i = 0; i < NUM_OPS; i++) {
+        values[i] = vm->INSTR[i].value;
+    }
+    // the records of a guarded VM skip checks a fork can't do without
+    if (vm->decoded && vm->decoded->size() == codesize + 1 && vm->decodedversion == as->codeversion &&
+        !as->isGuarded()) {
+        decoded = vm->decoded;
+    }
+    p = saved = new uint8_t[codeHigh + dataHigh - dataLow + stackHigh];
+    memcpy(p, as->code, codeHigh);
+    p += codeHigh;
+    memcpy(p, as->data + dataLow, dataHigh - dataLow);
+    p += dataHigh - dataLow;
+    memcpy(p, as->stack, stackHigh);
+    DBG_SUCC(("Snapshot taken at IP 0x%x.\n", regs[IP]));
+}
+
+VMSnapshot::~VMSnapshot() {
+    if (fd >= 0) {
+        close(fd);
+    }
+    delete[] saved;
+}
+
+// moves the saved bytes to their place in a file laid out like an arena
+void VMSnapshot::createFile(void) {
+    uint32_t size = VMAddrSpace::mappingSize(stacksize, codesize, datasize);
+
+#ifdef __linux__
+    fd = memfd_create("pasticciotto-snapshot", MFD_CLOEXEC);
+#else
+    char path[] = "/tmp/pasticciotto-snapshot-XXXXXX";
+
+    fd = mkstemp(path);
+    if (fd >= 0) {
+        unlink(path);
+    }
+#endif
+    if (fd < 0) {
+        DBG_ERROR(("Couldn't create the snapshot file: %s.\n", strerror(errno)));
+        throw std::runtime_error("Couldn't create the snapshot file");
+    }
+    // the file starts as a hole: only the bytes written take up memory
+    if (ftruncate(fd, size)) {
+        close(fd);
+        fd = -1;
+        throw std::runtime_error("Couldn't size the snapshot file");
+    }
+    save(saved, codeHigh, 0);
+    save(saved + codeHigh, dataHigh - dataLow, dataoff + dataLow);
+    save(saved + codeHigh + dataHigh - dataLow, stackHigh, stackoff);
+    delete[] saved;
+    saved = NULL;
+}
+
+void VMSnapshot::save(uint8_t *buf, uint32_t size, uint32_t offset) {
+    ssize_t written;
+
+    while (size) {
+        written = pwrite(fd, buf, size, offset);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            close(fd);
+            fd = -1;
+            throw std::runtime_error("Couldn't write the snapshot file");
+        }
+        buf += written;
+        size -= written;
+        offset += written;
+    }
+}
+
+/*
+INTERFACE
+*/
+
+/*
+ * Returns a new VM resuming from where the snapshot was taken, with the same
+ * opcodes, engine and segments. It is owned by the caller and stays valid
+ * after the snapshot is destroyed. Forks can be taken from several threads.
+ */
+VM *VMSnapshot::fork(void) {
+    VM *vm;
+    VMAddrSpace *as;
+    uint32_t i;
+
+    std::call_once(mapped, &VMSnapshot::createFile, this);
+    vm = new VM(stacksize, codesize, datasize, fd);
+    as = &vm->as;
+    for (i = 0; i < NUM_REGS; i++) {
+        vm->regs[i] = regs[i];
+    }
+    vm->flags = flags;
+    vm->bank = bank;
+    vm->icount = icount;
+    vm->engine = engine;
+    memcpy(vm->OPCODES, opcodes, sizeof(opcodes));
+    for (i = 0; i < NUM_OPS; i++) {
+        vm->INSTR[i].value = values[i];
+    }
+    if (decoded) {
+        vm->decoded = decoded;
+        vm->decodedversion = as->codeversion;
+    }
+    // reset() of a fork clears data and stack, like for any other VM
+    as->dataLow = dataLow;
+    as->dataHigh = dataHigh;
+    as->stackHigh = stackHigh;
+    as->codeHigh = codeHigh;
+    as->borrowFar(far, farsize);
+    return vm;
+}
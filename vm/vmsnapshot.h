@@ -0,0 +1,59 @@
+#ifndef VMSNAPSHOT_H
+#define VMSNAPSHOT_H
+
+#include <stdint.h>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "vm.h"
+
+/*
+ * The state of a VM at some point of its execution, which can be forked into
+ * any number of new VMs resuming from there. Taking a snapshot only copies
+ * the bytes written to the segments. The first fork saves them in an
+ * anonymous file that every fork maps privately: forks share its pages until
+ * they write them, and the kernel copies only the pages written. Forks also
+ * share the decoded instructions of the VM until they rewrite their code,
+ * and its far memory, if any, for good.
+ * Channels are not part of the state: forks start with none attached.
+ *
+ * Only the bytes the address space recorded as written are saved: writes
+ * going straight through getData() / getStack() have to be reported with
+ * dirtyData() / dirtyStack() first.
+ */
+class VMSnapshot {
+private:
+    int fd;
+    std::once_flag mapped;
+    uint32_t stacksize, codesize, datasize;
+    // where data and stack start in the arena
+    uint32_t dataoff, stackoff;
+    // what was written to the segments, as recorded by VMAddrSpace
+    uint32_t dataLow, dataHigh, stackHigh, codeHigh;
+    // the bytes written, code first, until the file is created
+    uint8_t *saved;
+    uint16_t regs[NUM_REGS];
+    flags_t flags;
+    uint16_t bank;
+    // not saved: forks share the far memory of the VM
+    uint8_t *far;
+    uint32_t farsize;
+    uint64_t icount;
+    uint8_t engine;
+    uint8_t opcodes[0x100];
+    uint8_t values[NUM_OPS];
+    std::shared_ptr<std::vector<VM::decoded_t>> decoded;
+
+    void createFile(void);
+
+    void save(uint8_t *buf, uint32_t size, uint32_t offset);
+
+public:
+    VMSnapshot(VM *vm);
+
+    ~VMSnapshot();
+
+    VM *fork(void);
+};
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef VMSTATS_H
+#define VMSTATS_H
+
+#include <stdint.h>
+
+/*
+ * Per instruction counters of STATS builds (PASTICCIOTTO_STATS). The engines
+ * open an interval with STATS_NEXT when they dispatch an instruction and
+ * close it with STATS_STOP when it fails or the run stops; the next
+ * STATS_NEXT closes it as succeeded. An instruction following a jump starts
+ * a block. Other builds compile them out.
+ */
+#ifdef STATS
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+
+#define STATS_CLOCK "rdtsc"
+
+static inline uint64_t statsClock(void) {
+    return __rdtsc();
+}
+#else
+#include <time.h>
+
+#define STATS_CLOCK "ns"
+
+static inline uint64_t statsClock(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
+
+#define STATS_NEXT(_op_, _ip_) statsNext(_op_, _ip_)
+#define STATS_STOP(_ok_) statsStop(_ok_)
+#else
+#define STATS_NEXT(_op_, _ip_)
+#define STATS_STOP(_ok_)
+#endif
+
+#endif
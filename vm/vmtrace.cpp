@@ -0,0 +1,277 @@
+#include "vmtrace.h"
+#include "debug.h"
+#include "vm.h"
+#include <string.h>
+#include <algorithm>
+#include <stdexcept>
+
+#define TRACE_MAGIC "PTRC"
+#define TRACE_VERSION 1
+
+/*
+ * A dump is this header, one trace_op_t per INSTR entry and the records,
+ * oldest first, all in the byte order of the host.
+ */
+typedef struct trace_file {
+    char magic[4];
+    uint8_t version;
+    // INSTR entries following the header
+    uint8_t ops;
+    // of the VM when dumped, as in the records
+    uint8_t flags;
+    uint8_t unused;
+    uint32_t records;
+    // records that came before the first one
+    uint64_t first;
+    uint64_t executed;
+    uint16_t regs[NUM_REGS];
+} trace_file_t;
+
+enum operands {
+    OPERANDS_NONE, OPERANDS_REG, OPERANDS_REGS, OPERANDS_IMM, OPERANDS_REG_IMM, OPERANDS_IMM_REG
+};
+
+typedef struct trace_op {
+    char name[4];
+    uint8_t operands;
+} trace_op_t;
+
+static const char *REG_NAMES[NUM_REGS] = {"R0", "R1", "R2", "R3", "S0", "S1", "S2", "S3", "IP", "RP", "SP"};
+
+// which of the operands decodeAt() fills op has, as it groups them
+static uint8_t operandsOf(uint8_t op) {
+    switch (op) {
+        case MOVI:
+        case LODI:
+        case ADDI:
+        case SUBI:
+        case ANDW:
+        case YORW:
+        case XORW:
+        case MULI:
+        case DIVI:
+        case SHLI:
+        case SHRI:
+        case CMPW:
+        case ANDB:
+        case YORB:
+        case XORB:
+        case CMPB:
+        case RECV:
+        case SEND:
+            return OPERANDS_REG_IMM;
+        case MOVR:
+        case LODR:
+        case STRR:
+        case LODF:
+        case STRF:
+        case ADDR:
+        case SUBR:
+        case ANDR:
+        case YORR:
+        case XORR:
+        case NOTR:
+        case MULR:
+        case DIVR:
+        case SHLR:
+        case SHRR:
+        case CMPR:
+            return OPERANDS_REGS;
+        case STRI:
+            return OPERANDS_IMM_REG;
+        case PUSH:
+        case POOP:
+        case BNKR:
+        case JMPR:
+        case JPAR:
+        case JPBR:
+        case JPER:
+        case JPNR:
+            return OPERANDS_REG;
+        case JMPI:
+        case JPAI:
+        case JPBI:
+        case JPEI:
+        case JPNI:
+        case BNKI:
+        case CALL:
+            return OPERANDS_IMM;
+        default:
+            return OPERANDS_NONE;
+    }
+}
+
+static const char *regName(uint8_t reg) {
+    return reg < NUM_REGS ? REG_NAMES[reg] : "R?";
+}
+
+/*
+CONSTRUCTORS
+*/
+VMTrace::VMTrace(VM *vm, uint32_t capacity) {
+    if (!VM::hasTrace()) {
+        throw std::runtime_error("Trace not compiled in");
+    }
+    if (capacity < 2 || capacity & (capacity - 1)) {
+        throw std::invalid_argument("Traces hold a power of two records");
+    }
+#ifdef TRACE
+    if (vm->trace) {
+        throw std::runtime_error("The VM is already traced");
+    }
+    vm->trace = this;
+#endif
+    this->vm = vm;
+    ring = new trace_record_t[capacity];
+    mask = capacity - 1;
+    head = 0;
+}
+
+VMTrace::~VMTrace() {
+#ifdef TRACE
+    vm->trace = NULL;
+#endif
+    delete[] ring;
+}
+
+/*
+INTERFACE
+*/
+uint64_t VMTrace::recorded(void) {
+    return head.load(std::memory_order_acquire);
+}
+
+/*
+ * Copies the records in the ring, oldest first, and returns how many came
+ * before them.
+ */
+uint64_t VMTrace::snapshot(std::vector<trace_record_t> *records) {
+    uint64_t end = head.load(std::memory_order_acquire), first, oldest;
+    uint32_t i;
+
+    // the slot of record end is the one being written
+    first = end > mask ? end - mask : 0;
+    records->resize(end - first);
+    for (i = 0; first + i < end; i++) {
+        (*records)[i] = ring[(first + i) & mask];
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    end = head.load(std::memory_order_relaxed);
+    oldest = end > mask ? end - mask : 0;
+    if (oldest > first) {
+        records->erase(records->begin(), records->begin() + std::min<uint64_t>(oldest - first, records->size()));
+        first = std::min(oldest, first + records->size());
+    }
+    return first;
+}
+
+// runs stopping with STOP_ERROR dump the ring to path, NULL stops them
+void VMTrace::flightRecorder(const char *path) {
+    flight = path ? path : "";
+}
+
+bool VMTrace::dump(FILE *out) {
+    std::vector<trace_record_t> records;
+    trace_file_t header;
+    trace_op_t op;
+    uint32_t i;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.ops = NUM_OPS + 1;
+    header.flags = vm->flags.ZF | vm->flags.CF << 1;
+    header.first = snapshot(&records);
+    header.records = records.size();
+    header.executed = vm->icount;
+    memcpy(header.regs, vm->regs, sizeof(header.regs));
+    if (fwrite(&header, sizeof(header), 1, out) != 1) {
+        return false;
+    }
+    for (i = 0; i <= NUM_OPS; i++) {
+        // every name is 4 letters long
+        memcpy(op.name, vm->INSTR[i].name, sizeof(op.name));
+        op.operands = operandsOf(i);
+        if (fwrite(&op, sizeof(op), 1, out) != 1) {
+            return false;
+        }
+    }
+    return fwrite(records.data(), sizeof(trace_record_t), records.size(), out) == records.size();
+}
+
+/*
+ * Writes a dump as one line per record, the last one being the instruction
+ * the VM stopped on, and the registers it stopped with.
+ */
+bool VMTrace::decode(FILE *in, FILE *out) {
+    trace_file_t header;
+    trace_op_t ops[0x100], *op;
+    trace_record_t rec;
+    char args[32], values[32];
+    uint32_t i;
+
+    if (fread(&header, sizeof(header), 1, in) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) ||
+        header.version != TRACE_VERSION || fread(ops, sizeof(trace_op_t), header.ops, in) != header.ops) {
+        return false;
+    }
+    fprintf(out, "# %u records after the first %lu, %lu instructions run\n", header.records,
+            (unsigned long) header.first, (unsigned long) header.executed);
+    for (i = 0; i < header.records; i++) {
+        if (fread(&rec, sizeof(rec), 1, in) != 1) {
+            return false;
+        }
+        op = rec.op < header.ops ? &ops[rec.op] : NULL;
+        args[0] = '\0';
+        values[0] = '\0';
+        switch (op ? op->operands : OPERANDS_NONE) {
+            case OPERANDS_REG:
+                snprintf(args, sizeof(args), "%s", regName(rec.dst));
+                snprintf(values, sizeof(values), "%s=0x%04x", regName(rec.dst), rec.dstval);
+                break;
+            case OPERANDS_REGS:
+                snprintf(args, sizeof(args), "%s, %s", regName(rec.dst), regName(rec.src));
+                snprintf(values, sizeof(values), "%s=0x%04x %s=0x%04x", regName(rec.dst), rec.dstval,
+                         regName(rec.src), rec.srcval);
+                break;
+            case OPERANDS_IMM:
+                snprintf(args, sizeof(args), "0x%04x", rec.imm);
+                break;
+            case OPERANDS_REG_IMM:
+                snprintf(args, sizeof(args), "%s, 0x%04x", regName(rec.dst), rec.imm);
+                snprintf(values, sizeof(values), "%s=0x%04x", regName(rec.dst), rec.dstval);
+                break;
+            case OPERANDS_IMM_REG:
+                snprintf(args, sizeof(args), "0x%04x, %s", rec.imm, regName(rec.src));
+                snprintf(values, sizeof(values), "%s=0x%04x", regName(rec.src), rec.srcval);
+                break;
+        }
+        fprintf(out, "%10lu  0x%04x  %-4.4s %-14s  %-22s  ZF=%u CF=%u\n", (unsigned long) (header.first + i), rec.ip,
+                op ? op->name : "????", args, values, rec.flags & 1, rec.flags >> 1 & 1);
+    }
+    fprintf(out, "#");
+    for (i = 0; i < NUM_REGS; i++) {
+        fprintf(out, " %s=0x%04x", REG_NAMES[i], header.regs[i]);
+    }
+    fprintf(out, " ZF=%u CF=%u\n", header.flags & 1, header.flags >> 1 & 1);
+    return true;
+}
+
+/*
+WORKERS
+*/
+void VMTrace::failed(void) {
+    FILE *f;
+
+    if (flight.empty()) {
+        return;
+    }
+    f = fopen(flight.c_str(), "wb");
+    if (!f) {
+        DBG_ERROR(("Couldn't open %s for the flight recorder.\n", flight.c_str()));
+        return;
+    }
+    if (!dump(f)) {
+        DBG_ERROR(("Couldn't write the flight recorder to %s.\n", flight.c_str()));
+    }
+    fclose(f);
+}
@@ -0,0 +1,93 @@
+#ifndef VMTRACE_H
+#define VMTRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+// records a trace holds by default, a power of two
+#define DEFAULT_TRACESIZE 0x1000
+
+// what TRACE builds record before running an instruction
+typedef struct trace_record {
+    uint16_t ip;
+    // index in INSTR, NUM_OPS for WAT?
+    uint8_t op;
+    // ZF | CF << 1
+    uint8_t flags;
+    // operands as decoded, 0 if the instruction has none
+    uint8_t dst;
+    uint8_t src;
+    uint16_t imm;
+    // the registers dst and src hold
+    uint16_t dstval;
+    uint16_t srcval;
+} trace_record_t;
+
+class VM;
+
+/*
+ * The last instructions a VM ran, for TRACE builds (PASTICCIOTTO_TRACE). The
+ * VM writes a record into a ring before every instruction, so the last one
+ * is the instruction that stopped it; an instruction waiting on a channel
+ * is recorded once per try. snapshot() can be called from any thread while
+ * the VM runs, so it leaves out the slot the VM may be writing: it returns
+ * up to capacity - 1 records, and drops those overwritten during the copy.
+ *
+ * With flightRecorder() set, a run stopping with STOP_ERROR dumps the ring
+ * to a file, which decode() (pasticciotto-trace) turns back into text. The
+ * file names the instructions itself, so it decodes without the opcodes
+ * key.
+ */
+class VMTrace {
+    friend class VM;
+
+private:
+    VM *vm;
+    trace_record_t *ring;
+    uint32_t mask;
+    // records written so far, only by the thread running the VM
+    std::atomic<uint64_t> head;
+    // where a failing run dumps the ring, if not empty
+    std::string flight;
+
+    trace_record_t *next(void) {
+        return &ring[head.load(std::memory_order_relaxed) & mask];
+    }
+
+    void commit(void) {
+        head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    void failed(void);
+
+public:
+    VMTrace(VM *vm, uint32_t capacity = DEFAULT_TRACESIZE);
+
+    ~VMTrace();
+
+    uint64_t recorded(void);
+
+    uint64_t snapshot(std::vector<trace_record_t> *records);
+
+    void flightRecorder(const char *path);
+
+    bool dump(FILE *out);
+
+    static bool decode(FILE *in, FILE *out);
+};
+
+#ifdef TRACE
+#define TRACE_NEXT(_op_, _ip_)                                                 \
+    do {                                                                       \
+        if (trace) {                                                           \
+            traceNext(_op_, _ip_);                                             \
+        }                                                                      \
+    } while (0)
+#else
+#define TRACE_NEXT(_op_, _ip_)
+#endif
+
+#endif